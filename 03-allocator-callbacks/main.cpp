@@ -30,6 +30,9 @@
 static bool RunDemo()
 {
     AllocationCallbacksBase::test();
+    PoolAllocationCallbacks::test();
+
+    DebugAllocationCallbacks::setMode(DEBUG_ALLOCATOR_LOG | DEBUG_ALLOCATOR_STATS);
 
     DeviceLoader loader;
     loader.SetEnableApiDump(false);
@@ -38,6 +41,8 @@ static bool RunDemo()
 
     LOGI("Successfully created device %p", loader.GetDevice());
 
+    DebugAllocationCallbacks::dumpStats();
+
     return true;
 }
 
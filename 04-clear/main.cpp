@@ -25,17 +25,305 @@
 
 #include "common/Common.h"
 
+#include "common/ComputeFill.h"
 #include "common/DeviceLoader.h"
-
-#include <fstream>
+#include "common/FrameManager.h"
+#include "common/ImageExport.h"
+#include "common/ImageStreamWriter.h"
+#include "common/JobSystem.h"
+#include "common/MemoryAllocator.h"
+#include "common/Profiler.h"
+#include "common/QueryManager.h"
+#include "common/ResourceStateTracker.h"
+#include "common/SparseImage.h"
+#include "common/StagingBuffer.h"
+#include "common/SubmitScheduler.h"
+#include "common/TransferEngine.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <deque>
+#include <memory>
 #include <string>
+#include <vector>
+
+struct DemoOptions
+{
+    uint32_t imageCount;
+    uint32_t imageWidth;
+    uint32_t imageHeight;
+    uint32_t mipLevels;   // 0 for a full chain
+    uint32_t arrayLayers;
+    VkFormat format;
+    bool writeOutput;
+    bool alignRows;
+    bool compute;
+    bool zeroCopy;
+    bool sparse;
+    bool stats;
+    std::string tracePath;
+    std::string streamPath;
+
+    DemoOptions()
+        : imageCount(1), imageWidth(256), imageHeight(256), mipLevels(1), arrayLayers(1),
+        format(VK_FORMAT_R8G8B8A8_UNORM), writeOutput(true), alignRows(false), compute(false),
+        zeroCopy(true), sparse(false), stats(false)
+    {
+    }
+};
+
+static void PrintUsage(const char *program)
+{
+    LOGI("Usage: %s [--count N] [--size WIDTHxHEIGHT] [--mips N] [--layers N] [--format rgba8|bgra8] [--no-output] [--align-rows] [--compute] [--no-zero-copy] [--sparse] [--stats] [--trace FILE] [--stream FILE]", program);
+}
+
+static bool ParseOptions(int argc, char **argv, DemoOptions &options)
+{
+    for (int i = 1; i < argc; ++i)
+    {
+        std::string arg = argv[i];
+        const char *value = (i + 1 < argc ? argv[i + 1] : nullptr);
+
+        if (arg == "--count" && value)
+        {
+            options.imageCount = (uint32_t)strtoul(value, nullptr, 10);
+            ++i;
+        }
+        else if (arg == "--size" && value)
+        {
+            if (sscanf(value, "%ux%u", &options.imageWidth, &options.imageHeight) != 2)
+                return false;
+            ++i;
+        }
+        else if (arg == "--mips" && value)
+        {
+            options.mipLevels = (uint32_t)strtoul(value, nullptr, 10);
+            ++i;
+        }
+        else if (arg == "--layers" && value)
+        {
+            options.arrayLayers = (uint32_t)strtoul(value, nullptr, 10);
+            ++i;
+        }
+        else if (arg == "--format" && value)
+        {
+            if (strcmp(value, "rgba8") == 0)
+                options.format = VK_FORMAT_R8G8B8A8_UNORM;
+            else if (strcmp(value, "bgra8") == 0)
+                options.format = VK_FORMAT_B8G8R8A8_UNORM;
+            else
+                return false;
+            ++i;
+        }
+        else if (arg == "--no-output")
+        {
+            options.writeOutput = false;
+        }
+        else if (arg == "--align-rows")
+        {
+            options.alignRows = true;
+        }
+        else if (arg == "--compute")
+        {
+            options.compute = true;
+        }
+        else if (arg == "--no-zero-copy")
+        {
+            options.zeroCopy = false;
+        }
+        else if (arg == "--sparse")
+        {
+            options.sparse = true;
+        }
+        else if (arg == "--stats")
+        {
+            options.stats = true;
+        }
+        else if (arg == "--stream" && value)
+        {
+            options.streamPath = value;
+            ++i;
+        }
+        else if (arg == "--trace" && value)
+        {
+            options.tracePath = value;
+            ++i;
+        }
+        else
+        {
+            return false;
+        }
+    }
+
+    // TGA sizes are 16-bit
+    if (options.imageCount == 0 || options.arrayLayers == 0 ||
+        options.imageWidth == 0 || options.imageWidth > 0xffff ||
+        options.imageHeight == 0 || options.imageHeight > 0xffff)
+        return false;
+
+    uint32_t fullChain = 1;
+    while ((std::max(options.imageWidth, options.imageHeight) >> fullChain) != 0)
+        ++fullChain;
+    if (options.mipLevels == 0)
+        options.mipLevels = fullChain;
+    return options.mipLevels <= fullChain;
+}
+
+// A device image that frames take turns rendering into
+struct RenderTarget
+{
+    AutoVkImage image;
+    AutoMemoryAllocation memory;
+    AutoVkImageView view; // for --compute
+
+    RenderTarget(const DeviceFunctions &pfn, VkDevice device, MemoryAllocator &allocator)
+        : image(pfn, device), memory(allocator), view(pfn, device)
+    {
+    }
+};
+
+static bool CreateRenderTargetImage(const DeviceFunctions &pfn, VkDevice device,
+    VkFormat format, uint32_t width, uint32_t height, uint32_t mipLevels, uint32_t arrayLayers,
+    VkImageTiling tiling, VkImageUsageFlags usage, AutoVkImage &image)
+{
+    VkImageCreateInfo imageCreateInfo = {};
+    imageCreateInfo.sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO;
+    imageCreateInfo.flags = 0;
+    imageCreateInfo.imageType = VK_IMAGE_TYPE_2D;
+    imageCreateInfo.format = format;
+    imageCreateInfo.extent = { width, height, 1 };
+    imageCreateInfo.mipLevels = mipLevels;
+    imageCreateInfo.arrayLayers = arrayLayers;
+    imageCreateInfo.samples = VK_SAMPLE_COUNT_1_BIT;
+    imageCreateInfo.tiling = tiling;
+    imageCreateInfo.usage = usage;
+    imageCreateInfo.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+    imageCreateInfo.queueFamilyIndexCount = 0;
+    imageCreateInfo.pQueueFamilyIndices = nullptr;
+    imageCreateInfo.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+    VkResult result = pfn.vkCreateImage(device, &imageCreateInfo, CREATE_ALLOCATOR(), image.ptr());
+    if (result != VK_SUCCESS)
+    {
+        LOGE("vkCreateImage failed (%d)", result);
+        return false;
+    }
+    return true;
+}
+
+/*
+ * Whether LINEAR images with this format, size and usage can be put in
+ * HOST_VISIBLE DEVICE_LOCAL memory, so the host can read them in place.
+ * Devices may support far less with LINEAR tiling than with OPTIMAL, and
+ * may not allow LINEAR images in every memory type, so this has to be
+ * checked with a real image.
+ */
+static bool SupportsZeroCopy(DeviceLoader &loader, MemoryAllocator &memoryAllocator,
+    VkFormat format, uint32_t width, uint32_t height, VkImageUsageFlags usage)
+{
+    const InstanceFunctions &ipfn = loader.GetInstanceFunctions();
+    const DeviceFunctions &pfn = loader.GetDeviceFunctions();
+
+    VkFormatProperties formatProperties;
+    ipfn.vkGetPhysicalDeviceFormatProperties(loader.GetPhysicalDevice(), format, &formatProperties);
+    if ((usage & VK_IMAGE_USAGE_STORAGE_BIT) &&
+        !(formatProperties.linearTilingFeatures & VK_FORMAT_FEATURE_STORAGE_IMAGE_BIT))
+        return false;
+
+    VkImageFormatProperties imageFormatProperties;
+    VkResult result = ipfn.vkGetPhysicalDeviceImageFormatProperties(loader.GetPhysicalDevice(), format,
+        VK_IMAGE_TYPE_2D, VK_IMAGE_TILING_LINEAR, usage, 0, &imageFormatProperties);
+    if (result != VK_SUCCESS ||
+        width > imageFormatProperties.maxExtent.width || height > imageFormatProperties.maxExtent.height)
+        return false;
+
+    AutoVkImage image(pfn, loader.GetDevice());
+    if (!CreateRenderTargetImage(pfn, loader.GetDevice(), format, width, height, 1, 1, VK_IMAGE_TILING_LINEAR, usage, image))
+        return false;
+
+    VkMemoryRequirements memoryRequirements;
+    pfn.vkGetImageMemoryRequirements(loader.GetDevice(), image, &memoryRequirements);
+    return memoryAllocator.FindMemoryType(memoryRequirements.memoryTypeBits,
+        VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT | VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT) != UINT32_MAX;
+}
+
+// Log the average of each statistic per pass, over all the frames
+static void LogQueryResults(QueryManager &queries)
+{
+    std::vector<std::string> names;
+    std::vector<uint32_t> frames;
+    std::vector<std::vector<uint64_t>> totals;
+    for (const QueryPassResult &result : queries.TakeResults())
+    {
+        size_t i = std::find(names.begin(), names.end(), result.name) - names.begin();
+        if (i == names.size())
+        {
+            names.push_back(result.name);
+            frames.push_back(0);
+            totals.emplace_back(result.statistics.size(), 0);
+        }
+        ++frames[i];
+        for (size_t j = 0; j < result.statistics.size(); ++j)
+            totals[i][j] += result.statistics[j];
+    }
+
+    if (names.empty())
+    {
+        LOGW("No pipeline statistics were collected");
+        return;
+    }
+
+    for (size_t i = 0; i < names.size(); ++i)
+    {
+        size_t j = 0;
+        for (uint32_t bit = 1; bit <= queries.GetStatistics(); bit <<= 1)
+        {
+            if (!(queries.GetStatistics() & bit))
+                continue;
+            LOGI("Pass %s: %.1f %s per frame (%u frames)", names[i].c_str(),
+                (double)totals[i][j] / frames[i], PipelineStatisticName((VkQueryPipelineStatisticFlagBits)bit), frames[i]);
+            ++j;
+        }
+    }
+}
+
+/*
+ * Fill mip levels 1 and up of every layer, by blitting each level from the
+ * one above it, with one barrier per level. Every level must be in
+ * TRANSFER_DST on queueFamily, and level 0 must have been written. The last
+ * level is left in TRANSFER_DST and the others in TRANSFER_SRC.
+ */
+static void RecordMipChain(const DeviceFunctions &pfn, ResourceStateTracker &stateTracker,
+    VkCommandBuffer commandBuffer, uint32_t queueFamily, VkImage image,
+    uint32_t width, uint32_t height, uint32_t mipLevels, uint32_t arrayLayers, VkFilter filter)
+{
+    for (uint32_t level = 1; level < mipLevels; ++level)
+    {
+        VkImageSubresourceRange srcRange = { VK_IMAGE_ASPECT_COLOR_BIT, level - 1, 1, 0, arrayLayers };
+        stateTracker.UseImage(image, RESOURCE_USAGE_TRANSFER_SRC, queueFamily, &srcRange);
+        stateTracker.Flush(commandBuffer, queueFamily);
+
+        VkImageBlit blit = {};
+        blit.srcSubresource = { VK_IMAGE_ASPECT_COLOR_BIT, level - 1, 0, arrayLayers };
+        blit.srcOffsets[1] = { (int32_t)std::max(width >> (level - 1), 1u), (int32_t)std::max(height >> (level - 1), 1u), 1 };
+        blit.dstSubresource = { VK_IMAGE_ASPECT_COLOR_BIT, level, 0, arrayLayers };
+        blit.dstOffsets[1] = { (int32_t)std::max(width >> level, 1u), (int32_t)std::max(height >> level, 1u), 1 };
+        pfn.vkCmdBlitImage(commandBuffer,
+            image, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL,
+            image, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+            1, &blit, filter);
+    }
+}
 
-static bool RunDemo()
+static bool RunDemo(const DemoOptions &options)
 {
     VkResult result;
 
-    uint32_t imageWidth = 256;
-    uint32_t imageHeight = 256;
+    uint32_t imageWidth = options.imageWidth;
+    uint32_t imageHeight = options.imageHeight;
+    uint32_t mipLevels = options.mipLevels;
+    uint32_t arrayLayers = options.arrayLayers;
+    VkFormat format = options.format;
 
 
     DeviceLoader loader;
@@ -43,15 +331,18 @@ static bool RunDemo()
         VK_DEBUG_REPORT_WARNING_BIT_EXT |
         VK_DEBUG_REPORT_PERFORMANCE_WARNING_BIT_EXT |
         VK_DEBUG_REPORT_ERROR_BIT_EXT);
+    loader.SetPipelineCachePath("pipeline_cache.bin");
+    loader.SetEnablePipelineStatistics(options.stats);
     if (!loader.Setup())
         return false;
 
     VkDevice device = loader.GetDevice();
 
-    const InstanceFunctions &pfn = loader.GetInstanceFunctions();
+    const InstanceFunctions &ipfn = loader.GetInstanceFunctions();
+    const DeviceFunctions &pfn = loader.GetDeviceFunctions();
 
     VkPhysicalDeviceMemoryProperties memoryProperties;
-    pfn.vkGetPhysicalDeviceMemoryProperties(loader.GetPhysicalDevice(), &memoryProperties);
+    ipfn.vkGetPhysicalDeviceMemoryProperties(loader.GetPhysicalDevice(), &memoryProperties);
 
     LOGI("Memory types: %d", memoryProperties.memoryTypeCount);
     for (uint32_t i = 0; i < memoryProperties.memoryTypeCount; ++i)
@@ -83,461 +374,1031 @@ static bool RunDemo()
         LOGI("    %d: size %d MB, flags %s (0x%x)", i, heap.size / (1024*1024), flags.c_str(), heap.flags);
     }
 
-    uint32_t deviceMemoryType = UINT32_MAX;
-    uint32_t stagingMemoryType = UINT32_MAX;
-    for (uint32_t i = 0; i < memoryProperties.memoryTypeCount; ++i)
-    {
-        auto type = memoryProperties.memoryTypes[i];
-        if (type.propertyFlags & VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT)
-            if (deviceMemoryType == UINT32_MAX)
-                deviceMemoryType = i;
+    MemoryAllocator memoryAllocator(ipfn, pfn, loader.GetPhysicalDevice(), device);
 
-        if (type.propertyFlags & VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT)
-            if (stagingMemoryType == UINT32_MAX)
-                stagingMemoryType = i;
-    }
+    const uint32_t framesInFlight = FrameManager::DEFAULT_FRAMES_IN_FLIGHT;
 
-    if (deviceMemoryType == UINT32_MAX || stagingMemoryType == UINT32_MAX)
+    // Times the clears and copies on the GPU, and the recording and output
+    // on the CPU, for --trace
+    VkPhysicalDeviceProperties physicalDeviceProperties;
+    ipfn.vkGetPhysicalDeviceProperties(loader.GetPhysicalDevice(), &physicalDeviceProperties);
+    Profiler profiler(pfn, device, physicalDeviceProperties.limits.timestampPeriod, framesInFlight);
+    profiler.AddQueueFamily(loader.GetGraphicsQueueFamily(),
+        loader.GetQueueFamilyProperties(loader.GetGraphicsQueueFamily()).timestampValidBits, "Graphics queue");
+    if (loader.GetTransferQueueFamily() != loader.GetGraphicsQueueFamily())
     {
-        LOGE("Failed to find suitable memory types");
-        return false;
+        profiler.AddQueueFamily(loader.GetTransferQueueFamily(),
+            loader.GetQueueFamilyProperties(loader.GetTransferQueueFamily()).timestampValidBits, "Transfer queue");
     }
+    if (!profiler.Setup())
+        return false;
 
+    // Counts the compute shader invocations per pass, for --stats. (Nothing
+    // here draws, so the other statistics would all be zero.)
+    VkQueryPipelineStatisticFlags statistics = 0;
+    if (options.stats && loader.GetEnabledFeatures().pipelineStatisticsQuery)
+        statistics = VK_QUERY_PIPELINE_STATISTIC_COMPUTE_SHADER_INVOCATIONS_BIT;
+    QueryManager queries(pfn, device, memoryAllocator, framesInFlight, false, statistics);
+    if (!queries.Setup())
+        return false;
 
-    AutoVkImage stagingImage(pfn, device);
-    AutoVkImage deviceImage(pfn, device);
+    VkImageUsageFlags imageUsage = VK_IMAGE_USAGE_TRANSFER_SRC_BIT | VK_IMAGE_USAGE_TRANSFER_DST_BIT | VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT;
 
-    VkImageCreateInfo imageCreateInfo = {};
-    imageCreateInfo.sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO;
-    imageCreateInfo.flags = 0;
-    imageCreateInfo.imageType = VK_IMAGE_TYPE_2D;
-    imageCreateInfo.format = VK_FORMAT_R8G8B8A8_UNORM;
-    imageCreateInfo.extent = { imageWidth, imageHeight, 1 };
-    imageCreateInfo.mipLevels = 1;
-    imageCreateInfo.arrayLayers = 1;
-    imageCreateInfo.samples = VK_SAMPLE_COUNT_1_BIT;
-    imageCreateInfo.tiling = VK_IMAGE_TILING_LINEAR;
-    imageCreateInfo.usage = VK_IMAGE_USAGE_TRANSFER_SRC_BIT | VK_IMAGE_USAGE_TRANSFER_DST_BIT;
-    imageCreateInfo.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
-    imageCreateInfo.queueFamilyIndexCount = 0;
-    imageCreateInfo.pQueueFamilyIndices = nullptr;
-    imageCreateInfo.initialLayout = VK_IMAGE_LAYOUT_PREINITIALIZED;
-    result = pfn.vkCreateImage(device, &imageCreateInfo, CREATE_ALLOCATOR(), stagingImage.ptr());
-    if (result != VK_SUCCESS)
+    // --compute fills the images with a compute shader on the graphics queue
+    // (so no ownership transfers are needed) instead of clearing them
+    if (options.compute)
     {
-        LOGE("vkCreateImage failed (%d)", result);
-        return false;
-    }
+        if (format != VK_FORMAT_R8G8B8A8_UNORM)
+        {
+            LOGE("--compute only supports the rgba8 format");
+            return false;
+        }
 
-    imageCreateInfo.tiling = VK_IMAGE_TILING_OPTIMAL;
-    imageCreateInfo.usage = VK_IMAGE_USAGE_TRANSFER_SRC_BIT | VK_IMAGE_USAGE_TRANSFER_DST_BIT | VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT;
-    imageCreateInfo.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
-    result = pfn.vkCreateImage(device, &imageCreateInfo, CREATE_ALLOCATOR(), deviceImage.ptr());
-    if (result != VK_SUCCESS)
-    {
-        LOGE("vkCreateImage failed (%d)", result);
-        return false;
-    }
+        if (mipLevels != 1 || arrayLayers != 1)
+        {
+            LOGE("--compute only supports one mip level and layer");
+            return false;
+        }
 
+        VkFormatProperties formatProperties;
+        ipfn.vkGetPhysicalDeviceFormatProperties(loader.GetPhysicalDevice(), format, &formatProperties);
+        if (!(formatProperties.optimalTilingFeatures & VK_FORMAT_FEATURE_STORAGE_IMAGE_BIT))
+        {
+            LOGE("Format %d doesn't support storage images", format);
+            return false;
+        }
 
-    VkMemoryRequirements stagingImageMemReq;
-    VkMemoryRequirements deviceImageMemReq;
-    pfn.vkGetImageMemoryRequirements(device, stagingImage, &stagingImageMemReq);
-    pfn.vkGetImageMemoryRequirements(device, deviceImage, &deviceImageMemReq);
-    LOGI("Staging image: size=0x%x alignment=0x%x bits=0x%x",
-        stagingImageMemReq.size, stagingImageMemReq.alignment, stagingImageMemReq.memoryTypeBits);
-    LOGI("Device image: size=0x%x alignment=0x%x bits=0x%x",
-        deviceImageMemReq.size, deviceImageMemReq.alignment, deviceImageMemReq.memoryTypeBits);
+        if (!(loader.GetQueueFamilyProperties(loader.GetGraphicsQueueFamily()).queueFlags & VK_QUEUE_COMPUTE_BIT))
+        {
+            LOGE("The graphics queue doesn't support compute");
+            return false;
+        }
 
-    if (!(stagingImageMemReq.memoryTypeBits & (1 << stagingMemoryType)))
-    {
-        LOGE("Staging image incompatible with the memory type we selected");
-        return false;
+        imageUsage |= VK_IMAGE_USAGE_STORAGE_BIT;
     }
 
-    if (!(deviceImageMemReq.memoryTypeBits & (1 << deviceMemoryType)))
+    // The mip chain is generated on the graphics queue by blitting, which
+    // needs the format to support it (and to filter linearly, for a smooth
+    // result)
+    VkFilter mipFilter = VK_FILTER_LINEAR;
+    if (mipLevels > 1)
     {
-        LOGE("Device image incompatible with the memory type we selected");
-        return false;
+        VkFormatProperties formatProperties;
+        ipfn.vkGetPhysicalDeviceFormatProperties(loader.GetPhysicalDevice(), format, &formatProperties);
+        VkFormatFeatureFlags blitFeatures = VK_FORMAT_FEATURE_BLIT_SRC_BIT | VK_FORMAT_FEATURE_BLIT_DST_BIT;
+        if ((formatProperties.optimalTilingFeatures & blitFeatures) != blitFeatures)
+        {
+            LOGE("Format %d doesn't support blits, so mip levels can't be generated", format);
+            return false;
+        }
+        if (!(formatProperties.optimalTilingFeatures & VK_FORMAT_FEATURE_SAMPLED_IMAGE_FILTER_LINEAR_BIT))
+            mipFilter = VK_FILTER_NEAREST;
     }
 
-    AutoVkDeviceMemory stagingImageMem(pfn, device);
-    AutoVkDeviceMemory deviceImageMem(pfn, device);
-
-    VkMemoryAllocateInfo allocateInfo = {};
-    allocateInfo.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
-
-    allocateInfo.allocationSize = stagingImageMemReq.size;
-    allocateInfo.memoryTypeIndex = stagingMemoryType;
-    result = pfn.vkAllocateMemory(device, &allocateInfo, CREATE_ALLOCATOR(), stagingImageMem.ptr());
-    if (result != VK_SUCCESS)
+    // With unified memory, the images can be LINEAR and in memory that the
+    // host can map, so it can read the results in place instead of having
+    // them copied into a staging buffer first. (A BAR heap could hold them
+    // too, but host reads from it are uncached, which is slower than the copy)
+    //
+    // The images are then only written by the clear or the compute shader.
+    // LINEAR images are only guaranteed to support one mip level and layer
+    VkImageUsageFlags zeroCopyUsage = imageUsage & ~(VK_IMAGE_USAGE_TRANSFER_SRC_BIT | VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT);
+    bool zeroCopy = options.zeroCopy && mipLevels == 1 && arrayLayers == 1 &&
+        memoryAllocator.GetArchitecture() == MEMORY_ARCHITECTURE_UNIFIED &&
+        SupportsZeroCopy(loader, memoryAllocator, format, imageWidth, imageHeight, zeroCopyUsage);
+    LOGI("Reading the images %s", zeroCopy ? "in place" : "back through a staging buffer");
+
+    VkImageTiling tiling = VK_IMAGE_TILING_OPTIMAL;
+    VkMemoryPropertyFlags imageMemoryRequired = VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT;
+    VkMemoryPropertyFlags imageMemoryPreferred = 0;
+    if (zeroCopy)
     {
-        LOGE("vkAllocateMemory failed (%d)", result);
-        return false;
+        tiling = VK_IMAGE_TILING_LINEAR;
+        imageUsage = zeroCopyUsage;
+        imageMemoryRequired |= VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT;
+        imageMemoryPreferred |= VK_MEMORY_PROPERTY_HOST_CACHED_BIT;
     }
 
-    allocateInfo.allocationSize = deviceImageMemReq.size;
-    allocateInfo.memoryTypeIndex = deviceMemoryType;
-    result = pfn.vkAllocateMemory(device, &allocateInfo, CREATE_ALLOCATOR(), deviceImageMem.ptr());
-    if (result != VK_SUCCESS)
     {
-        LOGE("vkAllocateMemory failed (%d)", result);
-        return false;
+        VkImageFormatProperties imageFormatProperties;
+        result = ipfn.vkGetPhysicalDeviceImageFormatProperties(loader.GetPhysicalDevice(), format,
+            VK_IMAGE_TYPE_2D, tiling, imageUsage, 0, &imageFormatProperties);
+        if (result != VK_SUCCESS)
+        {
+            LOGE("Format %d is not supported for rendering (%d)", format, result);
+            return false;
+        }
+        if (imageWidth > imageFormatProperties.maxExtent.width || imageHeight > imageFormatProperties.maxExtent.height)
+        {
+            LOGE("Image size %ux%u is larger than the maximum %ux%u", imageWidth, imageHeight,
+                imageFormatProperties.maxExtent.width, imageFormatProperties.maxExtent.height);
+            return false;
+        }
+        if (mipLevels > imageFormatProperties.maxMipLevels || arrayLayers > imageFormatProperties.maxArrayLayers)
+        {
+            LOGE("%u mip levels and %u layers is more than the maximum %u and %u", mipLevels, arrayLayers,
+                imageFormatProperties.maxMipLevels, imageFormatProperties.maxArrayLayers);
+            return false;
+        }
     }
 
-    result = pfn.vkBindImageMemory(device, stagingImage, stagingImageMem, 0);
-    if (result != VK_SUCCESS)
+    // One image per frame in flight, so frame N+1 can be cleared while
+    // frame N is being read back. They're created once and reused by every
+    // frame that comes round to their slot
+    std::vector<std::unique_ptr<RenderTarget>> renderTargets;
+    for (uint32_t i = 0; i < framesInFlight; ++i)
     {
-        LOGE("vkBindImageMemory failed (%d)", result);
-        return false;
+        std::unique_ptr<RenderTarget> target(new RenderTarget(pfn, device, memoryAllocator));
+
+        if (!CreateRenderTargetImage(pfn, device, format, imageWidth, imageHeight, mipLevels, arrayLayers,
+            tiling, imageUsage, target->image))
+            return false;
+
+        VkMemoryRequirements deviceImageMemReq;
+        pfn.vkGetImageMemoryRequirements(device, target->image, &deviceImageMemReq);
+        LOGI("Device image: size=0x%x alignment=0x%x bits=0x%x",
+            deviceImageMemReq.size, deviceImageMemReq.alignment, deviceImageMemReq.memoryTypeBits);
+
+        if (!memoryAllocator.AllocateForImage(target->image, tiling,
+            imageMemoryRequired, imageMemoryPreferred, *target->memory))
+        {
+            LOGE("Failed to allocate device image memory");
+            return false;
+        }
+
+        if (options.compute)
+        {
+            VkImageViewCreateInfo imageViewCreateInfo = {};
+            imageViewCreateInfo.sType = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO;
+            imageViewCreateInfo.image = target->image;
+            imageViewCreateInfo.viewType = VK_IMAGE_VIEW_TYPE_2D;
+            imageViewCreateInfo.format = format;
+            imageViewCreateInfo.components = {
+                VK_COMPONENT_SWIZZLE_IDENTITY, VK_COMPONENT_SWIZZLE_IDENTITY,
+                VK_COMPONENT_SWIZZLE_IDENTITY, VK_COMPONENT_SWIZZLE_IDENTITY };
+            imageViewCreateInfo.subresourceRange = { VK_IMAGE_ASPECT_COLOR_BIT, 0, 1, 0, 1 };
+            result = pfn.vkCreateImageView(device, &imageViewCreateInfo, CREATE_ALLOCATOR(), target->view.ptr());
+            if (result != VK_SUCCESS)
+            {
+                LOGE("vkCreateImageView failed (%d)", result);
+                return false;
+            }
+        }
+
+        renderTargets.push_back(std::move(target));
     }
 
-    result = pfn.vkBindImageMemory(device, deviceImage, deviceImageMem, 0);
-    if (result != VK_SUCCESS)
+    // Read the images back through regions of the staging ring, which is
+    // persistently mapped. The copies run on the transfer queue, which is a
+    // dedicated DMA family where the device has one.
+    //
+    // The ring is reused every frame, so it only needs room for the frames
+    // that can be live at once: the ones in flight, plus the one still being
+    // written out.
+    //
+    // The copies are into a buffer, not a LINEAR image, so the row pitch is
+    // our choice. By default rows are tightly packed, which is what the host
+    // wants; --align-rows pads them to optimalBufferCopyRowPitchAlignment,
+    // which some devices copy faster. Each mip level's layers follow one
+    // another, then the next level's
+    //
+    // In zero-copy mode none of that is needed, and the row pitch is the
+    // LINEAR images' (which are all laid out the same way)
+    VkSubresourceLayout zeroCopyLayout = {};
+    if (zeroCopy)
     {
-        LOGE("vkBindImageMemory failed (%d)", result);
-        return false;
+        VkImageSubresource subresource = { VK_IMAGE_ASPECT_COLOR_BIT, 0, 0 };
+        pfn.vkGetImageSubresourceLayout(device, renderTargets[0]->image, &subresource, &zeroCopyLayout);
     }
 
-    void *stagingImageMemPtr;
-    result = pfn.vkMapMemory(device, stagingImageMem, 0, VK_WHOLE_SIZE, 0, &stagingImageMemPtr);
-    if (result != VK_SUCCESS)
+    struct LevelLayout
     {
-        LOGE("vkMapMemory failed (%d)", result);
-        return false;
+        VkExtent3D extent;
+        VkDeviceSize offset;   // of layer 0, from the start of the readback
+        uint32_t rowLength;    // in texels
+        VkDeviceSize rowPitch;
+        VkDeviceSize layerPitch;
+    };
+    std::vector<LevelLayout> levels;
+    VkDeviceSize readbackSize = 0;
+    for (uint32_t level = 0; level < mipLevels; ++level)
+    {
+        LevelLayout layout;
+        layout.extent = { std::max(imageWidth >> level, 1u), std::max(imageHeight >> level, 1u), 1 };
+        layout.offset = readbackSize;
+        layout.rowLength = layout.extent.width;
+        if (options.alignRows && !zeroCopy)
+        {
+            VkDeviceSize pitchAlignment = std::max<VkDeviceSize>(
+                memoryAllocator.GetLimits().optimalBufferCopyRowPitchAlignment, 1);
+            while (((VkDeviceSize)layout.rowLength * 4) % pitchAlignment)
+                ++layout.rowLength;
+        }
+        layout.rowPitch = (zeroCopy ? zeroCopyLayout.rowPitch : (VkDeviceSize)layout.rowLength * 4);
+        layout.layerPitch = layout.rowPitch * layout.extent.height;
+        readbackSize += layout.layerPitch * arrayLayers;
+        levels.push_back(layout);
     }
 
+    // The copies for a readback, shared between the jobs that record them,
+    // with offsets relative to the readback's region. Level 0 is split into
+    // a band per job, which have to be a multiple of the transfer family's
+    // minImageTransferGranularity high (or there's only one band, if it's
+    // 0). The other levels are copied whole, which is always allowed, and
+    // are shared out round-robin
+    const uint32_t copyJobCount = 4;
+    std::vector<std::vector<VkBufferImageCopy>> copyJobs(copyJobCount);
+    if (!zeroCopy)
+    {
+        VkExtent3D granularity = loader.GetQueueFamilyProperties(loader.GetTransferQueueFamily()).minImageTransferGranularity;
+        uint32_t bandHeight = imageHeight;
+        if (granularity.height != 0)
+        {
+            bandHeight = (imageHeight + copyJobCount - 1) / copyJobCount;
+            bandHeight = (bandHeight + granularity.height - 1) / granularity.height * granularity.height;
+        }
 
-    VkImageSubresource colorSubresource;
-    colorSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
-    colorSubresource.mipLevel = 0;
-    colorSubresource.arrayLayer = 0;
+        uint32_t copyCount = 0;
+        for (uint32_t level = 0; level < mipLevels; ++level)
+        {
+            const LevelLayout &layout = levels[level];
+            uint32_t regionHeight = (level == 0 ? bandHeight : layout.extent.height);
+            for (uint32_t y = 0; y < layout.extent.height; y += regionHeight)
+            {
+                VkBufferImageCopy copyRegion = {};
+                copyRegion.bufferOffset = layout.offset + layout.rowPitch * y;
+                copyRegion.bufferRowLength = layout.rowLength;
+                copyRegion.bufferImageHeight = layout.extent.height; // so layers are layerPitch apart
+                copyRegion.imageSubresource = { VK_IMAGE_ASPECT_COLOR_BIT, level, 0, arrayLayers };
+                copyRegion.imageOffset = { 0, (int32_t)y, 0 };
+                copyRegion.imageExtent = { layout.extent.width, std::min(regionHeight, layout.extent.height - y), 1 };
+                ASSERT(IsTransferGranular(granularity, copyRegion.imageOffset, copyRegion.imageExtent, layout.extent));
+                copyJobs[copyCount++ % copyJobCount].push_back(copyRegion);
+            }
+        }
+    }
 
-    VkSubresourceLayout stagingImageLayout;
-    pfn.vkGetImageSubresourceLayout(device, stagingImage, &colorSubresource, &stagingImageLayout);
-    LOGI("Staging image: offset=0x%" PRIx64 " size=0x%" PRIx64 " pitch=(%" PRIu64 ", %" PRIu64 ", %" PRIu64 ")",
-        stagingImageLayout.offset, stagingImageLayout.size,
-        stagingImageLayout.rowPitch, stagingImageLayout.arrayPitch, stagingImageLayout.depthPitch);
+    // Every submit to a queue goes through its scheduler
+    SubmitSchedulerSet schedulers(pfn);
+    SubmitScheduler &graphicsScheduler = schedulers.Get(loader.GetGraphicsQueue());
 
-    VkSubresourceLayout deviceImageLayout;
-    pfn.vkGetImageSubresourceLayout(device, deviceImage, &colorSubresource, &deviceImageLayout);
-    LOGI("Device image: offset=0x%" PRIx64 " size=0x%" PRIx64 " pitch=(%" PRIu64 ", %" PRIu64 ", %" PRIu64 ")",
-        deviceImageLayout.offset, deviceImageLayout.size,
-        deviceImageLayout.rowPitch, deviceImageLayout.arrayPitch, deviceImageLayout.depthPitch);
+    std::unique_ptr<StagingBuffer> stagingBuffer;
+    std::unique_ptr<TransferEngine> transferEngine;
+    if (!zeroCopy)
+    {
+        VkDeviceSize stagingSize = std::max(StagingBuffer::DEFAULT_SIZE,
+            (readbackSize + 64 * 1024) * (framesInFlight + 1));
 
+        stagingBuffer.reset(new StagingBuffer(pfn, device, memoryAllocator, stagingSize));
+        if (!stagingBuffer->Setup())
+            return false;
 
+        transferEngine.reset(new TransferEngine(pfn, device, *stagingBuffer,
+            schedulers.Get(loader.GetTransferQueue()), loader.GetTransferQueueFamily(), framesInFlight));
+        if (!transferEngine->Setup())
+            return false;
+    }
 
-    AutoVkCommandPool graphicsCommandPool(pfn, device);
-    AutoVkCommandPool transferCommandPool(pfn, device);
 
-    VkCommandPoolCreateInfo commandPoolCreateInfo = {};
-    commandPoolCreateInfo.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
-    commandPoolCreateInfo.flags = 0;
-    commandPoolCreateInfo.queueFamilyIndex = loader.GetGraphicsQueueFamily();
-    result = pfn.vkCreateCommandPool(device, &commandPoolCreateInfo, CREATE_ALLOCATOR(), graphicsCommandPool.ptr());
-    if (result != VK_SUCCESS)
-    {
-        LOGE("vkCreateCommandPool failed (%d)", result);
-        return false;
-    }
+    JobSystem jobSystem;
 
-    commandPoolCreateInfo.queueFamilyIndex = loader.GetTransferQueueFamily();
-    result = pfn.vkCreateCommandPool(device, &commandPoolCreateInfo, CREATE_ALLOCATOR(), transferCommandPool.ptr());
-    if (result != VK_SUCCESS)
-    {
-        LOGE("vkCreateCommandPool failed (%d)", result);
+    FrameManager frameManager(pfn, device, framesInFlight);
+    if (!frameManager.Setup(std::vector<uint32_t>(1, loader.GetGraphicsQueueFamily()), 1))
         return false;
-    }
 
-    VkCommandBuffer clearCommandBuffer;
-    VkCommandBufferAllocateInfo commandBufferAllocateInfo = {};
-    commandBufferAllocateInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
-    commandBufferAllocateInfo.commandPool = graphicsCommandPool;
-    commandBufferAllocateInfo.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
-    commandBufferAllocateInfo.commandBufferCount = 1;
-    result = pfn.vkAllocateCommandBuffers(device, &commandBufferAllocateInfo, &clearCommandBuffer);
-    if (result != VK_SUCCESS)
+    ComputeFill computeFill(pfn, device);
+    std::vector<FillRect> fillRects;
+    if (options.compute)
     {
-        LOGE("vkAllocateCommandBuffers failed (%d)", result);
-        return false;
-    }
+        if (!computeFill.Setup(loader.GetPipelineCache().Get()))
+            return false;
 
-    VkCommandBuffer transferCommandBuffer;
-    commandBufferAllocateInfo.commandPool = transferCommandPool;
-    result = pfn.vkAllocateCommandBuffers(device, &commandBufferAllocateInfo, &transferCommandBuffer);
-    if (result != VK_SUCCESS)
-    {
-        LOGE("vkAllocateCommandBuffers failed (%d)", result);
-        return false;
+        // Each frame fills its image with one descriptor set
+        frameManager.SetupDescriptorPool(ComputeFill::GetDescriptorPoolSizes());
     }
 
+    ResourceStateTracker stateTracker(pfn);
+    for (auto &target : renderTargets)
+        stateTracker.AddImage(target->image, VK_IMAGE_ASPECT_COLOR_BIT, mipLevels, arrayLayers);
 
-
-    VkClearColorValue clearColor;
-    clearColor.float32[0] = 1.0f;
-    clearColor.float32[1] = 0.65f;
-    clearColor.float32[2] = 0.0f;
-    clearColor.float32[3] = 1.0f;
+    // The clear writes level 0 of every layer, and the rest of the chain is
+    // generated from that
     VkImageSubresourceRange colorSubresourceRange;
     colorSubresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
     colorSubresourceRange.baseMipLevel = 0;
     colorSubresourceRange.levelCount = 1;
     colorSubresourceRange.baseArrayLayer = 0;
-    colorSubresourceRange.layerCount = 1;
+    colorSubresourceRange.layerCount = arrayLayers;
+
+    struct PendingReadback
+    {
+        uint32_t index;
+        Frame *frame;         // for zero-copy
+        uint64_t batchNumber; // for staging
+        StagingRegion region;
+    };
+    std::vector<PendingReadback> pendingReadbacks;
+
+    // --stream writes every image's levels and layers into one mapped file,
+    // as back-to-back TGAs, on the writer's thread. It reads straight from
+    // the staging region or (for zero-copy) the render target, so each one
+    // keeps the ticket of its last write, to wait for before the device
+    // overwrites it
+    struct StreamedRegion
+    {
+        StagingRegion region;
+        uint64_t ticket;
+    };
+    ImageStreamWriter streamWriter;
+    uint64_t streamRecordSize = 0;
+    std::deque<StreamedRegion> streamedRegions; // oldest first
+    std::vector<uint64_t> targetStreamTickets(framesInFlight, 0); // per render target, for zero-copy
+    if (options.writeOutput && !options.streamPath.empty())
+    {
+        for (const LevelLayout &layout : levels)
+            streamRecordSize += GetTGASize(layout.extent.width, layout.extent.height) * arrayLayers;
+        if (!streamWriter.Open(options.streamPath, streamRecordSize * options.imageCount))
+            return false;
+    }
+
+    // Wait for the oldest readback and write it out. Its staging region stays
+    // valid until the ring wraps round to it, which can't happen before the
+    // next frame has been submitted. In zero-copy mode, the frame's slot (and
+    // so its image) can't be reused until this has returned
+    auto finishReadback = [&]() {
+        PendingReadback readback = pendingReadbacks.front();
+        pendingReadbacks.erase(pendingReadbacks.begin());
+
+        const void *texels;
+        {
+            CpuProfileScope scope(profiler, "Wait for readback");
+            if (zeroCopy)
+            {
+                MemoryAllocation &memory = *renderTargets[readback.index % framesInFlight]->memory;
+                if (!readback.frame->Wait() ||
+                    !memoryAllocator.InvalidateRange(memory, zeroCopyLayout.offset, zeroCopyLayout.size))
+                    return false;
+                texels = (const char *)memory.mappedPtr + zeroCopyLayout.offset;
+            }
+            else
+            {
+                if (!transferEngine->Wait(readback.batchNumber))
+                    return false;
+                texels = readback.region.ptr;
+            }
+        }
+
+        if (!options.writeOutput)
+            return true;
 
+        CpuProfileScope scope(profiler, "Write output");
 
+        if (!options.streamPath.empty())
+        {
+            uint64_t offset = streamRecordSize * readback.index;
+            uint64_t ticket = 0;
+            for (uint32_t level = 0; level < mipLevels; ++level)
+            {
+                const LevelLayout &layout = levels[level];
+                for (uint32_t layer = 0; layer < arrayLayers; ++layer)
+                {
+                    ticket = streamWriter.Write(offset,
+                        (const char *)texels + layout.offset + layout.layerPitch * layer,
+                        layout.extent.width, layout.extent.height,
+                        (size_t)layout.rowPitch, format == VK_FORMAT_B8G8R8A8_UNORM);
+                    offset += GetTGASize(layout.extent.width, layout.extent.height);
+                }
+            }
+
+            if (zeroCopy)
+            {
+                targetStreamTickets[readback.index % framesInFlight] = ticket;
+            }
+            else
+            {
+                StreamedRegion streamed;
+                streamed.region = readback.region;
+                streamed.ticket = ticket;
+                streamedRegions.push_back(streamed);
+            }
+            return true;
+        }
+
+        char prefix[32];
+        if (options.imageCount == 1)
+            snprintf(prefix, sizeof(prefix), "output");
+        else
+            snprintf(prefix, sizeof(prefix), "output_%04u", readback.index);
+
+        for (uint32_t level = 0; level < mipLevels; ++level)
+        {
+            const LevelLayout &layout = levels[level];
+            for (uint32_t layer = 0; layer < arrayLayers; ++layer)
+            {
+                char path[sizeof(prefix) + 40]; // room for "_layerN_mipN.tga" with any uint32_t
+                if (mipLevels == 1 && arrayLayers == 1)
+                    snprintf(path, sizeof(path), "%s.tga", prefix);
+                else
+                    snprintf(path, sizeof(path), "%s_layer%u_mip%u.tga", prefix, layer, level);
+                if (!WriteTGA(path, (const char *)texels + layout.offset + layout.layerPitch * layer,
+                    layout.extent.width, layout.extent.height,
+                    (size_t)layout.rowPitch, format == VK_FORMAT_B8G8R8A8_UNORM))
+                    return false;
+            }
+        }
+        return true;
+    };
+
+    auto startTime = std::chrono::steady_clock::now();
+
+    for (uint32_t index = 0; index < options.imageCount; ++index)
     {
-        VkCommandBufferBeginInfo beginInfo = {};
-        beginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
-        beginInfo.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
-        result = pfn.vkBeginCommandBuffer(clearCommandBuffer, &beginInfo);
+        // This waits for the frame that last used the slot, whose transfer
+        // batch has already been waited for by finishReadback()
+        Frame *frame;
+        if (!frameManager.BeginFrame(frame))
+            return false;
+
+        CpuProfileScope frameScope(profiler, "Frame");
+
+        VkImage image = renderTargets[index % framesInFlight]->image;
+
+        // The clear colour differs per image, so it's recorded every frame
+        VkCommandBuffer clearCommandBuffer;
+        if (!frame->AllocateCommandBuffer(loader.GetGraphicsQueueFamily(), clearCommandBuffer))
+            return false;
+
+        {
+            VkCommandBufferBeginInfo beginInfo = {};
+            beginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+            beginInfo.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+            result = pfn.vkBeginCommandBuffer(clearCommandBuffer, &beginInfo);
+            if (result != VK_SUCCESS)
+            {
+                LOGE("vkBeginCommandBuffer failed (%d)", result);
+                return false;
+            }
+        }
+
+        // This is the frame's first command buffer, so it resets the
+        // profiler's and query manager's queries for the frame
+        if (!profiler.BeginFrame(clearCommandBuffer, frame->GetNumber()) ||
+            !queries.BeginFrame(clearCommandBuffer, frame->GetNumber()))
+            return false;
+
+        VkClearColorValue clearColor;
+        clearColor.float32[0] = 1.0f;
+        clearColor.float32[1] = 0.65f;
+        clearColor.float32[2] = (float)index / options.imageCount;
+        clearColor.float32[3] = 1.0f;
+
+        // The previous contents are about to be overwritten, so they can be
+        // discarded, which avoids transferring ownership back from the
+        // transfer queue
+        stateTracker.SetImageState(image, RESOURCE_USAGE_UNDEFINED);
+        stateTracker.UseImage(image, options.compute ? RESOURCE_USAGE_COMPUTE_WRITE : RESOURCE_USAGE_TRANSFER_DST,
+            loader.GetGraphicsQueueFamily());
+        {
+            GpuProfileScope scope(profiler, clearCommandBuffer, loader.GetGraphicsQueueFamily(), "Barriers");
+            stateTracker.Flush(clearCommandBuffer, loader.GetGraphicsQueueFamily());
+        }
+
+        if (options.compute)
+        {
+            // A checkerboard of small tiles, each of which is a separate
+            // dispatch, alternating between the clear colour and a darker one
+            const uint32_t tileSize = 32;
+            fillRects.clear();
+            for (uint32_t y = 0; y < imageHeight; y += tileSize)
+            {
+                for (uint32_t x = 0; x < imageWidth; x += tileSize)
+                {
+                    FillRect rect;
+                    rect.offset = { (int32_t)x, (int32_t)y };
+                    rect.extent = { std::min(tileSize, imageWidth - x), std::min(tileSize, imageHeight - y) };
+                    float scale = ((x / tileSize + y / tileSize) & 1) ? 0.5f : 1.0f;
+                    for (int c = 0; c < 3; ++c)
+                        rect.color[c] = clearColor.float32[c] * scale;
+                    rect.color[3] = clearColor.float32[3];
+                    fillRects.push_back(rect);
+                }
+            }
+
+            GpuProfileScope scope(profiler, clearCommandBuffer, loader.GetGraphicsQueueFamily(), "Fill");
+            QueryPassScope pass(queries, clearCommandBuffer, "Fill");
+            if (!computeFill.Record(*frame, clearCommandBuffer, renderTargets[index % framesInFlight]->view,
+                fillRects.data(), (uint32_t)fillRects.size()))
+                return false;
+        }
+        else
+        {
+            GpuProfileScope scope(profiler, clearCommandBuffer, loader.GetGraphicsQueueFamily(), "Clear");
+            QueryPassScope pass(queries, clearCommandBuffer, "Clear");
+            pfn.vkCmdClearColorImage(clearCommandBuffer, image, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, &clearColor, 1, &colorSubresourceRange);
+        }
+
+        if (mipLevels > 1)
+        {
+            GpuProfileScope scope(profiler, clearCommandBuffer, loader.GetGraphicsQueueFamily(), "Mips");
+            RecordMipChain(pfn, stateTracker, clearCommandBuffer, loader.GetGraphicsQueueFamily(), image,
+                imageWidth, imageHeight, mipLevels, arrayLayers, mipFilter);
+        }
+
+        // This releases the image to the transfer queue (if it's a different
+        // family), and the transfer engine acquires it. For zero-copy, it
+        // makes the writes visible to the host once the frame's fence has
+        // signalled
+        if (zeroCopy)
+            stateTracker.UseImage(image, RESOURCE_USAGE_HOST_READ, loader.GetGraphicsQueueFamily());
+        else
+            stateTracker.UseImage(image, RESOURCE_USAGE_TRANSFER_SRC, transferEngine->GetQueueFamily());
+        {
+            GpuProfileScope scope(profiler, clearCommandBuffer, loader.GetGraphicsQueueFamily(), "Release");
+            stateTracker.Flush(clearCommandBuffer, loader.GetGraphicsQueueFamily());
+        }
+
+        queries.EndFrame(clearCommandBuffer);
+
+        result = pfn.vkEndCommandBuffer(clearCommandBuffer);
         if (result != VK_SUCCESS)
         {
-            LOGE("vkBeginCommandBuffer failed (%d)", result);
+            LOGE("vkEndCommandBuffer failed (%d)", result);
             return false;
         }
-    }
 
-    {
-        VkImageMemoryBarrier barrier = {};
-        barrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
-        barrier.srcAccessMask = 0;
-        barrier.dstAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
-        barrier.oldLayout = VK_IMAGE_LAYOUT_UNDEFINED;
-        barrier.newLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
-        barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
-        barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
-        barrier.image = deviceImage;
-        barrier.subresourceRange = colorSubresourceRange;
+        PendingReadback readback;
+        readback.index = index;
+        readback.frame = frame;
+        readback.batchNumber = TransferEngine::NO_BATCH;
 
-        pfn.vkCmdPipelineBarrier(clearCommandBuffer,
-            0,
-            VK_PIPELINE_STAGE_TRANSFER_BIT,
-            0,
-            0, nullptr,
-            0, nullptr,
-            1, &barrier);
-    }
+        VkSemaphore semaphore = VK_NULL_HANDLE;
+        if (!zeroCopy)
+        {
+            if (!transferEngine->AllocateReadback(readbackSize, 4, readback.region))
+                return false;
+
+            VkCommandBuffer transferCommandBuffer;
+            Frame *transferBatch;
+            if (!transferEngine->GetCommandBuffer(stateTracker, transferCommandBuffer, transferBatch))
+                return false;
+
+            // Record the copies in parallel on the job system's threads,
+            // with one vkCmdCopyImageToBuffer of several regions per job.
+            // (It's a tiny amount of work here, but the same pattern scales
+            // to scenes with lots of commands to record)
+            {
+                // The transfer queue only waits for the clear (which reset the
+                // queries) at the transfer stage, so the timestamps mustn't be
+                // written any earlier than that
+                uint32_t marker = profiler.BeginMarker(transferCommandBuffer, transferEngine->GetQueueFamily(),
+                    "Readback copy", VK_PIPELINE_STAGE_TRANSFER_BIT);
+
+                const StagingRegion &readbackRegion = readback.region;
+                bool ok = RecordSecondaryCommandBuffers(pfn, jobSystem, *transferBatch,
+                    transferEngine->GetQueueFamily(), transferCommandBuffer, copyJobCount,
+                    [&](uint32_t job, VkCommandBuffer commandBuffer) {
+                        if (copyJobs[job].empty())
+                            return true;
+
+                        std::vector<VkBufferImageCopy> copyRegions = copyJobs[job];
+                        for (VkBufferImageCopy &copyRegion : copyRegions)
+                            copyRegion.bufferOffset += readbackRegion.offset;
+
+                        pfn.vkCmdCopyImageToBuffer(commandBuffer,
+                            image, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL,
+                            readbackRegion.buffer,
+                            (uint32_t)copyRegions.size(), copyRegions.data());
+                        return true;
+                    });
+                if (!ok)
+                    return false;
+
+                profiler.EndMarker(transferCommandBuffer, marker, VK_PIPELINE_STAGE_TRANSFER_BIT);
+            }
 
-    pfn.vkCmdClearColorImage(clearCommandBuffer, deviceImage, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, &clearColor, 1, &colorSubresourceRange);
+            semaphore = frame->GetSemaphore(0);
+        }
 
-    {
-        VkImageMemoryBarrier barrier = {};
-        barrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
-        barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
-        barrier.dstAccessMask = VK_ACCESS_TRANSFER_READ_BIT;
-        barrier.oldLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
-        barrier.newLayout = VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL;
-        barrier.srcQueueFamilyIndex = loader.GetGraphicsQueueFamily();
-        barrier.dstQueueFamilyIndex = loader.GetTransferQueueFamily();
-        barrier.image = deviceImage;
-        barrier.subresourceRange = colorSubresourceRange;
+        // Only wait for the stream writer if it's still reading what this
+        // frame's work overwrites: the render target it clears, or an older
+        // region that the ring has wrapped round onto. Tickets finish in
+        // order, so waiting for the newest overlapping one covers the rest
+        if (zeroCopy)
+        {
+            if (!streamWriter.Wait(targetStreamTickets[index % framesInFlight]))
+                return false;
+        }
+        else
+        {
+            const StagingRegion &reused = readback.region;
+            uint64_t ticket = 0;
+            size_t retired = 0;
+            for (size_t i = 0; i < streamedRegions.size(); ++i)
+            {
+                const StagingRegion &streamed = streamedRegions[i].region;
+                if (streamed.offset < reused.offset + reused.size && reused.offset < streamed.offset + streamed.size)
+                {
+                    ticket = streamedRegions[i].ticket;
+                    retired = i + 1;
+                }
+            }
+            if (!streamWriter.Wait(ticket))
+                return false;
+            streamedRegions.erase(streamedRegions.begin(), streamedRegions.begin() + retired);
+        }
+
+        {
+            VkSubmitInfo submitInfo = {};
+            submitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+            submitInfo.commandBufferCount = 1;
+            submitInfo.pCommandBuffers = &clearCommandBuffer;
+
+            if (semaphore != VK_NULL_HANDLE)
+            {
+                submitInfo.signalSemaphoreCount = 1;
+                submitInfo.pSignalSemaphores = &semaphore;
+            }
+
+            if (!frame->SubmitLast(graphicsScheduler, 1, &submitInfo))
+                return false;
+        }
 
-        pfn.vkCmdPipelineBarrier(clearCommandBuffer,
-            VK_PIPELINE_STAGE_TRANSFER_BIT,
-            VK_PIPELINE_STAGE_TRANSFER_BIT,
-            0,
-            0, nullptr,
-            0, nullptr,
-            1, &barrier);
+        // The transfer batch waits for the clear via the semaphore
+        if (!zeroCopy && !transferEngine->Submit(stateTracker, semaphore, nullptr, readback.batchNumber))
+            return false;
+        pendingReadbacks.push_back(readback);
+
+        // Keep framesInFlight-1 readbacks outstanding while the next frame
+        // is recorded, so the host's writing overlaps with the device's work
+        while (pendingReadbacks.size() >= framesInFlight)
+        {
+            if (!finishReadback())
+                return false;
+        }
     }
 
-    result = pfn.vkEndCommandBuffer(clearCommandBuffer);
-    if (result != VK_SUCCESS)
+    while (!pendingReadbacks.empty())
     {
-        LOGE("vkEndCommandBuffer failed (%d)", result);
-        return false;
+        if (!finishReadback())
+            return false;
     }
 
+    if (!streamWriter.Close())
+        return false;
+
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - startTime).count();
+    double bytes = (double)readbackSize * options.imageCount;
+    LOGI("%u images of %ux%u in %.3f s: %.1f images/s, %.3f GB/s%s",
+        options.imageCount, imageWidth, imageHeight, seconds,
+        options.imageCount / seconds, bytes / seconds / 1e9,
+        options.writeOutput ? " (including writing output)" : "");
+
+    if (!options.tracePath.empty())
     {
-        VkCommandBufferBeginInfo beginInfo = {};
-        beginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
-        beginInfo.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
-        result = pfn.vkBeginCommandBuffer(transferCommandBuffer, &beginInfo);
-        if (result != VK_SUCCESS)
-        {
-            LOGE("vkBeginCommandBuffer failed (%d)", result);
+        if (!frameManager.WaitIdle() || (transferEngine && !transferEngine->WaitIdle()) || !profiler.ResolveAll())
             return false;
-        }
+        if (!profiler.WriteChromeTrace(options.tracePath))
+            return false;
+        LOGI("Wrote trace to %s", options.tracePath.c_str());
     }
 
+    if (options.stats)
     {
-        VkImageMemoryBarrier barriers[2] = {};
-        barriers[0].sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
-        barriers[0].srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
-        barriers[0].dstAccessMask = VK_ACCESS_TRANSFER_READ_BIT;
-        barriers[0].oldLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
-        barriers[0].newLayout = VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL;
-        barriers[0].srcQueueFamilyIndex = loader.GetGraphicsQueueFamily();
-        barriers[0].dstQueueFamilyIndex = loader.GetTransferQueueFamily();
-        barriers[0].image = deviceImage;
-        barriers[0].subresourceRange = colorSubresourceRange;
-
-        barriers[1].sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
-        barriers[1].srcAccessMask = 0;
-        barriers[1].dstAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
-        barriers[1].oldLayout = VK_IMAGE_LAYOUT_UNDEFINED;
-        barriers[1].newLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
-        barriers[1].srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
-        barriers[1].dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
-        barriers[1].image = stagingImage;
-        barriers[1].subresourceRange = colorSubresourceRange;
-
-        pfn.vkCmdPipelineBarrier(transferCommandBuffer,
-            VK_PIPELINE_STAGE_TRANSFER_BIT,
-            VK_PIPELINE_STAGE_TRANSFER_BIT,
-            0,
-            0, nullptr,
-            0, nullptr,
-            2, barriers);
-    }
-
-    {
-        VkImageSubresourceLayers copySubresourceLayers = {};
-        copySubresourceLayers.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
-        copySubresourceLayers.mipLevel = 0;
-        copySubresourceLayers.baseArrayLayer = 0;
-        copySubresourceLayers.layerCount = 1;
-
-        VkImageCopy copyRegion = {};
-        copyRegion.srcSubresource = copySubresourceLayers;
-        copyRegion.srcOffset = { 0, 0, 0 };
-        copyRegion.dstSubresource = copySubresourceLayers;
-        copyRegion.dstOffset = { 0, 0, 0 };
-        copyRegion.extent = { imageWidth, imageHeight, 1 };
-
-        pfn.vkCmdCopyImage(transferCommandBuffer,
-            deviceImage, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL,
-            stagingImage, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
-            1, &copyRegion);
-    }
-
-    {
-        VkImageMemoryBarrier barrier = {};
-        barrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
-        barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
-        barrier.dstAccessMask = VK_ACCESS_HOST_READ_BIT;
-        barrier.oldLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
-        barrier.newLayout = VK_IMAGE_LAYOUT_GENERAL;
-        barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
-        barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
-        barrier.image = stagingImage;
-        barrier.subresourceRange = colorSubresourceRange;
-
-        pfn.vkCmdPipelineBarrier(transferCommandBuffer,
-            VK_PIPELINE_STAGE_TRANSFER_BIT,
-            VK_PIPELINE_STAGE_HOST_BIT,
-            0,
-            0, nullptr,
-            0, nullptr,
-            1, &barrier);
-    }
-
-    result = pfn.vkEndCommandBuffer(transferCommandBuffer);
-    if (result != VK_SUCCESS)
+        if (!frameManager.WaitIdle() || !queries.ResolveAll())
+            return false;
+        LogQueryResults(queries);
+    }
+
+    memoryAllocator.LogHeapStats();
+
+    return true;
+}
+
+/*
+ * --sparse: the image is a SparseImage, which is cleared and read back in
+ * bands one tile high, with memory bound only to the bands that are in
+ * flight. That keeps the device memory to a few bands however big the image
+ * is (a 16384x16384 RGBA8 image would otherwise need 1GB). The host still
+ * holds the whole image, to write it out.
+ *
+ * Each band's clear waits for its tiles to be bound, and for the previous
+ * band's copy to have released the image back from the transfer queue. The
+ * clear covers the whole image, but only the resident tiles are written
+ */
+static bool RunSparseDemo(const DemoOptions &options)
+{
+    VkResult result;
+
+    uint32_t imageWidth = options.imageWidth;
+    uint32_t imageHeight = options.imageHeight;
+    VkFormat format = options.format;
+
+    if (options.compute)
     {
-        LOGE("vkEndCommandBuffer failed (%d)", result);
+        LOGE("--sparse doesn't support --compute");
         return false;
     }
 
+    DeviceLoader loader;
+    loader.SetDebugReportFlags(
+        VK_DEBUG_REPORT_WARNING_BIT_EXT |
+        VK_DEBUG_REPORT_PERFORMANCE_WARNING_BIT_EXT |
+        VK_DEBUG_REPORT_ERROR_BIT_EXT);
+    loader.SetPipelineCachePath("pipeline_cache.bin");
+    loader.SetEnableSparseResidency(true);
+    if (!loader.Setup())
+        return false;
 
-    AutoVkSemaphore semaphore(pfn, device);
-    VkSemaphoreCreateInfo semaphoreCreateInfo = {};
-    semaphoreCreateInfo.sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO;
-    result = pfn.vkCreateSemaphore(device, &semaphoreCreateInfo, CREATE_ALLOCATOR(), semaphore.ptr());
-    if (result != VK_SUCCESS)
+    if (loader.GetSparseQueue() == VK_NULL_HANDLE)
     {
-        LOGE("vkCreateSemaphore failed (%d)", result);
+        LOGE("--sparse needs a device with sparse residency");
         return false;
     }
 
+    if (options.mipLevels != 1 || options.arrayLayers != 1)
     {
-        VkSubmitInfo submitInfo = {};
-        submitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
-        submitInfo.commandBufferCount = 1;
-        submitInfo.pCommandBuffers = &clearCommandBuffer;
+        LOGE("--sparse only supports one mip level and layer");
+        return false;
+    }
 
-        submitInfo.signalSemaphoreCount = 1;
-        submitInfo.pSignalSemaphores = semaphore.ptr();
+    if (!options.streamPath.empty())
+    {
+        LOGE("--sparse doesn't support --stream");
+        return false;
+    }
 
-        result = pfn.vkQueueSubmit(loader.GetGraphicsQueue(), 1, &submitInfo, VK_NULL_HANDLE);
-        if (result != VK_SUCCESS)
+    VkDevice device = loader.GetDevice();
+
+    const InstanceFunctions &ipfn = loader.GetInstanceFunctions();
+    const DeviceFunctions &pfn = loader.GetDeviceFunctions();
+
+    MemoryAllocator memoryAllocator(ipfn, pfn, loader.GetPhysicalDevice(), device);
+
+    const uint32_t framesInFlight = FrameManager::DEFAULT_FRAMES_IN_FLIGHT;
+
+    {
+        VkImageFormatProperties imageFormatProperties;
+        result = ipfn.vkGetPhysicalDeviceImageFormatProperties(loader.GetPhysicalDevice(), format,
+            VK_IMAGE_TYPE_2D, VK_IMAGE_TILING_OPTIMAL,
+            VK_IMAGE_USAGE_TRANSFER_SRC_BIT | VK_IMAGE_USAGE_TRANSFER_DST_BIT,
+            VK_IMAGE_CREATE_SPARSE_BINDING_BIT | VK_IMAGE_CREATE_SPARSE_RESIDENCY_BIT, &imageFormatProperties);
+        if (result != VK_SUCCESS ||
+            imageWidth > imageFormatProperties.maxExtent.width || imageHeight > imageFormatProperties.maxExtent.height)
         {
-            LOGE("vkQueueSubmit failed (%d)", result);
+            LOGE("Sparse %ux%u images of format %d are not supported", imageWidth, imageHeight, format);
             return false;
         }
     }
 
-    {
-        VkSubmitInfo submitInfo = {};
-        submitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
-        submitInfo.commandBufferCount = 1;
-        submitInfo.pCommandBuffers = &transferCommandBuffer;
+    // Unlike the other modes, there's one image, and its bands are what's
+    // pipelined
+    SparseImage sparseImage(pfn, device, memoryAllocator);
+    if (!sparseImage.Setup(format, imageWidth, imageHeight,
+        VK_IMAGE_USAGE_TRANSFER_SRC_BIT | VK_IMAGE_USAGE_TRANSFER_DST_BIT))
+        return false;
+    VkImage image = sparseImage.GetImage();
 
-        submitInfo.waitSemaphoreCount = 1;
-        submitInfo.pWaitSemaphores = semaphore.ptr();
-        VkPipelineStageFlags stageFlags = VK_PIPELINE_STAGE_TRANSFER_BIT;
-        submitInfo.pWaitDstStageMask = &stageFlags;
+    uint32_t bandHeight = sparseImage.GetTileExtent().height;
+    uint32_t bandCount = (imageHeight + bandHeight - 1) / bandHeight;
+    VkDeviceSize rowPitch = (VkDeviceSize)imageWidth * 4;
+    VkDeviceSize bandSize = rowPitch * bandHeight;
 
-        result = pfn.vkQueueSubmit(loader.GetTransferQueue(), 1, &submitInfo, VK_NULL_HANDLE);
-        if (result != VK_SUCCESS)
+    // Each band is copied on its own, which the transfer family has to allow
+    VkExtent3D granularity = loader.GetQueueFamilyProperties(loader.GetTransferQueueFamily()).minImageTransferGranularity;
+    for (uint32_t band = 0; band < bandCount; ++band)
+    {
+        uint32_t y0 = band * bandHeight;
+        if (!IsTransferGranular(granularity, { 0, (int32_t)y0, 0 },
+            { imageWidth, std::min(bandHeight, imageHeight - y0), 1 }, { imageWidth, imageHeight, 1 }))
         {
-            LOGE("vkQueueSubmit failed (%d)", result);
+            LOGE("The transfer queue can't copy %u-row bands (minImageTransferGranularity (%u,%u,%u))",
+                bandHeight, granularity.width, granularity.height, granularity.depth);
             return false;
         }
     }
 
-    result = pfn.vkDeviceWaitIdle(device);
-    if (result != VK_SUCCESS)
-    {
-        LOGE("vkDeviceWaitIdle failed (%d)", result);
+    StagingBuffer stagingBuffer(pfn, device, memoryAllocator,
+        std::max(StagingBuffer::DEFAULT_SIZE, (bandSize + 64 * 1024) * (framesInFlight + 1)));
+    if (!stagingBuffer.Setup())
         return false;
-    }
 
-    VkMappedMemoryRange stagingImageMemRange = {};
-    stagingImageMemRange.sType = VK_STRUCTURE_TYPE_MAPPED_MEMORY_RANGE;
-    stagingImageMemRange.memory = stagingImageMem;
-    stagingImageMemRange.offset = 0;
-    stagingImageMemRange.size = VK_WHOLE_SIZE;
-    result = pfn.vkInvalidateMappedMemoryRanges(device, 1, &stagingImageMemRange);
-    if (result != VK_SUCCESS)
-    {
-        LOGE("vkInvalidateMappedMemoryRanges failed (%d)", result);
+    // The sparse queue is often the transfer queue too
+    SubmitSchedulerSet schedulers(pfn);
+    SubmitScheduler &graphicsScheduler = schedulers.Get(loader.GetGraphicsQueue());
+    SubmitScheduler &sparseScheduler = schedulers.Get(loader.GetSparseQueue());
+
+    TransferEngine transferEngine(pfn, device, stagingBuffer,
+        schedulers.Get(loader.GetTransferQueue()), loader.GetTransferQueueFamily(), framesInFlight);
+    if (!transferEngine.Setup())
         return false;
-    }
 
+    // Each band's frame signals one semaphore when its tiles are bound, and
+    // one when it has been cleared
+    FrameManager frameManager(pfn, device, framesInFlight);
+    if (!frameManager.Setup(std::vector<uint32_t>(1, loader.GetGraphicsQueueFamily()), 2))
+        return false;
+
+    ResourceStateTracker stateTracker(pfn);
+    stateTracker.AddImage(image, VK_IMAGE_ASPECT_COLOR_BIT, 1, 1);
+
+    VkImageSubresourceRange colorSubresourceRange = { VK_IMAGE_ASPECT_COLOR_BIT, 0, 1, 0, 1 };
+    VkImageSubresourceLayers colorSubresourceLayers = { VK_IMAGE_ASPECT_COLOR_BIT, 0, 0, 1 };
+
+    std::vector<uint8_t> texels(rowPitch * imageHeight);
+
+    struct PendingBand
     {
-        std::ofstream out("output.tga", std::ofstream::binary | std::ofstream::out);
+        uint32_t index;
+        uint32_t band;
+        uint64_t batchNumber;
+        StagingRegion region;
+    };
+    std::vector<PendingBand> pendingBands;
+
+    VkDeviceSize peakResidentBytes = 0;
+
+    // Wait for the oldest band's copy, after which its tiles can be unbound
+    // (by the next Submit), and write out the image once it's complete
+    auto finishBand = [&]() {
+        PendingBand pending = pendingBands.front();
+        pendingBands.erase(pendingBands.begin());
+
+        if (!transferEngine.Wait(pending.batchNumber))
+            return false;
+
+        uint32_t y0 = pending.band * bandHeight;
+        uint32_t rows = std::min(bandHeight, imageHeight - y0);
+        memcpy(&texels[rowPitch * y0], pending.region.ptr, (size_t)(rowPitch * rows));
+
+        sparseImage.Evict({ 0, (int32_t)y0 }, { imageWidth, rows });
+
+        if (!options.writeOutput || pending.band != bandCount - 1)
+            return true;
 
-        const uint8_t tga_header[18] = {
-            0, 0, 2,
-            0, 0, 0, 0, 0,
-            0, 0, 0, 0,
-            (uint8_t)(imageWidth & 0xff), (uint8_t)(imageWidth>> 8),
-            (uint8_t)(imageHeight & 0xff), (uint8_t)(imageHeight >> 8),
-            32, 8 | (1 << 5),
-        };
-        out.write((const char *)tga_header, sizeof(tga_header));
+        char path[64];
+        if (options.imageCount == 1)
+            snprintf(path, sizeof(path), "output.tga");
+        else
+            snprintf(path, sizeof(path), "output_%04u.tga", pending.index);
+        return WriteTGA(path, texels.data(), imageWidth, imageHeight,
+            (size_t)rowPitch, format == VK_FORMAT_B8G8R8A8_UNORM);
+    };
+
+    auto startTime = std::chrono::steady_clock::now();
+
+    // Signalled by each band's copy, for the next band's binds. Every clear
+    // writes the whole image, so the binds that unbind an evicted band have
+    // to wait for all the earlier clears and copies, not just the ones that
+    // finishBand() has waited for; the copy waits for its clear, which waits
+    // for the previous binds, so this one semaphore orders the whole chain
+    VkSemaphore copyDone = VK_NULL_HANDLE;
 
-        for (uint32_t y = 0; y < imageHeight; ++y)
+    for (uint32_t index = 0; index < options.imageCount; ++index)
+    {
+        VkClearColorValue clearColor;
+        clearColor.float32[0] = 1.0f;
+        clearColor.float32[1] = 0.65f;
+        clearColor.float32[2] = (float)index / options.imageCount;
+        clearColor.float32[3] = 1.0f;
+
+        for (uint32_t band = 0; band < bandCount; ++band)
         {
-            uint8_t *row = (uint8_t *)stagingImageMemPtr + stagingImageLayout.offset + stagingImageLayout.rowPitch * y;
-            for (uint32_t x = 0; x < imageWidth; ++x)
+            bool last = (index == options.imageCount - 1 && band == bandCount - 1);
+            uint32_t y0 = band * bandHeight;
+            uint32_t rows = std::min(bandHeight, imageHeight - y0);
+
+            Frame *frame;
+            if (!frameManager.BeginFrame(frame))
+                return false;
+
+            VkSemaphore bound = frame->GetSemaphore(0);
+            VkSemaphore cleared = frame->GetSemaphore(1);
+
+            // This also unbinds the bands that finishBand() has evicted
+            if (!sparseImage.MakeResident({ 0, (int32_t)y0 }, { imageWidth, rows }) ||
+                !sparseImage.Submit(sparseScheduler, copyDone, bound))
+                return false;
+            peakResidentBytes = std::max(peakResidentBytes, sparseImage.GetResidentBytes());
+
+            VkCommandBuffer commandBuffer;
+            if (!frame->AllocateCommandBuffer(loader.GetGraphicsQueueFamily(), commandBuffer))
+                return false;
+
+            VkCommandBufferBeginInfo beginInfo = {};
+            beginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+            beginInfo.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+            result = pfn.vkBeginCommandBuffer(commandBuffer, &beginInfo);
+            if (result != VK_SUCCESS)
+            {
+                LOGE("vkBeginCommandBuffer failed (%d)", result);
+                return false;
+            }
+
+            // The contents are kept, since the earlier bands' tiles may
+            // still be resident
+            stateTracker.UseImage(image, RESOURCE_USAGE_TRANSFER_DST, loader.GetGraphicsQueueFamily());
+            stateTracker.Flush(commandBuffer, loader.GetGraphicsQueueFamily());
+
+            pfn.vkCmdClearColorImage(commandBuffer, image, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+                &clearColor, 1, &colorSubresourceRange);
+
+            stateTracker.UseImage(image, RESOURCE_USAGE_TRANSFER_SRC, transferEngine.GetQueueFamily());
+            stateTracker.Flush(commandBuffer, loader.GetGraphicsQueueFamily());
+
+            result = pfn.vkEndCommandBuffer(commandBuffer);
+            if (result != VK_SUCCESS)
             {
-                uint8_t rgba[4];
-                memcpy(rgba, row + x * 4, 4);
-                uint8_t bgra[4] = { rgba[2], rgba[1], rgba[0], rgba[3] };
-                out.write((const char *)bgra, 4);
+                LOGE("vkEndCommandBuffer failed (%d)", result);
+                return false;
+            }
+
+            // The previous copy (which released the image back to this
+            // queue) is covered by waiting for the binds
+            VkPipelineStageFlags waitStage = VK_PIPELINE_STAGE_TRANSFER_BIT;
+
+            VkSubmitInfo submitInfo = {};
+            submitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+            submitInfo.waitSemaphoreCount = 1;
+            submitInfo.pWaitSemaphores = &bound;
+            submitInfo.pWaitDstStageMask = &waitStage;
+            submitInfo.commandBufferCount = 1;
+            submitInfo.pCommandBuffers = &commandBuffer;
+            submitInfo.signalSemaphoreCount = 1;
+            submitInfo.pSignalSemaphores = &cleared;
+            if (!frame->SubmitLast(graphicsScheduler, 1, &submitInfo))
+                return false;
+
+            PendingBand pending;
+            pending.index = index;
+            pending.band = band;
+            if (!transferEngine.ReadbackImage(stateTracker, image, colorSubresourceLayers,
+                { 0, (int32_t)y0, 0 }, { imageWidth, rows, 1 }, 4, pending.region))
+                return false;
+
+            // Release the image back to the graphics queue for the next band
+            copyDone = VK_NULL_HANDLE;
+            if (!last)
+                stateTracker.UseImage(image, RESOURCE_USAGE_TRANSFER_DST, loader.GetGraphicsQueueFamily());
+            if (!transferEngine.Submit(stateTracker, cleared, last ? nullptr : &copyDone, pending.batchNumber))
+                return false;
+            pendingBands.push_back(pending);
+
+            while (pendingBands.size() >= framesInFlight)
+            {
+                if (!finishBand())
+                    return false;
             }
         }
     }
 
+    while (!pendingBands.empty())
+    {
+        if (!finishBand())
+            return false;
+    }
+
+    // Unbind the last bands, and give their memory back
+    if (!sparseImage.Submit(sparseScheduler, VK_NULL_HANDLE, VK_NULL_HANDLE) || !sparseImage.Wait())
+        return false;
+
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - startTime).count();
+    double bytes = (double)rowPitch * imageHeight * options.imageCount;
+    LOGI("%u sparse images of %ux%u in %.3f s: %.1f images/s, %.3f GB/s%s",
+        options.imageCount, imageWidth, imageHeight, seconds,
+        options.imageCount / seconds, bytes / seconds / 1e9,
+        options.writeOutput ? " (including writing output)" : "");
+    LOGI("At most %u KB of the image was resident (of %u KB)",
+        (uint32_t)(peakResidentBytes / 1024), (uint32_t)(rowPitch * imageHeight / 1024));
+
+    memoryAllocator.LogHeapStats();
+
     return true;
 }
 
-int main()
+int main(int argc, char **argv)
 {
-    if (!RunDemo())
+    DemoOptions options;
+    if (!ParseOptions(argc, argv, options))
+    {
+        PrintUsage(argv[0]);
+        return -1;
+    }
+
+    // The validation layers can produce a lot of output, so print it from a
+    // background thread
+    SetLogAsync(true);
+
+    // Logging every host allocation would swamp the output (and the timings)
+    // in batch mode, so just count them
+    DebugAllocationCallbacks::setMode(DEBUG_ALLOCATOR_STATS);
+
+    bool ok = options.sparse ? RunSparseDemo(options) : RunDemo(options);
+
+    DebugAllocationCallbacks::dumpStats();
+
+    SetLogAsync(false);
+
+    if (!ok)
         return -1;
     return 0;
 }
@@ -0,0 +1,938 @@
+/*
+ * Copyright (c) 2016 Philip Taylor
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+/*
+ * Microbenchmarks for the common/ layer, written as JSON so results can be
+ * compared across devices and driver versions.
+ *
+ * Each benchmark repeats its operation until it has run for at least
+ * --min-time seconds, and reports the mean time per operation (plus the
+ * throughput, for the ones that move data).
+ */
+
+#include "common/Common.h"
+
+#include "common/AllocationCallbacks.h"
+#include "common/DeviceLoader.h"
+#include "common/FrameManager.h"
+#include "common/MemoryAllocator.h"
+#include "common/Profiler.h"
+#include "common/ResourceStateTracker.h"
+#include "common/StagingBuffer.h"
+#include "common/SubmitScheduler.h"
+#include "common/TransferEngine.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+
+struct BenchOptions
+{
+    std::string jsonPath;
+    double minTime; // seconds per benchmark
+
+    BenchOptions()
+        : jsonPath("vksxs-bench.json"), minTime(0.2)
+    {
+    }
+};
+
+struct BenchResult
+{
+    std::string name;
+    uint64_t iterations;
+    double nsPerOp;
+    double mbPerSec; // negative if the benchmark doesn't move data
+};
+
+class Bench
+{
+public:
+    explicit Bench(double minTime)
+        : m_MinTime(minTime)
+    {
+    }
+
+    /*
+     * Run fn (which performs opsPerCall operations, and returns false on
+     * failure) with a doubling number of calls until it takes at least the
+     * minimum time. bytesPerOp is used to compute the throughput.
+     */
+    bool Run(const std::string &name, uint64_t opsPerCall, uint64_t bytesPerOp, const std::function<bool ()> &fn)
+    {
+        // Warm up caches, lazily-created objects, etc
+        if (!fn())
+        {
+            LOGE("Benchmark %s failed", name.c_str());
+            return false;
+        }
+
+        uint64_t calls = 1;
+        double seconds;
+        while (true)
+        {
+            auto start = std::chrono::steady_clock::now();
+            for (uint64_t i = 0; i < calls; ++i)
+            {
+                if (!fn())
+                {
+                    LOGE("Benchmark %s failed", name.c_str());
+                    return false;
+                }
+            }
+            seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+            if (seconds >= m_MinTime)
+                break;
+            calls *= 2;
+        }
+
+        AddResult(name, calls * opsPerCall, seconds, bytesPerOp);
+        return true;
+    }
+
+    // For benchmarks that can't be repeated arbitrarily (or that time
+    // themselves)
+    void AddResult(const std::string &name, uint64_t ops, double seconds, uint64_t bytesPerOp)
+    {
+        BenchResult result;
+        result.name = name;
+        result.iterations = ops;
+        result.nsPerOp = seconds * 1e9 / ops;
+        result.mbPerSec = bytesPerOp ? (double)bytesPerOp * ops / seconds / (1024.0 * 1024.0) : -1.0;
+
+        if (result.mbPerSec >= 0.0)
+            LOGW("%-40s %12.1f ns/op %10.1f MB/s", name.c_str(), result.nsPerOp, result.mbPerSec);
+        else
+            LOGW("%-40s %12.1f ns/op", name.c_str(), result.nsPerOp);
+
+        m_Results.push_back(result);
+    }
+
+    const std::vector<BenchResult> &GetResults() const { return m_Results; }
+
+private:
+    double m_MinTime;
+    std::vector<BenchResult> m_Results;
+};
+
+static std::string JsonString(const char *str)
+{
+    std::string out = "\"";
+    for (const char *c = str; *c; ++c)
+    {
+        if (*c == '"' || *c == '\\')
+        {
+            out += '\\';
+            out += *c;
+        }
+        else if ((unsigned char)*c < 0x20)
+        {
+            char buf[8];
+            snprintf(buf, sizeof(buf), "\\u%04x", (unsigned char)*c);
+            out += buf;
+        }
+        else
+        {
+            out += *c;
+        }
+    }
+    out += "\"";
+    return out;
+}
+
+static bool WriteJson(const std::string &path, const VkPhysicalDeviceProperties *properties,
+    const std::vector<BenchResult> &results)
+{
+    FILE *f = fopen(path.c_str(), "w");
+    if (!f)
+    {
+        LOGE("Failed to open %s", path.c_str());
+        return false;
+    }
+
+    fprintf(f, "{\n");
+    if (properties)
+    {
+        fprintf(f, "  \"device\": {\"name\": %s, \"vendorID\": %u, \"deviceID\": %u, \"driverVersion\": %u, \"apiVersion\": \"%u.%u.%u\"},\n",
+            JsonString(properties->deviceName).c_str(), properties->vendorID, properties->deviceID,
+            properties->driverVersion, VK_VERSION_MAJOR(properties->apiVersion),
+            VK_VERSION_MINOR(properties->apiVersion), VK_VERSION_PATCH(properties->apiVersion));
+    }
+    else
+    {
+        fprintf(f, "  \"device\": null,\n");
+    }
+
+    fprintf(f, "  \"results\": [\n");
+    for (size_t i = 0; i < results.size(); ++i)
+    {
+        const BenchResult &result = results[i];
+        fprintf(f, "    {\"name\": %s, \"iterations\": %llu, \"ns_per_op\": %.3f",
+            JsonString(result.name.c_str()).c_str(), (unsigned long long)result.iterations, result.nsPerOp);
+        if (result.mbPerSec >= 0.0)
+            fprintf(f, ", \"mb_per_s\": %.3f", result.mbPerSec);
+        fprintf(f, "}%s\n", i + 1 < results.size() ? "," : "");
+    }
+    fprintf(f, "  ]\n}\n");
+
+    bool ok = (ferror(f) == 0);
+    if (fclose(f) != 0)
+        ok = false;
+    if (!ok)
+        LOGE("Failed to write %s", path.c_str());
+    return ok;
+}
+
+/*
+ * Host allocations, in batches (so the allocator sees several blocks live at
+ * once, like a driver does), with the same pattern through each allocator
+ */
+static bool BenchHostAllocations(Bench &bench)
+{
+    const size_t BATCH = 64;
+    const VkSystemAllocationScope scope = VK_SYSTEM_ALLOCATION_SCOPE_OBJECT;
+    void *blocks[BATCH];
+
+    static const size_t sizes[] = { 64, 1024, 16384 };
+    for (size_t size : sizes)
+    {
+        char suffix[32];
+        snprintf(suffix, sizeof(suffix), "/%u", (uint32_t)size);
+
+        bool ok = bench.Run(std::string("alloc_free/malloc") + suffix, BATCH, 0, [&]() {
+            for (size_t i = 0; i < BATCH; ++i)
+                blocks[i] = malloc(size);
+            for (size_t i = 0; i < BATCH; ++i)
+                free(blocks[i]);
+            return true;
+        });
+
+        ok = ok && bench.Run(std::string("alloc_free/doAllocation") + suffix, BATCH, 0, [&]() {
+            for (size_t i = 0; i < BATCH; ++i)
+                blocks[i] = AllocationCallbacksBase::doAllocation(size, 16, scope);
+            for (size_t i = 0; i < BATCH; ++i)
+            {
+                size_t originalSize;
+                AllocationCallbacksBase::doFree(blocks[i], &originalSize);
+            }
+            return true;
+        });
+
+        ok = ok && bench.Run(std::string("alloc_free/pool") + suffix, BATCH, 0, [&]() {
+            for (size_t i = 0; i < BATCH; ++i)
+                blocks[i] = PoolAllocationCallbacks::allocate(size, 16, scope);
+            for (size_t i = 0; i < BATCH; ++i)
+            {
+                size_t originalSize;
+                PoolAllocationCallbacks::deallocate(blocks[i], &originalSize);
+            }
+            return true;
+        });
+
+        if (!ok)
+            return false;
+    }
+
+    // Growing a block by doubling, like a driver's vector of objects
+    const size_t GROWTH_STEPS = 10;
+
+    bool ok = bench.Run("realloc_grow/realloc", GROWTH_STEPS, 0, [&]() {
+        void *p = malloc(64);
+        for (size_t i = 1; i <= GROWTH_STEPS; ++i)
+            p = realloc(p, (size_t)64 << i);
+        free(p);
+        return true;
+    });
+
+    ok = ok && bench.Run("realloc_grow/doReallocation", GROWTH_STEPS, 0, [&]() {
+        size_t originalSize;
+        void *p = AllocationCallbacksBase::doAllocation(64, 16, scope);
+        for (size_t i = 1; i <= GROWTH_STEPS; ++i)
+            p = AllocationCallbacksBase::doReallocation(p, (size_t)64 << i, 16, scope, &originalSize);
+        AllocationCallbacksBase::doFree(p, &originalSize);
+        return true;
+    });
+
+    ok = ok && bench.Run("realloc_grow/pool", GROWTH_STEPS, 0, [&]() {
+        size_t originalSize;
+        void *p = PoolAllocationCallbacks::allocate(64, 16, scope);
+        for (size_t i = 1; i <= GROWTH_STEPS; ++i)
+            p = PoolAllocationCallbacks::reallocate(p, (size_t)64 << i, 16, scope, &originalSize);
+        PoolAllocationCallbacks::deallocate(p, &originalSize);
+        return true;
+    });
+
+    return ok;
+}
+
+/*
+ * Instance and device creation. The first Setup() in the process also loads
+ * the Vulkan library and probes the instance's layers, so it's reported
+ * separately from the later ones
+ */
+static bool BenchDeviceLoaderSetup(Bench &bench)
+{
+    const uint32_t WARM_RUNS = 5;
+
+    double coldSeconds = 0.0;
+    double warmSeconds = 0.0;
+    for (uint32_t i = 0; i <= WARM_RUNS; ++i)
+    {
+        auto start = std::chrono::steady_clock::now();
+        {
+            DeviceLoader loader;
+            if (!loader.Setup())
+                return false;
+        }
+        double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        if (i == 0)
+            coldSeconds = seconds;
+        else
+            warmSeconds += seconds;
+    }
+
+    bench.AddResult("device_loader_setup/cold", 1, coldSeconds, 0);
+    bench.AddResult("device_loader_setup/warm", WARM_RUNS, warmSeconds, 0);
+    return true;
+}
+
+static bool BeginCommandBuffer(const DeviceFunctions &pfn, VkCommandBuffer commandBuffer)
+{
+    VkCommandBufferBeginInfo beginInfo = {};
+    beginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+    beginInfo.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+    VkResult result = pfn.vkBeginCommandBuffer(commandBuffer, &beginInfo);
+    if (result != VK_SUCCESS)
+    {
+        LOGE("vkBeginCommandBuffer failed (%d)", result);
+        return false;
+    }
+    return true;
+}
+
+static bool EndCommandBuffer(const DeviceFunctions &pfn, VkCommandBuffer commandBuffer)
+{
+    VkResult result = pfn.vkEndCommandBuffer(commandBuffer);
+    if (result != VK_SUCCESS)
+    {
+        LOGE("vkEndCommandBuffer failed (%d)", result);
+        return false;
+    }
+    return true;
+}
+
+static bool SubmitAndWait(Frame *frame, VkQueue queue, VkCommandBuffer commandBuffer)
+{
+    VkSubmitInfo submitInfo = {};
+    submitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+    submitInfo.commandBufferCount = 1;
+    submitInfo.pCommandBuffers = &commandBuffer;
+    return frame->SubmitLast(queue, 1, &submitInfo) && frame->Wait();
+}
+
+/*
+ * The fixed cost of getting a command buffer to the device and back: an
+ * empty command buffer from a frame (which reuses the slot's pool), and a
+ * submit that waits for its fence. The same submit of a persistent command
+ * buffer, recorded once, shows how much of that is the recording
+ */
+static bool BenchCommandBuffers(Bench &bench, DeviceLoader &loader, FrameManager &frameManager)
+{
+    const DeviceFunctions &pfn = loader.GetDeviceFunctions();
+    uint32_t queueFamily = loader.GetGraphicsQueueFamily();
+
+    bool ok = bench.Run("command_buffer/record_empty", 1, 0, [&]() {
+        Frame *frame;
+        VkCommandBuffer commandBuffer;
+        return frameManager.BeginFrame(frame) &&
+            frame->AllocateCommandBuffer(queueFamily, commandBuffer) &&
+            BeginCommandBuffer(pfn, commandBuffer) &&
+            EndCommandBuffer(pfn, commandBuffer);
+    });
+
+    ok = ok && bench.Run("command_buffer/submit_wait", 1, 0, [&]() {
+        Frame *frame;
+        VkCommandBuffer commandBuffer;
+        return frameManager.BeginFrame(frame) &&
+            frame->AllocateCommandBuffer(queueFamily, commandBuffer) &&
+            BeginCommandBuffer(pfn, commandBuffer) &&
+            EndCommandBuffer(pfn, commandBuffer) &&
+            SubmitAndWait(frame, loader.GetGraphicsQueue(), commandBuffer);
+    });
+
+    CommandBufferPool *commandBufferPool = frameManager.GetCommandBufferPool(queueFamily);
+    VkCommandBuffer persistent;
+    if (!ok || !commandBufferPool->AllocatePersistent(VK_COMMAND_BUFFER_LEVEL_PRIMARY, persistent))
+        return false;
+
+    // Not ONE_TIME_SUBMIT, since it's submitted every iteration
+    VkCommandBufferBeginInfo beginInfo = {};
+    beginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+    VkResult result = pfn.vkBeginCommandBuffer(persistent, &beginInfo);
+    if (result != VK_SUCCESS)
+    {
+        LOGE("vkBeginCommandBuffer failed (%d)", result);
+        commandBufferPool->FreePersistent(persistent);
+        return false;
+    }
+
+    ok = EndCommandBuffer(pfn, persistent) &&
+        bench.Run("command_buffer/submit_persistent", 1, 0, [&]() {
+            Frame *frame;
+            return frameManager.BeginFrame(frame) &&
+                SubmitAndWait(frame, loader.GetGraphicsQueue(), persistent);
+        });
+
+    // Every submit has been waited for, so it's safe to free
+    ok = frameManager.WaitIdle() && ok;
+    commandBufferPool->FreePersistent(persistent);
+    return ok;
+}
+
+/*
+ * 16 empty command buffers per frame, as 16 vkQueueSubmits or as one
+ * vkQueueSubmit with 16 submit infos through a SubmitScheduler. The
+ * difference is the fixed cost of each submit
+ */
+static bool BenchSubmits(Bench &bench, DeviceLoader &loader, FrameManager &frameManager)
+{
+    const DeviceFunctions &pfn = loader.GetDeviceFunctions();
+    uint32_t queueFamily = loader.GetGraphicsQueueFamily();
+    VkQueue queue = loader.GetGraphicsQueue();
+
+    const uint32_t COMMAND_BUFFERS = 16;
+
+    std::vector<VkCommandBuffer> commandBuffers(COMMAND_BUFFERS);
+    auto record = [&](Frame *frame) {
+        for (VkCommandBuffer &commandBuffer : commandBuffers)
+        {
+            if (!frame->AllocateCommandBuffer(queueFamily, commandBuffer) ||
+                !BeginCommandBuffer(pfn, commandBuffer) ||
+                !EndCommandBuffer(pfn, commandBuffer))
+                return false;
+        }
+        return true;
+    };
+
+    VkSubmitInfo submitInfo = {};
+    submitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+    submitInfo.commandBufferCount = 1;
+
+    bool ok = bench.Run("submit/individual", COMMAND_BUFFERS, 0, [&]() {
+        Frame *frame;
+        if (!frameManager.BeginFrame(frame) || !record(frame))
+            return false;
+        for (uint32_t i = 0; i + 1 < COMMAND_BUFFERS; ++i)
+        {
+            submitInfo.pCommandBuffers = &commandBuffers[i];
+            VkResult result = pfn.vkQueueSubmit(queue, 1, &submitInfo, VK_NULL_HANDLE);
+            if (result != VK_SUCCESS)
+            {
+                LOGE("vkQueueSubmit failed (%d)", result);
+                return false;
+            }
+        }
+        return SubmitAndWait(frame, queue, commandBuffers.back());
+    });
+
+    SubmitScheduler scheduler(pfn, queue);
+    ok = ok && bench.Run("submit/batched", COMMAND_BUFFERS, 0, [&]() {
+        Frame *frame;
+        if (!frameManager.BeginFrame(frame) || !record(frame))
+            return false;
+        for (VkCommandBuffer &commandBuffer : commandBuffers)
+        {
+            submitInfo.pCommandBuffers = &commandBuffer;
+            if (!scheduler.Post(1, &submitInfo))
+                return false;
+        }
+        return frame->SubmitLast(scheduler, 0, nullptr) && frame->Wait();
+    });
+
+    return ok && frameManager.WaitIdle();
+}
+
+// Small device images, which only exist to have barriers on them
+struct BenchImage
+{
+    AutoVkImage image;
+    AutoMemoryAllocation memory;
+
+    BenchImage(const DeviceFunctions &pfn, VkDevice device, MemoryAllocator &allocator)
+        : image(pfn, device), memory(allocator)
+    {
+    }
+};
+
+static bool CreateImage(const DeviceFunctions &pfn, VkDevice device, MemoryAllocator &memoryAllocator,
+    uint32_t width, uint32_t height, BenchImage &image)
+{
+    VkImageCreateInfo imageCreateInfo = {};
+    imageCreateInfo.sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO;
+    imageCreateInfo.imageType = VK_IMAGE_TYPE_2D;
+    imageCreateInfo.format = VK_FORMAT_R8G8B8A8_UNORM;
+    imageCreateInfo.extent = { width, height, 1 };
+    imageCreateInfo.mipLevels = 1;
+    imageCreateInfo.arrayLayers = 1;
+    imageCreateInfo.samples = VK_SAMPLE_COUNT_1_BIT;
+    imageCreateInfo.tiling = VK_IMAGE_TILING_OPTIMAL;
+    imageCreateInfo.usage = VK_IMAGE_USAGE_TRANSFER_SRC_BIT | VK_IMAGE_USAGE_TRANSFER_DST_BIT;
+    imageCreateInfo.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+    imageCreateInfo.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+    VkResult result = pfn.vkCreateImage(device, &imageCreateInfo, CREATE_ALLOCATOR(), image.image.ptr());
+    if (result != VK_SUCCESS)
+    {
+        LOGE("vkCreateImage failed (%d)", result);
+        return false;
+    }
+
+    if (!memoryAllocator.AllocateForImage(image.image, VK_IMAGE_TILING_OPTIMAL,
+        VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, 0, *image.memory))
+    {
+        LOGE("Failed to allocate image memory");
+        return false;
+    }
+
+    return true;
+}
+
+/*
+ * Layout transitions on a set of images, flipping every image between
+ * TRANSFER_DST and TRANSFER_SRC: the tracker's CPU cost to queue and flush
+ * them, and the device's cost to execute them
+ */
+static bool BenchBarriers(Bench &bench, DeviceLoader &loader, MemoryAllocator &memoryAllocator,
+    FrameManager &frameManager)
+{
+    const DeviceFunctions &pfn = loader.GetDeviceFunctions();
+    VkDevice device = loader.GetDevice();
+    uint32_t queueFamily = loader.GetGraphicsQueueFamily();
+
+    const uint32_t IMAGE_COUNT = 64;
+    const uint32_t FLUSHES_PER_COMMAND_BUFFER = 256;
+
+    std::vector<std::unique_ptr<BenchImage>> images;
+    ResourceStateTracker stateTracker(pfn);
+    for (uint32_t i = 0; i < IMAGE_COUNT; ++i)
+    {
+        std::unique_ptr<BenchImage> image(new BenchImage(pfn, device, memoryAllocator));
+        if (!CreateImage(pfn, device, memoryAllocator, 64, 64, *image))
+            return false;
+        stateTracker.AddImage(image->image, VK_IMAGE_ASPECT_COLOR_BIT, 1, 1);
+        images.push_back(std::move(image));
+    }
+
+    uint32_t flushCount = 0;
+    auto recordFlushes = [&](VkCommandBuffer commandBuffer) {
+        for (uint32_t i = 0; i < FLUSHES_PER_COMMAND_BUFFER; ++i)
+        {
+            ResourceUsage usage = (flushCount++ & 1) ? RESOURCE_USAGE_TRANSFER_SRC : RESOURCE_USAGE_TRANSFER_DST;
+            for (auto &image : images)
+                stateTracker.UseImage(image->image, usage, queueFamily);
+            stateTracker.Flush(commandBuffer, queueFamily);
+        }
+    };
+
+    // Recording only: these command buffers are never submitted, so the
+    // tracker's idea of the layouts is wrong afterwards
+    bool ok = bench.Run("barriers/record_64_images", FLUSHES_PER_COMMAND_BUFFER, 0, [&]() {
+        Frame *frame;
+        VkCommandBuffer commandBuffer;
+        if (!frameManager.BeginFrame(frame) ||
+            !frame->AllocateCommandBuffer(queueFamily, commandBuffer) ||
+            !BeginCommandBuffer(pfn, commandBuffer))
+            return false;
+        recordFlushes(commandBuffer);
+        return EndCommandBuffer(pfn, commandBuffer);
+    });
+    if (!ok)
+        return false;
+
+    // Nothing has been written to the images, so they can start again from
+    // UNDEFINED. These are recorded outside the timed region, so this is the
+    // submit round trip plus the device's time to execute the barriers
+    for (auto &image : images)
+        stateTracker.SetImageState(image->image, RESOURCE_USAGE_UNDEFINED);
+
+    const uint32_t EXECUTE_RUNS = 16;
+    double seconds = 0.0;
+    for (uint32_t run = 0; run < EXECUTE_RUNS; ++run)
+    {
+        Frame *frame;
+        VkCommandBuffer commandBuffer;
+        if (!frameManager.BeginFrame(frame) ||
+            !frame->AllocateCommandBuffer(queueFamily, commandBuffer) ||
+            !BeginCommandBuffer(pfn, commandBuffer))
+            return false;
+        recordFlushes(commandBuffer);
+        if (!EndCommandBuffer(pfn, commandBuffer))
+            return false;
+
+        auto start = std::chrono::steady_clock::now();
+        if (!SubmitAndWait(frame, loader.GetGraphicsQueue(), commandBuffer))
+            return false;
+        seconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    }
+    bench.AddResult("barriers/execute_64_images", EXECUTE_RUNS * FLUSHES_PER_COMMAND_BUFFER, seconds, 0);
+
+    return frameManager.WaitIdle();
+}
+
+/*
+ * A producer and a consumer on the same queue, with an independent command
+ * in between: clear A, transition A to TRANSFER_SRC, clear B, copy A to C.
+ * With a full pipeline barrier, clearing B has to wait for clearing A; with
+ * a split barrier (vkCmdSetEvent after clearing A, vkCmdWaitEvents before
+ * the copy) the two clears can overlap. Each is timed on the device with
+ * the Profiler's timestamps, and the difference is the idle time saved
+ */
+static bool BenchSplitBarriers(Bench &bench, DeviceLoader &loader, MemoryAllocator &memoryAllocator,
+    FrameManager &frameManager)
+{
+    const DeviceFunctions &pfn = loader.GetDeviceFunctions();
+    VkDevice device = loader.GetDevice();
+    uint32_t queueFamily = loader.GetGraphicsQueueFamily();
+
+    const uint32_t IMAGE_SIZE = 1024;
+    const uint32_t RUNS = 32;
+
+    VkPhysicalDeviceProperties properties;
+    loader.GetInstanceFunctions().vkGetPhysicalDeviceProperties(loader.GetPhysicalDevice(), &properties);
+
+    Profiler profiler(pfn, device, properties.limits.timestampPeriod, frameManager.GetFramesInFlight());
+    profiler.AddQueueFamily(queueFamily, loader.GetQueueFamilyProperties(queueFamily).timestampValidBits, "Graphics queue");
+    if (!profiler.Setup())
+        return false;
+
+    BenchImage a(pfn, device, memoryAllocator);
+    BenchImage b(pfn, device, memoryAllocator);
+    BenchImage c(pfn, device, memoryAllocator);
+    if (!CreateImage(pfn, device, memoryAllocator, IMAGE_SIZE, IMAGE_SIZE, a) ||
+        !CreateImage(pfn, device, memoryAllocator, IMAGE_SIZE, IMAGE_SIZE, b) ||
+        !CreateImage(pfn, device, memoryAllocator, IMAGE_SIZE, IMAGE_SIZE, c))
+        return false;
+
+    ResourceStateTracker stateTracker(pfn);
+    stateTracker.AddImage(a.image, VK_IMAGE_ASPECT_COLOR_BIT, 1, 1);
+    stateTracker.AddImage(b.image, VK_IMAGE_ASPECT_COLOR_BIT, 1, 1);
+    stateTracker.AddImage(c.image, VK_IMAGE_ASPECT_COLOR_BIT, 1, 1);
+
+    VkClearColorValue clearColor = {};
+    VkImageSubresourceRange range = { VK_IMAGE_ASPECT_COLOR_BIT, 0, 1, 0, 1 };
+    VkImageCopy copy = {};
+    copy.srcSubresource = { VK_IMAGE_ASPECT_COLOR_BIT, 0, 0, 1 };
+    copy.dstSubresource = copy.srcSubresource;
+    copy.extent = { IMAGE_SIZE, IMAGE_SIZE, 1 };
+
+    auto run = [&](bool split) {
+        Frame *frame;
+        VkCommandBuffer commandBuffer;
+        if (!frameManager.BeginFrame(frame) ||
+            !frame->AllocateCommandBuffer(queueFamily, commandBuffer) ||
+            !BeginCommandBuffer(pfn, commandBuffer) ||
+            !profiler.BeginFrame(commandBuffer, frame->GetNumber()))
+            return false;
+
+        stateTracker.SetImageState(a.image, RESOURCE_USAGE_UNDEFINED);
+        stateTracker.SetImageState(b.image, RESOURCE_USAGE_UNDEFINED);
+        stateTracker.SetImageState(c.image, RESOURCE_USAGE_UNDEFINED);
+        stateTracker.UseImage(a.image, RESOURCE_USAGE_TRANSFER_DST, queueFamily);
+        stateTracker.UseImage(b.image, RESOURCE_USAGE_TRANSFER_DST, queueFamily);
+        stateTracker.UseImage(c.image, RESOURCE_USAGE_TRANSFER_DST, queueFamily);
+        stateTracker.Flush(commandBuffer, queueFamily);
+
+        uint32_t marker = profiler.BeginMarker(commandBuffer, queueFamily, split ? "split" : "full");
+
+        pfn.vkCmdClearColorImage(commandBuffer, a.image, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, &clearColor, 1, &range);
+
+        SplitBarrier splitBarrier;
+        stateTracker.UseImage(a.image, RESOURCE_USAGE_TRANSFER_SRC, queueFamily);
+        if (split)
+            stateTracker.FlushSplit(commandBuffer, frame->GetEvent(0), queueFamily, splitBarrier);
+        else
+            stateTracker.Flush(commandBuffer, queueFamily);
+
+        pfn.vkCmdClearColorImage(commandBuffer, b.image, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, &clearColor, 1, &range);
+
+        stateTracker.WaitSplit(commandBuffer, splitBarrier);
+
+        pfn.vkCmdCopyImage(commandBuffer, a.image, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL,
+            c.image, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, 1, &copy);
+
+        profiler.EndMarker(commandBuffer, marker);
+
+        return EndCommandBuffer(pfn, commandBuffer) &&
+            SubmitAndWait(frame, loader.GetGraphicsQueue(), commandBuffer);
+    };
+
+    for (uint32_t i = 0; i < RUNS; ++i)
+    {
+        if (!run(false) || !run(true))
+            return false;
+    }
+
+    if (!frameManager.WaitIdle() || !profiler.ResolveAll())
+        return false;
+
+    double fullUs = 0.0, splitUs = 0.0;
+    uint32_t fullCount = 0, splitCount = 0;
+    for (const ProfileEvent &event : profiler.GetEvents())
+    {
+        if (!event.gpu)
+            continue;
+        if (event.name == "full")
+        {
+            fullUs += event.durationUs;
+            ++fullCount;
+        }
+        else if (event.name == "split")
+        {
+            splitUs += event.durationUs;
+            ++splitCount;
+        }
+    }
+
+    // No timestamps, e.g. the queue family doesn't support them
+    if (fullCount == 0 || splitCount == 0)
+    {
+        LOGW("Skipping barriers/split: no GPU timestamps");
+        return true;
+    }
+
+    bench.AddResult("barriers/full_gpu", fullCount, fullUs * 1e-6, 0);
+    bench.AddResult("barriers/split_gpu", splitCount, splitUs * 1e-6, 0);
+
+    double savedUs = fullUs / fullCount - splitUs / splitCount;
+    LOGW("Split barriers saved %.1f us of GPU time per frame (%.1f%%)",
+        savedUs, 100.0 * savedUs / (fullUs / fullCount));
+    return true;
+}
+
+/*
+ * Destroying a batch of transient buffers straight away, against handing
+ * them to the frame's DeletionQueue (which destroys them in one go when the
+ * slot comes round again). This creates the buffers in both cases, so the
+ * difference is the cost of deferring
+ */
+static bool BenchDestruction(Bench &bench, DeviceLoader &loader, FrameManager &frameManager)
+{
+    const DeviceFunctions &pfn = loader.GetDeviceFunctions();
+    VkDevice device = loader.GetDevice();
+
+    const uint32_t numBuffers = 256;
+
+    auto createBuffers = [&](std::vector<AutoVkBuffer> &buffers) {
+        VkBufferCreateInfo bufferCreateInfo = {};
+        bufferCreateInfo.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
+        bufferCreateInfo.size = 4096;
+        bufferCreateInfo.usage = VK_BUFFER_USAGE_TRANSFER_SRC_BIT;
+        bufferCreateInfo.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+
+        for (uint32_t i = 0; i < numBuffers; ++i)
+        {
+            AutoVkBuffer buffer(pfn, device);
+            VkResult result = pfn.vkCreateBuffer(device, &bufferCreateInfo, CREATE_ALLOCATOR(), buffer.ptr());
+            if (result != VK_SUCCESS)
+            {
+                LOGE("vkCreateBuffer failed (%d)", result);
+                return false;
+            }
+            buffers.push_back(std::move(buffer));
+        }
+        return true;
+    };
+
+    std::vector<AutoVkBuffer> buffers;
+    buffers.reserve(numBuffers);
+
+    bool ok = bench.Run("destroy/buffer_immediate", numBuffers, 0, [&]() {
+        Frame *frame;
+        if (!frameManager.BeginFrame(frame) || !createBuffers(buffers))
+            return false;
+        buffers.clear();
+        return true;
+    });
+
+    ok = ok && bench.Run("destroy/buffer_deferred", numBuffers, 0, [&]() {
+        Frame *frame;
+        if (!frameManager.BeginFrame(frame) || !createBuffers(buffers))
+            return false;
+        for (AutoVkBuffer &buffer : buffers)
+            frame->DeferDestroy(std::move(buffer));
+        buffers.clear();
+        return true;
+    });
+
+    return ok && frameManager.WaitIdle();
+}
+
+/*
+ * Image-to-buffer copies through the staging ring and the transfer queue,
+ * waiting for each one (so this includes the submit latency), then the
+ * host's bandwidth reading from the staging memory, which depends on
+ * whether it's HOST_CACHED
+ */
+static bool BenchReadback(Bench &bench, DeviceLoader &loader, MemoryAllocator &memoryAllocator)
+{
+    const DeviceFunctions &pfn = loader.GetDeviceFunctions();
+    VkDevice device = loader.GetDevice();
+
+    const uint32_t WIDTH = 2048;
+    const uint32_t HEIGHT = 2048;
+    const VkDeviceSize imageSize = (VkDeviceSize)WIDTH * HEIGHT * 4;
+
+    BenchImage image(pfn, device, memoryAllocator);
+    if (!CreateImage(pfn, device, memoryAllocator, WIDTH, HEIGHT, image))
+        return false;
+
+    StagingBuffer stagingBuffer(pfn, device, memoryAllocator,
+        std::max(StagingBuffer::DEFAULT_SIZE, (imageSize + 64 * 1024) * 3));
+    if (!stagingBuffer.Setup())
+        return false;
+
+    SubmitScheduler scheduler(pfn, loader.GetTransferQueue());
+    TransferEngine transferEngine(pfn, device, stagingBuffer,
+        scheduler, loader.GetTransferQueueFamily());
+    if (!transferEngine.Setup())
+        return false;
+
+    // The contents are never written, so they can be discarded before every
+    // copy, which keeps the image on the transfer family
+    ResourceStateTracker stateTracker(pfn);
+    stateTracker.AddImage(image.image, VK_IMAGE_ASPECT_COLOR_BIT, 1, 1);
+
+    VkImageSubresourceLayers subresource = {};
+    subresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+    subresource.mipLevel = 0;
+    subresource.baseArrayLayer = 0;
+    subresource.layerCount = 1;
+
+    StagingRegion region;
+    bool ok = bench.Run("readback/copy_2048x2048_rgba8", 1, imageSize, [&]() {
+        stateTracker.SetImageState(image.image, RESOURCE_USAGE_UNDEFINED);
+        uint64_t batchNumber;
+        return transferEngine.ReadbackImage(stateTracker, image.image, subresource,
+                { 0, 0, 0 }, { WIDTH, HEIGHT, 1 }, 4, region) &&
+            transferEngine.Submit(stateTracker, VK_NULL_HANDLE, nullptr, batchNumber) &&
+            transferEngine.Wait(batchNumber);
+    });
+    if (!ok)
+        return false;
+
+    // The last region is still valid, since nothing else has been allocated
+    std::vector<char> hostCopy((size_t)imageSize);
+    ok = bench.Run(stagingBuffer.IsCached() ? "readback/host_read_cached" : "readback/host_read_uncached",
+        1, imageSize, [&]() {
+            memcpy(hostCopy.data(), region.ptr, hostCopy.size());
+            return true;
+        });
+
+    return ok && transferEngine.WaitIdle();
+}
+
+static void PrintUsage(const char *program)
+{
+    LOGE("Usage: %s [--json FILE] [--min-time SECONDS] [--host-only]", program);
+}
+
+int main(int argc, char **argv)
+{
+    BenchOptions options;
+    bool hostOnly = false;
+    for (int i = 1; i < argc; ++i)
+    {
+        std::string arg = argv[i];
+        const char *value = (i + 1 < argc ? argv[i + 1] : nullptr);
+
+        if (arg == "--json" && value)
+        {
+            options.jsonPath = value;
+            ++i;
+        }
+        else if (arg == "--min-time" && value)
+        {
+            options.minTime = strtod(value, nullptr);
+            ++i;
+        }
+        else if (arg == "--host-only")
+        {
+            hostOnly = true;
+        }
+        else
+        {
+            PrintUsage(argv[0]);
+            return -1;
+        }
+    }
+
+    // The results are printed as warnings, so the setup messages don't get
+    // in the way. Logging host allocations would dominate the timings
+    SetLogMinSeverity(LOG_SEVERITY_WARN);
+    DebugAllocationCallbacks::setMode(0);
+
+    Bench bench(options.minTime);
+
+    if (!BenchHostAllocations(bench))
+        return -1;
+
+    if (hostOnly)
+        return WriteJson(options.jsonPath, nullptr, bench.GetResults()) ? 0 : -1;
+
+    if (!BenchDeviceLoaderSetup(bench))
+        return -1;
+
+    VkPhysicalDeviceProperties properties;
+    {
+        DeviceLoader loader;
+        if (!loader.Setup())
+            return -1;
+
+        VkDevice device = loader.GetDevice();
+        const InstanceFunctions &ipfn = loader.GetInstanceFunctions();
+        const DeviceFunctions &pfn = loader.GetDeviceFunctions();
+
+        ipfn.vkGetPhysicalDeviceProperties(loader.GetPhysicalDevice(), &properties);
+
+        MemoryAllocator memoryAllocator(ipfn, pfn, loader.GetPhysicalDevice(), device);
+
+        FrameManager frameManager(pfn, device);
+        if (!frameManager.Setup(std::vector<uint32_t>(1, loader.GetGraphicsQueueFamily()), 0, 1))
+            return -1;
+
+        if (!BenchCommandBuffers(bench, loader, frameManager) ||
+            !BenchSubmits(bench, loader, frameManager) ||
+            !BenchBarriers(bench, loader, memoryAllocator, frameManager) ||
+            !BenchSplitBarriers(bench, loader, memoryAllocator, frameManager) ||
+            !BenchDestruction(bench, loader, frameManager) ||
+            !BenchReadback(bench, loader, memoryAllocator))
+            return -1;
+    }
+
+    if (!WriteJson(options.jsonPath, &properties, bench.GetResults()))
+        return -1;
+
+    return 0;
+}
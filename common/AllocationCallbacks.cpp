@@ -25,7 +25,14 @@
 #include "common/AllocationCallbacks.h"
 
 #include <algorithm>
+#include <atomic>
+#include <cstddef>
 #include <cstdlib>
+#include <mutex>
+#include <set>
+#include <string>
+#include <thread>
+#include <vector>
 
 const char *AllocationCallbacksBase::scopeString(VkSystemAllocationScope scope)
 {
@@ -66,7 +73,8 @@ const char *AllocationCallbacksBase::typeString(VkInternalAllocationType type)
   *
   * We also store a BufferHeader structure just before the aligned buffer,
   * which tells us the size of the allocation and of the padding, so that we
-  * can realloc/free it correctly later.
+  * can realloc/free it correctly later. It also has room for an owner tag
+  * that callers can use to remember who made the allocation.
   *
   * So the malloced data looks like:
   *
@@ -89,6 +97,8 @@ struct BufferHeader
 {
     void *outer; // unaligned pointer returned by malloc()
     size_t size; // original size requested in the allocation call
+    VkSystemAllocationScope scope;
+    void *owner; // tag from setOwner()
 };
 
 void *AllocationCallbacksBase::doAllocation(size_t size, size_t alignment, VkSystemAllocationScope allocationScope)
@@ -112,6 +122,8 @@ void *AllocationCallbacksBase::doAllocation(size_t size, size_t alignment, VkSys
     BufferHeader header;
     header.outer = outer;
     header.size = size;
+    header.scope = allocationScope;
+    header.owner = nullptr;
 
     // Store the header just before inner
     memcpy((void *)(inner - sizeof(BufferHeader)), &header, sizeof(BufferHeader));
@@ -121,7 +133,7 @@ void *AllocationCallbacksBase::doAllocation(size_t size, size_t alignment, VkSys
 
 void *AllocationCallbacksBase::doReallocation(void *pOriginal,
     size_t size, size_t alignment, VkSystemAllocationScope allocationScope,
-    size_t *originalSize)
+    size_t *originalSize, VkSystemAllocationScope *originalScope)
 {
     // Must be a power of two
     ASSERT(alignment != 0 && !(alignment & (alignment - 1)));
@@ -133,7 +145,7 @@ void *AllocationCallbacksBase::doReallocation(void *pOriginal,
 
     if (size == 0)
     {
-        doFree(pOriginal, originalSize);
+        doFree(pOriginal, originalSize, originalScope);
         return nullptr;
     }
 
@@ -144,6 +156,8 @@ void *AllocationCallbacksBase::doReallocation(void *pOriginal,
     memcpy(&header, (void *)(inner - sizeof(BufferHeader)), sizeof(BufferHeader));
 
     *originalSize = header.size;
+    if (originalScope)
+        *originalScope = header.scope;
 
     // If we can be certain that realloc will return a correctly-aligned
     // pointer (which typically means alignment <= alignof(double)) then it's
@@ -182,6 +196,7 @@ void *AllocationCallbacksBase::doReallocation(void *pOriginal,
 
         header.outer = newOuter;
         header.size = size;
+        header.scope = allocationScope;
 
         // Store the updated header
         memcpy((void *)(newInner - sizeof(BufferHeader)), &header, sizeof(BufferHeader));
@@ -205,7 +220,7 @@ void *AllocationCallbacksBase::doReallocation(void *pOriginal,
     }
 }
 
-void AllocationCallbacksBase::doFree(void *pMemory, size_t *originalSize)
+void AllocationCallbacksBase::doFree(void *pMemory, size_t *originalSize, VkSystemAllocationScope *originalScope)
 {
     uintptr_t inner = (uintptr_t)pMemory;
 
@@ -213,10 +228,29 @@ void AllocationCallbacksBase::doFree(void *pMemory, size_t *originalSize)
     memcpy(&header, (void *)(inner - sizeof(BufferHeader)), sizeof(BufferHeader));
 
     *originalSize = header.size;
+    if (originalScope)
+        *originalScope = header.scope;
 
     free(header.outer);
 }
 
+void *AllocationCallbacksBase::getOwner(void *pMemory)
+{
+    uintptr_t inner = (uintptr_t)pMemory;
+
+    BufferHeader header;
+    memcpy(&header, (void *)(inner - sizeof(BufferHeader)), sizeof(BufferHeader));
+
+    return header.owner;
+}
+
+void AllocationCallbacksBase::setOwner(void *pMemory, void *owner)
+{
+    uintptr_t inner = (uintptr_t)pMemory;
+
+    memcpy((void *)(inner - sizeof(BufferHeader) + offsetof(BufferHeader, owner)), &owner, sizeof(owner));
+}
+
 void AllocationCallbacksBase::test()
 {
     VkSystemAllocationScope scope = VK_SYSTEM_ALLOCATION_SCOPE_COMMAND;
@@ -284,15 +318,123 @@ void AllocationCallbacksBase::test()
 
 
 
+void AllocationCounters::add(size_t size)
+{
+    allocations.fetch_add(1, std::memory_order_relaxed);
+    liveCount.fetch_add(1, std::memory_order_relaxed);
+    int64_t bytes = liveBytes.fetch_add((int64_t)size, std::memory_order_relaxed) + (int64_t)size;
+
+    int64_t peak = peakBytes.load(std::memory_order_relaxed);
+    while (bytes > peak && !peakBytes.compare_exchange_weak(peak, bytes, std::memory_order_relaxed))
+    {
+    }
+}
+
+void AllocationCounters::remove(size_t size)
+{
+    frees.fetch_add(1, std::memory_order_relaxed);
+    liveCount.fetch_sub(1, std::memory_order_relaxed);
+    liveBytes.fetch_sub((int64_t)size, std::memory_order_relaxed);
+}
+
+static std::atomic<uint32_t> g_DebugAllocatorMode(DEBUG_ALLOCATOR_LOG);
+
+// Linked list of every AllocationSite, newest first
+static std::atomic<AllocationSite *> g_AllocationSites(nullptr);
+
+// Indexed by VkSystemAllocationScope
+static const size_t NUM_ALLOCATION_SCOPES = VK_SYSTEM_ALLOCATION_SCOPE_RANGE_SIZE;
+static AllocationCounters g_ScopeCounters[NUM_ALLOCATION_SCOPES];
+static AllocationCounters g_InternalScopeCounters[NUM_ALLOCATION_SCOPES];
+
+static AllocationCounters &scopeCounters(AllocationCounters *counters, VkSystemAllocationScope scope)
+{
+    size_t i = (size_t)scope - VK_SYSTEM_ALLOCATION_SCOPE_BEGIN_RANGE;
+    ASSERT(i < NUM_ALLOCATION_SCOPES);
+    return counters[i];
+}
+
+void DebugAllocationCallbacks::setMode(uint32_t mode)
+{
+    g_DebugAllocatorMode.store(mode, std::memory_order_relaxed);
+}
+
+AllocationSite *DebugAllocationCallbacks::registerSite(const char *src)
+{
+    AllocationSite *site = new AllocationSite;
+    site->src = src;
+    site->next = g_AllocationSites.load(std::memory_order_relaxed);
+    while (!g_AllocationSites.compare_exchange_weak(site->next, site, std::memory_order_release, std::memory_order_relaxed))
+    {
+    }
+    return site;
+}
+
+static void logCounters(const char *name, const AllocationCounters &c)
+{
+    LOGI("  %s: %" PRIu64 " allocs, %" PRIu64 " reallocs, %" PRIu64 " frees, live %" PRId64 " (%" PRId64 " bytes), peak %" PRId64 " bytes",
+        name,
+        c.allocations.load(std::memory_order_relaxed),
+        c.reallocations.load(std::memory_order_relaxed),
+        c.frees.load(std::memory_order_relaxed),
+        c.liveCount.load(std::memory_order_relaxed),
+        c.liveBytes.load(std::memory_order_relaxed),
+        c.peakBytes.load(std::memory_order_relaxed));
+}
+
+void DebugAllocationCallbacks::dumpStats()
+{
+    LOGI("Host allocations by scope:");
+    for (size_t i = 0; i < NUM_ALLOCATION_SCOPES; ++i)
+    {
+        VkSystemAllocationScope scope = (VkSystemAllocationScope)(VK_SYSTEM_ALLOCATION_SCOPE_BEGIN_RANGE + i);
+        if (g_ScopeCounters[i].allocations.load(std::memory_order_relaxed))
+            logCounters(scopeString(scope), g_ScopeCounters[i]);
+    }
+
+    LOGI("Internal allocations by scope:");
+    for (size_t i = 0; i < NUM_ALLOCATION_SCOPES; ++i)
+    {
+        VkSystemAllocationScope scope = (VkSystemAllocationScope)(VK_SYSTEM_ALLOCATION_SCOPE_BEGIN_RANGE + i);
+        if (g_InternalScopeCounters[i].allocations.load(std::memory_order_relaxed))
+            logCounters(scopeString(scope), g_InternalScopeCounters[i]);
+    }
+
+    LOGI("Host allocations by call site:");
+    for (AllocationSite *site = g_AllocationSites.load(std::memory_order_acquire); site; site = site->next)
+    {
+        if (site->counters.allocations.load(std::memory_order_relaxed))
+            logCounters(site->src, site->counters);
+        if (site->internalCounters.allocations.load(std::memory_order_relaxed))
+        {
+            std::string name = std::string(site->src) + " (internal)";
+            logCounters(name.c_str(), site->internalCounters);
+        }
+    }
+}
+
 void *DebugAllocationCallbacks::fnAllocation(void *pUserData,
     size_t size, size_t alignment, VkSystemAllocationScope allocationScope)
 {
-    const char *src = (const char *)pUserData;
+    AllocationSite *site = (AllocationSite *)pUserData;
+    uint32_t mode = g_DebugAllocatorMode.load(std::memory_order_relaxed);
 
     void *ret = doAllocation(size, alignment, allocationScope);
 
-    LOGI("alloc: %s: %p: size=%lu alignment=%lu scope=%s",
-        src, ret, (unsigned long)size, (unsigned long)alignment, scopeString(allocationScope));
+    // The owner is only set if the allocation was counted, so that the free
+    // is only counted then too, even if setMode() is called in between
+    if (ret && (mode & DEBUG_ALLOCATOR_STATS))
+    {
+        setOwner(ret, site);
+        site->counters.add(size);
+        scopeCounters(g_ScopeCounters, allocationScope).add(size);
+    }
+
+    if (mode & DEBUG_ALLOCATOR_LOG)
+    {
+        LOGI("alloc: %s: %p: size=%lu alignment=%lu scope=%s",
+            site->src, ret, (unsigned long)size, (unsigned long)alignment, scopeString(allocationScope));
+    }
 
     return ret;
 }
@@ -300,38 +442,703 @@ void *DebugAllocationCallbacks::fnAllocation(void *pUserData,
 void *DebugAllocationCallbacks::fnReallocation(void *pUserData,
     void *pOriginal, size_t size, size_t alignment, VkSystemAllocationScope allocationScope)
 {
-    const char *src = (const char *)pUserData;
+    AllocationSite *site = (AllocationSite *)pUserData;
+    uint32_t mode = g_DebugAllocatorMode.load(std::memory_order_relaxed);
+
+    // The original may have been allocated through a different site (the
+    // callbacks passed to vkCreate* and vkDestroy* needn't match), so its
+    // bytes are taken away from whichever site owns them, if any (it wasn't
+    // counted if the stats were off at the time)
+    AllocationSite *originalSite = pOriginal ? (AllocationSite *)getOwner(pOriginal) : nullptr;
+
     size_t originalSize;
-    void *ret = doReallocation(pOriginal, size, alignment, allocationScope, &originalSize);
+    VkSystemAllocationScope originalScope = allocationScope;
+    void *ret = doReallocation(pOriginal, size, alignment, allocationScope, &originalSize, &originalScope);
+
+    // A failed reallocation leaves the original untouched; otherwise it's
+    // counted as a free of the original plus an allocation of the result
+    if (ret || size == 0)
+    {
+        if (originalSite)
+        {
+            originalSite->counters.remove(originalSize);
+            scopeCounters(g_ScopeCounters, originalScope).remove(originalSize);
+        }
 
-    LOGI("realloc: %s: %p -> %p: size=(original %lu, new %lu) alignment=%lu scope=%s",
-        src, pOriginal, ret,
-        (unsigned long)originalSize, (unsigned long)size,
-        (unsigned long)alignment, scopeString(allocationScope));
+        if (ret)
+            setOwner(ret, (mode & DEBUG_ALLOCATOR_STATS) ? site : nullptr);
+
+        if (mode & DEBUG_ALLOCATOR_STATS)
+        {
+            site->counters.reallocations.fetch_add(1, std::memory_order_relaxed);
+            scopeCounters(g_ScopeCounters, allocationScope).reallocations.fetch_add(1, std::memory_order_relaxed);
+            if (ret)
+            {
+                site->counters.add(size);
+                scopeCounters(g_ScopeCounters, allocationScope).add(size);
+            }
+        }
+    }
+
+    if (mode & DEBUG_ALLOCATOR_LOG)
+    {
+        LOGI("realloc: %s: %p -> %p: size=(original %lu, new %lu) alignment=%lu scope=%s",
+            site->src, pOriginal, ret,
+            (unsigned long)originalSize, (unsigned long)size,
+            (unsigned long)alignment, scopeString(allocationScope));
+    }
 
     return ret;
 }
 
 void DebugAllocationCallbacks::fnFree(void *pUserData, void *pMemory)
 {
-    const char *src = (const char *)pUserData;
+    // The spec allows pMemory to be NULL
+    if (!pMemory)
+        return;
+
+    AllocationSite *site = (AllocationSite *)pUserData;
+    uint32_t mode = g_DebugAllocatorMode.load(std::memory_order_relaxed);
+
+    // Credit the free to the site that made the allocation, not the one
+    // passed in here; they differ whenever an object is destroyed with
+    // different callbacks than it was created with. It's null if the
+    // allocation wasn't counted
+    AllocationSite *owner = (AllocationSite *)getOwner(pMemory);
+
     size_t originalSize;
-    doFree(pMemory, &originalSize);
-    LOGI("free: %s: %p: size=%lu", src, pMemory, (unsigned long)originalSize);
+    VkSystemAllocationScope originalScope;
+    doFree(pMemory, &originalSize, &originalScope);
+
+    if (owner)
+    {
+        owner->counters.remove(originalSize);
+        scopeCounters(g_ScopeCounters, originalScope).remove(originalSize);
+    }
+
+    if (mode & DEBUG_ALLOCATOR_LOG)
+        LOGI("free: %s: %p: size=%lu", site->src, pMemory, (unsigned long)originalSize);
 }
 
 void DebugAllocationCallbacks::fnInternalAllocation(void *pUserData,
     size_t size, VkInternalAllocationType allocationType, VkSystemAllocationScope allocationScope)
 {
-    const char *src = (const char *)pUserData;
-    LOGI("internal allocation: %s: size=%lu type=%s scope=%s",
-        src, typeString(allocationType), scopeString(allocationScope));
+    AllocationSite *site = (AllocationSite *)pUserData;
+    uint32_t mode = g_DebugAllocatorMode.load(std::memory_order_relaxed);
+
+    if (mode & DEBUG_ALLOCATOR_STATS)
+    {
+        site->internalCounters.add(size);
+        scopeCounters(g_InternalScopeCounters, allocationScope).add(size);
+    }
+
+    if (mode & DEBUG_ALLOCATOR_LOG)
+    {
+        LOGI("internal allocation: %s: size=%lu type=%s scope=%s",
+            site->src, (unsigned long)size, typeString(allocationType), scopeString(allocationScope));
+    }
 }
 
 void DebugAllocationCallbacks::fnInternalFree(void *pUserData,
     size_t size, VkInternalAllocationType allocationType, VkSystemAllocationScope allocationScope)
 {
-    const char *src = (const char *)pUserData;
-    LOGI("internal free: %s: size=%lu type=%s scope=%s",
-        src, typeString(allocationType), scopeString(allocationScope));
+    AllocationSite *site = (AllocationSite *)pUserData;
+    uint32_t mode = g_DebugAllocatorMode.load(std::memory_order_relaxed);
+
+    if (mode & DEBUG_ALLOCATOR_STATS)
+    {
+        site->internalCounters.remove(size);
+        scopeCounters(g_InternalScopeCounters, allocationScope).remove(size);
+    }
+
+    if (mode & DEBUG_ALLOCATOR_LOG)
+    {
+        LOGI("internal free: %s: size=%lu type=%s scope=%s",
+            site->src, (unsigned long)size, typeString(allocationType), scopeString(allocationScope));
+    }
+}
+
+
+
+/*
+ * PoolAllocationCallbacks
+ *
+ * Every block we hand out is immediately preceded by a PoolBlockHeader, which
+ * tells deallocate/reallocate which of the three strategies it came from:
+ *
+ *  .---------.-----------------.----------------.
+ *  | padding | PoolBlockHeader | requested size |
+ *  '---------'-----------------'----------------'
+ *                              ^
+ *                              returned pointer
+ *
+ * The header is always POOL_HEADER_SIZE bytes, so the returned pointer keeps
+ * the alignment of wherever the header was placed.
+ */
+
+const size_t PoolAllocationCallbacks::MAX_SMALL_SIZE;
+const size_t PoolAllocationCallbacks::SMALL_ALIGNMENT;
+
+enum PoolBlockKind
+{
+    POOL_BLOCK_SMALL,   // owner is the PoolThreadHeap whose free lists it belongs to
+    POOL_BLOCK_COMMAND, // owner is the PoolCommandArena it was bumped from
+    POOL_BLOCK_LARGE,   // owner is the pointer returned by doAllocation
+};
+
+struct PoolBlockHeader
+{
+    void *owner;
+    uint32_t size; // requested size (small, command), or offset from owner (large)
+    uint16_t kind;
+    uint16_t sizeClass;
+};
+
+static const size_t POOL_HEADER_SIZE = 16;
+static_assert(sizeof(PoolBlockHeader) <= POOL_HEADER_SIZE, "PoolBlockHeader too large");
+static_assert(PoolAllocationCallbacks::SMALL_ALIGNMENT == POOL_HEADER_SIZE, "Small blocks rely on the header preserving alignment");
+
+// Size classes are multiples of 16 bytes, with four steps per power of two
+// once we get past 128 bytes, so the rounding wastes at most 25%
+static const uint32_t POOL_SIZE_CLASSES[] = {
+    16, 32, 48, 64, 80, 96, 112, 128,
+    160, 192, 224, 256,
+    320, 384, 448, 512,
+    640, 768, 896, 1024,
+    1280, 1536, 1792, 2048,
+    2560, 3072, 3584, 4096,
+};
+static const size_t POOL_NUM_SIZE_CLASSES = sizeof(POOL_SIZE_CLASSES) / sizeof(POOL_SIZE_CLASSES[0]);
+
+// Small blocks are carved out of slabs of this size
+static const size_t POOL_SLAB_SIZE = 64 * 1024;
+
+// Size of each thread's command-scope arena
+static const size_t POOL_COMMAND_ARENA_SIZE = 64 * 1024;
+
+// Maps (size + 15) / 16 onto an index into POOL_SIZE_CLASSES
+struct PoolSizeClassTable
+{
+    uint8_t classes[PoolAllocationCallbacks::MAX_SMALL_SIZE / 16 + 1];
+
+    PoolSizeClassTable()
+    {
+        size_t c = 0;
+        for (size_t i = 0; i < sizeof(classes); ++i)
+        {
+            while (POOL_SIZE_CLASSES[c] < i * 16)
+                ++c;
+            classes[i] = (uint8_t)c;
+        }
+    }
+};
+
+static const PoolSizeClassTable s_PoolSizeClassTable;
+
+// Used to link together free blocks, stored in the block's payload
+struct PoolFreeBlock
+{
+    PoolFreeBlock *next;
+};
+
+struct PoolCommandArena
+{
+    char *base;
+    size_t used;
+
+    // Number of allocations that haven't been freed yet. Only the owning
+    // thread allocates (so only it increments and resets), but any thread
+    // may free
+    std::atomic<uint32_t> live;
+};
+
+struct PoolThreadHeap
+{
+    // Only accessed by the owning thread
+    PoolFreeBlock *freeLists[POOL_NUM_SIZE_CLASSES];
+    char *slabCursor;
+    char *slabEnd;
+
+    // Blocks freed by other threads, waiting to be moved onto freeLists.
+    // Other threads only ever push single blocks, and the owner only ever
+    // takes the whole list, so this doesn't suffer from the ABA problem
+    std::atomic<PoolFreeBlock *> remoteFrees;
+
+    PoolCommandArena commandArena;
+
+    PoolThreadHeap *nextRetired;
+};
+
+// Heaps whose threads have exited. Blocks from these can still be freed
+// (they just get pushed onto remoteFrees) and the heaps will be reused by
+// the next threads to start allocating. This is only touched on thread
+// creation and exit, so a plain lock is fine
+static std::mutex s_PoolRetiredHeapsMutex;
+static PoolThreadHeap *s_PoolRetiredHeaps;
+
+static PoolThreadHeap *PoolAcquireHeap()
+{
+    {
+        std::lock_guard<std::mutex> lock(s_PoolRetiredHeapsMutex);
+        if (s_PoolRetiredHeaps)
+        {
+            PoolThreadHeap *heap = s_PoolRetiredHeaps;
+            s_PoolRetiredHeaps = heap->nextRetired;
+            heap->nextRetired = nullptr;
+            return heap;
+        }
+    }
+
+    PoolThreadHeap *heap = new PoolThreadHeap;
+    for (size_t i = 0; i < POOL_NUM_SIZE_CLASSES; ++i)
+        heap->freeLists[i] = nullptr;
+    heap->slabCursor = nullptr;
+    heap->slabEnd = nullptr;
+    heap->remoteFrees.store(nullptr, std::memory_order_relaxed);
+    heap->commandArena.base = nullptr;
+    heap->commandArena.used = 0;
+    heap->commandArena.live.store(0, std::memory_order_relaxed);
+    heap->nextRetired = nullptr;
+    return heap;
+}
+
+static void PoolRetireHeap(PoolThreadHeap *heap)
+{
+    std::lock_guard<std::mutex> lock(s_PoolRetiredHeapsMutex);
+    heap->nextRetired = s_PoolRetiredHeaps;
+    s_PoolRetiredHeaps = heap;
+}
+
+// Hands the thread's heap back to the retired list when the thread exits
+struct PoolThreadHeapHandle
+{
+    PoolThreadHeap *heap;
+    bool exited; // the heap has been retired, and mustn't be used again
+
+    PoolThreadHeapHandle() : heap(nullptr), exited(false) { }
+
+    ~PoolThreadHeapHandle()
+    {
+        if (heap)
+            PoolRetireHeap(heap);
+
+        // Another thread may acquire the heap as soon as it's retired
+        heap = nullptr;
+        exited = true;
+    }
+};
+
+static thread_local PoolThreadHeapHandle t_PoolThreadHeap;
+
+// Returns null once the thread's heap has been retired, e.g. when another
+// thread_local's destructor allocates during thread exit, in which case the
+// caller has to fall back to PoolAllocateLarge
+static PoolThreadHeap *PoolGetThreadHeap()
+{
+    PoolThreadHeap *heap = t_PoolThreadHeap.heap;
+    if (!heap && !t_PoolThreadHeap.exited)
+        heap = t_PoolThreadHeap.heap = PoolAcquireHeap();
+    return heap;
+}
+
+static PoolBlockHeader *PoolGetHeader(void *pMemory)
+{
+    return (PoolBlockHeader *)((uintptr_t)pMemory - POOL_HEADER_SIZE);
+}
+
+static void *PoolWriteHeader(uintptr_t inner, void *owner, uint32_t size, PoolBlockKind kind, uint16_t sizeClass)
+{
+    PoolBlockHeader *header = PoolGetHeader((void *)inner);
+    header->owner = owner;
+    header->size = size;
+    header->kind = (uint16_t)kind;
+    header->sizeClass = sizeClass;
+    return (void *)inner;
+}
+
+static void *PoolAllocateCommand(PoolThreadHeap *heap, size_t size, size_t alignment)
+{
+    PoolCommandArena &arena = heap->commandArena;
+
+    if (!arena.base)
+    {
+        arena.base = (char *)malloc(POOL_COMMAND_ARENA_SIZE);
+        if (!arena.base)
+            return nullptr;
+    }
+
+    // Nothing in the arena is still in use, so start again from the bottom
+    if (arena.live.load(std::memory_order_acquire) == 0)
+        arena.used = 0;
+
+    alignment = std::max(alignment, PoolAllocationCallbacks::SMALL_ALIGNMENT);
+    uintptr_t base = (uintptr_t)arena.base;
+    uintptr_t inner = (base + arena.used + POOL_HEADER_SIZE + alignment - 1) & ~(alignment - 1);
+    if (inner + size > base + POOL_COMMAND_ARENA_SIZE)
+        return nullptr;
+
+    arena.used = inner + size - base;
+    arena.live.fetch_add(1, std::memory_order_relaxed);
+
+    return PoolWriteHeader(inner, &arena, (uint32_t)size, POOL_BLOCK_COMMAND, 0);
+}
+
+static void *PoolAllocateSmall(PoolThreadHeap *heap, size_t size)
+{
+    uint16_t sizeClass = s_PoolSizeClassTable.classes[(size + 15) / 16];
+    PoolFreeBlock *&freeList = heap->freeLists[sizeClass];
+
+    // Reclaim anything that other threads have freed for us
+    if (!freeList)
+    {
+        PoolFreeBlock *remote = heap->remoteFrees.exchange(nullptr, std::memory_order_acquire);
+        while (remote)
+        {
+            PoolFreeBlock *next = remote->next;
+            uint16_t c = PoolGetHeader(remote)->sizeClass;
+            remote->next = heap->freeLists[c];
+            heap->freeLists[c] = remote;
+            remote = next;
+        }
+    }
+
+    uintptr_t inner;
+    if (freeList)
+    {
+        inner = (uintptr_t)freeList;
+        freeList = freeList->next;
+    }
+    else
+    {
+        size_t stride = POOL_HEADER_SIZE + POOL_SIZE_CLASSES[sizeClass];
+        if (heap->slabCursor + stride > heap->slabEnd)
+        {
+            // Start a new slab. Whatever is left at the end of the old one is
+            // too small for this size class, so we just waste it
+            char *slab = (char *)AllocationCallbacksBase::doAllocation(POOL_SLAB_SIZE,
+                PoolAllocationCallbacks::SMALL_ALIGNMENT, VK_SYSTEM_ALLOCATION_SCOPE_INSTANCE);
+            if (!slab)
+                return nullptr;
+            heap->slabCursor = slab;
+            heap->slabEnd = slab + POOL_SLAB_SIZE;
+        }
+        inner = (uintptr_t)heap->slabCursor + POOL_HEADER_SIZE;
+        heap->slabCursor += stride;
+    }
+
+    return PoolWriteHeader(inner, heap, (uint32_t)size, POOL_BLOCK_SMALL, sizeClass);
+}
+
+static void *PoolAllocateLarge(size_t size, size_t alignment, VkSystemAllocationScope allocationScope)
+{
+    // Allocate with enough space before the returned pointer for our header,
+    // keeping the requested alignment
+    size_t offset = std::max(alignment, POOL_HEADER_SIZE);
+    ASSERT(offset <= UINT32_MAX);
+
+    void *outer = AllocationCallbacksBase::doAllocation(offset + size, offset, allocationScope);
+    if (!outer)
+        return nullptr;
+
+    return PoolWriteHeader((uintptr_t)outer + offset, outer, (uint32_t)offset, POOL_BLOCK_LARGE, 0);
+}
+
+// Returns the size that was requested when pMemory was allocated
+static size_t PoolGetSize(void *pMemory)
+{
+    PoolBlockHeader *header = PoolGetHeader(pMemory);
+    if (header->kind != POOL_BLOCK_LARGE)
+        return header->size;
+
+    // Large blocks don't have room for the size in their header, but the
+    // BufferHeader from doAllocation has it
+    BufferHeader outerHeader;
+    memcpy(&outerHeader, (void *)((uintptr_t)header->owner - sizeof(BufferHeader)), sizeof(BufferHeader));
+    return outerHeader.size - header->size;
+}
+
+void *PoolAllocationCallbacks::allocate(size_t size, size_t alignment, VkSystemAllocationScope allocationScope)
+{
+    // Must be a power of two
+    ASSERT(alignment != 0 && !(alignment & (alignment - 1)));
+
+    // The spec requires a return value of NULL when size is 0
+    if (size == 0)
+        return nullptr;
+
+    PoolThreadHeap *heap = PoolGetThreadHeap();
+    if (heap && allocationScope == VK_SYSTEM_ALLOCATION_SCOPE_COMMAND && size <= POOL_COMMAND_ARENA_SIZE / 4)
+    {
+        void *ret = PoolAllocateCommand(heap, size, alignment);
+        if (ret)
+            return ret;
+        // The arena is full, so fall back to the other strategies
+    }
+
+    if (heap && size <= MAX_SMALL_SIZE && alignment <= SMALL_ALIGNMENT)
+        return PoolAllocateSmall(heap, size);
+
+    return PoolAllocateLarge(size, alignment, allocationScope);
+}
+
+void *PoolAllocationCallbacks::reallocate(void *pOriginal,
+    size_t size, size_t alignment, VkSystemAllocationScope allocationScope,
+    size_t *originalSize)
+{
+    // Must be a power of two
+    ASSERT(alignment != 0 && !(alignment & (alignment - 1)));
+
+    *originalSize = 0;
+
+    if (pOriginal == nullptr)
+        return allocate(size, alignment, allocationScope);
+
+    if (size == 0)
+    {
+        deallocate(pOriginal, originalSize);
+        return nullptr;
+    }
+
+    *originalSize = PoolGetSize(pOriginal);
+
+    // If it still fits in the same small block, we can just update the size
+    PoolBlockHeader *header = PoolGetHeader(pOriginal);
+    if (header->kind == POOL_BLOCK_SMALL && alignment <= SMALL_ALIGNMENT
+        && size <= POOL_SIZE_CLASSES[header->sizeClass])
+    {
+        header->size = (uint32_t)size;
+        return pOriginal;
+    }
+
+    // Otherwise get a new buffer, and only release the original once that
+    // has succeeded (since we must leave it valid if we return NULL)
+    void *ret = allocate(size, alignment, allocationScope);
+    if (!ret)
+        return nullptr;
+
+    memcpy(ret, pOriginal, std::min(size, *originalSize));
+
+    size_t freedSize;
+    deallocate(pOriginal, &freedSize);
+
+    return ret;
+}
+
+void PoolAllocationCallbacks::deallocate(void *pMemory, size_t *originalSize)
+{
+    *originalSize = 0;
+
+    // vkFree with NULL is valid and must be ignored
+    if (pMemory == nullptr)
+        return;
+
+    *originalSize = PoolGetSize(pMemory);
+
+    PoolBlockHeader *header = PoolGetHeader(pMemory);
+    switch (header->kind)
+    {
+    case POOL_BLOCK_SMALL:
+    {
+        PoolThreadHeap *owner = (PoolThreadHeap *)header->owner;
+        PoolFreeBlock *block = (PoolFreeBlock *)pMemory;
+
+        if (owner == t_PoolThreadHeap.heap)
+        {
+            block->next = owner->freeLists[header->sizeClass];
+            owner->freeLists[header->sizeClass] = block;
+        }
+        else
+        {
+            PoolFreeBlock *head = owner->remoteFrees.load(std::memory_order_relaxed);
+            do
+            {
+                block->next = head;
+            } while (!owner->remoteFrees.compare_exchange_weak(head, block,
+                std::memory_order_release, std::memory_order_relaxed));
+        }
+        break;
+    }
+
+    case POOL_BLOCK_COMMAND:
+    {
+        PoolCommandArena *arena = (PoolCommandArena *)header->owner;
+        arena->live.fetch_sub(1, std::memory_order_release);
+        break;
+    }
+
+    case POOL_BLOCK_LARGE:
+    {
+        size_t outerSize;
+        doFree(header->owner, &outerSize);
+        break;
+    }
+
+    default:
+        ASSERT(!"invalid PoolBlockKind");
+    }
+}
+
+void *PoolAllocationCallbacks::fnAllocation(void * /*pUserData*/,
+    size_t size, size_t alignment, VkSystemAllocationScope allocationScope)
+{
+    return allocate(size, alignment, allocationScope);
+}
+
+void *PoolAllocationCallbacks::fnReallocation(void * /*pUserData*/,
+    void *pOriginal, size_t size, size_t alignment, VkSystemAllocationScope allocationScope)
+{
+    size_t originalSize;
+    return reallocate(pOriginal, size, alignment, allocationScope, &originalSize);
+}
+
+void PoolAllocationCallbacks::fnFree(void * /*pUserData*/, void *pMemory)
+{
+    size_t originalSize;
+    deallocate(pMemory, &originalSize);
+}
+
+void PoolAllocationCallbacks::test()
+{
+    size_t originalSize;
+
+    for (auto scope : { VK_SYSTEM_ALLOCATION_SCOPE_COMMAND, VK_SYSTEM_ALLOCATION_SCOPE_OBJECT })
+    {
+        ASSERT(allocate(0, 1, scope) == nullptr);
+
+        // Cover every size class, the large fallback, and a range of alignments
+        for (size_t size : { 1, 15, 16, 17, 100, 1000, 4095, 4096, 4097, 65536 })
+        {
+            for (size_t align = 1; align <= 4096; align *= 2)
+            {
+                void *b = allocate(size, align, scope);
+                ASSERT(b != nullptr);
+                ASSERT(((uintptr_t)b & (align - 1)) == 0);
+
+                memset(b, 0xff, size);
+
+                deallocate(b, &originalSize);
+                ASSERT(originalSize == size);
+            }
+        }
+
+        // Reallocation must preserve the contents across strategies
+        for (size_t align : { 1, 8, 16, 64, 4096 })
+        {
+            void *b0 = allocate(32, align, scope);
+            ASSERT(b0 != nullptr);
+            strcpy((char *)b0, "Hello world");
+
+            void *b1 = reallocate(b0, 48, align, scope, &originalSize);
+            ASSERT(b1 != nullptr);
+            ASSERT(originalSize == 32);
+            ASSERT(strcmp((char *)b1, "Hello world") == 0);
+
+            void *b2 = reallocate(b1, 65536, align, scope, &originalSize);
+            ASSERT(b2 != nullptr);
+            ASSERT(originalSize == 48);
+            ASSERT(strcmp((char *)b2, "Hello world") == 0);
+
+            void *b3 = reallocate(b2, 16, align, scope, &originalSize);
+            ASSERT(b3 != nullptr);
+            ASSERT(originalSize == 65536);
+            ASSERT(strcmp((char *)b3, "Hello world") == 0);
+
+            ASSERT(reallocate(b3, 0, align, scope, &originalSize) == nullptr);
+            ASSERT(originalSize == 16);
+        }
+    }
+
+    {
+        // The command arena should be reused from the start once everything
+        // in it has been freed
+        VkSystemAllocationScope scope = VK_SYSTEM_ALLOCATION_SCOPE_COMMAND;
+        void *b0 = allocate(64, 16, scope);
+        void *b1 = allocate(64, 16, scope);
+        ASSERT(b0 != nullptr && b1 != nullptr && b0 != b1);
+        deallocate(b0, &originalSize);
+        deallocate(b1, &originalSize);
+        void *b2 = allocate(64, 16, scope);
+        ASSERT(b2 == b0);
+        deallocate(b2, &originalSize);
+    }
+
+    {
+        // Freed small blocks should be reused by the same thread
+        VkSystemAllocationScope scope = VK_SYSTEM_ALLOCATION_SCOPE_OBJECT;
+        void *b0 = allocate(100, 8, scope);
+        deallocate(b0, &originalSize);
+        void *b1 = allocate(100, 8, scope);
+        ASSERT(b1 == b0);
+        deallocate(b1, &originalSize);
+    }
+
+    {
+        // Blocks freed on another thread should find their way back to the
+        // thread that allocated them
+        VkSystemAllocationScope scope = VK_SYSTEM_ALLOCATION_SCOPE_OBJECT;
+        std::vector<void *> blocks;
+        for (int i = 0; i < 1000; ++i)
+            blocks.push_back(allocate(200, 16, scope));
+
+        std::thread freer([&blocks]() {
+            for (void *b : blocks)
+            {
+                size_t size;
+                deallocate(b, &size);
+                ASSERT(size == 200);
+            }
+        });
+        freer.join();
+
+        std::set<void *> freed(blocks.begin(), blocks.end());
+        for (int i = 0; i < 1000; ++i)
+        {
+            void *b = allocate(200, 16, scope);
+            ASSERT(freed.count(b));
+            blocks[i] = b;
+        }
+        for (void *b : blocks)
+            deallocate(b, &originalSize);
+    }
+
+    {
+        // Threads allocating and freeing concurrently, including each
+        // other's blocks
+        const int numThreads = 4;
+        const int numBlocks = 10000;
+        std::vector<void *> shared(numThreads * numBlocks);
+        std::vector<std::thread> threads;
+        for (int t = 0; t < numThreads; ++t)
+        {
+            threads.emplace_back([t, &shared]() {
+                for (int i = 0; i < numBlocks; ++i)
+                {
+                    size_t size = 1 + (i * 37) % MAX_SMALL_SIZE;
+                    void *b = allocate(size, 8, VK_SYSTEM_ALLOCATION_SCOPE_OBJECT);
+                    ASSERT(b != nullptr);
+                    memset(b, t, size);
+                    shared[t * numBlocks + i] = b;
+                }
+            });
+        }
+        for (auto &thread : threads)
+            thread.join();
+        threads.clear();
+
+        for (int t = 0; t < numThreads; ++t)
+        {
+            threads.emplace_back([t, &shared]() {
+                // Free the blocks allocated by the 'next' thread
+                int victim = (t + 1) % numThreads;
+                for (int i = 0; i < numBlocks; ++i)
+                {
+                    size_t size;
+                    deallocate(shared[victim * numBlocks + i], &size);
+                    ASSERT(size == 1 + (i * 37) % MAX_SMALL_SIZE);
+                }
+            });
+        }
+        for (auto &thread : threads)
+            thread.join();
+    }
 }
@@ -25,6 +25,18 @@
 
 #include "common/Log.h"
 
+#include <atomic>
+
+// Whether to log every host allocation made by Vulkan. This defaults to on in
+// debug builds; define it to 0 or 1 before including this header to override.
+#ifndef ENABLE_DEBUG_ALLOCATOR
+# ifdef NDEBUG
+#  define ENABLE_DEBUG_ALLOCATOR 0
+# else
+#  define ENABLE_DEBUG_ALLOCATOR 1
+# endif
+#endif
+
 /*
  * Implements the (non-trivial) VkAllocationCallbacks semantics on top of the
  * system's standard malloc implementation. This is useful when you just want
@@ -37,11 +49,19 @@ public:
     static void *doAllocation(
         size_t size, size_t alignment, VkSystemAllocationScope allocationScope);
 
+    // originalScope (if not null) is set to the scope the original
+    // allocation was made with
     static void *doReallocation(void *pOriginal,
         size_t size, size_t alignment, VkSystemAllocationScope allocationScope,
-        size_t *originalSize);
+        size_t *originalSize, VkSystemAllocationScope *originalScope = nullptr);
+
+    static void doFree(void *pMemory, size_t *originalSize, VkSystemAllocationScope *originalScope = nullptr);
 
-    static void doFree(void *pMemory, size_t *originalSize);
+    // Opaque tag stored alongside an allocation from doAllocation or
+    // doReallocation (initially null). doReallocation may or may not carry
+    // it across to the new allocation, so callers should set it again.
+    static void *getOwner(void *pMemory);
+    static void setOwner(void *pMemory, void *owner);
 
     // Convert enums into strings for logging
     static const char *scopeString(VkSystemAllocationScope scope);
@@ -52,16 +72,58 @@ public:
 };
 
 /*
- * Provider of VkAllocationCallbacks, which simply logs every operation.
+ * Counters for a group of allocations (e.g. from one call site, or with one
+ * scope). These are updated with relaxed atomics, so they're cheap enough to
+ * leave on, and a snapshot taken while other threads are allocating may be
+ * slightly inconsistent.
+ */
+struct AllocationCounters
+{
+    std::atomic<uint64_t> allocations;   // including the allocating half of reallocations
+    std::atomic<uint64_t> reallocations;
+    std::atomic<uint64_t> frees;         // including the freeing half of reallocations
+    std::atomic<int64_t> liveCount;
+    std::atomic<int64_t> liveBytes;
+    std::atomic<int64_t> peakBytes;
+
+    AllocationCounters()
+        : allocations(0), reallocations(0), frees(0), liveCount(0), liveBytes(0), peakBytes(0)
+    {
+    }
+
+    void add(size_t size);
+    void remove(size_t size);
+};
+
+// The callbacks' pUserData: one per createCallbacks() call
+struct AllocationSite
+{
+    const char *src;
+    AllocationCounters counters;
+    AllocationCounters internalCounters; // from pfnInternalAllocation
+    AllocationSite *next;
+};
+
+enum DebugAllocatorModeBits
+{
+    DEBUG_ALLOCATOR_LOG = 1 << 0,   // print every operation
+    DEBUG_ALLOCATOR_STATS = 1 << 1, // update per-site and per-scope counters
+};
+
+/*
+ * Provider of VkAllocationCallbacks, which logs every operation and/or
+ * counts them.
  *
- * If you are passing it directly into a Vulkan API call, you can construct a
- * temporary VkAllocationCallbacks and pass its pointer into the API - the
- * temporary won't be destroyed until after the API call has returned.
+ * Logging is very slow and noisy, so for longer runs use
+ * setMode(DEBUG_ALLOCATOR_STATS) and call dumpStats() when you want to see
+ * where the allocations are coming from.
  *
- * i.e. you can use it like:
- *   vkFoo(..., &DebugAllocationCallbacks::createCallbacks("some identifier"));
- * or through a macro:
- *   vkFoo(..., CREATE_ALLOCATOR());
+ * The VkAllocationCallbacks must outlive the API call it's passed into, so
+ * you'll usually want to store it in a static, like:
+ *   static const VkAllocationCallbacks callbacks =
+ *       DebugAllocationCallbacks::createCallbacks("some identifier");
+ *   vkFoo(..., &callbacks);
+ * or use the CREATE_ALLOCATOR() macro, which does that for you.
  */
 class DebugAllocationCallbacks : private AllocationCallbacksBase
 {
@@ -71,11 +133,14 @@ public:
      * until the end of the Vulkan scope that used these callbacks.
      * This will be printed with each allocation, to help you tell where
      * they came from.
+     *
+     * Each call registers a new AllocationSite (which is never freed), so
+     * store the result in a static rather than calling this repeatedly.
      */
     static VkAllocationCallbacks createCallbacks(const char *src)
     {
         VkAllocationCallbacks callbacks = {};
-        callbacks.pUserData = (void *)src;
+        callbacks.pUserData = registerSite(src);
         callbacks.pfnAllocation = fnAllocation;
         callbacks.pfnReallocation = fnReallocation;
         callbacks.pfnFree = fnFree;
@@ -97,14 +162,148 @@ public:
 
     static VKAPI_ATTR void VKAPI_CALL fnInternalFree(void *pUserData,
         size_t size, VkInternalAllocationType allocationType, VkSystemAllocationScope allocationScope);
+
+    /*
+     * A combination of DebugAllocatorModeBits. Defaults to DEBUG_ALLOCATOR_LOG.
+     * This can be changed at any time: each allocation remembers whether it
+     * was counted, so its free is only counted if it was. (Internal
+     * allocations can't, so their counters are only exact if the mode is
+     * set before the driver makes any.)
+     */
+    static void setMode(uint32_t mode);
+
+    // Log the counters for each scope and for each call site that has been used
+    static void dumpStats();
+
+    static AllocationSite *registerSite(const char *src);
+};
+
+/*
+ * Provider of VkAllocationCallbacks intended for production use, where the
+ * driver's host allocations should be cheap and shouldn't contend on the
+ * system malloc's locks.
+ *
+ * Allocations are split three ways:
+ *
+ *  - VK_SYSTEM_ALLOCATION_SCOPE_COMMAND allocations only live for the duration
+ *    of a single API call, so they are bump-allocated from a per-thread arena.
+ *    The arena is reset wholesale whenever nothing in it is still alive.
+ *
+ *  - Other small allocations (up to MAX_SMALL_SIZE bytes, with alignment up to
+ *    SMALL_ALIGNMENT) come from per-thread size-class free lists. A thread
+ *    freeing a block that was allocated by another thread pushes it onto the
+ *    owner's lock-free 'remote free' list, which the owner reclaims the next
+ *    time it runs out of blocks in that size class.
+ *
+ *  - Everything else falls back to AllocationCallbacksBase (i.e. malloc).
+ *
+ * Memory for the free lists is never returned to the system (a thread's pools
+ * get handed to the next new thread when it exits), which is fine for the
+ * usual pattern of a fixed set of long-lived threads.
+ *
+ * The same VkAllocationCallbacks can be shared by every Vulkan object, so you
+ * can use it like:
+ *   vkFoo(..., PoolAllocationCallbacks::getCallbacks());
+ */
+class PoolAllocationCallbacks : private AllocationCallbacksBase
+{
+public:
+    static const size_t MAX_SMALL_SIZE = 4096;
+    static const size_t SMALL_ALIGNMENT = 16;
+
+    static const VkAllocationCallbacks *getCallbacks()
+    {
+        static const VkAllocationCallbacks callbacks = createCallbacks();
+        return &callbacks;
+    }
+
+    static VkAllocationCallbacks createCallbacks()
+    {
+        VkAllocationCallbacks callbacks = {};
+        callbacks.pUserData = nullptr;
+        callbacks.pfnAllocation = fnAllocation;
+        callbacks.pfnReallocation = fnReallocation;
+        callbacks.pfnFree = fnFree;
+        return callbacks;
+    }
+
+    static void *allocate(size_t size, size_t alignment, VkSystemAllocationScope allocationScope);
+
+    static void *reallocate(void *pOriginal,
+        size_t size, size_t alignment, VkSystemAllocationScope allocationScope,
+        size_t *originalSize);
+
+    static void deallocate(void *pMemory, size_t *originalSize);
+
+    static VKAPI_ATTR void* VKAPI_CALL fnAllocation(void *pUserData,
+        size_t size, size_t alignment, VkSystemAllocationScope allocationScope);
+
+    static VKAPI_ATTR void* VKAPI_CALL fnReallocation(void *pUserData,
+        void *pOriginal, size_t size, size_t alignment, VkSystemAllocationScope allocationScope);
+
+    static VKAPI_ATTR void VKAPI_CALL fnFree(void *pUserData, void *pMemory);
+
+    // Run some basic sanity tests
+    static void test();
 };
 
+/*
+ * Allocator policies, for selecting the VkAllocationCallbacks at compile time.
+ *
+ * Each policy's get() returns a pointer to a single static VkAllocationCallbacks
+ * (or nullptr), so nothing is constructed per call, and with
+ * NullAllocatorPolicy the compiler just sees a nullptr argument.
+ *
+ * Objects must be destroyed with callbacks compatible with the ones they were
+ * created with, so the RAII wrappers and DeviceLoader take the policy as a
+ * template parameter, defaulting to DefaultAllocatorPolicy.
+ */
+struct NullAllocatorPolicy
+{
+    static const VkAllocationCallbacks *get() { return nullptr; }
+};
+
+struct DebugAllocatorPolicy
+{
+    static const VkAllocationCallbacks *get()
+    {
+        static const VkAllocationCallbacks callbacks =
+            DebugAllocationCallbacks::createCallbacks("DebugAllocatorPolicy");
+        return &callbacks;
+    }
+};
+
+struct PoolAllocatorPolicy
+{
+    static const VkAllocationCallbacks *get() { return PoolAllocationCallbacks::getCallbacks(); }
+};
+
+#if ENABLE_DEBUG_ALLOCATOR
+typedef DebugAllocatorPolicy DefaultAllocatorPolicy;
+#elif ENABLE_POOL_ALLOCATOR
+typedef PoolAllocatorPolicy DefaultAllocatorPolicy;
+#else
+typedef NullAllocatorPolicy DefaultAllocatorPolicy;
+#endif
+
+/*
+ * Returns the VkAllocationCallbacks to use for a call that isn't managed by
+ * one of the wrappers. This is compatible with DefaultAllocatorPolicy.
+ *
+ * With the debug allocator, each call site gets its own static callbacks
+ * (constructed the first time it's reached), tagged with the file and line
+ * so the log tells you where each allocation came from.
+ */
 #if ENABLE_DEBUG_ALLOCATOR
 #define ALLOCATOR_SOURCE_STRINGIFY(line) #line
 #define ALLOCATOR_SOURCE_STRING(file, line) file ":" ALLOCATOR_SOURCE_STRINGIFY(line)
-#define CREATE_ALLOCATOR() (&DebugAllocationCallbacks::createCallbacks(ALLOCATOR_SOURCE_STRING(__FILE__, __LINE__)))
+#define CREATE_ALLOCATOR() ([]() -> const VkAllocationCallbacks * { \
+        static const VkAllocationCallbacks callbacks = \
+            DebugAllocationCallbacks::createCallbacks(ALLOCATOR_SOURCE_STRING(__FILE__, __LINE__)); \
+        return &callbacks; \
+    }())
 #else
-#define CREATE_ALLOCATOR() (nullptr)
+#define CREATE_ALLOCATOR() (DefaultAllocatorPolicy::get())
 #endif
 
 #endif // INCLUDED_VKSXS_ALLOCATION_CALLBACKS
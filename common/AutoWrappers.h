@@ -26,9 +26,15 @@
 #include "common/Common.h"
 
 #include "common/AllocationCallbacks.h"
+#include "common/DeviceFunctions.h"
 #include "common/InstanceFunctions.h"
 
-template <typename T, typename FN, FN InstanceFunctions::*CB>
+/*
+ * F is the function table (InstanceFunctions or DeviceFunctions) that the
+ * destroy function gets loaded from, and A is the allocator policy (see
+ * AllocationCallbacks.h) that the object was created with.
+ */
+template <typename F, typename T, typename FN, FN F::*CB, typename A = DefaultAllocatorPolicy>
 class WrapDispatchable
 {
     T m_Handle;
@@ -39,7 +45,7 @@ public:
     {
     }
 
-    WrapDispatchable(const InstanceFunctions &pfn, T handle = VK_NULL_HANDLE)
+    WrapDispatchable(const F &pfn, T handle = VK_NULL_HANDLE)
         : m_Handle(handle), m_vkDestroy(pfn.*CB)
     {
         ASSERT(m_vkDestroy != nullptr);
@@ -49,7 +55,7 @@ public:
     {
         ASSERT(!(m_Handle && !m_vkDestroy));
         if (m_vkDestroy)
-            m_vkDestroy(m_Handle, CREATE_ALLOCATOR());
+            m_vkDestroy(m_Handle, A::get());
     }
 
     operator T() { return m_Handle; }
@@ -73,7 +79,7 @@ public:
         {
             ASSERT(!(m_Handle && !m_vkDestroy));
             if (m_vkDestroy)
-                m_vkDestroy(m_Handle, CREATE_ALLOCATOR());
+                m_vkDestroy(m_Handle, A::get());
             m_Handle = v.m_Handle;
             m_vkDestroy = v.m_vkDestroy;
             v.m_Handle = VK_NULL_HANDLE;
@@ -83,7 +89,7 @@ public:
     }
 };
 
-template <typename P, typename T, typename FN, FN InstanceFunctions::*CB>
+template <typename F, typename P, typename T, typename FN, FN F::*CB, typename A = DefaultAllocatorPolicy>
 class WrapNonDispatchable
 {
     P m_Parent;
@@ -95,7 +101,7 @@ public:
     {
     }
 
-    WrapNonDispatchable(const InstanceFunctions &pfn, P parent, T handle = VK_NULL_HANDLE)
+    WrapNonDispatchable(const F &pfn, P parent, T handle = VK_NULL_HANDLE)
         : m_Parent(parent), m_Handle(handle), m_vkDestroy(pfn.*CB)
     {
     }
@@ -104,12 +110,25 @@ public:
     {
         ASSERT(!(m_Handle && !m_vkDestroy));
         if (m_vkDestroy)
-            m_vkDestroy(m_Parent, m_Handle, CREATE_ALLOCATOR());
+            m_vkDestroy(m_Parent, m_Handle, A::get());
     }
 
     operator T() { return m_Handle; }
     T *ptr() { return &m_Handle; }
 
+    P parent() const { return m_Parent; }
+    FN destroyFunction() const { return m_vkDestroy; }
+
+    // Give up ownership of the handle without destroying it (e.g. to pass it
+    // to a DeletionQueue)
+    T release()
+    {
+        T handle = m_Handle;
+        m_Handle = VK_NULL_HANDLE;
+        m_vkDestroy = nullptr;
+        return handle;
+    }
+
     // Allow moving but not copying
 
     WrapNonDispatchable(const WrapNonDispatchable &) = delete;
@@ -129,7 +148,7 @@ public:
         {
             ASSERT(!(m_Handle && !m_vkDestroy));
             if (m_vkDestroy)
-                m_vkDestroy(m_Parent, m_Handle, CREATE_ALLOCATOR());
+                m_vkDestroy(m_Parent, m_Handle, A::get());
             m_Parent = v.m_Parent;
             m_Handle = v.m_Handle;
             m_vkDestroy = v.m_vkDestroy;
@@ -141,13 +160,52 @@ public:
     }
 };
 
-typedef WrapDispatchable<VkInstance, PFN_vkDestroyInstance, &InstanceFunctions::vkDestroyInstance> AutoVkInstance;
-typedef WrapDispatchable<VkDevice, PFN_vkDestroyDevice, &InstanceFunctions::vkDestroyDevice> AutoVkDevice;
-
-typedef WrapNonDispatchable<VkInstance, VkDebugReportCallbackEXT, PFN_vkDestroyDebugReportCallbackEXT, &InstanceFunctions::vkDestroyDebugReportCallbackEXT> AutoVkDebugReportCallbackEXT;
-typedef WrapNonDispatchable<VkDevice, VkCommandPool, PFN_vkDestroyCommandPool, &InstanceFunctions::vkDestroyCommandPool> AutoVkCommandPool;
-typedef WrapNonDispatchable<VkDevice, VkImage, PFN_vkDestroyImage, &InstanceFunctions::vkDestroyImage> AutoVkImage;
-typedef WrapNonDispatchable<VkDevice, VkDeviceMemory, PFN_vkFreeMemory, &InstanceFunctions::vkFreeMemory> AutoVkDeviceMemory;
-typedef WrapNonDispatchable<VkDevice, VkSemaphore, PFN_vkDestroySemaphore, &InstanceFunctions::vkDestroySemaphore> AutoVkSemaphore;
+template <typename A = DefaultAllocatorPolicy> using AutoVkInstanceT = WrapDispatchable<InstanceFunctions, VkInstance, PFN_vkDestroyInstance, &InstanceFunctions::vkDestroyInstance, A>;
+typedef AutoVkInstanceT<> AutoVkInstance;
+template <typename A = DefaultAllocatorPolicy> using AutoVkDeviceT = WrapDispatchable<DeviceFunctions, VkDevice, PFN_vkDestroyDevice, &DeviceFunctions::vkDestroyDevice, A>;
+typedef AutoVkDeviceT<> AutoVkDevice;
+
+template <typename A = DefaultAllocatorPolicy> using AutoVkDebugReportCallbackEXTT = WrapNonDispatchable<InstanceFunctions, VkInstance, VkDebugReportCallbackEXT, PFN_vkDestroyDebugReportCallbackEXT, &InstanceFunctions::vkDestroyDebugReportCallbackEXT, A>;
+typedef AutoVkDebugReportCallbackEXTT<> AutoVkDebugReportCallbackEXT;
+template <typename A = DefaultAllocatorPolicy> using AutoVkCommandPoolT = WrapNonDispatchable<DeviceFunctions, VkDevice, VkCommandPool, PFN_vkDestroyCommandPool, &DeviceFunctions::vkDestroyCommandPool, A>;
+typedef AutoVkCommandPoolT<> AutoVkCommandPool;
+template <typename A = DefaultAllocatorPolicy> using AutoVkImageT = WrapNonDispatchable<DeviceFunctions, VkDevice, VkImage, PFN_vkDestroyImage, &DeviceFunctions::vkDestroyImage, A>;
+typedef AutoVkImageT<> AutoVkImage;
+template <typename A = DefaultAllocatorPolicy> using AutoVkDeviceMemoryT = WrapNonDispatchable<DeviceFunctions, VkDevice, VkDeviceMemory, PFN_vkFreeMemory, &DeviceFunctions::vkFreeMemory, A>;
+typedef AutoVkDeviceMemoryT<> AutoVkDeviceMemory;
+template <typename A = DefaultAllocatorPolicy> using AutoVkSemaphoreT = WrapNonDispatchable<DeviceFunctions, VkDevice, VkSemaphore, PFN_vkDestroySemaphore, &DeviceFunctions::vkDestroySemaphore, A>;
+typedef AutoVkSemaphoreT<> AutoVkSemaphore;
+template <typename A = DefaultAllocatorPolicy> using AutoVkFenceT = WrapNonDispatchable<DeviceFunctions, VkDevice, VkFence, PFN_vkDestroyFence, &DeviceFunctions::vkDestroyFence, A>;
+typedef AutoVkFenceT<> AutoVkFence;
+template <typename A = DefaultAllocatorPolicy> using AutoVkBufferT = WrapNonDispatchable<DeviceFunctions, VkDevice, VkBuffer, PFN_vkDestroyBuffer, &DeviceFunctions::vkDestroyBuffer, A>;
+typedef AutoVkBufferT<> AutoVkBuffer;
+template <typename A = DefaultAllocatorPolicy> using AutoVkPipelineCacheT = WrapNonDispatchable<DeviceFunctions, VkDevice, VkPipelineCache, PFN_vkDestroyPipelineCache, &DeviceFunctions::vkDestroyPipelineCache, A>;
+typedef AutoVkPipelineCacheT<> AutoVkPipelineCache;
+template <typename A = DefaultAllocatorPolicy> using AutoVkQueryPoolT = WrapNonDispatchable<DeviceFunctions, VkDevice, VkQueryPool, PFN_vkDestroyQueryPool, &DeviceFunctions::vkDestroyQueryPool, A>;
+typedef AutoVkQueryPoolT<> AutoVkQueryPool;
+template <typename A = DefaultAllocatorPolicy> using AutoVkImageViewT = WrapNonDispatchable<DeviceFunctions, VkDevice, VkImageView, PFN_vkDestroyImageView, &DeviceFunctions::vkDestroyImageView, A>;
+typedef AutoVkImageViewT<> AutoVkImageView;
+template <typename A = DefaultAllocatorPolicy> using AutoVkShaderModuleT = WrapNonDispatchable<DeviceFunctions, VkDevice, VkShaderModule, PFN_vkDestroyShaderModule, &DeviceFunctions::vkDestroyShaderModule, A>;
+typedef AutoVkShaderModuleT<> AutoVkShaderModule;
+template <typename A = DefaultAllocatorPolicy> using AutoVkDescriptorSetLayoutT = WrapNonDispatchable<DeviceFunctions, VkDevice, VkDescriptorSetLayout, PFN_vkDestroyDescriptorSetLayout, &DeviceFunctions::vkDestroyDescriptorSetLayout, A>;
+typedef AutoVkDescriptorSetLayoutT<> AutoVkDescriptorSetLayout;
+template <typename A = DefaultAllocatorPolicy> using AutoVkDescriptorPoolT = WrapNonDispatchable<DeviceFunctions, VkDevice, VkDescriptorPool, PFN_vkDestroyDescriptorPool, &DeviceFunctions::vkDestroyDescriptorPool, A>;
+typedef AutoVkDescriptorPoolT<> AutoVkDescriptorPool;
+template <typename A = DefaultAllocatorPolicy> using AutoVkPipelineLayoutT = WrapNonDispatchable<DeviceFunctions, VkDevice, VkPipelineLayout, PFN_vkDestroyPipelineLayout, &DeviceFunctions::vkDestroyPipelineLayout, A>;
+typedef AutoVkPipelineLayoutT<> AutoVkPipelineLayout;
+template <typename A = DefaultAllocatorPolicy> using AutoVkPipelineT = WrapNonDispatchable<DeviceFunctions, VkDevice, VkPipeline, PFN_vkDestroyPipeline, &DeviceFunctions::vkDestroyPipeline, A>;
+typedef AutoVkPipelineT<> AutoVkPipeline;
+template <typename A = DefaultAllocatorPolicy> using AutoVkBufferViewT = WrapNonDispatchable<DeviceFunctions, VkDevice, VkBufferView, PFN_vkDestroyBufferView, &DeviceFunctions::vkDestroyBufferView, A>;
+typedef AutoVkBufferViewT<> AutoVkBufferView;
+template <typename A = DefaultAllocatorPolicy> using AutoVkEventT = WrapNonDispatchable<DeviceFunctions, VkDevice, VkEvent, PFN_vkDestroyEvent, &DeviceFunctions::vkDestroyEvent, A>;
+typedef AutoVkEventT<> AutoVkEvent;
+template <typename A = DefaultAllocatorPolicy> using AutoVkSamplerT = WrapNonDispatchable<DeviceFunctions, VkDevice, VkSampler, PFN_vkDestroySampler, &DeviceFunctions::vkDestroySampler, A>;
+typedef AutoVkSamplerT<> AutoVkSampler;
+#if ENABLE_GRAPHICS_FUNCTIONS
+template <typename A = DefaultAllocatorPolicy> using AutoVkRenderPassT = WrapNonDispatchable<DeviceFunctions, VkDevice, VkRenderPass, PFN_vkDestroyRenderPass, &DeviceFunctions::vkDestroyRenderPass, A>;
+typedef AutoVkRenderPassT<> AutoVkRenderPass;
+template <typename A = DefaultAllocatorPolicy> using AutoVkFramebufferT = WrapNonDispatchable<DeviceFunctions, VkDevice, VkFramebuffer, PFN_vkDestroyFramebuffer, &DeviceFunctions::vkDestroyFramebuffer, A>;
+typedef AutoVkFramebufferT<> AutoVkFramebuffer;
+#endif
 
 #endif // INCLUDED_VKSXS_AUTO_WRAPPERS
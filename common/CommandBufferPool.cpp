@@ -0,0 +1,178 @@
+/*
+ * Copyright (c) 2016 Philip Taylor
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include "common/Common.h"
+
+#include "common/AllocationCallbacks.h"
+#include "common/CommandBufferPool.h"
+#include "common/Log.h"
+
+CommandBufferPool::CommandBufferPool(const DeviceFunctions &pfn, VkDevice device,
+    uint32_t queueFamily, uint32_t slotCount)
+    : m_pfn(pfn), m_Device(device), m_QueueFamily(queueFamily), m_SlotCount(slotCount)
+{
+    ASSERT(slotCount > 0);
+}
+
+bool CommandBufferPool::CreatePool(VkCommandPoolCreateFlags flags, AutoVkCommandPool &pool)
+{
+    VkCommandPoolCreateInfo commandPoolCreateInfo = {};
+    commandPoolCreateInfo.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
+    commandPoolCreateInfo.flags = flags;
+    commandPoolCreateInfo.queueFamilyIndex = m_QueueFamily;
+    VkResult result = m_pfn.vkCreateCommandPool(m_Device, &commandPoolCreateInfo, CREATE_ALLOCATOR(), pool.ptr());
+    if (result != VK_SUCCESS)
+    {
+        LOGE("vkCreateCommandPool failed (%d)", result);
+        return false;
+    }
+    return true;
+}
+
+CommandBufferPool::ThreadPools *CommandBufferPool::GetThreadPools()
+{
+    std::lock_guard<std::mutex> lock(m_Mutex);
+    std::unique_ptr<ThreadPools> &entry = m_Threads[std::this_thread::get_id()];
+    if (!entry)
+    {
+        entry.reset(new ThreadPools(m_pfn, m_Device));
+        entry->slots.resize(m_SlotCount);
+    }
+    return entry.get();
+}
+
+CommandBufferPool::SlotPool *CommandBufferPool::GetSlotPool(uint32_t slot)
+{
+    ASSERT(slot < m_SlotCount);
+
+    ThreadPools *threadPools = GetThreadPools();
+
+    // Only this thread touches its own ThreadPools here, so the pool can be
+    // created without holding the lock
+    std::unique_ptr<SlotPool> &slotPool = threadPools->slots[slot];
+    if (!slotPool)
+    {
+        std::unique_ptr<SlotPool> newPool(new SlotPool(m_pfn, m_Device));
+
+        // The pool is reset as a whole, so its command buffers are all
+        // short-lived
+        if (!CreatePool(VK_COMMAND_POOL_CREATE_TRANSIENT_BIT, newPool->pool))
+            return nullptr;
+
+        slotPool = std::move(newPool);
+    }
+
+    return slotPool.get();
+}
+
+bool CommandBufferPool::Allocate(uint32_t slot, VkCommandBufferLevel level, VkCommandBuffer &commandBuffer)
+{
+    SlotPool *slotPool = GetSlotPool(slot);
+    if (!slotPool)
+        return false;
+
+    std::vector<VkCommandBuffer> &commandBuffers = slotPool->commandBuffers[level];
+    size_t &used = slotPool->used[level];
+
+    if (used == commandBuffers.size())
+    {
+        VkCommandBufferAllocateInfo commandBufferAllocateInfo = {};
+        commandBufferAllocateInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
+        commandBufferAllocateInfo.commandPool = slotPool->pool;
+        commandBufferAllocateInfo.level = level;
+        commandBufferAllocateInfo.commandBufferCount = 1;
+        VkCommandBuffer newCommandBuffer;
+        VkResult result = m_pfn.vkAllocateCommandBuffers(m_Device, &commandBufferAllocateInfo, &newCommandBuffer);
+        if (result != VK_SUCCESS)
+        {
+            LOGE("vkAllocateCommandBuffers failed (%d)", result);
+            return false;
+        }
+        commandBuffers.push_back(newCommandBuffer);
+    }
+
+    commandBuffer = commandBuffers[used++];
+    return true;
+}
+
+bool CommandBufferPool::ResetSlot(uint32_t slot)
+{
+    ASSERT(slot < m_SlotCount);
+
+    std::lock_guard<std::mutex> lock(m_Mutex);
+
+    for (auto &thread : m_Threads)
+    {
+        SlotPool *slotPool = thread.second->slots[slot].get();
+        if (!slotPool || (slotPool->used[0] == 0 && slotPool->used[1] == 0))
+            continue;
+
+        // Keep the memory (no RELEASE_RESOURCES), since it'll be needed
+        // again next time round
+        VkResult result = m_pfn.vkResetCommandPool(m_Device, slotPool->pool, 0);
+        if (result != VK_SUCCESS)
+        {
+            LOGE("vkResetCommandPool failed (%d)", result);
+            return false;
+        }
+
+        slotPool->used[0] = slotPool->used[1] = 0;
+    }
+
+    return true;
+}
+
+bool CommandBufferPool::AllocatePersistent(VkCommandBufferLevel level, VkCommandBuffer &commandBuffer)
+{
+    // Each thread has its own persistent pool, so allocating here can't
+    // race with another thread recording into one of its buffers
+    ThreadPools *threadPools = GetThreadPools();
+
+    if (threadPools->persistent == VK_NULL_HANDLE)
+    {
+        if (!CreatePool(0, threadPools->persistent))
+            return false;
+    }
+
+    VkCommandBufferAllocateInfo commandBufferAllocateInfo = {};
+    commandBufferAllocateInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
+    commandBufferAllocateInfo.commandPool = threadPools->persistent;
+    commandBufferAllocateInfo.level = level;
+    commandBufferAllocateInfo.commandBufferCount = 1;
+    VkResult result = m_pfn.vkAllocateCommandBuffers(m_Device, &commandBufferAllocateInfo, &commandBuffer);
+    if (result != VK_SUCCESS)
+    {
+        LOGE("vkAllocateCommandBuffers failed (%d)", result);
+        return false;
+    }
+
+    return true;
+}
+
+void CommandBufferPool::FreePersistent(VkCommandBuffer commandBuffer)
+{
+    ThreadPools *threadPools = GetThreadPools();
+
+    // It wasn't allocated on this thread if there's no pool
+    ASSERT(threadPools->persistent != VK_NULL_HANDLE);
+    m_pfn.vkFreeCommandBuffers(m_Device, threadPools->persistent, 1, &commandBuffer);
+}
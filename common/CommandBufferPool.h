@@ -0,0 +1,126 @@
+/*
+ * Copyright (c) 2016 Philip Taylor
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#ifndef INCLUDED_VKSXS_COMMAND_BUFFER_POOL
+#define INCLUDED_VKSXS_COMMAND_BUFFER_POOL
+
+#include "common/Common.h"
+
+#include "common/AutoWrappers.h"
+#include "common/DeviceFunctions.h"
+
+#include <map>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/*
+ * Recycles command buffers for one queue family.
+ *
+ * A VkCommandPool must be externally synchronised, including while any of its
+ * command buffers are being recorded, so each thread that allocates gets its
+ * own VkCommandPool per frame slot. Allocate() is therefore thread-safe, and
+ * threads can record in parallel without locking.
+ *
+ * Once the GPU has finished with a slot, ResetSlot() resets every thread's
+ * pool for that slot with one vkResetCommandPool each (rather than resetting
+ * or freeing individual command buffers), and the command buffers are handed
+ * out again by later Allocate() calls instead of being reallocated. Nothing
+ * may be recording into that slot while it's being reset.
+ *
+ * Persistent command buffers are for static work that gets recorded once and
+ * submitted many times. They come from a separate per-thread pool that's
+ * never reset, and live until FreePersistent() or the CommandBufferPool's
+ * destruction. Like the slot pools, that pool belongs to the allocating
+ * thread, so a persistent command buffer must be recorded and freed on the
+ * thread that allocated it. Record them with
+ * VK_COMMAND_BUFFER_USAGE_SIMULTANEOUS_USE_BIT if they may be submitted again
+ * while a previous submission is still in flight.
+ */
+class CommandBufferPool
+{
+public:
+    CommandBufferPool(const DeviceFunctions &pfn, VkDevice device,
+        uint32_t queueFamily, uint32_t slotCount);
+
+    CommandBufferPool(const CommandBufferPool &) = delete;
+    CommandBufferPool &operator=(const CommandBufferPool &) = delete;
+
+    uint32_t GetQueueFamily() const { return m_QueueFamily; }
+    uint32_t GetSlotCount() const { return m_SlotCount; }
+
+    // Command buffers that are valid until the next ResetSlot(slot)
+    bool Allocate(uint32_t slot, VkCommandBufferLevel level, VkCommandBuffer &commandBuffer);
+
+    bool ResetSlot(uint32_t slot);
+
+    // Must be freed on the same thread, once the device has finished with it
+    bool AllocatePersistent(VkCommandBufferLevel level, VkCommandBuffer &commandBuffer);
+    void FreePersistent(VkCommandBuffer commandBuffer);
+
+private:
+    struct SlotPool
+    {
+        AutoVkCommandPool pool;
+
+        // Indexed by VkCommandBufferLevel
+        std::vector<VkCommandBuffer> commandBuffers[2];
+        size_t used[2];
+
+        SlotPool(const DeviceFunctions &pfn, VkDevice device)
+            : pool(pfn, device)
+        {
+            used[0] = used[1] = 0;
+        }
+    };
+
+    struct ThreadPools
+    {
+        std::vector<std::unique_ptr<SlotPool>> slots;
+
+        // Created by the first AllocatePersistent() on the thread
+        AutoVkCommandPool persistent;
+
+        ThreadPools(const DeviceFunctions &pfn, VkDevice device)
+            : persistent(pfn, device)
+        {
+        }
+    };
+
+    bool CreatePool(VkCommandPoolCreateFlags flags, AutoVkCommandPool &pool);
+    ThreadPools *GetThreadPools();
+    SlotPool *GetSlotPool(uint32_t slot);
+
+    const DeviceFunctions &m_pfn;
+    VkDevice m_Device;
+    uint32_t m_QueueFamily;
+    uint32_t m_SlotCount;
+
+    // Protects m_Threads (but not the contents of each ThreadPools, which
+    // are only touched by their own thread, or by ResetSlot while no thread
+    // is using that slot)
+    std::mutex m_Mutex;
+    std::map<std::thread::id, std::unique_ptr<ThreadPools>> m_Threads;
+};
+
+#endif // INCLUDED_VKSXS_COMMAND_BUFFER_POOL
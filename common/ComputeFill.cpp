@@ -0,0 +1,315 @@
+/*
+ * Copyright (c) 2016 Philip Taylor
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include "common/Common.h"
+
+#include "common/AllocationCallbacks.h"
+#include "common/ComputeFill.h"
+#include "common/Log.h"
+
+const uint32_t ComputeFill::LOCAL_SIZE;
+
+/*
+ * SPIR-V for:
+ *
+ *   #version 450
+ *   layout(local_size_x = 8, local_size_y = 8) in;
+ *   layout(set = 0, binding = 0, rgba8) uniform writeonly image2D image;
+ *   layout(push_constant) uniform Params { vec4 color; ivec2 offset; ivec2 extent; } params;
+ *   void main()
+ *   {
+ *       ivec2 pos = ivec2(gl_GlobalInvocationID.xy);
+ *       if (all(lessThan(pos, params.extent)))
+ *           imageStore(image, params.offset + pos, params.color);
+ *   }
+ *
+ * It's assembled by hand (with the instructions in the comments) so the
+ * samples don't need a shader compiler to build.
+ */
+static const uint32_t g_FillShaderSpirv[] = {
+    // Header: magic, version 1.0, generator, bound, schema
+    0x07230203, 0x00010000, 0x00000000, 42, 0,
+    // OpCapability Shader
+    0x00020011, 1,
+    // OpMemoryModel Logical GLSL450
+    0x0003000e, 0, 1,
+    // OpEntryPoint GLCompute %main "main" %gl_GlobalInvocationID
+    0x0006000f, 5, 1, 0x6e69616d, 0, 2,
+    // OpExecutionMode %main LocalSize 8 8 1
+    0x00060010, 1, 17, 8, 8, 1,
+    // OpDecorate %gl_GlobalInvocationID BuiltIn GlobalInvocationId
+    0x00040047, 2, 11, 28,
+    // OpDecorate %image DescriptorSet 0
+    0x00040047, 3, 34, 0,
+    // OpDecorate %image Binding 0
+    0x00040047, 3, 33, 0,
+    // OpDecorate %image NonReadable
+    0x00030047, 3, 25,
+    // OpDecorate %Params Block
+    0x00030047, 4, 2,
+    // OpMemberDecorate %Params 0 Offset 0
+    0x00050048, 4, 0, 35, 0,
+    // OpMemberDecorate %Params 1 Offset 16
+    0x00050048, 4, 1, 35, 16,
+    // OpMemberDecorate %Params 2 Offset 24
+    0x00050048, 4, 2, 35, 24,
+    // %void = OpTypeVoid
+    0x00020013, 5,
+    // %fn_void = OpTypeFunction %void
+    0x00030021, 6, 5,
+    // %bool = OpTypeBool
+    0x00020014, 7,
+    // %v2bool = OpTypeVector %bool 2
+    0x00040017, 8, 7, 2,
+    // %float = OpTypeFloat 32
+    0x00030016, 9, 32,
+    // %v4float = OpTypeVector %float 4
+    0x00040017, 10, 9, 4,
+    // %int = OpTypeInt 32 1
+    0x00040015, 11, 32, 1,
+    // %v2int = OpTypeVector %int 2
+    0x00040017, 12, 11, 2,
+    // %uint = OpTypeInt 32 0
+    0x00040015, 13, 32, 0,
+    // %v2uint = OpTypeVector %uint 2
+    0x00040017, 14, 13, 2,
+    // %v3uint = OpTypeVector %uint 3
+    0x00040017, 15, 13, 3,
+    // %ptr_Input_v3uint = OpTypePointer Input %v3uint
+    0x00040020, 16, 1, 15,
+    // %img2D = OpTypeImage %float 2D 0 0 0 2 Rgba8
+    0x00090019, 17, 9, 1, 0, 0, 0, 2, 4,
+    // %ptr_UniformConstant_img2D = OpTypePointer UniformConstant %img2D
+    0x00040020, 18, 0, 17,
+    // %Params = OpTypeStruct %v4float %v2int %v2int
+    0x0005001e, 4, 10, 12, 12,
+    // %ptr_PushConstant_Params = OpTypePointer PushConstant %Params
+    0x00040020, 19, 9, 4,
+    // %ptr_PushConstant_v4float = OpTypePointer PushConstant %v4float
+    0x00040020, 20, 9, 10,
+    // %ptr_PushConstant_v2int = OpTypePointer PushConstant %v2int
+    0x00040020, 21, 9, 12,
+    // %int_0 = OpConstant %int 0
+    0x0004002b, 11, 22, 0,
+    // %int_1 = OpConstant %int 1
+    0x0004002b, 11, 23, 1,
+    // %int_2 = OpConstant %int 2
+    0x0004002b, 11, 24, 2,
+    // %gl_GlobalInvocationID = OpVariable %ptr_Input_v3uint Input
+    0x0004003b, 16, 2, 1,
+    // %image = OpVariable %ptr_UniformConstant_img2D UniformConstant
+    0x0004003b, 18, 3, 0,
+    // %params = OpVariable %ptr_PushConstant_Params PushConstant
+    0x0004003b, 19, 25, 9,
+    // %main = OpFunction %void None %fn_void
+    0x00050036, 5, 1, 0, 6,
+    // %entry = OpLabel
+    0x000200f8, 26,
+    // %gid = OpLoad %v3uint %gl_GlobalInvocationID
+    0x0004003d, 15, 27, 2,
+    // %gid_xy = OpVectorShuffle %v2uint %gid %gid 0 1
+    0x0007004f, 14, 28, 27, 27, 0, 1,
+    // %pos = OpBitcast %v2int %gid_xy
+    0x0004007c, 12, 29, 28,
+    // %extent_ptr = OpAccessChain %ptr_PushConstant_v2int %params %int_2
+    0x00050041, 21, 30, 25, 24,
+    // %extent = OpLoad %v2int %extent_ptr
+    0x0004003d, 12, 31, 30,
+    // %inside2 = OpSLessThan %v2bool %pos %extent
+    0x000500b1, 8, 32, 29, 31,
+    // %inside = OpAll %bool %inside2
+    0x0004009b, 7, 33, 32,
+    // OpSelectionMerge %merge None
+    0x000300f7, 34, 0,
+    // OpBranchConditional %inside %write %merge
+    0x000400fa, 33, 35, 34,
+    // %write = OpLabel
+    0x000200f8, 35,
+    // %offset_ptr = OpAccessChain %ptr_PushConstant_v2int %params %int_1
+    0x00050041, 21, 36, 25, 23,
+    // %offset = OpLoad %v2int %offset_ptr
+    0x0004003d, 12, 37, 36,
+    // %coord = OpIAdd %v2int %offset %pos
+    0x00050080, 12, 38, 37, 29,
+    // %color_ptr = OpAccessChain %ptr_PushConstant_v4float %params %int_0
+    0x00050041, 20, 39, 25, 22,
+    // %color = OpLoad %v4float %color_ptr
+    0x0004003d, 10, 40, 39,
+    // %img = OpLoad %img2D %image
+    0x0004003d, 17, 41, 3,
+    // OpImageWrite %img %coord %color
+    0x00040063, 41, 38, 40,
+    // OpBranch %merge
+    0x000200f9, 34,
+    // %merge = OpLabel
+    0x000200f8, 34,
+    // OpReturn
+    0x000100fd,
+    // OpFunctionEnd
+    0x00010038,
+};
+
+// Matches the shader's Params block
+struct FillPushConstants
+{
+    float color[4];
+    int32_t offset[2];
+    int32_t extent[2];
+};
+
+ComputeFill::ComputeFill(const DeviceFunctions &pfn, VkDevice device)
+    : m_pfn(pfn), m_Device(device),
+    m_DescriptorSetLayout(pfn, device), m_PipelineLayout(pfn, device), m_Pipeline(pfn, device)
+{
+}
+
+std::vector<VkDescriptorPoolSize> ComputeFill::GetDescriptorPoolSizes()
+{
+    VkDescriptorPoolSize size;
+    size.type = VK_DESCRIPTOR_TYPE_STORAGE_IMAGE;
+    size.descriptorCount = 1;
+    return std::vector<VkDescriptorPoolSize>(1, size);
+}
+
+bool ComputeFill::Setup(VkPipelineCache pipelineCache)
+{
+    VkResult result;
+
+    VkDescriptorSetLayoutBinding binding = {};
+    binding.binding = 0;
+    binding.descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_IMAGE;
+    binding.descriptorCount = 1;
+    binding.stageFlags = VK_SHADER_STAGE_COMPUTE_BIT;
+
+    VkDescriptorSetLayoutCreateInfo descriptorSetLayoutCreateInfo = {};
+    descriptorSetLayoutCreateInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO;
+    descriptorSetLayoutCreateInfo.bindingCount = 1;
+    descriptorSetLayoutCreateInfo.pBindings = &binding;
+    result = m_pfn.vkCreateDescriptorSetLayout(m_Device, &descriptorSetLayoutCreateInfo, CREATE_ALLOCATOR(), m_DescriptorSetLayout.ptr());
+    if (result != VK_SUCCESS)
+    {
+        LOGE("vkCreateDescriptorSetLayout failed (%d)", result);
+        return false;
+    }
+
+    VkPushConstantRange pushConstantRange = {};
+    pushConstantRange.stageFlags = VK_SHADER_STAGE_COMPUTE_BIT;
+    pushConstantRange.offset = 0;
+    pushConstantRange.size = sizeof(FillPushConstants);
+
+    VkPipelineLayoutCreateInfo pipelineLayoutCreateInfo = {};
+    pipelineLayoutCreateInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO;
+    pipelineLayoutCreateInfo.setLayoutCount = 1;
+    pipelineLayoutCreateInfo.pSetLayouts = m_DescriptorSetLayout.ptr();
+    pipelineLayoutCreateInfo.pushConstantRangeCount = 1;
+    pipelineLayoutCreateInfo.pPushConstantRanges = &pushConstantRange;
+    result = m_pfn.vkCreatePipelineLayout(m_Device, &pipelineLayoutCreateInfo, CREATE_ALLOCATOR(), m_PipelineLayout.ptr());
+    if (result != VK_SUCCESS)
+    {
+        LOGE("vkCreatePipelineLayout failed (%d)", result);
+        return false;
+    }
+
+    // The module is only needed while creating the pipeline
+    AutoVkShaderModule shaderModule(m_pfn, m_Device);
+    VkShaderModuleCreateInfo shaderModuleCreateInfo = {};
+    shaderModuleCreateInfo.sType = VK_STRUCTURE_TYPE_SHADER_MODULE_CREATE_INFO;
+    shaderModuleCreateInfo.codeSize = sizeof(g_FillShaderSpirv);
+    shaderModuleCreateInfo.pCode = g_FillShaderSpirv;
+    result = m_pfn.vkCreateShaderModule(m_Device, &shaderModuleCreateInfo, CREATE_ALLOCATOR(), shaderModule.ptr());
+    if (result != VK_SUCCESS)
+    {
+        LOGE("vkCreateShaderModule failed (%d)", result);
+        return false;
+    }
+
+    VkComputePipelineCreateInfo pipelineCreateInfo = {};
+    pipelineCreateInfo.sType = VK_STRUCTURE_TYPE_COMPUTE_PIPELINE_CREATE_INFO;
+    pipelineCreateInfo.stage.sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
+    pipelineCreateInfo.stage.stage = VK_SHADER_STAGE_COMPUTE_BIT;
+    pipelineCreateInfo.stage.module = shaderModule;
+    pipelineCreateInfo.stage.pName = "main";
+    pipelineCreateInfo.layout = m_PipelineLayout;
+    pipelineCreateInfo.basePipelineIndex = -1;
+    result = m_pfn.vkCreateComputePipelines(m_Device, pipelineCache, 1, &pipelineCreateInfo, CREATE_ALLOCATOR(), m_Pipeline.ptr());
+    if (result != VK_SUCCESS)
+    {
+        LOGE("vkCreateComputePipelines failed (%d)", result);
+        return false;
+    }
+
+    return true;
+}
+
+bool ComputeFill::Record(Frame &frame, VkCommandBuffer commandBuffer, VkImageView imageView,
+    const FillRect *rects, uint32_t rectCount)
+{
+    if (rectCount == 0)
+        return true;
+
+    // The set is only used by this frame, so it can come from the frame's
+    // pool and be recycled wholesale, instead of being freed
+    VkDescriptorSet descriptorSet;
+    if (!frame.AllocateDescriptorSet(m_DescriptorSetLayout, descriptorSet))
+        return false;
+
+    VkDescriptorImageInfo imageInfo = {};
+    imageInfo.imageView = imageView;
+    imageInfo.imageLayout = VK_IMAGE_LAYOUT_GENERAL;
+
+    VkWriteDescriptorSet write = {};
+    write.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+    write.dstSet = descriptorSet;
+    write.dstBinding = 0;
+    write.dstArrayElement = 0;
+    write.descriptorCount = 1;
+    write.descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_IMAGE;
+    write.pImageInfo = &imageInfo;
+    m_pfn.vkUpdateDescriptorSets(m_Device, 1, &write, 0, nullptr);
+
+    m_pfn.vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, m_Pipeline);
+    m_pfn.vkCmdBindDescriptorSets(commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, m_PipelineLayout,
+        0, 1, &descriptorSet, 0, nullptr);
+
+    for (uint32_t i = 0; i < rectCount; ++i)
+    {
+        const FillRect &rect = rects[i];
+        if (rect.extent.width == 0 || rect.extent.height == 0)
+            continue;
+
+        FillPushConstants constants;
+        memcpy(constants.color, rect.color, sizeof(constants.color));
+        constants.offset[0] = rect.offset.x;
+        constants.offset[1] = rect.offset.y;
+        constants.extent[0] = (int32_t)rect.extent.width;
+        constants.extent[1] = (int32_t)rect.extent.height;
+        m_pfn.vkCmdPushConstants(commandBuffer, m_PipelineLayout, VK_SHADER_STAGE_COMPUTE_BIT,
+            0, sizeof(constants), &constants);
+
+        m_pfn.vkCmdDispatch(commandBuffer,
+            (rect.extent.width + LOCAL_SIZE - 1) / LOCAL_SIZE,
+            (rect.extent.height + LOCAL_SIZE - 1) / LOCAL_SIZE,
+            1);
+    }
+
+    return true;
+}
@@ -0,0 +1,87 @@
+/*
+ * Copyright (c) 2016 Philip Taylor
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#ifndef INCLUDED_VKSXS_COMPUTE_FILL
+#define INCLUDED_VKSXS_COMPUTE_FILL
+
+#include "common/Common.h"
+
+#include "common/AutoWrappers.h"
+#include "common/DeviceFunctions.h"
+#include "common/FrameManager.h"
+
+#include <vector>
+
+struct FillRect
+{
+    VkOffset2D offset;
+    VkExtent2D extent;
+    float color[4];
+};
+
+/*
+ * Fills rectangles of R8G8B8A8_UNORM storage images with solid colours,
+ * using a compute shader.
+ *
+ * Lots of small dispatches are cheap as long as nothing gets in between
+ * them, so Record() binds the pipeline and a descriptor set once, then just
+ * updates the push constants and dispatches for each rectangle, with no
+ * barriers between them. (Overlapping rectangles are therefore filled in an
+ * undefined order.)
+ *
+ * The descriptor set comes from the frame's DescriptorPool, which must have
+ * been set up with room for GetDescriptorPoolSizes().
+ */
+class ComputeFill
+{
+public:
+    static const uint32_t LOCAL_SIZE = 8; // the shader's workgroup is LOCAL_SIZE x LOCAL_SIZE
+
+    ComputeFill(const DeviceFunctions &pfn, VkDevice device);
+
+    ComputeFill(const ComputeFill &) = delete;
+    ComputeFill &operator=(const ComputeFill &) = delete;
+
+    bool Setup(VkPipelineCache pipelineCache);
+
+    // The descriptors that each Record() call allocates
+    static std::vector<VkDescriptorPoolSize> GetDescriptorPoolSizes();
+
+    /*
+     * imageView must be a 2D R8G8B8A8_UNORM view of an image with
+     * STORAGE_BIT usage, in RESOURCE_USAGE_COMPUTE_WRITE (i.e. GENERAL
+     * layout) by the time the commands execute. commandBuffer must be for
+     * a queue family with compute support.
+     */
+    bool Record(Frame &frame, VkCommandBuffer commandBuffer, VkImageView imageView,
+        const FillRect *rects, uint32_t rectCount);
+
+private:
+    const DeviceFunctions &m_pfn;
+    VkDevice m_Device;
+
+    AutoVkDescriptorSetLayout m_DescriptorSetLayout;
+    AutoVkPipelineLayout m_PipelineLayout;
+    AutoVkPipeline m_Pipeline;
+};
+
+#endif // INCLUDED_VKSXS_COMPUTE_FILL
@@ -0,0 +1,94 @@
+/*
+ * Copyright (c) 2016 Philip Taylor
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include "common/Common.h"
+
+#include "common/DeletionQueue.h"
+#include "common/Log.h"
+
+DeletionQueue::DeletionQueue(uint32_t slotCount)
+    : m_Slots(slotCount)
+{
+    ASSERT(slotCount > 0);
+}
+
+DeletionQueue::~DeletionQueue()
+{
+    FlushAll();
+}
+
+void DeletionQueue::Push(uint32_t slot, const Entry &entry)
+{
+    ASSERT(slot < m_Slots.size());
+
+    std::lock_guard<std::mutex> lock(m_Mutex);
+    m_Slots[slot].objects.push_back(entry);
+}
+
+void DeletionQueue::DeferFunction(uint32_t slot, std::function<void ()> fn)
+{
+    ASSERT(slot < m_Slots.size());
+
+    std::lock_guard<std::mutex> lock(m_Mutex);
+    m_Slots[slot].functions.push_back(std::move(fn));
+}
+
+void DeletionQueue::Flush(uint32_t slot)
+{
+    ASSERT(slot < m_Slots.size());
+
+    // Swap the lists out, so other threads can keep deferring (into the
+    // slot's next use) while this destroys them. Swapping rather than moving
+    // keeps the vectors' capacity for next time
+    std::vector<Entry> objects;
+    std::vector<std::function<void ()>> functions;
+    {
+        std::lock_guard<std::mutex> lock(m_Mutex);
+        objects.swap(m_Slots[slot].objects);
+        functions.swap(m_Slots[slot].functions);
+    }
+
+    // Run the functions first, since they may free memory that was bound to
+    // the objects (which is allowed, as long as the objects aren't used again)
+    for (auto &fn : functions)
+        fn();
+
+    for (const Entry &entry : objects)
+        entry.destroy(entry);
+
+    // Give the (now empty) storage back if nothing was queued meanwhile
+    objects.clear();
+    functions.clear();
+    {
+        std::lock_guard<std::mutex> lock(m_Mutex);
+        if (m_Slots[slot].objects.empty())
+            m_Slots[slot].objects.swap(objects);
+        if (m_Slots[slot].functions.empty())
+            m_Slots[slot].functions.swap(functions);
+    }
+}
+
+void DeletionQueue::FlushAll()
+{
+    for (uint32_t slot = 0; slot < m_Slots.size(); ++slot)
+        Flush(slot);
+}
@@ -0,0 +1,118 @@
+/*
+ * Copyright (c) 2016 Philip Taylor
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#ifndef INCLUDED_VKSXS_DELETION_QUEUE
+#define INCLUDED_VKSXS_DELETION_QUEUE
+
+#include "common/Common.h"
+
+#include "common/AutoWrappers.h"
+
+#include <cstring>
+#include <functional>
+#include <mutex>
+#include <vector>
+
+/*
+ * Destroys objects once the GPU has finished with them, instead of when they
+ * go out of scope.
+ *
+ * Objects are queued against a frame slot (see FrameManager), and destroyed
+ * when the slot is next recycled, i.e. after that frame's fence has signalled.
+ * Frames retire in order, so that's also after every earlier frame, and an
+ * object can be deferred as soon as the last frame that uses it has been
+ * submitted. (Objects used by other submits, like the TransferEngine's, must
+ * be kept alive until those have been waited for.)
+ *
+ * Each entry is a handle and its destroy function, with no allocation per
+ * object beyond the queue's own storage, so thousands of transient objects
+ * can be retired cheaply in one batch.
+ *
+ * Defer() is thread-safe.
+ */
+class DeletionQueue
+{
+public:
+    explicit DeletionQueue(uint32_t slotCount);
+
+    // Destroys everything that's still queued, so the GPU must be idle
+    ~DeletionQueue();
+
+    DeletionQueue(const DeletionQueue &) = delete;
+    DeletionQueue &operator=(const DeletionQueue &) = delete;
+
+    // Take ownership of a device object from its wrapper
+    template <typename F, typename T, typename FN, FN F::*CB, typename A>
+    void Defer(uint32_t slot, WrapNonDispatchable<F, VkDevice, T, FN, CB, A> &&object)
+    {
+        VkDevice device = object.parent();
+        FN vkDestroy = object.destroyFunction();
+        T handle = object.release();
+        if (!vkDestroy || handle == VK_NULL_HANDLE)
+            return;
+
+        Entry entry;
+        entry.destroy = &DestroyThunk<T, FN, A>;
+        entry.vkDestroy = reinterpret_cast<PFN_vkVoidFunction>(vkDestroy);
+        entry.device = device;
+        memcpy(&entry.handle, &handle, sizeof(handle));
+        Push(slot, entry);
+    }
+
+    // Anything else, e.g. returning a MemoryAllocation to its allocator
+    void DeferFunction(uint32_t slot, std::function<void ()> fn);
+
+    // Destroy everything that was queued against the slot
+    void Flush(uint32_t slot);
+
+    void FlushAll();
+
+private:
+    struct Entry
+    {
+        void (*destroy)(const Entry &entry);
+        PFN_vkVoidFunction vkDestroy;
+        VkDevice device;
+        uint64_t handle; // large enough for any non-dispatchable handle
+    };
+
+    template <typename T, typename FN, typename A>
+    static void DestroyThunk(const Entry &entry)
+    {
+        T handle;
+        memcpy(&handle, &entry.handle, sizeof(handle));
+        reinterpret_cast<FN>(entry.vkDestroy)(entry.device, handle, A::get());
+    }
+
+    struct Slot
+    {
+        std::vector<Entry> objects;
+        std::vector<std::function<void ()>> functions;
+    };
+
+    void Push(uint32_t slot, const Entry &entry);
+
+    std::mutex m_Mutex;
+    std::vector<Slot> m_Slots;
+};
+
+#endif // INCLUDED_VKSXS_DELETION_QUEUE
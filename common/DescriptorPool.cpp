@@ -0,0 +1,128 @@
+/*
+ * Copyright (c) 2016 Philip Taylor
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include "common/Common.h"
+
+#include "common/AllocationCallbacks.h"
+#include "common/DescriptorPool.h"
+#include "common/Log.h"
+
+const uint32_t DescriptorPool::DEFAULT_SETS_PER_POOL;
+
+DescriptorPool::DescriptorPool(const DeviceFunctions &pfn, VkDevice device, uint32_t slotCount,
+    const std::vector<VkDescriptorPoolSize> &sizesPerSet, uint32_t setsPerPool)
+    : m_pfn(pfn), m_Device(device), m_SlotCount(slotCount), m_SetsPerPool(setsPerPool),
+    m_PoolSizes(sizesPerSet), m_Slots(slotCount)
+{
+    ASSERT(slotCount > 0);
+    ASSERT(setsPerPool > 0);
+
+    for (VkDescriptorPoolSize &size : m_PoolSizes)
+        size.descriptorCount *= setsPerPool;
+
+    for (Slot &slot : m_Slots)
+        slot.current = 0;
+}
+
+bool DescriptorPool::CreatePool(AutoVkDescriptorPool &pool)
+{
+    // No FREE_DESCRIPTOR_SET_BIT, since sets are only ever freed by resetting
+    VkDescriptorPoolCreateInfo descriptorPoolCreateInfo = {};
+    descriptorPoolCreateInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO;
+    descriptorPoolCreateInfo.flags = 0;
+    descriptorPoolCreateInfo.maxSets = m_SetsPerPool;
+    descriptorPoolCreateInfo.poolSizeCount = (uint32_t)m_PoolSizes.size();
+    descriptorPoolCreateInfo.pPoolSizes = m_PoolSizes.data();
+    VkResult result = m_pfn.vkCreateDescriptorPool(m_Device, &descriptorPoolCreateInfo, CREATE_ALLOCATOR(), pool.ptr());
+    if (result != VK_SUCCESS)
+    {
+        LOGE("vkCreateDescriptorPool failed (%d)", result);
+        return false;
+    }
+    return true;
+}
+
+bool DescriptorPool::Allocate(uint32_t slotIndex, VkDescriptorSetLayout layout, VkDescriptorSet &descriptorSet)
+{
+    ASSERT(slotIndex < m_SlotCount);
+
+    std::lock_guard<std::mutex> lock(m_Mutex);
+
+    Slot &slot = m_Slots[slotIndex];
+
+    // Vulkan 1.0 has no specific error for an exhausted pool (and drivers
+    // needn't detect it), so count the sets rather than relying on
+    // vkAllocateDescriptorSets to fail
+    while (slot.current < slot.pools.size() && slot.pools[slot.current]->used == m_SetsPerPool)
+        ++slot.current;
+
+    if (slot.current == slot.pools.size())
+    {
+        std::unique_ptr<Pool> newPool(new Pool(m_pfn, m_Device));
+        if (!CreatePool(newPool->pool))
+            return false;
+        slot.pools.push_back(std::move(newPool));
+    }
+
+    Pool &pool = *slot.pools[slot.current];
+
+    VkDescriptorSetAllocateInfo descriptorSetAllocateInfo = {};
+    descriptorSetAllocateInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO;
+    descriptorSetAllocateInfo.descriptorPool = pool.pool;
+    descriptorSetAllocateInfo.descriptorSetCount = 1;
+    descriptorSetAllocateInfo.pSetLayouts = &layout;
+    VkResult result = m_pfn.vkAllocateDescriptorSets(m_Device, &descriptorSetAllocateInfo, &descriptorSet);
+    if (result != VK_SUCCESS)
+    {
+        LOGE("vkAllocateDescriptorSets failed (%d)", result);
+        return false;
+    }
+
+    ++pool.used;
+    return true;
+}
+
+bool DescriptorPool::ResetSlot(uint32_t slotIndex)
+{
+    ASSERT(slotIndex < m_SlotCount);
+
+    std::lock_guard<std::mutex> lock(m_Mutex);
+
+    Slot &slot = m_Slots[slotIndex];
+    for (auto &pool : slot.pools)
+    {
+        if (pool->used == 0)
+            continue;
+
+        VkResult result = m_pfn.vkResetDescriptorPool(m_Device, pool->pool, 0);
+        if (result != VK_SUCCESS)
+        {
+            LOGE("vkResetDescriptorPool failed (%d)", result);
+            return false;
+        }
+
+        pool->used = 0;
+    }
+
+    slot.current = 0;
+    return true;
+}
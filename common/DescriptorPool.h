@@ -0,0 +1,102 @@
+/*
+ * Copyright (c) 2016 Philip Taylor
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#ifndef INCLUDED_VKSXS_DESCRIPTOR_POOL
+#define INCLUDED_VKSXS_DESCRIPTOR_POOL
+
+#include "common/Common.h"
+
+#include "common/AutoWrappers.h"
+#include "common/DeviceFunctions.h"
+
+#include <memory>
+#include <mutex>
+#include <vector>
+
+/*
+ * Hands out short-lived descriptor sets, one group per frame slot.
+ *
+ * Freeing descriptor sets individually needs the pool to be created with
+ * FREE_DESCRIPTOR_SET_BIT, and makes the driver track (and fragment) each
+ * set. Sets that are written every frame don't need any of that: each slot
+ * has its own VkDescriptorPools, and once the GPU has finished with the slot,
+ * ResetSlot() recycles everything with one vkResetDescriptorPool per pool.
+ *
+ * Pools are created on demand with room for setsPerPool sets, each of which
+ * may use up to the descriptor counts in sizesPerSet. When a slot's pool is
+ * full another one is chained on, and kept for next time, so a steady
+ * workload stops creating pools after the first few frames.
+ *
+ * Allocate() is thread-safe. Nothing may be using the slot's sets (or
+ * allocating from the slot) while it's being reset.
+ */
+class DescriptorPool
+{
+public:
+    static const uint32_t DEFAULT_SETS_PER_POOL = 256;
+
+    DescriptorPool(const DeviceFunctions &pfn, VkDevice device, uint32_t slotCount,
+        const std::vector<VkDescriptorPoolSize> &sizesPerSet,
+        uint32_t setsPerPool = DEFAULT_SETS_PER_POOL);
+
+    DescriptorPool(const DescriptorPool &) = delete;
+    DescriptorPool &operator=(const DescriptorPool &) = delete;
+
+    uint32_t GetSlotCount() const { return m_SlotCount; }
+
+    // A descriptor set that is valid until the next ResetSlot(slot)
+    bool Allocate(uint32_t slot, VkDescriptorSetLayout layout, VkDescriptorSet &descriptorSet);
+
+    bool ResetSlot(uint32_t slot);
+
+private:
+    struct Pool
+    {
+        AutoVkDescriptorPool pool;
+        uint32_t used;
+
+        Pool(const DeviceFunctions &pfn, VkDevice device)
+            : pool(pfn, device), used(0)
+        {
+        }
+    };
+
+    struct Slot
+    {
+        std::vector<std::unique_ptr<Pool>> pools;
+        size_t current; // the pool that's being allocated from
+    };
+
+    bool CreatePool(AutoVkDescriptorPool &pool);
+
+    const DeviceFunctions &m_pfn;
+    VkDevice m_Device;
+    uint32_t m_SlotCount;
+    uint32_t m_SetsPerPool;
+    std::vector<VkDescriptorPoolSize> m_PoolSizes; // for a whole pool
+
+    // A VkDescriptorPool must be externally synchronised
+    std::mutex m_Mutex;
+    std::vector<Slot> m_Slots;
+};
+
+#endif // INCLUDED_VKSXS_DESCRIPTOR_POOL
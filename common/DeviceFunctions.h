@@ -0,0 +1,191 @@
+/*
+ * Copyright (c) 2016 Philip Taylor
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#ifndef INCLUDED_VKSXS_DEVICE_FUNCTIONS
+#define INCLUDED_VKSXS_DEVICE_FUNCTIONS
+
+#include "common/Common.h"
+
+/*
+ * Functions whose first parameter is a VkDevice, VkQueue or VkCommandBuffer.
+ *
+ * These are loaded with vkGetDeviceProcAddr once the device has been created,
+ * rather than with vkGetInstanceProcAddr. The instance-level pointers have to
+ * work with any device, so the loader returns a trampoline that looks up the
+ * device's dispatch table on every call; the device-level pointers can go
+ * straight to the driver (or to the first enabled layer). That matters most
+ * for the vkCmd* functions, which get called a lot.
+ */
+#define DEVICE_FUNCTIONS \
+    X(vkAllocateCommandBuffers) \
+    X(vkAllocateDescriptorSets) \
+    X(vkAllocateMemory) \
+    X(vkBeginCommandBuffer) \
+    X(vkBindBufferMemory) \
+    X(vkBindImageMemory) \
+    X(vkCmdBeginQuery) \
+    X(vkCmdBindDescriptorSets) \
+    X(vkCmdBindPipeline) \
+    X(vkCmdBlitImage) \
+    X(vkCmdClearColorImage) \
+    X(vkCmdClearDepthStencilImage) \
+    X(vkCmdCopyBuffer) \
+    X(vkCmdCopyBufferToImage) \
+    X(vkCmdCopyImage) \
+    X(vkCmdCopyImageToBuffer) \
+    X(vkCmdCopyQueryPoolResults) \
+    X(vkCmdDispatch) \
+    X(vkCmdDispatchIndirect) \
+    X(vkCmdEndQuery) \
+    X(vkCmdExecuteCommands) \
+    X(vkCmdFillBuffer) \
+    X(vkCmdPipelineBarrier) \
+    X(vkCmdPushConstants) \
+    X(vkCmdResetEvent) \
+    X(vkCmdResetQueryPool) \
+    X(vkCmdResolveImage) \
+    X(vkCmdSetEvent) \
+    X(vkCmdUpdateBuffer) \
+    X(vkCmdWaitEvents) \
+    X(vkCmdWriteTimestamp) \
+    X(vkCreateBuffer) \
+    X(vkCreateBufferView) \
+    X(vkCreateCommandPool) \
+    X(vkCreateComputePipelines) \
+    X(vkCreateDescriptorPool) \
+    X(vkCreateDescriptorSetLayout) \
+    X(vkCreateEvent) \
+    X(vkCreateFence) \
+    X(vkCreateImage) \
+    X(vkCreateImageView) \
+    X(vkCreatePipelineCache) \
+    X(vkCreatePipelineLayout) \
+    X(vkCreateQueryPool) \
+    X(vkCreateSampler) \
+    X(vkCreateSemaphore) \
+    X(vkCreateShaderModule) \
+    X(vkDestroyBuffer) \
+    X(vkDestroyBufferView) \
+    X(vkDestroyCommandPool) \
+    X(vkDestroyDescriptorPool) \
+    X(vkDestroyDescriptorSetLayout) \
+    X(vkDestroyDevice) \
+    X(vkDestroyEvent) \
+    X(vkDestroyFence) \
+    X(vkDestroyImage) \
+    X(vkDestroyImageView) \
+    X(vkDestroyPipeline) \
+    X(vkDestroyPipelineCache) \
+    X(vkDestroyPipelineLayout) \
+    X(vkDestroyQueryPool) \
+    X(vkDestroySampler) \
+    X(vkDestroySemaphore) \
+    X(vkDestroyShaderModule) \
+    X(vkDeviceWaitIdle) \
+    X(vkEndCommandBuffer) \
+    X(vkFlushMappedMemoryRanges) \
+    X(vkFreeCommandBuffers) \
+    X(vkFreeDescriptorSets) \
+    X(vkFreeMemory) \
+    X(vkGetBufferMemoryRequirements) \
+    X(vkGetDeviceMemoryCommitment) \
+    X(vkGetDeviceQueue) \
+    X(vkGetEventStatus) \
+    X(vkGetFenceStatus) \
+    X(vkGetImageMemoryRequirements) \
+    X(vkGetImageSubresourceLayout) \
+    X(vkGetPipelineCacheData) \
+    X(vkGetQueryPoolResults) \
+    X(vkInvalidateMappedMemoryRanges) \
+    X(vkMapMemory) \
+    X(vkMergePipelineCaches) \
+    X(vkQueueSubmit) \
+    X(vkQueueWaitIdle) \
+    X(vkResetCommandBuffer) \
+    X(vkResetCommandPool) \
+    X(vkResetDescriptorPool) \
+    X(vkResetEvent) \
+    X(vkResetFences) \
+    X(vkSetEvent) \
+    X(vkUnmapMemory) \
+    X(vkUpdateDescriptorSets) \
+    X(vkWaitForFences) \
+
+/*
+ * Drawing and render passes. Compute/transfer-only binaries can build with
+ * ENABLE_GRAPHICS_FUNCTIONS=0, which leaves these out of DeviceFunctions
+ * entirely, so they're neither stored nor looked up.
+ */
+#ifndef ENABLE_GRAPHICS_FUNCTIONS
+#define ENABLE_GRAPHICS_FUNCTIONS 1
+#endif
+
+#if ENABLE_GRAPHICS_FUNCTIONS
+#define DEVICE_FUNCTIONS_GRAPHICS \
+    X(vkCmdBeginRenderPass) \
+    X(vkCmdBindIndexBuffer) \
+    X(vkCmdBindVertexBuffers) \
+    X(vkCmdClearAttachments) \
+    X(vkCmdDraw) \
+    X(vkCmdDrawIndexed) \
+    X(vkCmdDrawIndexedIndirect) \
+    X(vkCmdDrawIndirect) \
+    X(vkCmdEndRenderPass) \
+    X(vkCmdNextSubpass) \
+    X(vkCmdSetBlendConstants) \
+    X(vkCmdSetDepthBias) \
+    X(vkCmdSetDepthBounds) \
+    X(vkCmdSetLineWidth) \
+    X(vkCmdSetScissor) \
+    X(vkCmdSetStencilCompareMask) \
+    X(vkCmdSetStencilReference) \
+    X(vkCmdSetStencilWriteMask) \
+    X(vkCmdSetViewport) \
+    X(vkCreateFramebuffer) \
+    X(vkCreateGraphicsPipelines) \
+    X(vkCreateRenderPass) \
+    X(vkDestroyFramebuffer) \
+    X(vkDestroyRenderPass) \
+    X(vkGetRenderAreaGranularity) \
+
+#else
+#define DEVICE_FUNCTIONS_GRAPHICS
+#endif
+
+/*
+ * Only loaded when the device was created with the sparseBinding feature
+ * (otherwise they're null, since they can't be used anyway).
+ */
+#define DEVICE_FUNCTIONS_SPARSE \
+    X(vkGetImageSparseMemoryRequirements) \
+    X(vkQueueBindSparse) \
+
+struct DeviceFunctions
+{
+#define X(n) PFN_##n n;
+    DEVICE_FUNCTIONS
+    DEVICE_FUNCTIONS_GRAPHICS
+    DEVICE_FUNCTIONS_SPARSE
+#undef X
+};
+
+#endif // INCLUDED_VKSXS_DEVICE_FUNCTIONS
@@ -27,14 +27,25 @@
 #include "common/DeviceLoader.h"
 #include "common/Log.h"
 
+#include <algorithm>
 #include <fstream>
 #include <map>
+#include <mutex>
 #include <set>
 #include <vector>
 
-DeviceLoader::DeviceLoader()
+template <typename A>
+DeviceLoaderT<A>::DeviceLoaderT()
 {
     m_EnableApiDump = false;
+    m_LogCapabilities = false;
+    m_ScoreFunction = DefaultPhysicalDeviceScore;
+    m_PhysicalDeviceRank = 0;
+    m_EnableSparseResidency = false;
+    m_EnablePipelineStatistics = false;
+    m_SparseQueueFamily = UINT32_MAX;
+    m_SparseQueue = VK_NULL_HANDLE;
+    memset(&m_EnabledFeatures, 0, sizeof(m_EnabledFeatures));
 
     m_DebugReportFlags = 0;
     m_DebugReportFlags |= VK_DEBUG_REPORT_INFORMATION_BIT_EXT;
@@ -44,25 +55,166 @@ DeviceLoader::DeviceLoader()
     m_DebugReportFlags |= VK_DEBUG_REPORT_DEBUG_BIT_EXT;
 }
 
-DeviceLoader::~DeviceLoader()
+template <typename A>
+DeviceLoaderT<A>::~DeviceLoaderT()
 {
+    if (m_PipelineCache)
+        m_PipelineCache->Save();
 }
 
 static void *LoadGlobalSymbol(const char *symbol)
 {
+    // Open the library once and keep it. Don't bother calling
+    // FreeLibrary()/dlclose() because we don't mind leaving the library
+    // loaded until the process terminates
 #ifdef _WIN32
-    HMODULE module = LoadLibraryA("vulkan-1.dll");
+    static HMODULE module = LoadLibraryA("vulkan-1.dll");
     if (!module)
         return nullptr;
-    return GetProcAddress(module, symbol);
+    return (void *)GetProcAddress(module, symbol);
 #else
-    void *handle = dlopen("libvulkan.so", RTLD_LOCAL|RTLD_LAZY);
+    static void *handle = dlopen("libvulkan.so", RTLD_LOCAL|RTLD_LAZY);
     if (!handle)
         return nullptr;
     return dlsym(handle, symbol);
 #endif
-    // Don't bother calling FreeLibrary()/dlclose() because we don't mind
-    // leaving the library loaded until the process terminates
+}
+
+bool HasExtension(const std::vector<VkExtensionProperties> &extensions, const std::string &name)
+{
+    for (auto &extension : extensions)
+    {
+        if (name == extension.extensionName)
+            return true;
+    }
+    return false;
+}
+
+/*
+ * Fill 'out' from a vkEnumerate*-style function. This starts with room for
+ * 'out's previous size (or a generous guess), so it normally takes a single
+ * call rather than one for the count and one for the data, and only retries
+ * on VK_INCOMPLETE.
+ */
+template <typename T, typename F>
+static VkResult EnumerateAll(const F &enumerate, std::vector<T> &out)
+{
+    uint32_t capacity = std::max<uint32_t>((uint32_t)out.size(), 32);
+    while (true)
+    {
+        out.resize(capacity);
+        uint32_t count = capacity;
+        VkResult result = enumerate(&count, out.data());
+        if (result == VK_INCOMPLETE)
+        {
+            capacity *= 2;
+            continue;
+        }
+        if (result != VK_SUCCESS)
+        {
+            out.clear();
+            return result;
+        }
+        out.resize(count);
+        return VK_SUCCESS;
+    }
+}
+
+typedef std::function<VkResult (uint32_t *, VkLayerProperties *)> EnumerateLayersFunction;
+typedef std::function<VkResult (const char *, uint32_t *, VkExtensionProperties *)> EnumerateExtensionsFunction;
+
+static bool ProbeLayers(const EnumerateLayersFunction &enumerateLayers,
+    const EnumerateExtensionsFunction &enumerateExtensions, std::vector<LayerCapabilities> &layers)
+{
+    std::vector<VkLayerProperties> layerProperties;
+    VkResult result = EnumerateAll(enumerateLayers, layerProperties);
+    if (result != VK_SUCCESS)
+    {
+        LOGE("Failed to enumerate layers (%d)", result);
+        return false;
+    }
+
+    layers.resize(layerProperties.size());
+    for (size_t i = 0; i < layerProperties.size(); ++i)
+    {
+        layers[i].properties = layerProperties[i];
+        const char *layerName = layerProperties[i].layerName;
+        result = EnumerateAll([&](uint32_t *count, VkExtensionProperties *extensions) {
+            return enumerateExtensions(layerName, count, extensions);
+        }, layers[i].extensions);
+        if (result != VK_SUCCESS)
+        {
+            LOGE("Failed to enumerate extensions for layer %s (%d)", layerName, result);
+            return false;
+        }
+    }
+    return true;
+}
+
+int64_t DefaultPhysicalDeviceScore(const PhysicalDeviceInfo &info)
+{
+    int64_t typeRank = 0;
+    switch (info.properties.deviceType)
+    {
+    case VK_PHYSICAL_DEVICE_TYPE_DISCRETE_GPU: typeRank = 4; break;
+    case VK_PHYSICAL_DEVICE_TYPE_INTEGRATED_GPU: typeRank = 3; break;
+    case VK_PHYSICAL_DEVICE_TYPE_VIRTUAL_GPU: typeRank = 2; break;
+    case VK_PHYSICAL_DEVICE_TYPE_CPU: typeRank = 1; break;
+    default: typeRank = 0; break;
+    }
+
+    // Heap size in MB fits comfortably below the queue bits
+    int64_t score = typeRank << 40;
+    if (info.hasDedicatedTransferQueue)
+        score |= (int64_t)1 << 37;
+    if (info.hasAsyncComputeQueue)
+        score |= (int64_t)1 << 36;
+    score |= std::min<int64_t>((int64_t)(info.deviceLocalHeapSize >> 20), ((int64_t)1 << 36) - 1);
+    return score;
+}
+
+static bool GetPhysicalDeviceInfo(const InstanceFunctions &pfn, VkPhysicalDevice physicalDevice,
+    PhysicalDeviceInfo &info)
+{
+    info.physicalDevice = physicalDevice;
+    pfn.vkGetPhysicalDeviceProperties(physicalDevice, &info.properties);
+    pfn.vkGetPhysicalDeviceMemoryProperties(physicalDevice, &info.memoryProperties);
+
+    uint32_t queueFamilyCount;
+    pfn.vkGetPhysicalDeviceQueueFamilyProperties(physicalDevice, &queueFamilyCount, nullptr);
+    info.queueFamilies.resize(queueFamilyCount);
+    pfn.vkGetPhysicalDeviceQueueFamilyProperties(physicalDevice, &queueFamilyCount, info.queueFamilies.data());
+
+    VkResult result = EnumerateAll([&](uint32_t *count, VkExtensionProperties *extensions) {
+        return pfn.vkEnumerateDeviceExtensionProperties(physicalDevice, nullptr, count, extensions);
+    }, info.extensions);
+    if (result != VK_SUCCESS)
+    {
+        LOGE("vkEnumerateDeviceExtensionProperties failed (%d)", result);
+        return false;
+    }
+
+    info.deviceLocalHeapSize = 0;
+    for (uint32_t i = 0; i < info.memoryProperties.memoryHeapCount; ++i)
+    {
+        const VkMemoryHeap &heap = info.memoryProperties.memoryHeaps[i];
+        if (heap.flags & VK_MEMORY_HEAP_DEVICE_LOCAL_BIT)
+            info.deviceLocalHeapSize = std::max(info.deviceLocalHeapSize, heap.size);
+    }
+
+    info.hasDedicatedTransferQueue = false;
+    info.hasAsyncComputeQueue = false;
+    for (auto family : info.queueFamilies)
+    {
+        if (family.queueCount == 0)
+            continue;
+        if ((family.queueFlags & VK_QUEUE_TRANSFER_BIT) && !(family.queueFlags & (VK_QUEUE_GRAPHICS_BIT | VK_QUEUE_COMPUTE_BIT)))
+            info.hasDedicatedTransferQueue = true;
+        if ((family.queueFlags & VK_QUEUE_COMPUTE_BIT) && !(family.queueFlags & VK_QUEUE_GRAPHICS_BIT))
+            info.hasAsyncComputeQueue = true;
+    }
+
+    return true;
 }
 
 static std::string VersionToString(uint32_t version)
@@ -73,6 +225,33 @@ static std::string VersionToString(uint32_t version)
     return std::string(buf);
 }
 
+static void LogCapabilities(const char *kind, const char *Kind, const Capabilities &capabilities)
+{
+    LOGI("%d %s layers", (int)capabilities.layers.size(), kind);
+    for (auto &layer : capabilities.layers)
+    {
+        LOGI("%s layer: \"%s\", spec version %s, impl version %d, \"%s\"",
+            Kind,
+            layer.properties.layerName,
+            VersionToString(layer.properties.specVersion).c_str(),
+            layer.properties.implementationVersion,
+            layer.properties.description);
+
+        for (auto &extension : layer.extensions)
+        {
+            LOGI("    %s layer extension: \"%s\", spec version %d",
+                Kind, extension.extensionName, extension.specVersion);
+        }
+    }
+
+    LOGI("%d %s extensions", (int)capabilities.extensions.size(), kind);
+    for (auto &extension : capabilities.extensions)
+    {
+        LOGI("%s extension: \"%s\", spec version %d",
+            Kind, extension.extensionName, extension.specVersion);
+    }
+}
+
 static VKAPI_ATTR VkBool32 VKAPI_CALL DebugReportCallbackCallback(
     VkDebugReportFlagsEXT flags,
     VkDebugReportObjectTypeEXT objectType,
@@ -98,11 +277,23 @@ static VKAPI_ATTR VkBool32 VKAPI_CALL DebugReportCallbackCallback(
     else
         severity = "???";
 
-    if (ENABLE_DEBUG_REPORT_VERBOSE)
-        PrintfMessage("[%s][CALLBACK] %s: %s [flags=0x%x objectType=%d object=0x%" PRIx64 " location=%d messageCode=%d pUserData=%p]\n",
-            severity, pLayerPrefix, pMessage, flags, objectType, object, location, messageCode, pUserData);
+    // Map onto the log's severities, so filtered messages never get formatted
+    LogSeverity logSeverity;
+    if (flags & VK_DEBUG_REPORT_ERROR_BIT_EXT)
+        logSeverity = LOG_SEVERITY_ERROR;
+    else if (flags & (VK_DEBUG_REPORT_WARNING_BIT_EXT | VK_DEBUG_REPORT_PERFORMANCE_WARNING_BIT_EXT))
+        logSeverity = LOG_SEVERITY_WARN;
     else
-        PrintfMessage("[%s][CALLBACK] %s: %s\n", severity, pLayerPrefix, pMessage);
+        logSeverity = LOG_SEVERITY_INFO;
+
+    if (IsLogSeverityEnabled(logSeverity))
+    {
+        if (ENABLE_DEBUG_REPORT_VERBOSE)
+            PrintfMessage("[%s][CALLBACK] %s: %s [flags=0x%x objectType=%d object=0x%" PRIx64 " location=%d messageCode=%d pUserData=%p]\n",
+                severity, pLayerPrefix, pMessage, flags, objectType, object, location, messageCode, pUserData);
+        else
+            PrintfMessage("[%s][CALLBACK] %s: %s\n", severity, pLayerPrefix, pMessage);
+    }
 
 #ifdef _WIN32
     if (flags & VK_DEBUG_REPORT_ERROR_BIT_EXT)
@@ -115,7 +306,8 @@ static VKAPI_ATTR VkBool32 VKAPI_CALL DebugReportCallbackCallback(
     return VK_FALSE;
 }
 
-bool DeviceLoader::Setup()
+template <typename A>
+bool DeviceLoaderT<A>::Setup()
 {
     if (m_EnableApiDump)
     {
@@ -153,7 +345,7 @@ bool DeviceLoader::Setup()
 
 #define X(n) \
         auto pfn_##n = (PFN_##n)pfn_vkGetInstanceProcAddr(nullptr, #n); \
-        if (!pfn_vkCreateInstance) { \
+        if (!pfn_##n) { \
             LOGE("Failed to find %s", #n); \
             return false; \
         }
@@ -164,85 +356,38 @@ bool DeviceLoader::Setup()
 
     VkResult result;
 
-    uint32_t instanceLayerCount;
-    result = pfn_vkEnumerateInstanceLayerProperties(&instanceLayerCount, nullptr);
-    if (result != VK_SUCCESS)
+    // The loader's layers and extensions don't change while the process is
+    // running, so they're only probed by the first Setup()
     {
-        LOGE("vkEnumerateInstanceLayerProperties failed (%d)", result);
-        return false;
-    }
-    LOGI("%d instance layers", instanceLayerCount);
+        static std::mutex s_Mutex;
+        static bool s_Probed = false;
+        static Capabilities s_InstanceCapabilities;
 
-    std::vector<VkLayerProperties> instanceLayers(instanceLayerCount);
-    if (instanceLayerCount > 0)
-    {
-        result = pfn_vkEnumerateInstanceLayerProperties(&instanceLayerCount, instanceLayers.data());
-        if (result != VK_SUCCESS)
-        {
-            LOGE("vkEnumerateInstanceLayerProperties failed (%d)", result);
-            return false;
-        }
-    }
-
-    for (auto layer : instanceLayers)
-    {
-        LOGI("Instance layer: \"%s\", spec version %s, impl version %d, \"%s\"",
-            layer.layerName,
-            VersionToString(layer.specVersion).c_str(),
-            layer.implementationVersion,
-            layer.description);
-
-        uint32_t instanceLayerExtensionCount;
-        result = pfn_vkEnumerateInstanceExtensionProperties(layer.layerName, &instanceLayerExtensionCount, nullptr);
-        if (result != VK_SUCCESS)
+        std::lock_guard<std::mutex> lock(s_Mutex);
+        if (!s_Probed)
         {
-            LOGE("vkEnumerateInstanceExtensionProperties failed (%d)", result);
-            return false;
-        }
+            Capabilities capabilities;
+            if (!ProbeLayers(pfn_vkEnumerateInstanceLayerProperties,
+                pfn_vkEnumerateInstanceExtensionProperties, capabilities.layers))
+                return false;
 
-        std::vector<VkExtensionProperties> instanceLayerExtensions(instanceLayerExtensionCount);
-        if (instanceLayerExtensionCount > 0)
-        {
-            result = pfn_vkEnumerateInstanceExtensionProperties(layer.layerName, &instanceLayerExtensionCount, instanceLayerExtensions.data());
+            result = EnumerateAll([&](uint32_t *count, VkExtensionProperties *extensions) {
+                return pfn_vkEnumerateInstanceExtensionProperties(nullptr, count, extensions);
+            }, capabilities.extensions);
             if (result != VK_SUCCESS)
             {
                 LOGE("vkEnumerateInstanceExtensionProperties failed (%d)", result);
                 return false;
             }
-        }
 
-        for (auto extension : instanceLayerExtensions)
-        {
-            LOGI("    Instance layer extension: \"%s\", spec version %d",
-                extension.extensionName, extension.specVersion);
-        }
-    }
-
-    uint32_t instanceExtensionCount;
-    result = pfn_vkEnumerateInstanceExtensionProperties(nullptr, &instanceExtensionCount, nullptr);
-    if (result != VK_SUCCESS)
-    {
-        LOGE("vkEnumerateInstanceExtensionProperties failed (%d)", result);
-        return false;
-    }
-    LOGI("%d instance extensions", instanceExtensionCount);
-
-    std::vector<VkExtensionProperties> instanceExtensions(instanceExtensionCount);
-    if (instanceLayerCount > 0)
-    {
-        result = pfn_vkEnumerateInstanceExtensionProperties(nullptr, &instanceExtensionCount, instanceExtensions.data());
-        if (result != VK_SUCCESS)
-        {
-            LOGE("vkEnumerateInstanceExtensionProperties failed (%d)", result);
-            return false;
+            s_InstanceCapabilities = std::move(capabilities);
+            s_Probed = true;
         }
+        m_InstanceCapabilities = s_InstanceCapabilities;
     }
 
-    for (auto extension : instanceExtensions)
-    {
-        LOGI("Instance extension: \"%s\", spec version %d",
-            extension.extensionName, extension.specVersion);
-    }
+    if (m_LogCapabilities)
+        LogCapabilities("instance", "Instance", m_InstanceCapabilities);
 
     std::vector<std::string> desiredInstanceLayers;
     std::vector<std::string> desiredInstanceExtensions;
@@ -286,33 +431,11 @@ bool DeviceLoader::Setup()
 
     // Map from layer name to set of extension names
     std::map<std::string, std::set<std::string>> instanceAvailableLayers;
-    for (auto layer : instanceLayers)
+    for (auto &layer : m_InstanceCapabilities.layers)
     {
-        std::set<std::string> extensionNames;
-
-        uint32_t instanceLayerExtensionCount;
-        result = pfn_vkEnumerateInstanceExtensionProperties(layer.layerName, &instanceLayerExtensionCount, nullptr);
-        if (result != VK_SUCCESS)
-        {
-            LOGE("vkEnumerateInstanceExtensionProperties failed (%d)", result);
-            return false;
-        }
-
-        std::vector<VkExtensionProperties> instanceLayerExtensions(instanceLayerExtensionCount);
-        if (instanceLayerExtensionCount > 0)
-        {
-            result = pfn_vkEnumerateInstanceExtensionProperties(layer.layerName, &instanceLayerExtensionCount, instanceLayerExtensions.data());
-            if (result != VK_SUCCESS)
-            {
-                LOGE("vkEnumerateInstanceExtensionProperties failed (%d)", result);
-                return false;
-            }
-        }
-
-        for (auto extension : instanceLayerExtensions)
+        std::set<std::string> &extensionNames = instanceAvailableLayers[layer.properties.layerName];
+        for (auto &extension : layer.extensions)
             extensionNames.insert(extension.extensionName);
-
-        instanceAvailableLayers[layer.layerName] = std::move(extensionNames);
     }
 
     std::vector<const char *> instanceEnabledLayerNames;
@@ -321,7 +444,10 @@ bool DeviceLoader::Setup()
     // so be careful not to trigger any reallocation in those Available objects
     // until we've called vkCreateInstance and finished using the char*s
 
+    // The implementation's own extensions, plus any from the enabled layers below
     std::set<std::string> instanceAvailableExtensions;
+    for (auto &extension : m_InstanceCapabilities.extensions)
+        instanceAvailableExtensions.insert(extension.extensionName);
 
     for (auto name : desiredInstanceLayers)
     {
@@ -333,7 +459,7 @@ bool DeviceLoader::Setup()
 
             instanceAvailableExtensions.insert(it->second.begin(), it->second.end());
         }
-        else
+        else if (m_LogCapabilities)
         {
             LOGI("Cannot find desired instance layer %s", name.c_str());
         }
@@ -347,7 +473,7 @@ bool DeviceLoader::Setup()
             LOGI("Enabling instance extension %s", it->c_str());
             instanceEnabledExtensionNames.push_back(it->c_str());
         }
-        else
+        else if (m_LogCapabilities)
         {
             LOGI("Cannot find desired instance extension %s", name.c_str());
         }
@@ -379,7 +505,7 @@ bool DeviceLoader::Setup()
     instanceCreateInfo.pNext = &debugReportCreateInfo;
 
     VkInstance unwrappedInstance;
-    result = pfn_vkCreateInstance(&instanceCreateInfo, CREATE_ALLOCATOR(), &unwrappedInstance);
+    result = pfn_vkCreateInstance(&instanceCreateInfo, A::get(), &unwrappedInstance);
     if (result != VK_SUCCESS)
     {
         LOGE("vkCreateInstance failed (%d)", result);
@@ -412,18 +538,18 @@ bool DeviceLoader::Setup()
         // got the vkDestroyInstance function - in that case we have no safe
         // choice but to leak the instance
         if (pfn.vkDestroyInstance)
-            pfn.vkDestroyInstance(unwrappedInstance, CREATE_ALLOCATOR());
+            pfn.vkDestroyInstance(unwrappedInstance, A::get());
         return false;
     }
 
     // Set up a RAII wrapper so we don't need to worry about calling
     // vkDestroyInstance manually
-    AutoVkInstance instance(pfn, unwrappedInstance);
+    AutoVkInstanceT<A> instance(pfn, unwrappedInstance);
 
-    AutoVkDebugReportCallbackEXT debugReportCallback(pfn, instance);
+    AutoVkDebugReportCallbackEXTT<A> debugReportCallback(pfn, instance);
     if (instanceEnabledExtensions.count("VK_EXT_debug_report"))
     {
-        result = pfn.vkCreateDebugReportCallbackEXT(instance, &debugReportCreateInfo, CREATE_ALLOCATOR(), debugReportCallback.ptr());
+        result = pfn.vkCreateDebugReportCallbackEXT(instance, &debugReportCreateInfo, A::get(), debugReportCallback.ptr());
         if (result != VK_SUCCESS)
         {
             LOGE("vkCreateDebugReportCallbackEXT failed (%d)", result);
@@ -433,157 +559,109 @@ bool DeviceLoader::Setup()
 
     // Now we've got the instance, so we can find the physical devices
 
-    uint32_t physicalDeviceCount;
-    result = pfn.vkEnumeratePhysicalDevices(instance, &physicalDeviceCount, nullptr);
+    std::vector<VkPhysicalDevice> physicalDevices;
+    result = EnumerateAll([&](uint32_t *count, VkPhysicalDevice *devices) {
+        return pfn.vkEnumeratePhysicalDevices(instance, count, devices);
+    }, physicalDevices);
     if (result != VK_SUCCESS)
     {
         LOGE("vkEnumeratePhysicalDevices failed (%d)", result);
         return false;
     }
 
-    if (physicalDeviceCount == 0)
+    if (physicalDevices.empty())
     {
         LOGE("No physical devices found - maybe you don't have any Vulkan drivers installed");
         return false;
     }
 
-    std::vector<VkPhysicalDevice> physicalDevices(physicalDeviceCount);
-    result = pfn.vkEnumeratePhysicalDevices(instance, &physicalDeviceCount, physicalDevices.data());
-    if (result != VK_SUCCESS)
-    {
-        LOGE("vkEnumeratePhysicalDevices failed (%d)", result);
-        return false;
-    }
-
+    // Score every device that can run us, and pick by rank
+    std::vector<std::pair<int64_t, PhysicalDeviceInfo>> scoredPhysicalDevices;
     for (auto physicalDevice : physicalDevices)
     {
-        VkPhysicalDeviceProperties properties;
-        pfn.vkGetPhysicalDeviceProperties(physicalDevice, &properties);
-
-        // Dump some basic information.
-        // (driverVersion doesn't have to be packed in format defined by Vulkan,
-        // but it might be, so we'll decode and print it in that form in case it's helpful.)
-        LOGI("Device: \"%s\", API version %s, driver version %d (%s), vendor 0x%04x, device 0x%04x, type %d",
-            properties.deviceName, VersionToString(properties.apiVersion).c_str(),
-            properties.driverVersion, VersionToString(properties.driverVersion).c_str(),
-            properties.vendorID, properties.deviceID,
-            properties.deviceType);
-    }
-
-    // Use the hopelessly inadequate approach of choosing the first from the list
-    VkPhysicalDevice preferredPhysicalDevice = physicalDevices[0];
-
-
-
-    uint32_t deviceLayerCount;
-    result = pfn.vkEnumerateDeviceLayerProperties(preferredPhysicalDevice, &deviceLayerCount, nullptr);
-    if (result != VK_SUCCESS)
-    {
-        LOGE("vkEnumerateDeviceLayerProperties failed (%d)", result);
-        return false;
-    }
-    LOGI("%d device layers", deviceLayerCount);
+        PhysicalDeviceInfo info;
+        if (!GetPhysicalDeviceInfo(pfn, physicalDevice, info))
+            return false;
 
-    std::vector<VkLayerProperties> deviceLayers(deviceLayerCount);
-    if (deviceLayerCount > 0)
-    {
-        result = pfn.vkEnumerateDeviceLayerProperties(preferredPhysicalDevice, &deviceLayerCount, deviceLayers.data());
-        if (result != VK_SUCCESS)
+        if (m_LogCapabilities)
         {
-            LOGE("vkEnumerateDeviceLayerProperties failed (%d)", result);
-            return false;
+            // (driverVersion doesn't have to be packed in format defined by Vulkan,
+            // but it might be, so we'll decode and print it in that form in case it's helpful.)
+            const VkPhysicalDeviceProperties &properties = info.properties;
+            LOGI("Device: \"%s\", API version %s, driver version %d (%s), vendor 0x%04x, device 0x%04x, type %d",
+                properties.deviceName, VersionToString(properties.apiVersion).c_str(),
+                properties.driverVersion, VersionToString(properties.driverVersion).c_str(),
+                properties.vendorID, properties.deviceID,
+                properties.deviceType);
         }
-    }
 
-    for (auto layer : deviceLayers)
-    {
-        LOGI("Device layer: \"%s\", spec version %s, impl version %d, \"%s\"",
-            layer.layerName,
-            VersionToString(layer.specVersion).c_str(),
-            layer.implementationVersion,
-            layer.description);
-
-        uint32_t deviceLayerExtensionCount;
-        result = pfn.vkEnumerateDeviceExtensionProperties(preferredPhysicalDevice, layer.layerName, &deviceLayerExtensionCount, nullptr);
-        if (result != VK_SUCCESS)
+        bool suitable = false;
+        for (auto family : info.queueFamilies)
         {
-            LOGE("vkEnumerateDeviceExtensionProperties failed (%d)", result);
-            return false;
+            if ((family.queueFlags & VK_QUEUE_GRAPHICS_BIT) && family.queueCount > 0)
+                suitable = true;
         }
 
-        std::vector<VkExtensionProperties> deviceLayerExtensions(deviceLayerExtensionCount);
-        if (deviceLayerExtensionCount > 0)
+        for (auto name : m_RequiredDeviceExtensions)
         {
-            result = pfn.vkEnumerateDeviceExtensionProperties(preferredPhysicalDevice, layer.layerName, &deviceLayerExtensionCount, deviceLayerExtensions.data());
-            if (result != VK_SUCCESS)
+            if (!HasExtension(info.extensions, name))
             {
-                LOGE("vkEnumerateDeviceExtensionProperties failed (%d)", result);
-                return false;
+                LOGI("Device \"%s\" lacks required extension %s", info.properties.deviceName, name.c_str());
+                suitable = false;
             }
         }
 
-        for (auto extension : deviceLayerExtensions)
-        {
-            LOGI("    Device layer extension: \"%s\", spec version %d",
-                extension.extensionName, extension.specVersion);
-        }
+        int64_t score = (suitable ? m_ScoreFunction(info) : -1);
+        if (m_LogCapabilities)
+            LOGI("Device \"%s\": score %" PRId64, info.properties.deviceName, score);
+        if (score >= 0)
+            scoredPhysicalDevices.emplace_back(score, std::move(info));
     }
 
-    uint32_t deviceExtensionCount;
-    result = pfn.vkEnumerateDeviceExtensionProperties(preferredPhysicalDevice, nullptr, &deviceExtensionCount, nullptr);
-    if (result != VK_SUCCESS)
+    // Stable, so equally scored devices stay in the driver's order
+    std::stable_sort(scoredPhysicalDevices.begin(), scoredPhysicalDevices.end(),
+        [](const std::pair<int64_t, PhysicalDeviceInfo> &a, const std::pair<int64_t, PhysicalDeviceInfo> &b) {
+            return a.first > b.first;
+        });
+
+    m_SuitablePhysicalDevices.clear();
+    for (auto &scored : scoredPhysicalDevices)
+        m_SuitablePhysicalDevices.push_back(std::move(scored.second));
+
+    if (m_PhysicalDeviceRank >= m_SuitablePhysicalDevices.size())
     {
-        LOGE("vkEnumerateDeviceExtensionProperties failed (%d)", result);
+        LOGE("Wanted suitable physical device %u, but only found %u",
+            m_PhysicalDeviceRank, (uint32_t)m_SuitablePhysicalDevices.size());
         return false;
     }
-    LOGI("%d device extensions", deviceExtensionCount);
 
-    std::vector<VkExtensionProperties> deviceExtensions(deviceExtensionCount);
-    if (deviceLayerCount > 0)
-    {
-        result = pfn.vkEnumerateDeviceExtensionProperties(preferredPhysicalDevice, nullptr, &deviceExtensionCount, deviceExtensions.data());
-        if (result != VK_SUCCESS)
-        {
-            LOGE("vkEnumerateDeviceExtensionProperties failed (%d)", result);
-            return false;
-        }
-    }
+    const PhysicalDeviceInfo &preferredPhysicalDeviceInfo = m_SuitablePhysicalDevices[m_PhysicalDeviceRank];
+    VkPhysicalDevice preferredPhysicalDevice = preferredPhysicalDeviceInfo.physicalDevice;
+    LOGI("Using device \"%s\"", preferredPhysicalDeviceInfo.properties.deviceName);
+
+    // The device's own extensions were found while scoring it, so only its
+    // layers are left to probe
+    m_DeviceCapabilities.extensions = preferredPhysicalDeviceInfo.extensions;
+    if (!ProbeLayers(
+        [&](uint32_t *count, VkLayerProperties *layers) {
+            return pfn.vkEnumerateDeviceLayerProperties(preferredPhysicalDevice, count, layers);
+        },
+        [&](const char *layerName, uint32_t *count, VkExtensionProperties *extensions) {
+            return pfn.vkEnumerateDeviceExtensionProperties(preferredPhysicalDevice, layerName, count, extensions);
+        },
+        m_DeviceCapabilities.layers))
+        return false;
 
-    for (auto extension : deviceExtensions)
-    {
-        LOGI("Device extension: \"%s\", spec version %d",
-            extension.extensionName, extension.specVersion);
-    }
+    if (m_LogCapabilities)
+        LogCapabilities("device", "Device", m_DeviceCapabilities);
 
     // Map from layer name to set of extension names
     std::map<std::string, std::set<std::string>> deviceAvailableLayers;
-    for (auto layer : deviceLayers)
+    for (auto &layer : m_DeviceCapabilities.layers)
     {
-        std::set<std::string> extensionNames;
-
-        uint32_t deviceLayerExtensionCount;
-        result = pfn.vkEnumerateDeviceExtensionProperties(preferredPhysicalDevice, layer.layerName, &deviceLayerExtensionCount, nullptr);
-        if (result != VK_SUCCESS)
-        {
-            LOGE("vkEnumerateDeviceExtensionProperties failed (%d)", result);
-            return false;
-        }
-
-        std::vector<VkExtensionProperties> deviceLayerExtensions(deviceLayerExtensionCount);
-        if (deviceLayerExtensionCount > 0)
-        {
-            result = pfn.vkEnumerateDeviceExtensionProperties(preferredPhysicalDevice, layer.layerName, &deviceLayerExtensionCount, deviceLayerExtensions.data());
-            if (result != VK_SUCCESS)
-            {
-                LOGE("vkEnumerateDeviceExtensionProperties failed (%d)", result);
-                return false;
-            }
-        }
-
-        for (auto extension : deviceLayerExtensions)
+        std::set<std::string> &extensionNames = deviceAvailableLayers[layer.properties.layerName];
+        for (auto &extension : layer.extensions)
             extensionNames.insert(extension.extensionName);
-
-        deviceAvailableLayers[layer.layerName] = std::move(extensionNames);
     }
 
     std::vector<const char *> deviceEnabledLayerNames;
@@ -592,7 +670,10 @@ bool DeviceLoader::Setup()
     // so be careful not to trigger any reallocation in those Available objects
     // until we've called vkCreateDevice and finished using the char*s
 
+    // The device's own extensions, plus any from the enabled layers below
     std::set<std::string> deviceAvailableExtensions;
+    for (auto &extension : m_DeviceCapabilities.extensions)
+        deviceAvailableExtensions.insert(extension.extensionName);
 
     for (auto name : desiredDeviceLayers)
     {
@@ -604,12 +685,15 @@ bool DeviceLoader::Setup()
 
             deviceAvailableExtensions.insert(it->second.begin(), it->second.end());
         }
-        else
+        else if (m_LogCapabilities)
         {
             LOGI("Cannot find desired device layer %s", name.c_str());
         }
     }
 
+    desiredDeviceExtensions.insert(desiredDeviceExtensions.end(),
+        m_RequiredDeviceExtensions.begin(), m_RequiredDeviceExtensions.end());
+
     for (auto name : desiredDeviceExtensions)
     {
         auto it = deviceAvailableExtensions.find(name);
@@ -618,7 +702,7 @@ bool DeviceLoader::Setup()
             LOGI("Enabling device extension %s", it->c_str());
             deviceEnabledExtensionNames.push_back(it->c_str());
         }
-        else
+        else if (m_LogCapabilities)
         {
             LOGI("Cannot find desired device extension %s", name.c_str());
         }
@@ -626,63 +710,129 @@ bool DeviceLoader::Setup()
 
 
 
-    VkPhysicalDeviceProperties preferredPhysicalDeviceProperties;
-    pfn.vkGetPhysicalDeviceProperties(preferredPhysicalDevice, &preferredPhysicalDeviceProperties);
-
-    uint32_t queueFamilyPropertyCount;
-    pfn.vkGetPhysicalDeviceQueueFamilyProperties(preferredPhysicalDevice, &queueFamilyPropertyCount, nullptr);
-    std::vector<VkQueueFamilyProperties> queueFamilyProperties(queueFamilyPropertyCount);
-    pfn.vkGetPhysicalDeviceQueueFamilyProperties(preferredPhysicalDevice, &queueFamilyPropertyCount, queueFamilyProperties.data());
+    const VkPhysicalDeviceProperties &preferredPhysicalDeviceProperties = preferredPhysicalDeviceInfo.properties;
+    const std::vector<VkQueueFamilyProperties> &queueFamilyProperties = preferredPhysicalDeviceInfo.queueFamilies;
 
-    for (auto family : queueFamilyProperties)
+    if (m_LogCapabilities)
     {
-        LOGI("Queue family: flags 0x%08x, count %u, timestampValidBits %u, minImageTransferGranularity (%u,%u,%u)",
-            family.queueFlags, family.queueCount, family.timestampValidBits,
-            family.minImageTransferGranularity.width,
-            family.minImageTransferGranularity.height,
-            family.minImageTransferGranularity.depth);
+        for (auto family : queueFamilyProperties)
+        {
+            LOGI("Queue family: flags 0x%08x, count %u, timestampValidBits %u, minImageTransferGranularity (%u,%u,%u)",
+                family.queueFlags, family.queueCount, family.timestampValidBits,
+                family.minImageTransferGranularity.width,
+                family.minImageTransferGranularity.height,
+                family.minImageTransferGranularity.depth);
+        }
     }
 
-    int graphicsQueueFamilyIdx = -1;
-    int transferQueueFamilyIdx = -1;
-    for (size_t i = 0; i < queueFamilyProperties.size(); ++i)
-    {
-        if (graphicsQueueFamilyIdx == -1 && (queueFamilyProperties[i].queueFlags & VK_QUEUE_GRAPHICS_BIT))
-            graphicsQueueFamilyIdx = (int)i;
-
-        if (transferQueueFamilyIdx == -1 && (queueFamilyProperties[i].queueFlags & VK_QUEUE_TRANSFER_BIT))
-            transferQueueFamilyIdx = (int)i;
-    }
+    // Transfers prefer a family with no graphics or compute support (usually
+    // a dedicated DMA engine), then a compute-only one, so copies can run in
+    // parallel with graphics work. Compute prefers a family without graphics,
+    // for async compute. Any graphics or compute family can do transfers, so
+    // the graphics family is the fallback for both
+    auto findQueueFamily = [&](VkQueueFlags required, VkQueueFlags excluded) {
+        for (size_t i = 0; i < queueFamilyProperties.size(); ++i)
+        {
+            VkQueueFlags flags = queueFamilyProperties[i].queueFlags;
+            if ((flags & required) == required && !(flags & excluded) && queueFamilyProperties[i].queueCount > 0)
+                return (int)i;
+        }
+        return -1;
+    };
 
+    int graphicsQueueFamilyIdx = findQueueFamily(VK_QUEUE_GRAPHICS_BIT, 0);
     ASSERT(graphicsQueueFamilyIdx != -1);
-    ASSERT(transferQueueFamilyIdx != -1);
 
-    VkPhysicalDeviceFeatures enabledFeatures = {};
+    int transferQueueFamilyIdx = findQueueFamily(VK_QUEUE_TRANSFER_BIT, VK_QUEUE_GRAPHICS_BIT | VK_QUEUE_COMPUTE_BIT);
+    if (transferQueueFamilyIdx == -1)
+        transferQueueFamilyIdx = findQueueFamily(VK_QUEUE_COMPUTE_BIT, VK_QUEUE_GRAPHICS_BIT);
+    if (transferQueueFamilyIdx == -1)
+        transferQueueFamilyIdx = graphicsQueueFamilyIdx;
+
+    int computeQueueFamilyIdx = findQueueFamily(VK_QUEUE_COMPUTE_BIT, VK_QUEUE_GRAPHICS_BIT);
+    if (computeQueueFamilyIdx == -1)
+        computeQueueFamilyIdx = graphicsQueueFamilyIdx;
+
+    // Give each role its own queue where the family has enough, else share
+    // the family's last one
+    std::vector<uint32_t> queueCounts(queueFamilyProperties.size(), 0);
+    auto assignQueue = [&](int family) {
+        uint32_t index = std::min(queueCounts[family], queueFamilyProperties[family].queueCount - 1);
+        queueCounts[family] = std::max(queueCounts[family], index + 1);
+        return index;
+    };
+    uint32_t graphicsQueueIdx = assignQueue(graphicsQueueFamilyIdx);
+    uint32_t transferQueueIdx = assignQueue(transferQueueFamilyIdx);
+    uint32_t computeQueueIdx = assignQueue(computeQueueFamilyIdx);
+
+    LOGI("Queues: graphics %d.%u, transfer %d.%u, compute %d.%u",
+        graphicsQueueFamilyIdx, graphicsQueueIdx,
+        transferQueueFamilyIdx, transferQueueIdx,
+        computeQueueFamilyIdx, computeQueueIdx);
 
-    std::vector<VkDeviceQueueCreateInfo> deviceQueueCreateInfos;
+    VkPhysicalDeviceFeatures enabledFeatures = {};
 
-    bool separateQueuesOnSharedFamily = false;
-    if (transferQueueFamilyIdx == graphicsQueueFamilyIdx
-        && queueFamilyProperties[graphicsQueueFamilyIdx].queueCount > 1)
-        separateQueuesOnSharedFamily = true;
+    // Sparse binds go on whichever of our queues can do them, preferring
+    // the transfer queue so they don't hold up graphics work
+    int sparseQueueFamilyIdx = -1;
+    uint32_t sparseQueueIdx = 0;
+    if (m_EnableSparseResidency)
+    {
+        VkPhysicalDeviceFeatures supportedFeatures;
+        pfn.vkGetPhysicalDeviceFeatures(preferredPhysicalDevice, &supportedFeatures);
+
+        const std::pair<int, uint32_t> candidates[] = {
+            { transferQueueFamilyIdx, transferQueueIdx },
+            { computeQueueFamilyIdx, computeQueueIdx },
+            { graphicsQueueFamilyIdx, graphicsQueueIdx },
+        };
+        for (auto &candidate : candidates)
+        {
+            if (queueFamilyProperties[candidate.first].queueFlags & VK_QUEUE_SPARSE_BINDING_BIT)
+            {
+                sparseQueueFamilyIdx = candidate.first;
+                sparseQueueIdx = candidate.second;
+                break;
+            }
+        }
 
-    float defaultPriorities[] = { 1.0f, 1.0f };
+        if (supportedFeatures.sparseBinding && supportedFeatures.sparseResidencyImage2D && sparseQueueFamilyIdx != -1)
+        {
+            enabledFeatures.sparseBinding = VK_TRUE;
+            enabledFeatures.sparseResidencyImage2D = VK_TRUE;
+            LOGI("Sparse residency enabled, binding on queue %d.%u", sparseQueueFamilyIdx, sparseQueueIdx);
+        }
+        else
+        {
+            LOGW("Sparse residency is not supported by this device");
+            sparseQueueFamilyIdx = -1;
+        }
+    }
 
+    if (m_EnablePipelineStatistics)
     {
-        VkDeviceQueueCreateInfo deviceQueueCreateInfo = {};
-        deviceQueueCreateInfo.sType = VK_STRUCTURE_TYPE_DEVICE_QUEUE_CREATE_INFO;
-        deviceQueueCreateInfo.queueFamilyIndex = graphicsQueueFamilyIdx;
-        deviceQueueCreateInfo.queueCount = separateQueuesOnSharedFamily ? 2 : 1;
-        deviceQueueCreateInfo.pQueuePriorities = defaultPriorities;
-        deviceQueueCreateInfos.push_back(deviceQueueCreateInfo);
+        VkPhysicalDeviceFeatures supportedFeatures;
+        pfn.vkGetPhysicalDeviceFeatures(preferredPhysicalDevice, &supportedFeatures);
+
+        if (supportedFeatures.pipelineStatisticsQuery)
+            enabledFeatures.pipelineStatisticsQuery = VK_TRUE;
+        else
+            LOGW("Pipeline statistics queries are not supported by this device");
     }
 
-    if (transferQueueFamilyIdx != graphicsQueueFamilyIdx)
+    std::vector<VkDeviceQueueCreateInfo> deviceQueueCreateInfos;
+
+    float defaultPriorities[] = { 1.0f, 1.0f, 1.0f };
+
+    for (size_t i = 0; i < queueCounts.size(); ++i)
     {
+        if (queueCounts[i] == 0)
+            continue;
+
         VkDeviceQueueCreateInfo deviceQueueCreateInfo = {};
         deviceQueueCreateInfo.sType = VK_STRUCTURE_TYPE_DEVICE_QUEUE_CREATE_INFO;
-        deviceQueueCreateInfo.queueFamilyIndex = transferQueueFamilyIdx;
-        deviceQueueCreateInfo.queueCount = 1;
+        deviceQueueCreateInfo.queueFamilyIndex = (uint32_t)i;
+        deviceQueueCreateInfo.queueCount = queueCounts[i];
         deviceQueueCreateInfo.pQueuePriorities = defaultPriorities;
         deviceQueueCreateInfos.push_back(deviceQueueCreateInfo);
     }
@@ -698,22 +848,68 @@ bool DeviceLoader::Setup()
     deviceCreateInfo.pEnabledFeatures = &enabledFeatures;
 
     VkDevice device;
-    result = pfn.vkCreateDevice(preferredPhysicalDevice, &deviceCreateInfo, CREATE_ALLOCATOR(), &device);
+    result = pfn.vkCreateDevice(preferredPhysicalDevice, &deviceCreateInfo, A::get(), &device);
     if (result != VK_SUCCESS)
     {
         LOGE("vkCreateDevice failed (%d)", result);
         return false;
     }
 
+    // Load the per-device functions. These bypass the loader's dispatch
+    // trampolines, so they're what we want to use for anything that's
+    // called frequently (particularly vkCmd*)
+    DeviceFunctions &dpfn = m_DeviceFunctions;
+    memset(&dpfn, 0, sizeof(dpfn));
+
+#define X(n) \
+        dpfn.n = (PFN_##n)pfn.vkGetDeviceProcAddr(device, #n); \
+        if (!dpfn.n) { \
+            LOGE("Failed to get device symbol %s", #n); \
+            ok = false; \
+        }
+
+    DEVICE_FUNCTIONS
+    DEVICE_FUNCTIONS_GRAPHICS
+    if (enabledFeatures.sparseBinding)
+    {
+        DEVICE_FUNCTIONS_SPARSE
+    }
+#undef X
+
+    if (!ok)
+    {
+        // As with the instance, we can only clean up if we got vkDestroyDevice
+        if (dpfn.vkDestroyDevice)
+            dpfn.vkDestroyDevice(device, A::get());
+        return false;
+    }
+
+    m_QueueFamilyProperties = queueFamilyProperties;
     m_GraphicsQueueFamily = graphicsQueueFamilyIdx;
     m_TransferQueueFamily = transferQueueFamilyIdx;
-    pfn.vkGetDeviceQueue(device, m_GraphicsQueueFamily, 0, &m_GraphicsQueue);
-    pfn.vkGetDeviceQueue(device, m_TransferQueueFamily, separateQueuesOnSharedFamily ? 1 : 0, &m_TransferQueue);
+    m_ComputeQueueFamily = computeQueueFamilyIdx;
+    dpfn.vkGetDeviceQueue(device, m_GraphicsQueueFamily, graphicsQueueIdx, &m_GraphicsQueue);
+    dpfn.vkGetDeviceQueue(device, m_TransferQueueFamily, transferQueueIdx, &m_TransferQueue);
+    dpfn.vkGetDeviceQueue(device, m_ComputeQueueFamily, computeQueueIdx, &m_ComputeQueue);
+    if (sparseQueueFamilyIdx != -1)
+    {
+        m_SparseQueueFamily = sparseQueueFamilyIdx;
+        dpfn.vkGetDeviceQueue(device, m_SparseQueueFamily, sparseQueueIdx, &m_SparseQueue);
+    }
+    m_EnabledFeatures = enabledFeatures;
 
     m_Instance = std::move(instance);
     m_DebugReportCallback = std::move(debugReportCallback);
-    m_Device = AutoVkDevice(pfn, device);
+    m_Device = AutoVkDeviceT<A>(dpfn, device);
     m_PhysicalDevice = preferredPhysicalDevice;
 
+    m_PipelineCache.reset(new PipelineCache(dpfn, device, preferredPhysicalDeviceProperties));
+    if (!m_PipelineCache->Setup(m_PipelineCachePath))
+        return false;
+
     return true;
 }
+
+template class DeviceLoaderT<NullAllocatorPolicy>;
+template class DeviceLoaderT<DebugAllocatorPolicy>;
+template class DeviceLoaderT<PoolAllocatorPolicy>;
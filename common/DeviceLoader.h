@@ -23,52 +23,212 @@
 #ifndef INCLUDED_VKSXS_DEVICE_LOADER
 #define INCLUDED_VKSXS_DEVICE_LOADER
 
-#define ENABLE_DEBUG_ALLOCATOR 1
+#ifndef ENABLE_DEBUG_REPORT_VERBOSE
 #define ENABLE_DEBUG_REPORT_VERBOSE 0
+#endif
 
 #include "common/Common.h"
 
 #include "common/AutoWrappers.h"
+#include "common/DeviceFunctions.h"
 #include "common/InstanceFunctions.h"
+#include "common/PipelineCache.h"
 
-class DeviceLoader
+#include <functional>
+#include <memory>
+#include <set>
+#include <string>
+#include <vector>
+
+bool HasExtension(const std::vector<VkExtensionProperties> &extensions, const std::string &name);
+
+struct LayerCapabilities
+{
+    VkLayerProperties properties;
+    std::vector<VkExtensionProperties> extensions;
+};
+
+/*
+ * The layers and extensions available for the instance or a device, probed
+ * once during DeviceLoader::Setup()
+ */
+struct Capabilities
+{
+    std::vector<LayerCapabilities> layers;
+    std::vector<VkExtensionProperties> extensions; // not including ones from layers
+};
+
+/*
+ * What DeviceLoader knows about a physical device when choosing which one to
+ * use.
+ */
+struct PhysicalDeviceInfo
+{
+    VkPhysicalDevice physicalDevice;
+    VkPhysicalDeviceProperties properties;
+    VkPhysicalDeviceMemoryProperties memoryProperties;
+    std::vector<VkQueueFamilyProperties> queueFamilies;
+    std::vector<VkExtensionProperties> extensions; // not including ones from layers
+
+    VkDeviceSize deviceLocalHeapSize; // largest DEVICE_LOCAL heap
+    bool hasDedicatedTransferQueue;   // a family with transfer but not graphics/compute
+    bool hasAsyncComputeQueue;        // a family with compute but not graphics
+};
+
+/*
+ * Returns a score for a physical device (higher is better), or a negative
+ * number if it can't be used. Devices without a graphics queue or without
+ * all of the required extensions are rejected before this is called.
+ */
+typedef std::function<int64_t (const PhysicalDeviceInfo &)> PhysicalDeviceScoreFunction;
+
+/*
+ * Ranks by device type (discrete > integrated > virtual > CPU), then by
+ * having a dedicated transfer family and an async compute family, then by
+ * the size of the largest DEVICE_LOCAL heap.
+ */
+int64_t DefaultPhysicalDeviceScore(const PhysicalDeviceInfo &info);
+
+/*
+ * A is the allocator policy (see AllocationCallbacks.h) used for the instance,
+ * device and debug report callback. The implementation is explicitly
+ * instantiated for each of the policies.
+ */
+template <typename A = DefaultAllocatorPolicy>
+class DeviceLoaderT
 {
 public:
-    DeviceLoader();
+    typedef A AllocatorPolicy;
 
-    ~DeviceLoader();
+    DeviceLoaderT();
+
+    ~DeviceLoaderT();
 
     void SetEnableApiDump(bool enable) { m_EnableApiDump = enable; }
     void SetDebugReportFlags(VkDebugReportFlagsEXT flags) { m_DebugReportFlags = flags; }
 
+    // Log every layer, extension, device and queue family found by Setup()
+    void SetLogCapabilities(bool enable) { m_LogCapabilities = enable; }
+
+    // Replace DefaultPhysicalDeviceScore
+    void SetPhysicalDeviceScoreFunction(const PhysicalDeviceScoreFunction &fn) { m_ScoreFunction = fn; }
+
+    // Devices without this extension are unsuitable; it's enabled on the one chosen
+    void AddRequiredDeviceExtension(const std::string &name) { m_RequiredDeviceExtensions.push_back(name); }
+
+    /*
+     * Use the rank'th best suitable device (0 is the best). To use several
+     * GPUs, set up one loader with rank 0, then one more per remaining
+     * entry in GetSuitablePhysicalDevices().
+     */
+    void SetPhysicalDeviceRank(uint32_t rank) { m_PhysicalDeviceRank = rank; }
+
+    /*
+     * Seed the pipeline cache from this file in Setup(), and write it back
+     * when the loader is destroyed. (Otherwise the cache starts empty and
+     * isn't saved.)
+     */
+    void SetPipelineCachePath(const std::string &path) { m_PipelineCachePath = path; }
+
+    /*
+     * Enable the sparseBinding and sparseResidencyImage2D features (for
+     * SparseImage) if the device supports them and one of its queues can do
+     * sparse binding. Setup() still succeeds if it can't; check
+     * GetSparseQueue().
+     */
+    void SetEnableSparseResidency(bool enable) { m_EnableSparseResidency = enable; }
+
+    /*
+     * Enable the pipelineStatisticsQuery feature (for QueryManager) if the
+     * device supports it. Check GetEnabledFeatures() after Setup().
+     */
+    void SetEnablePipelineStatistics(bool enable) { m_EnablePipelineStatistics = enable; }
+
     bool Setup();
 
     const InstanceFunctions &GetInstanceFunctions() const { return m_InstanceFunctions; }
+    const DeviceFunctions &GetDeviceFunctions() const { return m_DeviceFunctions; }
+
+    const Capabilities &GetInstanceCapabilities() const { return m_InstanceCapabilities; }
+    const Capabilities &GetDeviceCapabilities() const { return m_DeviceCapabilities; }
 
     VkPhysicalDevice GetPhysicalDevice() { return m_PhysicalDevice; }
+
+    // Every suitable device, best first (valid after Setup, even if it failed
+    // because the rank was too high)
+    const std::vector<PhysicalDeviceInfo> &GetSuitablePhysicalDevices() const { return m_SuitablePhysicalDevices; }
     VkDevice GetDevice() { return m_Device; }
 
+    PipelineCache &GetPipelineCache() { return *m_PipelineCache; }
+
+    /*
+     * The transfer and compute queues are on dedicated families where the
+     * device has them, else they may be (or share) the graphics queue.
+     * Resources with VK_SHARING_MODE_EXCLUSIVE need ownership transfers
+     * between different families.
+     */
     uint32_t GetGraphicsQueueFamily() { return m_GraphicsQueueFamily; }
     uint32_t GetTransferQueueFamily() { return m_TransferQueueFamily; }
+    uint32_t GetComputeQueueFamily() { return m_ComputeQueueFamily; }
     VkQueue GetGraphicsQueue() { return m_GraphicsQueue; }
     VkQueue GetTransferQueue() { return m_TransferQueue; }
+    VkQueue GetComputeQueue() { return m_ComputeQueue; }
+
+    /*
+     * A queue for vkQueueBindSparse: the transfer queue if its family
+     * supports sparse binding, else the compute or graphics queue. It's
+     * VK_NULL_HANDLE unless sparse residency was enabled.
+     */
+    uint32_t GetSparseQueueFamily() { return m_SparseQueueFamily; }
+    VkQueue GetSparseQueue() { return m_SparseQueue; }
+
+    const VkPhysicalDeviceFeatures &GetEnabledFeatures() const { return m_EnabledFeatures; }
+
+    const VkQueueFamilyProperties &GetQueueFamilyProperties(uint32_t queueFamily) const
+    {
+        return m_QueueFamilyProperties[queueFamily];
+    }
 
 private:
     bool m_EnableApiDump;
+    bool m_LogCapabilities;
     VkDebugReportFlagsEXT m_DebugReportFlags;
+    PhysicalDeviceScoreFunction m_ScoreFunction;
+    std::vector<std::string> m_RequiredDeviceExtensions;
+    uint32_t m_PhysicalDeviceRank;
+    bool m_EnableSparseResidency;
+    bool m_EnablePipelineStatistics;
+
+    std::vector<PhysicalDeviceInfo> m_SuitablePhysicalDevices;
 
-    AutoVkInstance m_Instance;
-    AutoVkDebugReportCallbackEXT m_DebugReportCallback;
-    AutoVkDevice m_Device;
+    AutoVkInstanceT<A> m_Instance;
+    AutoVkDebugReportCallbackEXTT<A> m_DebugReportCallback;
+    AutoVkDeviceT<A> m_Device;
+    std::unique_ptr<PipelineCache> m_PipelineCache; // must be destroyed before m_Device
+    std::string m_PipelineCachePath;
 
     VkPhysicalDevice m_PhysicalDevice;
 
     uint32_t m_GraphicsQueueFamily;
     uint32_t m_TransferQueueFamily;
+    uint32_t m_ComputeQueueFamily;
     VkQueue m_GraphicsQueue;
     VkQueue m_TransferQueue;
+    VkQueue m_ComputeQueue;
+    uint32_t m_SparseQueueFamily;
+    VkQueue m_SparseQueue;
+
+    VkPhysicalDeviceFeatures m_EnabledFeatures;
+
+    std::vector<VkQueueFamilyProperties> m_QueueFamilyProperties;
 
     InstanceFunctions m_InstanceFunctions;
+    DeviceFunctions m_DeviceFunctions;
+
+    Capabilities m_InstanceCapabilities;
+    Capabilities m_DeviceCapabilities;
 };
 
+typedef DeviceLoaderT<> DeviceLoader;
+
 #endif // INCLUDED_VKSXS_DEVICE_LOADER
@@ -0,0 +1,257 @@
+/*
+ * Copyright (c) 2016 Philip Taylor
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include "common/Common.h"
+
+#include "common/AllocationCallbacks.h"
+#include "common/FrameManager.h"
+#include "common/Log.h"
+
+const uint32_t FrameManager::DEFAULT_FRAMES_IN_FLIGHT;
+
+Frame::Frame(const DeviceFunctions &pfn, VkDevice device, uint32_t slot, DeletionQueue &deletionQueue)
+    : m_pfn(pfn), m_Device(device), m_Slot(slot), m_Number(0), m_Submitted(false),
+    m_Fence(pfn, device), m_DescriptorPool(nullptr), m_DeletionQueue(&deletionQueue)
+{
+}
+
+bool Frame::Setup(uint32_t semaphoreCount, uint32_t eventCount)
+{
+    VkResult result;
+
+    VkFenceCreateInfo fenceCreateInfo = {};
+    fenceCreateInfo.sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO;
+    result = m_pfn.vkCreateFence(m_Device, &fenceCreateInfo, CREATE_ALLOCATOR(), m_Fence.ptr());
+    if (result != VK_SUCCESS)
+    {
+        LOGE("vkCreateFence failed (%d)", result);
+        return false;
+    }
+
+    for (uint32_t i = 0; i < semaphoreCount; ++i)
+    {
+        AutoVkSemaphore semaphore(m_pfn, m_Device);
+        VkSemaphoreCreateInfo semaphoreCreateInfo = {};
+        semaphoreCreateInfo.sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO;
+        result = m_pfn.vkCreateSemaphore(m_Device, &semaphoreCreateInfo, CREATE_ALLOCATOR(), semaphore.ptr());
+        if (result != VK_SUCCESS)
+        {
+            LOGE("vkCreateSemaphore failed (%d)", result);
+            return false;
+        }
+        m_Semaphores.push_back(std::move(semaphore));
+    }
+
+    for (uint32_t i = 0; i < eventCount; ++i)
+    {
+        AutoVkEvent event(m_pfn, m_Device);
+        VkEventCreateInfo eventCreateInfo = {};
+        eventCreateInfo.sType = VK_STRUCTURE_TYPE_EVENT_CREATE_INFO;
+        result = m_pfn.vkCreateEvent(m_Device, &eventCreateInfo, CREATE_ALLOCATOR(), event.ptr());
+        if (result != VK_SUCCESS)
+        {
+            LOGE("vkCreateEvent failed (%d)", result);
+            return false;
+        }
+        m_Events.push_back(std::move(event));
+    }
+
+    return true;
+}
+
+bool Frame::ResetEvents()
+{
+    for (auto &event : m_Events)
+    {
+        VkResult result = m_pfn.vkResetEvent(m_Device, event);
+        if (result != VK_SUCCESS)
+        {
+            LOGE("vkResetEvent failed (%d)", result);
+            return false;
+        }
+    }
+    return true;
+}
+
+bool Frame::SubmitLast(VkQueue queue, uint32_t submitCount, const VkSubmitInfo *pSubmits)
+{
+    ASSERT(!m_Submitted);
+
+    VkResult result = m_pfn.vkQueueSubmit(queue, submitCount, pSubmits, m_Fence);
+    if (result != VK_SUCCESS)
+    {
+        LOGE("vkQueueSubmit failed (%d)", result);
+        return false;
+    }
+
+    m_Submitted = true;
+    return true;
+}
+
+bool Frame::SubmitLast(SubmitScheduler &scheduler, uint32_t submitCount, const VkSubmitInfo *pSubmits)
+{
+    ASSERT(!m_Submitted);
+
+    if (!scheduler.Post(submitCount, pSubmits) || !scheduler.Flush(m_Fence))
+        return false;
+
+    m_Submitted = true;
+    return true;
+}
+
+bool Frame::AllocateCommandBuffer(uint32_t queueFamily, VkCommandBuffer &commandBuffer,
+    VkCommandBufferLevel level)
+{
+    for (CommandBufferPool *commandBufferPool : m_CommandBufferPools)
+    {
+        if (commandBufferPool->GetQueueFamily() == queueFamily)
+            return commandBufferPool->Allocate(m_Slot, level, commandBuffer);
+    }
+
+    LOGE("No command buffer pool for queue family %u in this frame", queueFamily);
+    return false;
+}
+
+bool Frame::AllocateDescriptorSet(VkDescriptorSetLayout layout, VkDescriptorSet &descriptorSet)
+{
+    if (!m_DescriptorPool)
+    {
+        LOGE("No descriptor pool in this frame (FrameManager::SetupDescriptorPool wasn't called)");
+        return false;
+    }
+
+    return m_DescriptorPool->Allocate(m_Slot, layout, descriptorSet);
+}
+
+bool Frame::Wait()
+{
+    if (!m_Submitted)
+        return true;
+
+    VkResult result = m_pfn.vkWaitForFences(m_Device, 1, m_Fence.ptr(), VK_TRUE, UINT64_MAX);
+    if (result != VK_SUCCESS)
+    {
+        LOGE("vkWaitForFences failed (%d)", result);
+        return false;
+    }
+
+    result = m_pfn.vkResetFences(m_Device, 1, m_Fence.ptr());
+    if (result != VK_SUCCESS)
+    {
+        LOGE("vkResetFences failed (%d)", result);
+        return false;
+    }
+
+    m_Submitted = false;
+    return true;
+}
+
+FrameManager::FrameManager(const DeviceFunctions &pfn, VkDevice device, uint32_t framesInFlight)
+    : m_pfn(pfn), m_Device(device), m_DeletionQueue(framesInFlight), m_FrameNumber(0)
+{
+    ASSERT(framesInFlight > 0);
+    for (uint32_t i = 0; i < framesInFlight; ++i)
+        m_Frames.emplace_back(new Frame(pfn, device, i, m_DeletionQueue));
+}
+
+FrameManager::~FrameManager()
+{
+    WaitIdle();
+}
+
+bool FrameManager::Setup(const std::vector<uint32_t> &queueFamilies, uint32_t semaphoreCount, uint32_t eventCount)
+{
+    for (uint32_t queueFamily : queueFamilies)
+    {
+        m_CommandBufferPools.emplace_back(new CommandBufferPool(m_pfn, m_Device,
+            queueFamily, (uint32_t)m_Frames.size()));
+    }
+
+    for (auto &frame : m_Frames)
+    {
+        if (!frame->Setup(semaphoreCount, eventCount))
+            return false;
+
+        for (auto &commandBufferPool : m_CommandBufferPools)
+            frame->m_CommandBufferPools.push_back(commandBufferPool.get());
+    }
+    return true;
+}
+
+void FrameManager::SetupDescriptorPool(const std::vector<VkDescriptorPoolSize> &sizesPerSet, uint32_t setsPerPool)
+{
+    ASSERT(!m_DescriptorPool);
+
+    m_DescriptorPool.reset(new DescriptorPool(m_pfn, m_Device, (uint32_t)m_Frames.size(),
+        sizesPerSet, setsPerPool));
+
+    for (auto &frame : m_Frames)
+        frame->m_DescriptorPool = m_DescriptorPool.get();
+}
+
+bool FrameManager::BeginFrame(Frame *&frame)
+{
+    Frame *next = m_Frames[m_FrameNumber % m_Frames.size()].get();
+
+    if (!next->Wait() || !next->ResetEvents())
+        return false;
+
+    // Everything deferred during the slot's last use was only used by that
+    // frame or earlier ones, which have all finished now
+    m_DeletionQueue.Flush(next->m_Slot);
+
+    for (auto &commandBufferPool : m_CommandBufferPools)
+    {
+        if (!commandBufferPool->ResetSlot(next->m_Slot))
+            return false;
+    }
+
+    if (m_DescriptorPool && !m_DescriptorPool->ResetSlot(next->m_Slot))
+        return false;
+
+    next->m_Number = m_FrameNumber++;
+    frame = next;
+    return true;
+}
+
+CommandBufferPool *FrameManager::GetCommandBufferPool(uint32_t queueFamily)
+{
+    for (auto &commandBufferPool : m_CommandBufferPools)
+    {
+        if (commandBufferPool->GetQueueFamily() == queueFamily)
+            return commandBufferPool.get();
+    }
+    return nullptr;
+}
+
+bool FrameManager::WaitIdle()
+{
+    bool ok = true;
+    for (auto &frame : m_Frames)
+    {
+        if (!frame->Wait())
+            ok = false;
+    }
+
+    m_DeletionQueue.FlushAll();
+    return ok;
+}
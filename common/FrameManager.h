@@ -0,0 +1,208 @@
+/*
+ * Copyright (c) 2016 Philip Taylor
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#ifndef INCLUDED_VKSXS_FRAME_MANAGER
+#define INCLUDED_VKSXS_FRAME_MANAGER
+
+#include "common/Common.h"
+
+#include "common/AutoWrappers.h"
+#include "common/CommandBufferPool.h"
+#include "common/DeletionQueue.h"
+#include "common/DescriptorPool.h"
+#include "common/DeviceFunctions.h"
+#include "common/SubmitScheduler.h"
+
+#include <memory>
+#include <vector>
+
+/*
+ * The per-frame resources for one slot of a FrameManager. Everything in here
+ * may be reused as soon as the slot comes round again, so it must only be
+ * used by work submitted during this frame.
+ */
+class Frame
+{
+public:
+    Frame(const DeviceFunctions &pfn, VkDevice device, uint32_t slot, DeletionQueue &deletionQueue);
+
+    Frame(const Frame &) = delete;
+    Frame &operator=(const Frame &) = delete;
+
+    // Counts up from 0, across all slots
+    uint64_t GetNumber() const { return m_Number; }
+
+    /*
+     * vkQueueSubmit with the frame's fence. This must be the frame's last
+     * submit that uses any of its resources (e.g. one that waits on the
+     * semaphores signalled by its other submits), and there can only be one.
+     */
+    bool SubmitLast(VkQueue queue, uint32_t submitCount, const VkSubmitInfo *pSubmits);
+
+    // Likewise, but through the queue's scheduler, in the same vkQueueSubmit
+    // as everything else that's been posted to it
+    bool SubmitLast(SubmitScheduler &scheduler, uint32_t submitCount, const VkSubmitInfo *pSubmits);
+
+    // Whether SubmitLast() has been called in this use of the slot
+    bool IsSubmitted() const { return m_Submitted; }
+
+    /*
+     * Wait for SubmitLast()'s work to finish, if it has been called. The
+     * FrameManager does this before reusing the slot, but it can be done
+     * earlier, e.g. to read back results.
+     */
+    bool Wait();
+
+    VkSemaphore GetSemaphore(uint32_t i) { return m_Semaphores[i]; }
+
+    // Unsignalled at the start of each frame, e.g. for split barriers (see
+    // ResourceStateTracker::FlushSplit)
+    VkEvent GetEvent(uint32_t i) { return m_Events[i]; }
+
+    /*
+     * Returns a command buffer for the given queue family, which must be one
+     * of the families passed to FrameManager::Setup(). This is thread-safe
+     * (see CommandBufferPool). Command buffers allocated in earlier uses of
+     * this slot are handed out again rather than reallocated.
+     */
+    bool AllocateCommandBuffer(uint32_t queueFamily, VkCommandBuffer &commandBuffer,
+        VkCommandBufferLevel level = VK_COMMAND_BUFFER_LEVEL_PRIMARY);
+
+    // A descriptor set for this frame's commands, from the FrameManager's
+    // DescriptorPool (see FrameManager::SetupDescriptorPool). Thread-safe
+    bool AllocateDescriptorSet(VkDescriptorSetLayout layout, VkDescriptorSet &descriptorSet);
+
+    /*
+     * Destroy the object when this slot is next reused, i.e. once this frame
+     * and every earlier one have finished, instead of when the wrapper goes
+     * out of scope. Call it after the last SubmitLast() that uses the
+     * object. Thread-safe
+     */
+    template <typename W>
+    void DeferDestroy(W &&object) { m_DeletionQueue->Defer(m_Slot, std::move(object)); }
+
+    // Likewise for anything that isn't a wrapped handle
+    void DeferFunction(std::function<void ()> fn) { m_DeletionQueue->DeferFunction(m_Slot, std::move(fn)); }
+
+private:
+    friend class FrameManager;
+
+    bool Setup(uint32_t semaphoreCount, uint32_t eventCount);
+
+    // Reset the events, once the slot's previous use has finished
+    bool ResetEvents();
+
+    const DeviceFunctions &m_pfn;
+    VkDevice m_Device;
+    uint32_t m_Slot;
+    uint64_t m_Number;
+    bool m_Submitted;
+
+    AutoVkFence m_Fence;
+    std::vector<AutoVkSemaphore> m_Semaphores;
+    std::vector<AutoVkEvent> m_Events;
+
+    // Owned by the FrameManager
+    std::vector<CommandBufferPool *> m_CommandBufferPools;
+    DescriptorPool *m_DescriptorPool;
+    DeletionQueue *m_DeletionQueue;
+};
+
+/*
+ * Cycles through N sets of per-frame resources (a slot in each queue family's
+ * CommandBufferPool, a fence, some semaphores and events, a slot of a
+ * DeletionQueue and optionally a slot of a DescriptorPool), so the CPU can
+ * record frame N+1 while the GPU is still executing frame N, instead of
+ * waiting for the whole device to go idle.
+ *
+ * BeginFrame() waits only for the fence of the frame that last used the
+ * slot it's about to reuse, i.e. the frame N-framesInFlight. A frame that
+ * was abandoned before SubmitLast() (e.g. on an error path) isn't waited
+ * for, so it can't deadlock.
+ *
+ * Usage:
+ *   while (...)
+ *   {
+ *       Frame *frame;
+ *       manager.BeginFrame(frame);
+ *       frame->AllocateCommandBuffer(family, cmd);
+ *       ... record and submit, ending with frame->SubmitLast(...) ...
+ *   }
+ *   manager.WaitIdle();
+ */
+class FrameManager
+{
+public:
+    static const uint32_t DEFAULT_FRAMES_IN_FLIGHT = 2;
+
+    FrameManager(const DeviceFunctions &pfn, VkDevice device,
+        uint32_t framesInFlight = DEFAULT_FRAMES_IN_FLIGHT);
+
+    // Waits for all frames to finish
+    ~FrameManager();
+
+    FrameManager(const FrameManager &) = delete;
+    FrameManager &operator=(const FrameManager &) = delete;
+
+    /*
+     * queueFamilies lists every queue family that frames will record command
+     * buffers for. Each frame gets semaphoreCount semaphores, for ordering
+     * submits within the frame, and eventCount events, for ordering commands
+     * within a queue.
+     */
+    bool Setup(const std::vector<uint32_t> &queueFamilies, uint32_t semaphoreCount, uint32_t eventCount = 0);
+
+    /*
+     * Give each frame descriptor sets of up to sizesPerSet descriptors,
+     * which are all recycled when the slot is reused. Call this after
+     * Setup(), if the frames need any.
+     */
+    void SetupDescriptorPool(const std::vector<VkDescriptorPoolSize> &sizesPerSet,
+        uint32_t setsPerPool = DescriptorPool::DEFAULT_SETS_PER_POOL);
+
+    uint32_t GetFramesInFlight() const { return (uint32_t)m_Frames.size(); }
+
+    // Wait for the next slot to be free, and reset its resources
+    bool BeginFrame(Frame *&frame);
+
+    /*
+     * For persistent command buffers, which can be submitted in any frame.
+     * Returns nullptr if the family wasn't passed to Setup().
+     */
+    CommandBufferPool *GetCommandBufferPool(uint32_t queueFamily);
+
+    // Wait for every submitted frame to finish, and destroy everything that
+    // was deferred
+    bool WaitIdle();
+
+private:
+    const DeviceFunctions &m_pfn;
+    VkDevice m_Device;
+
+    std::vector<std::unique_ptr<CommandBufferPool>> m_CommandBufferPools;
+    std::unique_ptr<DescriptorPool> m_DescriptorPool;
+    DeletionQueue m_DeletionQueue;
+    std::vector<std::unique_ptr<Frame>> m_Frames;
+    uint64_t m_FrameNumber;
+};
+
+#endif // INCLUDED_VKSXS_FRAME_MANAGER
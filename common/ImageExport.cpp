@@ -0,0 +1,224 @@
+/*
+ * Copyright (c) 2016 Philip Taylor
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include "common/Common.h"
+
+#include "common/ImageExport.h"
+#include "common/Log.h"
+
+#include <algorithm>
+#include <fstream>
+#include <vector>
+
+#if defined(_M_X64) || defined(_M_IX86) || defined(__x86_64__) || defined(__i386__)
+# define SWIZZLE_SSSE3 1
+# include <tmmintrin.h>
+# ifdef _MSC_VER
+#  include <intrin.h>
+# endif
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+# define SWIZZLE_NEON 1
+# include <arm_neon.h>
+#endif
+
+static void SwizzleRGBAToBGRAScalar(const uint8_t *src, uint8_t *dst, size_t count)
+{
+    for (size_t i = 0; i < count; ++i)
+    {
+        uint8_t r = src[i*4 + 0];
+        uint8_t g = src[i*4 + 1];
+        uint8_t b = src[i*4 + 2];
+        uint8_t a = src[i*4 + 3];
+        dst[i*4 + 0] = b;
+        dst[i*4 + 1] = g;
+        dst[i*4 + 2] = r;
+        dst[i*4 + 3] = a;
+    }
+}
+
+#if SWIZZLE_SSSE3
+
+// The rest of the file is built without -mssse3, so only this function may
+// use SSSE3 instructions, and only once CpuHasSSSE3() says it can
+#if defined(__GNUC__)
+__attribute__((target("ssse3")))
+#endif
+static size_t SwizzleRGBAToBGRASSSE3(const uint8_t *src, uint8_t *dst, size_t count)
+{
+    const __m128i shuffle = _mm_setr_epi8(2, 1, 0, 3, 6, 5, 4, 7, 10, 9, 8, 11, 14, 13, 12, 15);
+
+    size_t i = 0;
+    for (; i + 4 <= count; i += 4)
+    {
+        __m128i v = _mm_loadu_si128((const __m128i *)(src + i*4));
+        _mm_storeu_si128((__m128i *)(dst + i*4), _mm_shuffle_epi8(v, shuffle));
+    }
+    return i;
+}
+
+static bool CpuHasSSSE3()
+{
+#if defined(_MSC_VER)
+    int info[4];
+    __cpuid(info, 1);
+    return (info[2] & (1 << 9)) != 0;
+#else
+    return __builtin_cpu_supports("ssse3");
+#endif
+}
+
+#endif // SWIZZLE_SSSE3
+
+#if SWIZZLE_NEON
+
+static size_t SwizzleRGBAToBGRANEON(const uint8_t *src, uint8_t *dst, size_t count)
+{
+    size_t i = 0;
+    for (; i + 16 <= count; i += 16)
+    {
+        // De-interleave into one register per channel, and swap R and B
+        uint8x16x4_t v = vld4q_u8(src + i*4);
+        uint8x16_t r = v.val[0];
+        v.val[0] = v.val[2];
+        v.val[2] = r;
+        vst4q_u8(dst + i*4, v);
+    }
+    return i;
+}
+
+#endif // SWIZZLE_NEON
+
+void SwizzleRGBAToBGRA(const void *src, void *dst, size_t count)
+{
+    const uint8_t *s = (const uint8_t *)src;
+    uint8_t *d = (uint8_t *)dst;
+    size_t done = 0;
+
+#if SWIZZLE_SSSE3
+    static const bool hasSSSE3 = CpuHasSSSE3();
+    if (hasSSSE3)
+        done = SwizzleRGBAToBGRASSSE3(s, d, count);
+#elif SWIZZLE_NEON
+    done = SwizzleRGBAToBGRANEON(s, d, count);
+#endif
+
+    SwizzleRGBAToBGRAScalar(s + done*4, d + done*4, count - done);
+}
+
+static const size_t TGA_HEADER_SIZE = 18;
+
+static void MakeTGAHeader(uint32_t width, uint32_t height, uint8_t header[TGA_HEADER_SIZE])
+{
+    const uint8_t tga_header[TGA_HEADER_SIZE] = {
+        0, 0, 2,
+        0, 0, 0, 0, 0,
+        0, 0, 0, 0,
+        (uint8_t)(width & 0xff), (uint8_t)(width >> 8),
+        (uint8_t)(height & 0xff), (uint8_t)(height >> 8),
+        32, 8 | (1 << 5),
+    };
+    memcpy(header, tga_header, TGA_HEADER_SIZE);
+}
+
+size_t GetTGASize(uint32_t width, uint32_t height)
+{
+    return TGA_HEADER_SIZE + (size_t)width * height * 4;
+}
+
+bool EncodeTGA(void *dst, const void *texels, uint32_t width, uint32_t height,
+    size_t rowPitch, bool bgra)
+{
+    if (width > 0xffff || height > 0xffff)
+    {
+        LOGE("Image size %ux%u is too large for TGA", width, height);
+        return false;
+    }
+
+    uint8_t *out = (uint8_t *)dst;
+    MakeTGAHeader(width, height, out);
+    out += TGA_HEADER_SIZE;
+
+    const uint8_t *src = (const uint8_t *)texels;
+    size_t rowSize = (size_t)width * 4;
+    for (uint32_t y = 0; y < height; ++y)
+    {
+        if (bgra)
+            memcpy(out + rowSize * y, src + rowPitch * y, rowSize);
+        else
+            SwizzleRGBAToBGRA(src + rowPitch * y, out + rowSize * y, width);
+    }
+    return true;
+}
+
+bool WriteTGA(const std::string &path, const void *texels, uint32_t width, uint32_t height,
+    size_t rowPitch, bool bgra)
+{
+    if (width > 0xffff || height > 0xffff)
+    {
+        LOGE("Image size %ux%u is too large for TGA", width, height);
+        return false;
+    }
+
+    std::ofstream out(path, std::ofstream::binary | std::ofstream::out | std::ofstream::trunc);
+
+    uint8_t tga_header[TGA_HEADER_SIZE];
+    MakeTGAHeader(width, height, tga_header);
+    out.write((const char *)tga_header, sizeof(tga_header));
+
+    const uint8_t *src = (const uint8_t *)texels;
+    size_t rowSize = (size_t)width * 4;
+
+    if (bgra && rowPitch == rowSize)
+    {
+        // Already in the file's layout
+        out.write((const char *)src, rowSize * height);
+    }
+    else
+    {
+        // Gather about 1MB of rows per write
+        uint32_t rowsPerChunk = (uint32_t)std::max<size_t>(1, (1024 * 1024) / rowSize);
+        std::vector<uint8_t> chunk(rowSize * std::min(rowsPerChunk, height));
+
+        for (uint32_t y = 0; y < height; y += rowsPerChunk)
+        {
+            uint32_t rows = std::min(rowsPerChunk, height - y);
+            for (uint32_t i = 0; i < rows; ++i)
+            {
+                const uint8_t *row = src + rowPitch * (y + i);
+                uint8_t *dst = chunk.data() + rowSize * i;
+                if (bgra)
+                    memcpy(dst, row, rowSize);
+                else
+                    SwizzleRGBAToBGRA(row, dst, width);
+            }
+            out.write((const char *)chunk.data(), rowSize * rows);
+        }
+    }
+
+    out.close();
+    if (!out)
+    {
+        LOGE("Failed to write %s", path.c_str());
+        return false;
+    }
+    return true;
+}
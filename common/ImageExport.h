@@ -0,0 +1,61 @@
+/*
+ * Copyright (c) 2016 Philip Taylor
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#ifndef INCLUDED_VKSXS_IMAGE_EXPORT
+#define INCLUDED_VKSXS_IMAGE_EXPORT
+
+#include "common/Common.h"
+
+#include <string>
+
+/*
+ * Copy 'count' 32-bit texels from src to dst, swapping the first and third
+ * bytes of each (so RGBA becomes BGRA and vice versa). src and dst may be
+ * the same, but mustn't otherwise overlap.
+ *
+ * This uses SSSE3 (if the CPU supports it) or NEON, with a scalar fallback.
+ */
+void SwizzleRGBAToBGRA(const void *src, void *dst, size_t count);
+
+/*
+ * Write a 32-bit uncompressed top-down TGA file. 'texels' is width*height
+ * texels of RGBA (or BGRA if 'bgra' is true, which needs no swizzling), with
+ * rows rowPitch bytes apart.
+ *
+ * Rows are swizzled into a buffer and written out several at a time, rather
+ * than texel by texel.
+ */
+bool WriteTGA(const std::string &path, const void *texels, uint32_t width, uint32_t height,
+    size_t rowPitch, bool bgra);
+
+// The size of a file written by WriteTGA
+size_t GetTGASize(uint32_t width, uint32_t height);
+
+/*
+ * Like WriteTGA, but into memory: 'dst' must have GetTGASize(width, height)
+ * bytes. The rows are swizzled or copied directly into dst, so this works
+ * well for writing into a mapped file.
+ */
+bool EncodeTGA(void *dst, const void *texels, uint32_t width, uint32_t height,
+    size_t rowPitch, bool bgra);
+
+#endif // INCLUDED_VKSXS_IMAGE_EXPORT
@@ -0,0 +1,265 @@
+/*
+ * Copyright (c) 2016 Philip Taylor
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include "common/Common.h"
+
+#include "common/ImageExport.h"
+#include "common/ImageStreamWriter.h"
+#include "common/Log.h"
+
+#include <cerrno>
+
+#ifndef _WIN32
+# include <fcntl.h>
+# include <sys/mman.h>
+# include <unistd.h>
+#endif
+
+MappedFile::MappedFile()
+#ifdef _WIN32
+    : m_File(INVALID_HANDLE_VALUE), m_Mapping(nullptr),
+#else
+    : m_File(-1),
+#endif
+    m_Data(nullptr), m_Size(0)
+{
+}
+
+MappedFile::~MappedFile()
+{
+    Close();
+}
+
+#ifdef _WIN32
+
+bool MappedFile::Open(const std::string &path, uint64_t size)
+{
+    Close();
+    m_Path = path;
+
+    m_File = CreateFileA(path.c_str(), GENERIC_READ | GENERIC_WRITE, 0, nullptr,
+        CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, nullptr);
+    if (m_File == INVALID_HANDLE_VALUE)
+    {
+        LOGE("Failed to create %s (%lu)", path.c_str(), GetLastError());
+        return false;
+    }
+
+    // Mapping a zero-length file fails, and there'd be nothing to write anyway
+    if (size == 0)
+        return true;
+
+    LARGE_INTEGER end;
+    end.QuadPart = (LONGLONG)size;
+    if (!SetFilePointerEx(m_File, end, nullptr, FILE_BEGIN) || !SetEndOfFile(m_File))
+    {
+        LOGE("Failed to allocate %" PRIu64 " bytes for %s (%lu)", size, path.c_str(), GetLastError());
+        return false;
+    }
+
+    m_Mapping = CreateFileMappingA(m_File, nullptr, PAGE_READWRITE,
+        (DWORD)(size >> 32), (DWORD)(size & 0xffffffff), nullptr);
+    if (!m_Mapping)
+    {
+        LOGE("CreateFileMapping failed for %s (%lu)", path.c_str(), GetLastError());
+        return false;
+    }
+
+    m_Data = (uint8_t *)MapViewOfFile(m_Mapping, FILE_MAP_WRITE, 0, 0, (SIZE_T)size);
+    if (!m_Data)
+    {
+        LOGE("MapViewOfFile failed for %s (%lu)", path.c_str(), GetLastError());
+        return false;
+    }
+
+    m_Size = size;
+    return true;
+}
+
+bool MappedFile::Close()
+{
+    bool ok = true;
+    if (m_Data && !UnmapViewOfFile(m_Data))
+        ok = false;
+    if (m_Mapping && !CloseHandle(m_Mapping))
+        ok = false;
+    if (m_File != INVALID_HANDLE_VALUE && !CloseHandle(m_File))
+        ok = false;
+    if (!ok)
+        LOGE("Failed to close %s (%lu)", m_Path.c_str(), GetLastError());
+
+    m_Data = nullptr;
+    m_Mapping = nullptr;
+    m_File = INVALID_HANDLE_VALUE;
+    m_Size = 0;
+    return ok;
+}
+
+#else // _WIN32
+
+bool MappedFile::Open(const std::string &path, uint64_t size)
+{
+    Close();
+    m_Path = path;
+
+    m_File = open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (m_File < 0)
+    {
+        LOGE("Failed to create %s (%d)", path.c_str(), errno);
+        return false;
+    }
+
+    if (size == 0)
+        return true;
+
+    // Allocating the blocks now means running out of disk space is an error
+    // here, rather than a SIGBUS while writing into the mapping
+#ifdef __linux__
+    int err = posix_fallocate(m_File, 0, (off_t)size);
+#else
+    int err = (ftruncate(m_File, (off_t)size) == 0 ? 0 : errno);
+#endif
+    if (err != 0)
+    {
+        LOGE("Failed to allocate %" PRIu64 " bytes for %s (%d)", size, path.c_str(), err);
+        return false;
+    }
+
+    void *data = mmap(nullptr, (size_t)size, PROT_READ | PROT_WRITE, MAP_SHARED, m_File, 0);
+    if (data == MAP_FAILED)
+    {
+        LOGE("mmap failed for %s (%d)", path.c_str(), errno);
+        return false;
+    }
+
+    m_Data = (uint8_t *)data;
+    m_Size = size;
+    return true;
+}
+
+bool MappedFile::Close()
+{
+    bool ok = true;
+    if (m_Data && munmap(m_Data, (size_t)m_Size) != 0)
+        ok = false;
+    if (m_File >= 0 && close(m_File) != 0)
+        ok = false;
+    if (!ok)
+        LOGE("Failed to close %s (%d)", m_Path.c_str(), errno);
+
+    m_Data = nullptr;
+    m_File = -1;
+    m_Size = 0;
+    return ok;
+}
+
+#endif // _WIN32
+
+ImageStreamWriter::ImageStreamWriter()
+    : m_Completed(0), m_Failed(false), m_Quit(false), m_NextTicket(1)
+{
+}
+
+ImageStreamWriter::~ImageStreamWriter()
+{
+    Close();
+}
+
+bool ImageStreamWriter::Open(const std::string &path, uint64_t size)
+{
+    if (!Close() || !m_File.Open(path, size))
+        return false;
+
+    m_Failed = false;
+    m_Quit = false;
+    m_Thread = std::thread(&ImageStreamWriter::WorkerMain, this);
+    return true;
+}
+
+uint64_t ImageStreamWriter::Write(uint64_t offset, const void *texels, uint32_t width, uint32_t height,
+    size_t rowPitch, bool bgra)
+{
+    Job job = { offset, texels, width, height, rowPitch, bgra };
+    {
+        std::lock_guard<std::mutex> lock(m_Mutex);
+        m_Jobs.push_back(job);
+    }
+    m_WorkCond.notify_one();
+    return m_NextTicket++;
+}
+
+bool ImageStreamWriter::Wait(uint64_t ticket)
+{
+    std::unique_lock<std::mutex> lock(m_Mutex);
+    m_DoneCond.wait(lock, [&]() { return m_Completed >= ticket; });
+    return !m_Failed;
+}
+
+bool ImageStreamWriter::Close()
+{
+    if (!m_Thread.joinable())
+        return m_File.Close();
+
+    bool ok = WaitIdle();
+
+    {
+        std::lock_guard<std::mutex> lock(m_Mutex);
+        m_Quit = true;
+    }
+    m_WorkCond.notify_one();
+    m_Thread.join();
+
+    return m_File.Close() && ok;
+}
+
+void ImageStreamWriter::WorkerMain()
+{
+    std::unique_lock<std::mutex> lock(m_Mutex);
+    while (true)
+    {
+        m_WorkCond.wait(lock, [&]() { return m_Quit || !m_Jobs.empty(); });
+        if (m_Jobs.empty())
+            return;
+
+        Job job = m_Jobs.front();
+        m_Jobs.pop_front();
+        lock.unlock();
+
+        bool ok = true;
+        if (job.offset + GetTGASize(job.width, job.height) > m_File.GetSize())
+        {
+            LOGE("TGA record at %" PRIu64 " doesn't fit in the %" PRIu64 "-byte file", job.offset, m_File.GetSize());
+            ok = false;
+        }
+        else
+        {
+            ok = EncodeTGA(m_File.GetData() + job.offset, job.texels, job.width, job.height,
+                job.rowPitch, job.bgra);
+        }
+
+        lock.lock();
+        if (!ok)
+            m_Failed = true;
+        ++m_Completed;
+        m_DoneCond.notify_all();
+    }
+}
@@ -0,0 +1,142 @@
+/*
+ * Copyright (c) 2016 Philip Taylor
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#ifndef INCLUDED_VKSXS_IMAGE_STREAM_WRITER
+#define INCLUDED_VKSXS_IMAGE_STREAM_WRITER
+
+#include "common/Common.h"
+
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+
+/*
+ * A file that's created (or truncated) at a fixed size, with its disk space
+ * allocated up front where the OS supports that, and mapped for writing.
+ */
+class MappedFile
+{
+public:
+    MappedFile();
+
+    // Closes the file
+    ~MappedFile();
+
+    MappedFile(const MappedFile &) = delete;
+    MappedFile &operator=(const MappedFile &) = delete;
+
+    bool Open(const std::string &path, uint64_t size);
+
+    // Unmap and close; the OS writes the dirty pages back in its own time
+    bool Close();
+
+    uint8_t *GetData() { return m_Data; }
+    uint64_t GetSize() const { return m_Size; }
+
+private:
+#ifdef _WIN32
+    HANDLE m_File;
+    HANDLE m_Mapping;
+#else
+    int m_File;
+#endif
+    uint8_t *m_Data;
+    uint64_t m_Size;
+    std::string m_Path;
+};
+
+/*
+ * Writes a batch of images into one MappedFile as back-to-back TGA records,
+ * so nothing is opened per image, and the render thread never waits on
+ * disk I/O. The caller chooses each record's offset (so the file's layout
+ * doesn't depend on the order writes finish in), and the file can be split
+ * back into TGAs using the sizes from GetTGASize().
+ *
+ * Write() queues the texels to be swizzled (or copied) straight into the
+ * mapping on the writer's own thread. The JobSystem only runs parallel-fors
+ * that its caller waits for, so it doesn't fit this. The texels, e.g. a
+ * region of the mapped staging buffer, must stay valid until Wait() has
+ * returned for the write's ticket.
+ *
+ * Write/Wait are not thread-safe; use one writer per thread.
+ */
+class ImageStreamWriter
+{
+public:
+    ImageStreamWriter();
+
+    // Waits for the writes and closes the file
+    ~ImageStreamWriter();
+
+    ImageStreamWriter(const ImageStreamWriter &) = delete;
+    ImageStreamWriter &operator=(const ImageStreamWriter &) = delete;
+
+    bool Open(const std::string &path, uint64_t size);
+
+    /*
+     * Queue a TGA of the texels (as for WriteTGA) into the record at
+     * 'offset', which must have GetTGASize(width, height) bytes. Returns a
+     * ticket for Wait().
+     */
+    uint64_t Write(uint64_t offset, const void *texels, uint32_t width, uint32_t height,
+        size_t rowPitch, bool bgra);
+
+    // Wait for the ticket's write and all before it; false if any failed
+    bool Wait(uint64_t ticket);
+
+    bool WaitIdle() { return Wait(m_NextTicket - 1); }
+
+    // WaitIdle, then stop the thread and close the file
+    bool Close();
+
+private:
+    struct Job
+    {
+        uint64_t offset;
+        const void *texels;
+        uint32_t width;
+        uint32_t height;
+        size_t rowPitch;
+        bool bgra;
+    };
+
+    void WorkerMain();
+
+    MappedFile m_File;
+    std::thread m_Thread;
+
+    std::mutex m_Mutex;
+    std::condition_variable m_WorkCond;
+    std::condition_variable m_DoneCond;
+
+    // Protected by m_Mutex
+    std::deque<Job> m_Jobs;
+    uint64_t m_Completed; // tickets [1, m_Completed] are done
+    bool m_Failed;
+    bool m_Quit;
+
+    uint64_t m_NextTicket;
+};
+
+#endif // INCLUDED_VKSXS_IMAGE_STREAM_WRITER
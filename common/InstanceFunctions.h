@@ -26,114 +26,12 @@
 #include "common/Common.h"
 
 #define INSTANCE_FUNCTIONS \
-    X(vkAllocateCommandBuffers) \
-    X(vkAllocateDescriptorSets) \
-    X(vkAllocateMemory) \
-    X(vkBeginCommandBuffer) \
-    X(vkBindBufferMemory) \
-    X(vkBindImageMemory) \
-    X(vkCmdBeginQuery) \
-    X(vkCmdBeginRenderPass) \
-    X(vkCmdBindDescriptorSets) \
-    X(vkCmdBindIndexBuffer) \
-    X(vkCmdBindPipeline) \
-    X(vkCmdBindVertexBuffers) \
-    X(vkCmdBlitImage) \
-    X(vkCmdClearAttachments) \
-    X(vkCmdClearColorImage) \
-    X(vkCmdClearDepthStencilImage) \
-    X(vkCmdCopyBuffer) \
-    X(vkCmdCopyBufferToImage) \
-    X(vkCmdCopyImage) \
-    X(vkCmdCopyImageToBuffer) \
-    X(vkCmdCopyQueryPoolResults) \
-    X(vkCmdDispatch) \
-    X(vkCmdDispatchIndirect) \
-    X(vkCmdDraw) \
-    X(vkCmdDrawIndexed) \
-    X(vkCmdDrawIndexedIndirect) \
-    X(vkCmdDrawIndirect) \
-    X(vkCmdEndQuery) \
-    X(vkCmdEndRenderPass) \
-    X(vkCmdExecuteCommands) \
-    X(vkCmdFillBuffer) \
-    X(vkCmdNextSubpass) \
-    X(vkCmdPipelineBarrier) \
-    X(vkCmdPushConstants) \
-    X(vkCmdResetEvent) \
-    X(vkCmdResetQueryPool) \
-    X(vkCmdResolveImage) \
-    X(vkCmdSetBlendConstants) \
-    X(vkCmdSetDepthBias) \
-    X(vkCmdSetDepthBounds) \
-    X(vkCmdSetEvent) \
-    X(vkCmdSetLineWidth) \
-    X(vkCmdSetScissor) \
-    X(vkCmdSetStencilCompareMask) \
-    X(vkCmdSetStencilReference) \
-    X(vkCmdSetStencilWriteMask) \
-    X(vkCmdSetViewport) \
-    X(vkCmdUpdateBuffer) \
-    X(vkCmdWaitEvents) \
-    X(vkCmdWriteTimestamp) \
-    X(vkCreateBuffer) \
-    X(vkCreateBufferView) \
-    X(vkCreateCommandPool) \
-    X(vkCreateComputePipelines) \
-    X(vkCreateDescriptorPool) \
-    X(vkCreateDescriptorSetLayout) \
     X(vkCreateDevice) \
-    X(vkCreateEvent) \
-    X(vkCreateFence) \
-    X(vkCreateFramebuffer) \
-    X(vkCreateGraphicsPipelines) \
-    X(vkCreateImage) \
-    X(vkCreateImageView) \
-    X(vkCreatePipelineCache) \
-    X(vkCreatePipelineLayout) \
-    X(vkCreateQueryPool) \
-    X(vkCreateRenderPass) \
-    X(vkCreateSampler) \
-    X(vkCreateSemaphore) \
-    X(vkCreateShaderModule) \
-    X(vkDestroyBuffer) \
-    X(vkDestroyBufferView) \
-    X(vkDestroyCommandPool) \
-    X(vkDestroyDescriptorPool) \
-    X(vkDestroyDescriptorSetLayout) \
-    X(vkDestroyDevice) \
-    X(vkDestroyEvent) \
-    X(vkDestroyFence) \
-    X(vkDestroyFramebuffer) \
-    X(vkDestroyImage) \
-    X(vkDestroyImageView) \
     X(vkDestroyInstance) \
-    X(vkDestroyPipeline) \
-    X(vkDestroyPipelineCache) \
-    X(vkDestroyPipelineLayout) \
-    X(vkDestroyQueryPool) \
-    X(vkDestroyRenderPass) \
-    X(vkDestroySampler) \
-    X(vkDestroySemaphore) \
-    X(vkDestroyShaderModule) \
-    X(vkDeviceWaitIdle) \
-    X(vkEndCommandBuffer) \
     X(vkEnumerateDeviceExtensionProperties) \
     X(vkEnumerateDeviceLayerProperties) \
     X(vkEnumeratePhysicalDevices) \
-    X(vkFlushMappedMemoryRanges) \
-    X(vkFreeCommandBuffers) \
-    X(vkFreeDescriptorSets) \
-    X(vkFreeMemory) \
-    X(vkGetBufferMemoryRequirements) \
-    X(vkGetDeviceMemoryCommitment) \
     X(vkGetDeviceProcAddr) \
-    X(vkGetDeviceQueue) \
-    X(vkGetEventStatus) \
-    X(vkGetFenceStatus) \
-    X(vkGetImageMemoryRequirements) \
-    X(vkGetImageSparseMemoryRequirements) \
-    X(vkGetImageSubresourceLayout) \
     X(vkGetInstanceProcAddr) \
     X(vkGetPhysicalDeviceFeatures) \
     X(vkGetPhysicalDeviceFormatProperties) \
@@ -142,24 +40,6 @@
     X(vkGetPhysicalDeviceProperties) \
     X(vkGetPhysicalDeviceQueueFamilyProperties) \
     X(vkGetPhysicalDeviceSparseImageFormatProperties) \
-    X(vkGetPipelineCacheData) \
-    X(vkGetQueryPoolResults) \
-    X(vkGetRenderAreaGranularity) \
-    X(vkInvalidateMappedMemoryRanges) \
-    X(vkMapMemory) \
-    X(vkMergePipelineCaches) \
-    X(vkQueueBindSparse) \
-    X(vkQueueSubmit) \
-    X(vkQueueWaitIdle) \
-    X(vkResetCommandBuffer) \
-    X(vkResetCommandPool) \
-    X(vkResetDescriptorPool) \
-    X(vkResetEvent) \
-    X(vkResetFences) \
-    X(vkSetEvent) \
-    X(vkUnmapMemory) \
-    X(vkUpdateDescriptorSets) \
-    X(vkWaitForFences) \
 
 #define INSTANCE_FUNCTIONS_EXT_DEBUG_REPORT \
     X(vkCreateDebugReportCallbackEXT) \
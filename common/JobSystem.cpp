@@ -0,0 +1,191 @@
+/*
+ * Copyright (c) 2016 Philip Taylor
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include "common/Common.h"
+
+#include "common/JobSystem.h"
+#include "common/Log.h"
+
+uint32_t JobSystem::DefaultWorkerCount()
+{
+    uint32_t n = std::thread::hardware_concurrency();
+    return n > 1 ? n - 1 : 0;
+}
+
+JobSystem::JobSystem(uint32_t workerCount)
+    : m_Fn(nullptr), m_Count(0), m_Generation(0), m_Remaining(0), m_ActiveWorkers(0),
+    m_Quit(false), m_Next(0)
+{
+    for (uint32_t i = 0; i < workerCount; ++i)
+        m_Threads.emplace_back(&JobSystem::WorkerMain, this);
+}
+
+JobSystem::~JobSystem()
+{
+    {
+        std::lock_guard<std::mutex> lock(m_Mutex);
+        m_Quit = true;
+    }
+    m_WorkCond.notify_all();
+
+    for (auto &thread : m_Threads)
+        thread.join();
+}
+
+void JobSystem::RunJobs(const std::function<void (uint32_t)> *fn, uint32_t count)
+{
+    uint32_t done = 0;
+    while (true)
+    {
+        uint32_t i = m_Next.fetch_add(1, std::memory_order_relaxed);
+        if (i >= count)
+            break;
+        (*fn)(i);
+        ++done;
+    }
+
+    if (done)
+    {
+        std::lock_guard<std::mutex> lock(m_Mutex);
+        m_Remaining -= done;
+        if (m_Remaining == 0)
+            m_DoneCond.notify_all();
+    }
+}
+
+void JobSystem::WorkerMain()
+{
+    uint64_t seenGeneration = 0;
+    while (true)
+    {
+        const std::function<void (uint32_t)> *fn;
+        uint32_t count;
+        {
+            std::unique_lock<std::mutex> lock(m_Mutex);
+            m_WorkCond.wait(lock, [&]() { return m_Quit || m_Generation != seenGeneration; });
+            if (m_Quit)
+                return;
+
+            // Pick up the current ParallelFor under the lock. It can't return
+            // (and invalidate fn) until we've decremented m_ActiveWorkers
+            seenGeneration = m_Generation;
+            fn = m_Fn;
+            count = m_Count;
+            ++m_ActiveWorkers;
+        }
+
+        RunJobs(fn, count);
+
+        {
+            std::lock_guard<std::mutex> lock(m_Mutex);
+            --m_ActiveWorkers;
+            if (m_ActiveWorkers == 0)
+                m_DoneCond.notify_all();
+        }
+    }
+}
+
+void JobSystem::ParallelFor(uint32_t count, const std::function<void (uint32_t)> &fn)
+{
+    if (count == 0)
+        return;
+
+    // Not worth waking anyone up
+    if (m_Threads.empty() || count == 1)
+    {
+        for (uint32_t i = 0; i < count; ++i)
+            fn(i);
+        return;
+    }
+
+    {
+        // A worker that woke up too late for the previous ParallelFor may
+        // still be checking for work left over from it
+        std::unique_lock<std::mutex> lock(m_Mutex);
+        m_DoneCond.wait(lock, [&]() { return m_ActiveWorkers == 0; });
+
+        ASSERT(m_Remaining == 0);
+        m_Fn = &fn;
+        m_Count = count;
+        m_Remaining = count;
+        m_Next.store(0, std::memory_order_relaxed);
+        ++m_Generation;
+    }
+    m_WorkCond.notify_all();
+
+    RunJobs(&fn, count);
+
+    std::unique_lock<std::mutex> lock(m_Mutex);
+    m_DoneCond.wait(lock, [&]() { return m_Remaining == 0 && m_ActiveWorkers == 0; });
+    m_Fn = nullptr;
+}
+
+bool RecordSecondaryCommandBuffers(const DeviceFunctions &pfn, JobSystem &jobSystem,
+    Frame &frame, uint32_t queueFamily, VkCommandBuffer primary, uint32_t count,
+    const std::function<bool (uint32_t, VkCommandBuffer)> &record)
+{
+    std::vector<VkCommandBuffer> commandBuffers(count, VK_NULL_HANDLE);
+    std::atomic<bool> ok(true);
+
+    jobSystem.ParallelFor(count, [&](uint32_t i) {
+        VkCommandBuffer commandBuffer;
+        if (!frame.AllocateCommandBuffer(queueFamily, commandBuffer, VK_COMMAND_BUFFER_LEVEL_SECONDARY))
+        {
+            ok = false;
+            return;
+        }
+
+        VkCommandBufferInheritanceInfo inheritanceInfo = {};
+        inheritanceInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_INHERITANCE_INFO;
+
+        VkCommandBufferBeginInfo beginInfo = {};
+        beginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+        beginInfo.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+        beginInfo.pInheritanceInfo = &inheritanceInfo;
+        VkResult result = pfn.vkBeginCommandBuffer(commandBuffer, &beginInfo);
+        if (result != VK_SUCCESS)
+        {
+            LOGE("vkBeginCommandBuffer failed (%d)", result);
+            ok = false;
+            return;
+        }
+
+        if (!record(i, commandBuffer))
+            ok = false;
+
+        result = pfn.vkEndCommandBuffer(commandBuffer);
+        if (result != VK_SUCCESS)
+        {
+            LOGE("vkEndCommandBuffer failed (%d)", result);
+            ok = false;
+            return;
+        }
+
+        commandBuffers[i] = commandBuffer;
+    });
+
+    if (!ok)
+        return false;
+
+    pfn.vkCmdExecuteCommands(primary, count, commandBuffers.data());
+    return true;
+}
@@ -0,0 +1,100 @@
+/*
+ * Copyright (c) 2016 Philip Taylor
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#ifndef INCLUDED_VKSXS_JOB_SYSTEM
+#define INCLUDED_VKSXS_JOB_SYSTEM
+
+#include "common/Common.h"
+
+#include "common/DeviceFunctions.h"
+#include "common/FrameManager.h"
+
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/*
+ * A fixed set of worker threads that can run a parallel-for. The threads
+ * persist for the JobSystem's lifetime, so anything that's cached per thread
+ * (like CommandBufferPool's command pools) keeps getting reused.
+ */
+class JobSystem
+{
+public:
+    // One worker per hardware thread, minus one for the calling thread
+    static uint32_t DefaultWorkerCount();
+
+    explicit JobSystem(uint32_t workerCount = DefaultWorkerCount());
+
+    ~JobSystem();
+
+    JobSystem(const JobSystem &) = delete;
+    JobSystem &operator=(const JobSystem &) = delete;
+
+    // Number of threads that run jobs, including the caller of ParallelFor
+    uint32_t GetThreadCount() const { return (uint32_t)m_Threads.size() + 1; }
+
+    /*
+     * Call fn(i) for every i in [0, count), spread across the workers and the
+     * calling thread, and return once they've all finished. Only one thread
+     * may call ParallelFor at once.
+     */
+    void ParallelFor(uint32_t count, const std::function<void (uint32_t)> &fn);
+
+private:
+    void WorkerMain();
+    void RunJobs(const std::function<void (uint32_t)> *fn, uint32_t count);
+
+    std::vector<std::thread> m_Threads;
+
+    std::mutex m_Mutex;
+    std::condition_variable m_WorkCond;
+    std::condition_variable m_DoneCond;
+
+    // The current ParallelFor, protected by m_Mutex
+    const std::function<void (uint32_t)> *m_Fn;
+    uint32_t m_Count;
+    uint64_t m_Generation;
+    uint32_t m_Remaining;
+    uint32_t m_ActiveWorkers;
+    bool m_Quit;
+
+    std::atomic<uint32_t> m_Next;
+};
+
+/*
+ * Record 'count' pieces of work into secondary command buffers in parallel,
+ * then execute them in order from 'primary'.
+ *
+ * record(i, commandBuffer) is called on one of the job system's threads with
+ * a secondary command buffer that's already begun (outside of any render
+ * pass), and should return false on failure. The command buffers come from
+ * the calling thread's pools in 'frame', so they're recycled with the frame.
+ */
+bool RecordSecondaryCommandBuffers(const DeviceFunctions &pfn, JobSystem &jobSystem,
+    Frame &frame, uint32_t queueFamily, VkCommandBuffer primary, uint32_t count,
+    const std::function<bool (uint32_t, VkCommandBuffer)> &record);
+
+#endif // INCLUDED_VKSXS_JOB_SYSTEM
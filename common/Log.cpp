@@ -24,13 +24,26 @@
 
 #include "common/Log.h"
 
+#include <chrono>
+#include <condition_variable>
 #include <cstdarg>
 #include <cstdio>
+#include <cstring>
+#include <mutex>
+#include <thread>
 
-void PrintMessage(const char *msg)
+static const size_t MAX_MESSAGE_SIZE = 1024;
+
+std::atomic<int> g_LogMinSeverity(LOG_SEVERITY_INFO);
+
+void SetLogMinSeverity(LogSeverity severity)
 {
-    printf("%s", msg);
-    fflush(stdout);
+    g_LogMinSeverity.store(severity, std::memory_order_relaxed);
+}
+
+static void WriteMessage(const char *msg)
+{
+    fputs(msg, stdout);
 #ifdef _WIN32
     // It's awkward to read stdout in Visual Studio, so duplicate the message
     // into VS's debug output window
@@ -38,9 +51,275 @@ void PrintMessage(const char *msg)
 #endif
 }
 
+/*
+ * Bounded multi-producer single-consumer queue of fixed-size records.
+ *
+ * Each record has a sequence number which says whose turn it is:
+ * a producer can claim slot (pos % capacity) when sequence == pos, and
+ * publishes it by setting sequence = pos + 1; the consumer can read it when
+ * sequence == pos + 1, and hands it back to the producers by setting
+ * sequence = pos + capacity. Producers claim slots with a CAS on enqueuePos,
+ * so they never block each other (except when the buffer is full, in which
+ * case they have to wait for the consumer to catch up).
+ */
+struct LogRecord
+{
+    std::atomic<size_t> sequence;
+    char text[MAX_MESSAGE_SIZE];
+};
+
+static const size_t LOG_RING_CAPACITY = 1024; // must be a power of two
+
+// How many records to print before flushing stdout, if the queue doesn't
+// empty out first
+static const size_t LOG_FLUSH_INTERVAL = 64;
+
+class AsyncLog
+{
+public:
+    AsyncLog()
+        : m_Running(false), m_Enabled(false), m_StopRequested(false), m_ConsumerSleeping(false)
+    {
+        for (size_t i = 0; i < LOG_RING_CAPACITY; ++i)
+            m_Records[i].sequence.store(i, std::memory_order_relaxed);
+        m_EnqueuePos.store(0, std::memory_order_relaxed);
+        m_DequeuePos.store(0, std::memory_order_relaxed);
+        m_PrintedPos.store(0, std::memory_order_relaxed);
+    }
+
+    ~AsyncLog()
+    {
+        Stop();
+    }
+
+    bool IsEnabled() const { return m_Enabled.load(std::memory_order_acquire); }
+
+    void Start()
+    {
+        std::lock_guard<std::mutex> lock(m_ControlMutex);
+        if (m_Running)
+            return;
+        m_Running = true;
+        m_StopRequested.store(false, std::memory_order_relaxed);
+        m_Thread = std::thread([this]() { Drain(); });
+        m_Enabled.store(true, std::memory_order_release);
+    }
+
+    void Stop()
+    {
+        std::lock_guard<std::mutex> lock(m_ControlMutex);
+        if (!m_Running)
+            return;
+
+        // New messages will go down the synchronous path from now on, but
+        // there may be producers that already decided to push, so let the
+        // consumer drain everything before exiting
+        m_Enabled.store(false, std::memory_order_release);
+        m_StopRequested.store(true, std::memory_order_release);
+        Wake();
+        m_Thread.join();
+
+        // The consumer only waits for slots that were claimed before it
+        // checked, so print anything that's turned up since
+        DrainStopped();
+        m_Running = false;
+    }
+
+    void Push(const char *msg)
+    {
+        size_t pos = m_EnqueuePos.load(std::memory_order_relaxed);
+        LogRecord *record;
+        for (;;)
+        {
+            record = &m_Records[pos & (LOG_RING_CAPACITY - 1)];
+            size_t seq = record->sequence.load(std::memory_order_acquire);
+            intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+            if (diff == 0)
+            {
+                if (m_EnqueuePos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+                    break;
+            }
+            else if (diff < 0)
+            {
+                // The buffer is full. Don't drop the message (it might be the
+                // error we're looking for); wait for the consumer instead
+                Wake();
+                std::this_thread::yield();
+                pos = m_EnqueuePos.load(std::memory_order_relaxed);
+            }
+            else
+            {
+                // Another producer claimed this slot first
+                pos = m_EnqueuePos.load(std::memory_order_relaxed);
+            }
+        }
+
+        strncpy(record->text, msg, MAX_MESSAGE_SIZE);
+        record->text[MAX_MESSAGE_SIZE - 1] = '\0';
+        record->sequence.store(pos + 1, std::memory_order_release);
+
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (m_ConsumerSleeping.load(std::memory_order_relaxed))
+            Wake();
+
+        // We might have passed IsEnabled() just before Stop(), and published
+        // after Stop() had finished draining, in which case nobody else is
+        // going to print it
+        if (m_StopRequested.load(std::memory_order_relaxed))
+        {
+            std::lock_guard<std::mutex> lock(m_ControlMutex);
+            if (!m_Running)
+                DrainStopped();
+        }
+    }
+
+    void Flush()
+    {
+        if (!IsEnabled())
+            return;
+
+        // Wait until the consumer has printed everything that was claimed
+        // before we got here
+        size_t target = m_EnqueuePos.load(std::memory_order_acquire);
+        Wake();
+        while (m_PrintedPos.load(std::memory_order_acquire) < target)
+        {
+            if (!IsEnabled())
+                return;
+            std::this_thread::yield();
+        }
+    }
+
+private:
+    void Wake()
+    {
+        std::lock_guard<std::mutex> lock(m_WakeMutex);
+        m_WakeCond.notify_one();
+    }
+
+    void Drain()
+    {
+        size_t unflushed = 0;
+        for (;;)
+        {
+            size_t pos = m_DequeuePos.load(std::memory_order_relaxed);
+            LogRecord &record = m_Records[pos & (LOG_RING_CAPACITY - 1)];
+            if (record.sequence.load(std::memory_order_acquire) == pos + 1)
+            {
+                WriteMessage(record.text);
+                record.sequence.store(pos + LOG_RING_CAPACITY, std::memory_order_release);
+                m_DequeuePos.store(pos + 1, std::memory_order_relaxed);
+
+                // Don't let a constant stream of messages stall FlushLog
+                if (++unflushed >= LOG_FLUSH_INTERVAL)
+                {
+                    fflush(stdout);
+                    m_PrintedPos.store(pos + 1, std::memory_order_release);
+                    unflushed = 0;
+                }
+                continue;
+            }
+
+            // Nothing more to print right now, so this is a good time to
+            // flush the whole batch at once
+            fflush(stdout);
+            m_PrintedPos.store(pos, std::memory_order_release);
+            unflushed = 0;
+
+            // Only stop once every claimed slot has been printed
+            if (m_StopRequested.load(std::memory_order_acquire)
+                && m_EnqueuePos.load(std::memory_order_acquire) == pos)
+                return;
+
+            std::unique_lock<std::mutex> lock(m_WakeMutex);
+            m_ConsumerSleeping.store(true, std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            if (record.sequence.load(std::memory_order_acquire) != pos + 1
+                && !m_StopRequested.load(std::memory_order_acquire))
+            {
+                // Producers wake us up, but use a timeout anyway so that a
+                // slot that's been claimed but not yet published can't
+                // leave us waiting
+                m_WakeCond.wait_for(lock, std::chrono::milliseconds(10));
+            }
+            m_ConsumerSleeping.store(false, std::memory_order_relaxed);
+        }
+    }
+
+    // Print every claimed record on the calling thread, once the consumer
+    // thread has exited. Must be called with m_ControlMutex held
+    void DrainStopped()
+    {
+        // Pairs with the fence in Push, so either we see its record or it
+        // sees m_StopRequested
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+
+        size_t pos = m_DequeuePos.load(std::memory_order_relaxed);
+        while (pos != m_EnqueuePos.load(std::memory_order_acquire))
+        {
+            LogRecord &record = m_Records[pos & (LOG_RING_CAPACITY - 1)];
+
+            // The producer has claimed the slot but may still be copying
+            // its message into it
+            while (record.sequence.load(std::memory_order_acquire) != pos + 1)
+                std::this_thread::yield();
+
+            WriteMessage(record.text);
+            record.sequence.store(pos + LOG_RING_CAPACITY, std::memory_order_release);
+            ++pos;
+            m_DequeuePos.store(pos, std::memory_order_relaxed);
+        }
+
+        fflush(stdout);
+        m_PrintedPos.store(pos, std::memory_order_release);
+    }
+
+    LogRecord m_Records[LOG_RING_CAPACITY];
+    std::atomic<size_t> m_EnqueuePos;
+    std::atomic<size_t> m_DequeuePos;
+    std::atomic<size_t> m_PrintedPos;
+
+    std::mutex m_ControlMutex;
+    bool m_Running;
+    std::atomic<bool> m_Enabled;
+    std::atomic<bool> m_StopRequested;
+    std::thread m_Thread;
+
+    std::mutex m_WakeMutex;
+    std::condition_variable m_WakeCond;
+    std::atomic<bool> m_ConsumerSleeping;
+};
+
+static AsyncLog s_AsyncLog;
+
+void SetLogAsync(bool enable)
+{
+    if (enable)
+        s_AsyncLog.Start();
+    else
+        s_AsyncLog.Stop();
+}
+
+void FlushLog()
+{
+    s_AsyncLog.Flush();
+    fflush(stdout);
+}
+
+void PrintMessage(const char *msg)
+{
+    if (s_AsyncLog.IsEnabled())
+    {
+        s_AsyncLog.Push(msg);
+        return;
+    }
+
+    WriteMessage(msg);
+    fflush(stdout);
+}
+
 void PrintfMessage(const char *fmt, ...)
 {
-    const size_t MAX_MESSAGE_SIZE = 1024;
     char buf[MAX_MESSAGE_SIZE];
 
     va_list ap;
@@ -23,14 +23,48 @@
 #ifndef INCLUDED_VKSXS_LOG
 #define INCLUDED_VKSXS_LOG
 
+#include <atomic>
+
+enum LogSeverity
+{
+    LOG_SEVERITY_INFO,
+    LOG_SEVERITY_WARN,
+    LOG_SEVERITY_ERROR,
+};
+
+// Messages below this severity are discarded, before doing any formatting.
+// Use SetLogMinSeverity rather than changing this directly
+extern std::atomic<int> g_LogMinSeverity;
+
+inline bool IsLogSeverityEnabled(LogSeverity severity)
+{
+    return (int)severity >= g_LogMinSeverity.load(std::memory_order_relaxed);
+}
+
+void SetLogMinSeverity(LogSeverity severity);
+
+/*
+ * By default every message is printed (and flushed) synchronously, so nothing
+ * gets lost if we crash. When that's too slow (e.g. when the validation layers
+ * are producing lots of messages), the asynchronous mode copies each message
+ * into a lock-free ring buffer and returns immediately, and a background thread
+ * does the printing. Each message is truncated to MAX_MESSAGE_SIZE.
+ *
+ * SetLogAsync(false) (and process exit) prints any remaining messages and
+ * stops the background thread. FlushLog waits until everything logged so far
+ * has been printed.
+ */
+void SetLogAsync(bool enable);
+void FlushLog();
+
 void PrintMessage(const char *msg);
 void PrintfMessage(const char *fmt, ...);
 
 // Trivial logging system
-#define LOGI(fmt, ...) do { PrintfMessage("[INFO] " fmt "\n", __VA_ARGS__); } while (0)
-#define LOGW(fmt, ...) do { PrintfMessage("[WARN] " fmt "\n", __VA_ARGS__); } while (0)
-#define LOGE(fmt, ...) do { PrintfMessage("[ERROR] " fmt "\n", __VA_ARGS__); } while (0)
+#define LOGI(fmt, ...) do { if (IsLogSeverityEnabled(LOG_SEVERITY_INFO)) PrintfMessage("[INFO] " fmt "\n", __VA_ARGS__); } while (0)
+#define LOGW(fmt, ...) do { if (IsLogSeverityEnabled(LOG_SEVERITY_WARN)) PrintfMessage("[WARN] " fmt "\n", __VA_ARGS__); } while (0)
+#define LOGE(fmt, ...) do { if (IsLogSeverityEnabled(LOG_SEVERITY_ERROR)) PrintfMessage("[ERROR] " fmt "\n", __VA_ARGS__); } while (0)
 
-#define ASSERT(cond) do { if (!(cond)) { LOGE("Assertion failed: %s:%d: %s", __FILE__, __LINE__, #cond); abort(); } } while (0)
+#define ASSERT(cond) do { if (!(cond)) { LOGE("Assertion failed: %s:%d: %s", __FILE__, __LINE__, #cond); FlushLog(); abort(); } } while (0)
 
 #endif // INCLUDED_VKSXS_LOG
@@ -0,0 +1,604 @@
+/*
+ * Copyright (c) 2016 Philip Taylor
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include "common/Common.h"
+
+#include "common/AllocationCallbacks.h"
+#include "common/Log.h"
+#include "common/MemoryAllocator.h"
+
+#include <algorithm>
+#include <deque>
+#include <iterator>
+
+const VkDeviceSize MemoryAllocator::DEFAULT_BLOCK_SIZE;
+
+static VkDeviceSize AlignUp(VkDeviceSize value, VkDeviceSize alignment)
+{
+    return (value + alignment - 1) / alignment * alignment;
+}
+
+static VkDeviceSize AlignDown(VkDeviceSize value, VkDeviceSize alignment)
+{
+    return value / alignment * alignment;
+}
+
+struct MemoryBlock
+{
+    VkDeviceMemory memory;
+    VkDeviceSize size;
+    uint32_t memoryTypeIndex;
+    MemoryPoolStrategy strategy;
+    bool dedicated;
+    void *mapped;
+
+    // Number of live allocations in this block
+    uint32_t allocationCount;
+
+    // MEMORY_POOL_FREE_LIST: map from offset to size of each free range.
+    // Adjacent free ranges are always merged
+    std::map<VkDeviceSize, VkDeviceSize> freeRanges;
+
+    // MEMORY_POOL_LINEAR: live allocations, oldest first. The newest
+    // allocation is at the back, so new allocations go after it (wrapping
+    // around to offset 0 when they hit the end of the block), and space is
+    // reclaimed from the front
+    struct RingEntry
+    {
+        VkDeviceSize begin;
+        VkDeviceSize end;
+        bool freed;
+    };
+    std::deque<RingEntry> ring;
+
+    bool AllocateFreeList(VkDeviceSize size, VkDeviceSize alignment, VkDeviceSize &offset)
+    {
+        // First fit
+        for (auto it = freeRanges.begin(); it != freeRanges.end(); ++it)
+        {
+            VkDeviceSize rangeBegin = it->first;
+            VkDeviceSize rangeEnd = it->first + it->second;
+            VkDeviceSize alignedBegin = AlignUp(rangeBegin, alignment);
+            if (alignedBegin + size > rangeEnd)
+                continue;
+
+            freeRanges.erase(it);
+
+            // Return the unused space on either side of the allocation
+            if (alignedBegin > rangeBegin)
+                freeRanges[rangeBegin] = alignedBegin - rangeBegin;
+            if (alignedBegin + size < rangeEnd)
+                freeRanges[alignedBegin + size] = rangeEnd - (alignedBegin + size);
+
+            offset = alignedBegin;
+            return true;
+        }
+        return false;
+    }
+
+    void FreeFreeList(VkDeviceSize offset, VkDeviceSize size)
+    {
+        auto next = freeRanges.lower_bound(offset);
+        ASSERT(next == freeRanges.end() || next->first >= offset + size);
+
+        // Merge with the following range
+        if (next != freeRanges.end() && next->first == offset + size)
+        {
+            size += next->second;
+            next = freeRanges.erase(next);
+        }
+
+        // Merge with the preceding range
+        if (next != freeRanges.begin())
+        {
+            auto prev = std::prev(next);
+            ASSERT(prev->first + prev->second <= offset);
+            if (prev->first + prev->second == offset)
+            {
+                prev->second += size;
+                return;
+            }
+        }
+
+        freeRanges[offset] = size;
+    }
+
+    bool AllocateLinear(VkDeviceSize size, VkDeviceSize alignment, VkDeviceSize &offset)
+    {
+        if (ring.empty())
+        {
+            if (size > this->size)
+                return false;
+            offset = 0;
+        }
+        else
+        {
+            VkDeviceSize head = ring.back().end;
+            VkDeviceSize tail = ring.front().begin;
+            bool wrapped = ring.back().begin < tail;
+            VkDeviceSize aligned = AlignUp(head, alignment);
+
+            if (wrapped)
+            {
+                // Free space is [head, tail)
+                if (aligned + size > tail)
+                    return false;
+                offset = aligned;
+            }
+            else if (aligned + size <= this->size)
+            {
+                // Fits in [head, end of block)
+                offset = aligned;
+            }
+            else if (size <= tail)
+            {
+                // Wrap around to [0, tail)
+                offset = 0;
+            }
+            else
+            {
+                return false;
+            }
+        }
+
+        RingEntry entry = { offset, offset + size, false };
+        ring.push_back(entry);
+        return true;
+    }
+
+    void FreeLinear(VkDeviceSize offset)
+    {
+        auto it = std::find_if(ring.begin(), ring.end(),
+            [offset](const RingEntry &e) { return e.begin == offset && !e.freed; });
+        ASSERT(it != ring.end());
+        it->freed = true;
+
+        while (!ring.empty() && ring.front().freed)
+            ring.pop_front();
+    }
+};
+
+const char *MemoryArchitectureString(MemoryArchitecture architecture)
+{
+    switch (architecture)
+    {
+    case MEMORY_ARCHITECTURE_DISCRETE: return "discrete";
+    case MEMORY_ARCHITECTURE_BAR: return "discrete with host-visible device memory";
+    case MEMORY_ARCHITECTURE_UNIFIED: return "unified";
+    default: return "unknown";
+    }
+}
+
+MemoryAllocator::MemoryAllocator(const InstanceFunctions &ipfn, const DeviceFunctions &pfn,
+    VkPhysicalDevice physicalDevice, VkDevice device, VkDeviceSize blockSize)
+    : m_pfn(pfn), m_Device(device), m_BlockSize(blockSize), m_AllocationCount(0)
+{
+    ipfn.vkGetPhysicalDeviceMemoryProperties(physicalDevice, &m_MemoryProperties);
+
+    VkPhysicalDeviceProperties properties;
+    ipfn.vkGetPhysicalDeviceProperties(physicalDevice, &properties);
+    m_Limits = properties.limits;
+
+    for (uint32_t i = 0; i < VK_MAX_MEMORY_HEAPS; ++i)
+    {
+        m_HeapStats[i] = MemoryHeapStats();
+        if (i < m_MemoryProperties.memoryHeapCount)
+            m_HeapStats[i].heapSize = m_MemoryProperties.memoryHeaps[i].size;
+    }
+
+    // The main heap is the largest DEVICE_LOCAL one (every device has at
+    // least one)
+    uint32_t mainHeap = UINT32_MAX;
+    for (uint32_t i = 0; i < m_MemoryProperties.memoryHeapCount; ++i)
+    {
+        const VkMemoryHeap &heap = m_MemoryProperties.memoryHeaps[i];
+        if ((heap.flags & VK_MEMORY_HEAP_DEVICE_LOCAL_BIT) &&
+            (mainHeap == UINT32_MAX || heap.size > m_MemoryProperties.memoryHeaps[mainHeap].size))
+            mainHeap = i;
+    }
+
+    m_Architecture = MEMORY_ARCHITECTURE_DISCRETE;
+    const VkMemoryPropertyFlags mappableDeviceLocal = VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT | VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT;
+    for (uint32_t i = 0; i < m_MemoryProperties.memoryTypeCount; ++i)
+    {
+        const VkMemoryType &type = m_MemoryProperties.memoryTypes[i];
+        if ((type.propertyFlags & mappableDeviceLocal) != mappableDeviceLocal)
+            continue;
+
+        if (type.heapIndex == mainHeap)
+        {
+            m_Architecture = MEMORY_ARCHITECTURE_UNIFIED;
+            break;
+        }
+        m_Architecture = MEMORY_ARCHITECTURE_BAR;
+    }
+
+    LOGI("Memory architecture: %s", MemoryArchitectureString(m_Architecture));
+}
+
+MemoryAllocator::~MemoryAllocator()
+{
+    for (auto &byType : m_Pools)
+        for (auto &byStrategy : byType)
+            for (auto &pool : byStrategy)
+                for (auto &block : pool.blocks)
+                {
+                    if (block->allocationCount)
+                        LOGW("MemoryAllocator destroyed with %u allocations still live", block->allocationCount);
+                    DestroyBlock(block.get());
+                }
+
+    for (auto &block : m_DedicatedBlocks)
+    {
+        LOGW("MemoryAllocator destroyed with a dedicated allocation still live");
+        DestroyBlock(block.get());
+    }
+}
+
+uint32_t MemoryAllocator::FindMemoryType(uint32_t memoryTypeBits,
+    VkMemoryPropertyFlags required, VkMemoryPropertyFlags preferred) const
+{
+    // The spec requires memory types to be ordered so that ones with a subset
+    // of another's flags (or the same flags but better performance) come
+    // first, so the first match is the least 'special' suitable type
+    for (uint32_t i = 0; i < m_MemoryProperties.memoryTypeCount; ++i)
+    {
+        VkMemoryPropertyFlags flags = m_MemoryProperties.memoryTypes[i].propertyFlags;
+        if ((memoryTypeBits & (1 << i)) && (flags & (required | preferred)) == (required | preferred))
+            return i;
+    }
+
+    for (uint32_t i = 0; i < m_MemoryProperties.memoryTypeCount; ++i)
+    {
+        VkMemoryPropertyFlags flags = m_MemoryProperties.memoryTypes[i].propertyFlags;
+        if ((memoryTypeBits & (1 << i)) && (flags & required) == required)
+            return i;
+    }
+
+    return UINT32_MAX;
+}
+
+MemoryBlock *MemoryAllocator::CreateBlock(uint32_t memoryTypeIndex, VkDeviceSize size, MemoryPoolStrategy strategy)
+{
+    if (m_AllocationCount >= m_Limits.maxMemoryAllocationCount)
+    {
+        LOGE("Exceeded maxMemoryAllocationCount (%u)", m_Limits.maxMemoryAllocationCount);
+        return nullptr;
+    }
+
+    // Going over the heap's size might fail, or (on some platforms) silently
+    // page memory out to somewhere much slower
+    MemoryHeapStats &heapStats = m_HeapStats[m_MemoryProperties.memoryTypes[memoryTypeIndex].heapIndex];
+    if (heapStats.blockBytes + size > heapStats.heapSize)
+    {
+        LOGW("Allocating %" PRIu64 " KB exceeds heap %u's size (%" PRIu64 " of %" PRIu64 " KB in use)",
+            size / 1024, m_MemoryProperties.memoryTypes[memoryTypeIndex].heapIndex,
+            heapStats.blockBytes / 1024, heapStats.heapSize / 1024);
+    }
+
+    VkMemoryAllocateInfo allocateInfo = {};
+    allocateInfo.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
+    allocateInfo.allocationSize = size;
+    allocateInfo.memoryTypeIndex = memoryTypeIndex;
+
+    VkDeviceMemory memory;
+    VkResult result = m_pfn.vkAllocateMemory(m_Device, &allocateInfo, CREATE_ALLOCATOR(), &memory);
+    if (result != VK_SUCCESS)
+    {
+        LOGE("vkAllocateMemory failed (%d)", result);
+        return nullptr;
+    }
+
+    void *mapped = nullptr;
+    if (m_MemoryProperties.memoryTypes[memoryTypeIndex].propertyFlags & VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT)
+    {
+        // Each VkDeviceMemory can only be mapped once at a time, so we map the
+        // whole block up front and leave it mapped
+        result = m_pfn.vkMapMemory(m_Device, memory, 0, VK_WHOLE_SIZE, 0, &mapped);
+        if (result != VK_SUCCESS)
+        {
+            LOGE("vkMapMemory failed (%d)", result);
+            m_pfn.vkFreeMemory(m_Device, memory, CREATE_ALLOCATOR());
+            return nullptr;
+        }
+    }
+
+    ++m_AllocationCount;
+
+    heapStats.blockBytes += size;
+    heapStats.peakBlockBytes = std::max(heapStats.peakBlockBytes, heapStats.blockBytes);
+    ++heapStats.blockCount;
+
+    MemoryBlock *block = new MemoryBlock;
+    block->memory = memory;
+    block->size = size;
+    block->memoryTypeIndex = memoryTypeIndex;
+    block->strategy = strategy;
+    block->dedicated = false;
+    block->mapped = mapped;
+    block->allocationCount = 0;
+    if (strategy == MEMORY_POOL_FREE_LIST)
+        block->freeRanges[0] = size;
+    return block;
+}
+
+void MemoryAllocator::DestroyBlock(MemoryBlock *block)
+{
+    // vkFreeMemory implicitly unmaps
+    m_pfn.vkFreeMemory(m_Device, block->memory, CREATE_ALLOCATOR());
+    block->memory = VK_NULL_HANDLE;
+    --m_AllocationCount;
+
+    MemoryHeapStats &heapStats = m_HeapStats[m_MemoryProperties.memoryTypes[block->memoryTypeIndex].heapIndex];
+    heapStats.blockBytes -= block->size;
+    --heapStats.blockCount;
+}
+
+bool MemoryAllocator::Allocate(const VkMemoryRequirements &requirements,
+    VkMemoryPropertyFlags required, VkMemoryPropertyFlags preferred,
+    MemoryResourceType resourceType, MemoryPoolStrategy strategy,
+    MemoryAllocation &allocation)
+{
+    uint32_t memoryTypeIndex = FindMemoryType(requirements.memoryTypeBits, required, preferred);
+    if (memoryTypeIndex == UINT32_MAX)
+    {
+        LOGE("Failed to find memory type for bits 0x%x, flags 0x%x", requirements.memoryTypeBits, required);
+        return false;
+    }
+
+    std::lock_guard<std::mutex> lock(m_Mutex);
+
+    // A block can't usefully be larger than its heap
+    VkDeviceSize heapSize = m_MemoryProperties.memoryHeaps[m_MemoryProperties.memoryTypes[memoryTypeIndex].heapIndex].size;
+    VkDeviceSize blockSize = std::min(m_BlockSize, std::max<VkDeviceSize>(heapSize / 8, 1));
+
+    // Big allocations get their own VkDeviceMemory, so we don't waste the
+    // rest of a block
+    if (requirements.size > blockSize / 2)
+    {
+        MemoryBlock *block = CreateBlock(memoryTypeIndex, requirements.size, strategy);
+        if (!block)
+            return false;
+        block->dedicated = true;
+        block->allocationCount = 1;
+        m_DedicatedBlocks.emplace_back(block);
+
+        MemoryHeapStats &heapStats = m_HeapStats[m_MemoryProperties.memoryTypes[memoryTypeIndex].heapIndex];
+        heapStats.usedBytes += requirements.size;
+        ++heapStats.allocationCount;
+
+        allocation.memory = block->memory;
+        allocation.offset = 0;
+        allocation.size = requirements.size;
+        allocation.memoryTypeIndex = memoryTypeIndex;
+        allocation.mappedPtr = block->mapped;
+        allocation.block = block;
+        return true;
+    }
+
+    // If linear and optimal resources might conflict, keep them in separate
+    // blocks. bufferImageGranularity is typically either 1 (no conflict) or
+    // large enough (e.g. 1KB-64KB) that padding between neighbours would be
+    // wasteful anyway
+    if (m_Limits.bufferImageGranularity <= 1)
+        resourceType = MEMORY_RESOURCE_LINEAR;
+
+    Pool &pool = m_Pools[memoryTypeIndex][strategy][resourceType];
+
+    VkDeviceSize alignment = std::max<VkDeviceSize>(requirements.alignment, 1);
+
+    MemoryBlock *block = nullptr;
+    VkDeviceSize offset = 0;
+    for (auto &b : pool.blocks)
+    {
+        bool ok = (strategy == MEMORY_POOL_FREE_LIST
+            ? b->AllocateFreeList(requirements.size, alignment, offset)
+            : b->AllocateLinear(requirements.size, alignment, offset));
+        if (ok)
+        {
+            block = b.get();
+            break;
+        }
+    }
+
+    if (!block)
+    {
+        block = CreateBlock(memoryTypeIndex, blockSize, strategy);
+        if (!block)
+            return false;
+        pool.blocks.emplace_back(block);
+
+        bool ok = (strategy == MEMORY_POOL_FREE_LIST
+            ? block->AllocateFreeList(requirements.size, alignment, offset)
+            : block->AllocateLinear(requirements.size, alignment, offset));
+        ASSERT(ok);
+    }
+
+    ++block->allocationCount;
+
+    MemoryHeapStats &heapStats = m_HeapStats[m_MemoryProperties.memoryTypes[memoryTypeIndex].heapIndex];
+    heapStats.usedBytes += requirements.size;
+    ++heapStats.allocationCount;
+
+    allocation.memory = block->memory;
+    allocation.offset = offset;
+    allocation.size = requirements.size;
+    allocation.memoryTypeIndex = memoryTypeIndex;
+    allocation.mappedPtr = block->mapped ? (char *)block->mapped + offset : nullptr;
+    allocation.block = block;
+    return true;
+}
+
+bool MemoryAllocator::AllocateForImage(VkImage image, VkImageTiling tiling,
+    VkMemoryPropertyFlags required, VkMemoryPropertyFlags preferred,
+    MemoryAllocation &allocation, MemoryPoolStrategy strategy)
+{
+    VkMemoryRequirements requirements;
+    m_pfn.vkGetImageMemoryRequirements(m_Device, image, &requirements);
+
+    MemoryResourceType resourceType = (tiling == VK_IMAGE_TILING_LINEAR ? MEMORY_RESOURCE_LINEAR : MEMORY_RESOURCE_OPTIMAL);
+    if (!Allocate(requirements, required, preferred, resourceType, strategy, allocation))
+        return false;
+
+    VkResult result = m_pfn.vkBindImageMemory(m_Device, image, allocation.memory, allocation.offset);
+    if (result != VK_SUCCESS)
+    {
+        LOGE("vkBindImageMemory failed (%d)", result);
+        Free(allocation);
+        return false;
+    }
+
+    return true;
+}
+
+bool MemoryAllocator::AllocateForBuffer(VkBuffer buffer,
+    VkMemoryPropertyFlags required, VkMemoryPropertyFlags preferred,
+    MemoryAllocation &allocation, MemoryPoolStrategy strategy)
+{
+    VkMemoryRequirements requirements;
+    m_pfn.vkGetBufferMemoryRequirements(m_Device, buffer, &requirements);
+
+    if (!Allocate(requirements, required, preferred, MEMORY_RESOURCE_LINEAR, strategy, allocation))
+        return false;
+
+    VkResult result = m_pfn.vkBindBufferMemory(m_Device, buffer, allocation.memory, allocation.offset);
+    if (result != VK_SUCCESS)
+    {
+        LOGE("vkBindBufferMemory failed (%d)", result);
+        Free(allocation);
+        return false;
+    }
+
+    return true;
+}
+
+void MemoryAllocator::Free(MemoryAllocation &allocation)
+{
+    MemoryBlock *block = allocation.block;
+    if (!block)
+        return;
+
+    std::lock_guard<std::mutex> lock(m_Mutex);
+
+    ASSERT(block->allocationCount > 0);
+    --block->allocationCount;
+
+    MemoryHeapStats &heapStats = m_HeapStats[m_MemoryProperties.memoryTypes[allocation.memoryTypeIndex].heapIndex];
+    heapStats.usedBytes -= allocation.size;
+    --heapStats.allocationCount;
+
+    if (block->dedicated)
+    {
+        DestroyBlock(block);
+        auto it = std::find_if(m_DedicatedBlocks.begin(), m_DedicatedBlocks.end(),
+            [block](const std::unique_ptr<MemoryBlock> &b) { return b.get() == block; });
+        ASSERT(it != m_DedicatedBlocks.end());
+        m_DedicatedBlocks.erase(it);
+    }
+    else
+    {
+        if (block->strategy == MEMORY_POOL_FREE_LIST)
+            block->FreeFreeList(allocation.offset, allocation.size);
+        else
+            block->FreeLinear(allocation.offset);
+
+        // Keep empty blocks around for reuse, to avoid repeatedly allocating
+        // and freeing when usage hovers around a block boundary
+    }
+
+    allocation = MemoryAllocation();
+}
+
+MemoryHeapStats MemoryAllocator::GetHeapStats(uint32_t heapIndex)
+{
+    ASSERT(heapIndex < m_MemoryProperties.memoryHeapCount);
+
+    std::lock_guard<std::mutex> lock(m_Mutex);
+    return m_HeapStats[heapIndex];
+}
+
+void MemoryAllocator::LogHeapStats()
+{
+    for (uint32_t i = 0; i < m_MemoryProperties.memoryHeapCount; ++i)
+    {
+        MemoryHeapStats stats = GetHeapStats(i);
+        LOGI("Heap %u: %u blocks, %" PRIu64 " KB (peak %" PRIu64 " KB, %.1f%% of %" PRIu64 " KB), %u allocations using %" PRIu64 " KB",
+            i, stats.blockCount, stats.blockBytes / 1024, stats.peakBlockBytes / 1024,
+            stats.heapSize ? 100.0 * stats.peakBlockBytes / stats.heapSize : 0.0, stats.heapSize / 1024,
+            stats.allocationCount, stats.usedBytes / 1024);
+    }
+}
+
+bool MemoryAllocator::GetMappedRange(const MemoryAllocation &allocation, VkDeviceSize offset, VkDeviceSize size,
+    VkMappedMemoryRange &range)
+{
+    ASSERT(allocation.mappedPtr);
+    ASSERT(offset + size <= allocation.size);
+
+    if (m_MemoryProperties.memoryTypes[allocation.memoryTypeIndex].propertyFlags & VK_MEMORY_PROPERTY_HOST_COHERENT_BIT)
+        return false;
+
+    // The range must be a multiple of nonCoherentAtomSize, or extend to the
+    // end of the VkDeviceMemory. Other allocations in the same block may get
+    // flushed or invalidated too, which is harmless as long as nobody else is
+    // writing to those bytes from the host at the same time
+    VkDeviceSize atom = std::max<VkDeviceSize>(m_Limits.nonCoherentAtomSize, 1);
+    VkDeviceSize begin = AlignDown(allocation.offset + offset, atom);
+    VkDeviceSize end = AlignUp(allocation.offset + offset + size, atom);
+
+    range = {};
+    range.sType = VK_STRUCTURE_TYPE_MAPPED_MEMORY_RANGE;
+    range.memory = allocation.memory;
+    range.offset = begin;
+    range.size = (end >= allocation.block->size ? VK_WHOLE_SIZE : end - begin);
+    return true;
+}
+
+bool MemoryAllocator::FlushRange(const MemoryAllocation &allocation, VkDeviceSize offset, VkDeviceSize size)
+{
+    VkMappedMemoryRange range;
+    if (!GetMappedRange(allocation, offset, size, range))
+        return true;
+
+    VkResult result = m_pfn.vkFlushMappedMemoryRanges(m_Device, 1, &range);
+    if (result != VK_SUCCESS)
+    {
+        LOGE("vkFlushMappedMemoryRanges failed (%d)", result);
+        return false;
+    }
+    return true;
+}
+
+bool MemoryAllocator::InvalidateRange(const MemoryAllocation &allocation, VkDeviceSize offset, VkDeviceSize size)
+{
+    VkMappedMemoryRange range;
+    if (!GetMappedRange(allocation, offset, size, range))
+        return true;
+
+    VkResult result = m_pfn.vkInvalidateMappedMemoryRanges(m_Device, 1, &range);
+    if (result != VK_SUCCESS)
+    {
+        LOGE("vkInvalidateMappedMemoryRanges failed (%d)", result);
+        return false;
+    }
+    return true;
+}
@@ -0,0 +1,258 @@
+/*
+ * Copyright (c) 2016 Philip Taylor
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#ifndef INCLUDED_VKSXS_MEMORY_ALLOCATOR
+#define INCLUDED_VKSXS_MEMORY_ALLOCATOR
+
+#include "common/Common.h"
+
+#include "common/DeviceFunctions.h"
+#include "common/InstanceFunctions.h"
+
+#include <map>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+/*
+ * Resources which may be placed in the same VkDeviceMemory need to be kept
+ * bufferImageGranularity apart if one is linear and the other isn't, so the
+ * allocator needs to know which kind each allocation is for.
+ */
+enum MemoryResourceType
+{
+    MEMORY_RESOURCE_LINEAR,  // buffers, and images with VK_IMAGE_TILING_LINEAR
+    MEMORY_RESOURCE_OPTIMAL, // images with VK_IMAGE_TILING_OPTIMAL
+};
+
+enum MemoryPoolStrategy
+{
+    // General-purpose: allocations can be freed in any order
+    MEMORY_POOL_FREE_LIST,
+
+    // Ring buffer: allocations are very cheap, but space is only reclaimed
+    // once everything allocated before it has been freed too. Good for
+    // short-lived per-frame resources
+    MEMORY_POOL_LINEAR,
+};
+
+/*
+ * How the device's memory relates to the host's, which decides whether
+ * resources that the host reads or writes are worth copying through a
+ * staging buffer.
+ */
+enum MemoryArchitecture
+{
+    // No DEVICE_LOCAL memory is HOST_VISIBLE, so the host only sees the
+    // device's resources through copies
+    MEMORY_ARCHITECTURE_DISCRETE,
+
+    // Some DEVICE_LOCAL memory is HOST_VISIBLE, but not in the main
+    // DEVICE_LOCAL heap: typically a small PCIe BAR window (e.g. 256MB),
+    // which is good for the host to stream writes into but slow to read from
+    MEMORY_ARCHITECTURE_BAR,
+
+    // The main DEVICE_LOCAL heap is HOST_VISIBLE, e.g. integrated GPUs where
+    // the host and device share memory. Resources can be read and written
+    // in place by both, and copying them just doubles the memory traffic
+    MEMORY_ARCHITECTURE_UNIFIED,
+};
+
+const char *MemoryArchitectureString(MemoryArchitecture architecture);
+
+struct MemoryBlock;
+
+struct MemoryAllocation
+{
+    VkDeviceMemory memory;
+    VkDeviceSize offset;
+    VkDeviceSize size;
+    uint32_t memoryTypeIndex;
+
+    // Pointer to the start of the allocation, if the memory type is
+    // HOST_VISIBLE (the whole block is persistently mapped), else nullptr
+    void *mappedPtr;
+
+    MemoryBlock *block;
+
+    MemoryAllocation()
+        : memory(VK_NULL_HANDLE), offset(0), size(0), memoryTypeIndex(UINT32_MAX),
+        mappedPtr(nullptr), block(nullptr)
+    {
+    }
+};
+
+// Device memory usage of one heap, as seen by one MemoryAllocator
+struct MemoryHeapStats
+{
+    VkDeviceSize heapSize;
+    VkDeviceSize blockBytes;     // in VkDeviceMemory allocations
+    VkDeviceSize peakBlockBytes;
+    VkDeviceSize usedBytes;      // sub-allocated to resources
+    uint32_t blockCount;
+    uint32_t allocationCount;
+};
+
+/*
+ * Sub-allocator for VkDeviceMemory.
+ *
+ * Drivers may have a low limit on the number of allocations
+ * (maxMemoryAllocationCount can be as low as 4096) and vkAllocateMemory is
+ * typically an expensive kernel call, so we allocate memory in large blocks
+ * and carve resources out of them.
+ *
+ * Each memory type has its own set of pools (one per strategy, and one per
+ * MemoryResourceType if bufferImageGranularity requires separating linear and
+ * optimal resources). Requests that are a large fraction of the block size
+ * get a dedicated VkDeviceMemory instead.
+ *
+ * Allocate/Free are thread-safe.
+ */
+class MemoryAllocator
+{
+public:
+    static const VkDeviceSize DEFAULT_BLOCK_SIZE = 64 * 1024 * 1024;
+
+    MemoryAllocator(const InstanceFunctions &ipfn, const DeviceFunctions &pfn,
+        VkPhysicalDevice physicalDevice, VkDevice device,
+        VkDeviceSize blockSize = DEFAULT_BLOCK_SIZE);
+
+    ~MemoryAllocator();
+
+    MemoryAllocator(const MemoryAllocator &) = delete;
+    MemoryAllocator &operator=(const MemoryAllocator &) = delete;
+
+    const VkPhysicalDeviceMemoryProperties &GetMemoryProperties() const { return m_MemoryProperties; }
+    const VkPhysicalDeviceLimits &GetLimits() const { return m_Limits; }
+    MemoryArchitecture GetArchitecture() const { return m_Architecture; }
+
+    /*
+     * Returns the index of a memory type that's allowed by memoryTypeBits and
+     * has all the required flags, preferring one that also has all the
+     * preferred flags. Returns UINT32_MAX if there's no suitable type.
+     */
+    uint32_t FindMemoryType(uint32_t memoryTypeBits,
+        VkMemoryPropertyFlags required, VkMemoryPropertyFlags preferred = 0) const;
+
+    bool Allocate(const VkMemoryRequirements &requirements,
+        VkMemoryPropertyFlags required, VkMemoryPropertyFlags preferred,
+        MemoryResourceType resourceType, MemoryPoolStrategy strategy,
+        MemoryAllocation &allocation);
+
+    // Allocate and bind memory for a resource
+    bool AllocateForImage(VkImage image, VkImageTiling tiling,
+        VkMemoryPropertyFlags required, VkMemoryPropertyFlags preferred,
+        MemoryAllocation &allocation, MemoryPoolStrategy strategy = MEMORY_POOL_FREE_LIST);
+
+    bool AllocateForBuffer(VkBuffer buffer,
+        VkMemoryPropertyFlags required, VkMemoryPropertyFlags preferred,
+        MemoryAllocation &allocation, MemoryPoolStrategy strategy = MEMORY_POOL_FREE_LIST);
+
+    void Free(MemoryAllocation &allocation);
+
+    // Usage of a heap (an index into GetMemoryProperties().memoryHeaps)
+    MemoryHeapStats GetHeapStats(uint32_t heapIndex);
+
+    // Log every heap's usage against its size
+    void LogHeapStats();
+
+    /*
+     * Make host writes visible to the device, or device writes visible to the
+     * host, for a range within a mapped allocation. Does nothing for
+     * HOST_COHERENT memory. The range is expanded to nonCoherentAtomSize.
+     */
+    bool FlushRange(const MemoryAllocation &allocation, VkDeviceSize offset, VkDeviceSize size);
+    bool InvalidateRange(const MemoryAllocation &allocation, VkDeviceSize offset, VkDeviceSize size);
+
+private:
+    struct Pool
+    {
+        std::vector<std::unique_ptr<MemoryBlock>> blocks;
+    };
+
+    MemoryBlock *CreateBlock(uint32_t memoryTypeIndex, VkDeviceSize size, MemoryPoolStrategy strategy);
+    void DestroyBlock(MemoryBlock *block);
+
+    bool GetMappedRange(const MemoryAllocation &allocation, VkDeviceSize offset, VkDeviceSize size,
+        VkMappedMemoryRange &range);
+
+    const DeviceFunctions &m_pfn;
+    VkDevice m_Device;
+    VkDeviceSize m_BlockSize;
+
+    VkPhysicalDeviceMemoryProperties m_MemoryProperties;
+    VkPhysicalDeviceLimits m_Limits;
+    MemoryArchitecture m_Architecture;
+
+    std::mutex m_Mutex;
+
+    // Indexed by memory type, strategy, and resource type
+    Pool m_Pools[VK_MAX_MEMORY_TYPES][2][2];
+
+    // Blocks which hold a single large allocation
+    std::vector<std::unique_ptr<MemoryBlock>> m_DedicatedBlocks;
+
+    uint32_t m_AllocationCount;
+
+    MemoryHeapStats m_HeapStats[VK_MAX_MEMORY_HEAPS];
+};
+
+/*
+ * RAII wrapper that returns an allocation to its MemoryAllocator.
+ * The MemoryAllocator must outlive it.
+ */
+class AutoMemoryAllocation
+{
+public:
+    explicit AutoMemoryAllocation(MemoryAllocator &allocator)
+        : m_Allocator(allocator)
+    {
+    }
+
+    ~AutoMemoryAllocation()
+    {
+        m_Allocator.Free(m_Allocation);
+    }
+
+    AutoMemoryAllocation(const AutoMemoryAllocation &) = delete;
+    AutoMemoryAllocation &operator=(const AutoMemoryAllocation &) = delete;
+
+    MemoryAllocation &operator*() { return m_Allocation; }
+    MemoryAllocation *operator->() { return &m_Allocation; }
+
+    // Give up ownership without freeing it (e.g. to free it later, once the
+    // GPU has finished with it)
+    MemoryAllocation release()
+    {
+        MemoryAllocation allocation = m_Allocation;
+        m_Allocation = MemoryAllocation();
+        return allocation;
+    }
+
+    MemoryAllocator &GetAllocator() { return m_Allocator; }
+
+private:
+    MemoryAllocator &m_Allocator;
+    MemoryAllocation m_Allocation;
+};
+
+#endif // INCLUDED_VKSXS_MEMORY_ALLOCATOR
@@ -0,0 +1,179 @@
+/*
+ * Copyright (c) 2016 Philip Taylor
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include "common/Common.h"
+
+#include "common/AllocationCallbacks.h"
+#include "common/Log.h"
+#include "common/PipelineCache.h"
+
+#include <cstdio>
+#include <fstream>
+#include <iterator>
+
+// The VK_PIPELINE_CACHE_HEADER_VERSION_ONE header, as defined by the spec
+struct PipelineCacheHeader
+{
+    uint32_t headerSize;
+    uint32_t headerVersion;
+    uint32_t vendorID;
+    uint32_t deviceID;
+    uint8_t pipelineCacheUUID[VK_UUID_SIZE];
+};
+
+PipelineCache::PipelineCache(const DeviceFunctions &pfn, VkDevice device, const VkPhysicalDeviceProperties &properties)
+    : m_pfn(pfn), m_Device(device), m_Properties(properties), m_Cache(pfn, device)
+{
+}
+
+bool PipelineCache::IsCompatible(const std::vector<char> &data) const
+{
+    PipelineCacheHeader header;
+    if (data.size() < sizeof(header))
+        return false;
+    memcpy(&header, data.data(), sizeof(header));
+
+    return header.headerSize >= sizeof(header) &&
+        header.headerSize <= data.size() &&
+        header.headerVersion == VK_PIPELINE_CACHE_HEADER_VERSION_ONE &&
+        header.vendorID == m_Properties.vendorID &&
+        header.deviceID == m_Properties.deviceID &&
+        memcmp(header.pipelineCacheUUID, m_Properties.pipelineCacheUUID, VK_UUID_SIZE) == 0;
+}
+
+bool PipelineCache::Setup(const std::string &path)
+{
+    m_Path = path;
+
+    std::vector<char> data;
+    if (!path.empty())
+    {
+        std::ifstream in(path, std::ifstream::binary | std::ifstream::in);
+        if (in)
+        {
+            data.assign(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+            if (!IsCompatible(data))
+            {
+                LOGI("Ignoring incompatible pipeline cache %s", path.c_str());
+                data.clear();
+            }
+            else
+            {
+                LOGI("Loaded %u bytes of pipeline cache from %s", (uint32_t)data.size(), path.c_str());
+            }
+        }
+    }
+
+    VkPipelineCacheCreateInfo createInfo = {};
+    createInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_CACHE_CREATE_INFO;
+    createInfo.initialDataSize = data.size();
+    createInfo.pInitialData = data.empty() ? nullptr : data.data();
+    VkResult result = m_pfn.vkCreatePipelineCache(m_Device, &createInfo, CREATE_ALLOCATOR(), m_Cache.ptr());
+    if (result != VK_SUCCESS)
+    {
+        LOGE("vkCreatePipelineCache failed (%d)", result);
+        return false;
+    }
+
+    return true;
+}
+
+bool PipelineCache::Save()
+{
+    if (m_Path.empty() || !m_Cache)
+        return true;
+
+    size_t size;
+    VkResult result = m_pfn.vkGetPipelineCacheData(m_Device, m_Cache, &size, nullptr);
+    if (result != VK_SUCCESS)
+    {
+        LOGE("vkGetPipelineCacheData failed (%d)", result);
+        return false;
+    }
+
+    std::vector<char> data(size);
+    result = m_pfn.vkGetPipelineCacheData(m_Device, m_Cache, &size, data.data());
+    if (result != VK_SUCCESS)
+    {
+        LOGE("vkGetPipelineCacheData failed (%d)", result);
+        return false;
+    }
+    data.resize(size);
+
+    std::string tempPath = m_Path + ".tmp";
+    {
+        std::ofstream out(tempPath, std::ofstream::binary | std::ofstream::out | std::ofstream::trunc);
+        out.write(data.data(), data.size());
+        out.close();
+        if (!out)
+        {
+            LOGE("Failed to write pipeline cache to %s", tempPath.c_str());
+            std::remove(tempPath.c_str());
+            return false;
+        }
+    }
+
+#ifdef _WIN32
+    bool renamed = (MoveFileExA(tempPath.c_str(), m_Path.c_str(), MOVEFILE_REPLACE_EXISTING) != 0);
+#else
+    bool renamed = (std::rename(tempPath.c_str(), m_Path.c_str()) == 0);
+#endif
+    if (!renamed)
+    {
+        LOGE("Failed to rename %s to %s", tempPath.c_str(), m_Path.c_str());
+        std::remove(tempPath.c_str());
+        return false;
+    }
+
+    return true;
+}
+
+bool PipelineCache::CreateThreadCache(AutoVkPipelineCache &cache)
+{
+    AutoVkPipelineCache newCache(m_pfn, m_Device);
+
+    VkPipelineCacheCreateInfo createInfo = {};
+    createInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_CACHE_CREATE_INFO;
+    VkResult result = m_pfn.vkCreatePipelineCache(m_Device, &createInfo, CREATE_ALLOCATOR(), newCache.ptr());
+    if (result != VK_SUCCESS)
+    {
+        LOGE("vkCreatePipelineCache failed (%d)", result);
+        return false;
+    }
+
+    cache = std::move(newCache);
+    return true;
+}
+
+bool PipelineCache::Merge(const std::vector<VkPipelineCache> &caches)
+{
+    if (caches.empty())
+        return true;
+
+    VkResult result = m_pfn.vkMergePipelineCaches(m_Device, m_Cache, (uint32_t)caches.size(), caches.data());
+    if (result != VK_SUCCESS)
+    {
+        LOGE("vkMergePipelineCaches failed (%d)", result);
+        return false;
+    }
+    return true;
+}
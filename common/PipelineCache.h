@@ -0,0 +1,84 @@
+/*
+ * Copyright (c) 2016 Philip Taylor
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#ifndef INCLUDED_VKSXS_PIPELINE_CACHE
+#define INCLUDED_VKSXS_PIPELINE_CACHE
+
+#include "common/Common.h"
+
+#include "common/AutoWrappers.h"
+#include "common/DeviceFunctions.h"
+
+#include <string>
+#include <vector>
+
+/*
+ * A VkPipelineCache that can be loaded from and saved to disk.
+ *
+ * Cache data from a different driver or device is useless (and could crash a
+ * buggy driver), so loaded data is only used if its header matches the
+ * current device's vendorID, deviceID and pipelineCacheUUID. Saving writes a
+ * temporary file and renames it over the old one, so a crash mid-write can't
+ * leave a truncated cache.
+ *
+ * In Vulkan 1.0, use of a VkPipelineCache must be externally synchronised.
+ * Threads that compile pipelines in parallel should each use their own cache
+ * from CreateThreadCache(), merged back with Merge() afterwards.
+ */
+class PipelineCache
+{
+public:
+    PipelineCache(const DeviceFunctions &pfn, VkDevice device, const VkPhysicalDeviceProperties &properties);
+
+    PipelineCache(const PipelineCache &) = delete;
+    PipelineCache &operator=(const PipelineCache &) = delete;
+
+    /*
+     * Create the cache, seeded from 'path' if it exists and is compatible
+     * (an empty path, missing file or mismatched data gives an empty cache)
+     */
+    bool Setup(const std::string &path);
+
+    VkPipelineCache Get() { return m_Cache; }
+
+    // Write the cache's data to the path given to Setup (if any)
+    bool Save();
+
+    // An empty cache for one thread's pipeline creation
+    bool CreateThreadCache(AutoVkPipelineCache &cache);
+
+    // Merge other caches (e.g. from CreateThreadCache) into this one
+    bool Merge(const std::vector<VkPipelineCache> &caches);
+
+    // Whether 'data' is pipeline cache data for this device
+    bool IsCompatible(const std::vector<char> &data) const;
+
+private:
+    const DeviceFunctions &m_pfn;
+    VkDevice m_Device;
+    VkPhysicalDeviceProperties m_Properties;
+    std::string m_Path;
+
+    AutoVkPipelineCache m_Cache;
+};
+
+#endif // INCLUDED_VKSXS_PIPELINE_CACHE
@@ -0,0 +1,289 @@
+/*
+ * Copyright (c) 2016 Philip Taylor
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include "common/Common.h"
+
+#include "common/AllocationCallbacks.h"
+#include "common/Log.h"
+#include "common/Profiler.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <fstream>
+
+const uint32_t Profiler::INVALID_MARKER;
+const uint32_t Profiler::DEFAULT_MAX_MARKERS_PER_FRAME;
+
+Profiler::Profiler(const DeviceFunctions &pfn, VkDevice device, float timestampPeriod,
+    uint32_t framesInFlight, uint32_t maxMarkersPerFrame)
+    : m_pfn(pfn), m_Device(device), m_TimestampPeriod(timestampPeriod),
+    m_MaxMarkersPerFrame(maxMarkersPerFrame),
+    m_CpuStart(std::chrono::steady_clock::now()),
+    m_HaveGpuStart(false), m_GpuStart(0),
+    m_CurrentSlot(~(uint32_t)0)
+{
+    for (uint32_t i = 0; i < framesInFlight; ++i)
+        m_Slots.emplace_back(new Slot(pfn, device));
+}
+
+void Profiler::AddQueueFamily(uint32_t queueFamily, uint32_t timestampValidBits, const std::string &name)
+{
+    if (queueFamily >= m_QueueFamilies.size())
+        m_QueueFamilies.resize(queueFamily + 1, QueueFamilyInfo{ 0, std::string() });
+
+    QueueFamilyInfo &info = m_QueueFamilies[queueFamily];
+    if (timestampValidBits == 0)
+        info.timestampMask = 0;
+    else if (timestampValidBits >= 64)
+        info.timestampMask = ~(uint64_t)0;
+    else
+        info.timestampMask = ((uint64_t)1 << timestampValidBits) - 1;
+    info.name = name;
+}
+
+bool Profiler::Setup()
+{
+    for (auto &slot : m_Slots)
+    {
+        VkQueryPoolCreateInfo createInfo = {};
+        createInfo.sType = VK_STRUCTURE_TYPE_QUERY_POOL_CREATE_INFO;
+        createInfo.queryType = VK_QUERY_TYPE_TIMESTAMP;
+        createInfo.queryCount = m_MaxMarkersPerFrame * 2;
+        VkResult result = m_pfn.vkCreateQueryPool(m_Device, &createInfo, CREATE_ALLOCATOR(), slot->queryPool.ptr());
+        if (result != VK_SUCCESS)
+        {
+            LOGE("vkCreateQueryPool failed (%d)", result);
+            return false;
+        }
+    }
+    return true;
+}
+
+bool Profiler::BeginFrame(VkCommandBuffer commandBuffer, uint64_t frameNumber)
+{
+    std::lock_guard<std::mutex> lock(m_Mutex);
+
+    uint32_t slotIndex = (uint32_t)(frameNumber % m_Slots.size());
+    Slot &slot = *m_Slots[slotIndex];
+    if (!Resolve(slot))
+        return false;
+
+    m_pfn.vkCmdResetQueryPool(commandBuffer, slot.queryPool, 0, m_MaxMarkersPerFrame * 2);
+    slot.frameNumber = frameNumber;
+    slot.active = true;
+    m_CurrentSlot = slotIndex;
+    return true;
+}
+
+uint32_t Profiler::BeginMarker(VkCommandBuffer commandBuffer, uint32_t queueFamily, const char *name,
+    VkPipelineStageFlagBits stage)
+{
+    std::lock_guard<std::mutex> lock(m_Mutex);
+
+    if (m_CurrentSlot >= m_Slots.size())
+        return INVALID_MARKER;
+
+    if (queueFamily >= m_QueueFamilies.size() || m_QueueFamilies[queueFamily].timestampMask == 0)
+        return INVALID_MARKER;
+
+    Slot &slot = *m_Slots[m_CurrentSlot];
+    if (slot.markers.size() >= m_MaxMarkersPerFrame)
+        return INVALID_MARKER;
+
+    uint32_t marker = (uint32_t)slot.markers.size();
+    slot.markers.push_back(Marker{ name, queueFamily });
+
+    m_pfn.vkCmdWriteTimestamp(commandBuffer, stage, slot.queryPool, marker * 2);
+
+    // Include the slot, so EndMarker() still finds the right pool if the
+    // next frame has begun in the meantime
+    return m_CurrentSlot * m_MaxMarkersPerFrame + marker;
+}
+
+void Profiler::EndMarker(VkCommandBuffer commandBuffer, uint32_t marker, VkPipelineStageFlagBits stage)
+{
+    if (marker == INVALID_MARKER)
+        return;
+
+    std::lock_guard<std::mutex> lock(m_Mutex);
+    Slot &slot = *m_Slots[marker / m_MaxMarkersPerFrame];
+    m_pfn.vkCmdWriteTimestamp(commandBuffer, stage, slot.queryPool, (marker % m_MaxMarkersPerFrame) * 2 + 1);
+}
+
+double Profiler::GetCpuTimeUs() const
+{
+    return std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - m_CpuStart).count();
+}
+
+void Profiler::AddCpuEvent(const char *name, double startUs, double endUs)
+{
+    ProfileEvent event;
+    event.name = name;
+    event.track = "CPU";
+    event.gpu = false;
+    event.frame = 0;
+    event.startUs = startUs;
+    event.durationUs = endUs - startUs;
+
+    std::lock_guard<std::mutex> lock(m_Mutex);
+    m_Events.push_back(std::move(event));
+}
+
+bool Profiler::Resolve(Slot &slot)
+{
+    if (!slot.active)
+        return true;
+    slot.active = false;
+
+    uint32_t queryCount = (uint32_t)slot.markers.size() * 2;
+    if (queryCount == 0)
+        return true;
+
+    // The slot's frame has finished, so the results are ready and this
+    // doesn't wait
+    std::vector<uint64_t> timestamps(queryCount);
+    VkResult result = m_pfn.vkGetQueryPoolResults(m_Device, slot.queryPool, 0, queryCount,
+        timestamps.size() * sizeof(uint64_t), timestamps.data(), sizeof(uint64_t),
+        VK_QUERY_RESULT_64_BIT);
+    if (result == VK_NOT_READY)
+    {
+        // A marker was begun but never submitted (e.g. on an error path)
+        LOGW("Dropping GPU timings for frame %" PRIu64 ", which has unwritten timestamps", slot.frameNumber);
+        slot.markers.clear();
+        return true;
+    }
+    if (result != VK_SUCCESS)
+    {
+        LOGE("vkGetQueryPoolResults failed (%d)", result);
+        return false;
+    }
+
+    for (size_t i = 0; i < slot.markers.size(); ++i)
+    {
+        const Marker &marker = slot.markers[i];
+        uint64_t mask = m_QueueFamilies[marker.queueFamily].timestampMask;
+        uint64_t start = timestamps[i*2] & mask;
+        uint64_t end = timestamps[i*2 + 1] & mask;
+
+        if (!m_HaveGpuStart)
+        {
+            m_GpuStart = start;
+            m_HaveGpuStart = true;
+        }
+
+        ProfileEvent event;
+        event.name = marker.name;
+        event.track = m_QueueFamilies[marker.queueFamily].name;
+        event.gpu = true;
+        event.frame = slot.frameNumber;
+        event.startUs = (double)(int64_t)(start - m_GpuStart) * m_TimestampPeriod / 1000.0;
+        event.durationUs = (double)((end - start) & mask) * m_TimestampPeriod / 1000.0;
+        m_Events.push_back(std::move(event));
+    }
+
+    slot.markers.clear();
+    return true;
+}
+
+bool Profiler::ResolveAll()
+{
+    std::lock_guard<std::mutex> lock(m_Mutex);
+
+    // Oldest first, so the GPU start time comes from the earliest frame
+    std::vector<Slot *> slots;
+    for (auto &slot : m_Slots)
+        slots.push_back(slot.get());
+    std::sort(slots.begin(), slots.end(), [](const Slot *a, const Slot *b) {
+        return a->frameNumber < b->frameNumber;
+    });
+
+    for (Slot *slot : slots)
+    {
+        if (!Resolve(*slot))
+            return false;
+    }
+    m_CurrentSlot = ~(uint32_t)0;
+    return true;
+}
+
+std::vector<ProfileEvent> Profiler::GetEvents() const
+{
+    std::lock_guard<std::mutex> lock(m_Mutex);
+    return m_Events;
+}
+
+static std::string EscapeJson(const std::string &str)
+{
+    std::string out;
+    for (char c : str)
+    {
+        if (c == '"' || c == '\\')
+        {
+            out += '\\';
+            out += c;
+        }
+        else if ((unsigned char)c < 0x20)
+        {
+            char buf[8];
+            snprintf(buf, sizeof(buf), "\\u%04x", c);
+            out += buf;
+        }
+        else
+        {
+            out += c;
+        }
+    }
+    return out;
+}
+
+bool Profiler::WriteChromeTrace(const std::string &path) const
+{
+    std::vector<ProfileEvent> events = GetEvents();
+
+    std::ofstream out(path, std::ofstream::out | std::ofstream::trunc);
+    out << "{\"traceEvents\":[\n";
+
+    // Name the processes, since CPU and GPU times aren't on the same clock
+    out << "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":0,\"args\":{\"name\":\"CPU\"}},\n";
+    out << "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":1,\"args\":{\"name\":\"GPU\"}}";
+
+    char buf[64];
+    for (const ProfileEvent &event : events)
+    {
+        out << ",\n{\"name\":\"" << EscapeJson(event.name) << "\",\"ph\":\"X\"";
+        snprintf(buf, sizeof(buf), ",\"ts\":%.3f,\"dur\":%.3f", event.startUs, event.durationUs);
+        out << buf;
+        out << ",\"pid\":" << (event.gpu ? 1 : 0) << ",\"tid\":\"" << EscapeJson(event.track) << "\"";
+        if (event.gpu)
+            out << ",\"args\":{\"frame\":" << event.frame << "}";
+        out << "}";
+    }
+    out << "\n]}\n";
+
+    out.close();
+    if (!out)
+    {
+        LOGE("Failed to write %s", path.c_str());
+        return false;
+    }
+    return true;
+}
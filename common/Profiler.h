@@ -0,0 +1,208 @@
+/*
+ * Copyright (c) 2016 Philip Taylor
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#ifndef INCLUDED_VKSXS_PROFILER
+#define INCLUDED_VKSXS_PROFILER
+
+#include "common/Common.h"
+
+#include "common/AutoWrappers.h"
+#include "common/DeviceFunctions.h"
+
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+struct ProfileEvent
+{
+    std::string name;
+    std::string track;   // "CPU", or the queue family's name
+    bool gpu;
+    uint64_t frame;      // FrameManager frame number (GPU events only)
+    double startUs;      // CPU: since the profiler was created. GPU: since the first timestamp
+    double durationUs;
+};
+
+/*
+ * Collects CPU and GPU timings, and writes them as a Chrome trace (for
+ * chrome://tracing or similar viewers).
+ *
+ * GPU markers write a pair of timestamps with vkCmdWriteTimestamp into a
+ * query pool that belongs to the current frame's slot. The results are
+ * read by BeginFrame() when the slot comes round again, by which point
+ * FrameManager has waited for the slot's fence, so reading them never
+ * stalls. WaitIdle()/ResolveAll() picks up the rest once the device is
+ * idle.
+ *
+ * Vulkan 1.0 has no way to correlate the CPU and GPU clocks, so GPU events
+ * are put in their own process in the trace, relative to the first GPU
+ * timestamp. Timestamps from different queues are assumed to share a
+ * timebase, which is true on most implementations but isn't guaranteed.
+ *
+ * BeginMarker/EndMarker/AddCpuEvent are thread-safe, so markers can be put
+ * in secondary command buffers recorded on the JobSystem.
+ */
+class Profiler
+{
+public:
+    static const uint32_t INVALID_MARKER = ~(uint32_t)0;
+    static const uint32_t DEFAULT_MAX_MARKERS_PER_FRAME = 256;
+
+    Profiler(const DeviceFunctions &pfn, VkDevice device, float timestampPeriod,
+        uint32_t framesInFlight, uint32_t maxMarkersPerFrame = DEFAULT_MAX_MARKERS_PER_FRAME);
+
+    Profiler(const Profiler &) = delete;
+    Profiler &operator=(const Profiler &) = delete;
+
+    /*
+     * Describe a queue family that markers will be recorded on. Markers on
+     * families with no timestampValidBits (or that weren't added) are
+     * ignored.
+     */
+    void AddQueueFamily(uint32_t queueFamily, uint32_t timestampValidBits, const std::string &name);
+
+    bool Setup();
+
+    /*
+     * Resolve the results of the frame that last used frameNumber's slot,
+     * then reset the slot's queries in commandBuffer. That command buffer
+     * must execute before any of the frame's markers, and the previous use
+     * of the slot must have finished (as it has after FrameManager::BeginFrame).
+     */
+    bool BeginFrame(VkCommandBuffer commandBuffer, uint64_t frameNumber);
+
+    /*
+     * Write the start timestamp for a marker in the current frame, after
+     * the work previously submitted to the queue reaches 'stage'. Returns
+     * INVALID_MARKER if it can't be timed, which EndMarker() ignores.
+     */
+    uint32_t BeginMarker(VkCommandBuffer commandBuffer, uint32_t queueFamily, const char *name,
+        VkPipelineStageFlagBits stage = VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT);
+    void EndMarker(VkCommandBuffer commandBuffer, uint32_t marker,
+        VkPipelineStageFlagBits stage = VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT);
+
+    // Microseconds since the profiler was created, for CPU events
+    double GetCpuTimeUs() const;
+    void AddCpuEvent(const char *name, double startUs, double endUs);
+
+    // Resolve every slot; the device must have finished all the frames
+    bool ResolveAll();
+
+    std::vector<ProfileEvent> GetEvents() const;
+
+    bool WriteChromeTrace(const std::string &path) const;
+
+private:
+    struct Marker
+    {
+        std::string name;
+        uint32_t queueFamily;
+    };
+
+    struct Slot
+    {
+        AutoVkQueryPool queryPool;
+        uint64_t frameNumber;
+        bool active;
+        std::vector<Marker> markers; // marker i uses queries 2i and 2i+1
+
+        Slot(const DeviceFunctions &pfn, VkDevice device)
+            : queryPool(pfn, device), frameNumber(0), active(false)
+        {
+        }
+    };
+
+    struct QueueFamilyInfo
+    {
+        uint64_t timestampMask; // 0 if timestamps aren't supported
+        std::string name;
+    };
+
+    bool Resolve(Slot &slot);
+
+    const DeviceFunctions &m_pfn;
+    VkDevice m_Device;
+    double m_TimestampPeriod; // nanoseconds per tick
+    uint32_t m_MaxMarkersPerFrame;
+
+    std::chrono::steady_clock::time_point m_CpuStart;
+    bool m_HaveGpuStart;
+    uint64_t m_GpuStart;
+
+    std::vector<QueueFamilyInfo> m_QueueFamilies;
+
+    mutable std::mutex m_Mutex;
+    std::vector<std::unique_ptr<Slot>> m_Slots;
+    uint32_t m_CurrentSlot; // index into m_Slots, or ~0 before BeginFrame
+    std::vector<ProfileEvent> m_Events;
+};
+
+// Times the commands recorded into commandBuffer during its lifetime
+class GpuProfileScope
+{
+public:
+    GpuProfileScope(Profiler &profiler, VkCommandBuffer commandBuffer, uint32_t queueFamily, const char *name)
+        : m_Profiler(profiler), m_CommandBuffer(commandBuffer),
+        m_Marker(profiler.BeginMarker(commandBuffer, queueFamily, name))
+    {
+    }
+
+    ~GpuProfileScope()
+    {
+        m_Profiler.EndMarker(m_CommandBuffer, m_Marker);
+    }
+
+    GpuProfileScope(const GpuProfileScope &) = delete;
+    GpuProfileScope &operator=(const GpuProfileScope &) = delete;
+
+private:
+    Profiler &m_Profiler;
+    VkCommandBuffer m_CommandBuffer;
+    uint32_t m_Marker;
+};
+
+// Times the CPU work done during its lifetime
+class CpuProfileScope
+{
+public:
+    CpuProfileScope(Profiler &profiler, const char *name)
+        : m_Profiler(profiler), m_Name(name), m_Start(profiler.GetCpuTimeUs())
+    {
+    }
+
+    ~CpuProfileScope()
+    {
+        m_Profiler.AddCpuEvent(m_Name, m_Start, m_Profiler.GetCpuTimeUs());
+    }
+
+    CpuProfileScope(const CpuProfileScope &) = delete;
+    CpuProfileScope &operator=(const CpuProfileScope &) = delete;
+
+private:
+    Profiler &m_Profiler;
+    const char *m_Name;
+    double m_Start;
+};
+
+#endif // INCLUDED_VKSXS_PROFILER
@@ -0,0 +1,277 @@
+/*
+ * Copyright (c) 2016 Philip Taylor
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include "common/Common.h"
+
+#include "common/AllocationCallbacks.h"
+#include "common/Log.h"
+#include "common/QueryManager.h"
+
+#include <algorithm>
+
+const uint32_t QueryManager::INVALID_PASS;
+const uint32_t QueryManager::DEFAULT_MAX_PASSES_PER_FRAME;
+
+const char *PipelineStatisticName(VkQueryPipelineStatisticFlagBits statistic)
+{
+    switch (statistic)
+    {
+    case VK_QUERY_PIPELINE_STATISTIC_INPUT_ASSEMBLY_VERTICES_BIT: return "input assembly vertices";
+    case VK_QUERY_PIPELINE_STATISTIC_INPUT_ASSEMBLY_PRIMITIVES_BIT: return "input assembly primitives";
+    case VK_QUERY_PIPELINE_STATISTIC_VERTEX_SHADER_INVOCATIONS_BIT: return "vertex shader invocations";
+    case VK_QUERY_PIPELINE_STATISTIC_GEOMETRY_SHADER_INVOCATIONS_BIT: return "geometry shader invocations";
+    case VK_QUERY_PIPELINE_STATISTIC_GEOMETRY_SHADER_PRIMITIVES_BIT: return "geometry shader primitives";
+    case VK_QUERY_PIPELINE_STATISTIC_CLIPPING_INVOCATIONS_BIT: return "clipping invocations";
+    case VK_QUERY_PIPELINE_STATISTIC_CLIPPING_PRIMITIVES_BIT: return "clipping primitives";
+    case VK_QUERY_PIPELINE_STATISTIC_FRAGMENT_SHADER_INVOCATIONS_BIT: return "fragment shader invocations";
+    case VK_QUERY_PIPELINE_STATISTIC_TESSELLATION_CONTROL_SHADER_PATCHES_BIT: return "tessellation control shader patches";
+    case VK_QUERY_PIPELINE_STATISTIC_TESSELLATION_EVALUATION_SHADER_INVOCATIONS_BIT: return "tessellation evaluation shader invocations";
+    case VK_QUERY_PIPELINE_STATISTIC_COMPUTE_SHADER_INVOCATIONS_BIT: return "compute shader invocations";
+    default: return nullptr;
+    }
+}
+
+static uint32_t CountBits(uint32_t bits)
+{
+    uint32_t count = 0;
+    for (; bits; bits &= bits - 1)
+        ++count;
+    return count;
+}
+
+QueryManager::QueryManager(const DeviceFunctions &pfn, VkDevice device, MemoryAllocator &allocator,
+    uint32_t framesInFlight, bool occlusion, VkQueryPipelineStatisticFlags statistics,
+    uint32_t maxPassesPerFrame)
+    : m_pfn(pfn), m_Device(device), m_Allocator(allocator),
+    m_Occlusion(occlusion), m_Statistics(statistics), m_StatisticCount(CountBits(statistics)),
+    m_MaxPassesPerFrame(maxPassesPerFrame),
+    m_OcclusionPool(pfn, device), m_StatisticsPool(pfn, device),
+    m_Buffer(pfn, device), m_Memory(allocator), m_SlotSize(0),
+    m_Slots(framesInFlight), m_CurrentSlot(~(uint32_t)0)
+{
+}
+
+bool QueryManager::CreateQueryPool(VkQueryType type, VkQueryPipelineStatisticFlags statistics, AutoVkQueryPool &pool)
+{
+    VkQueryPoolCreateInfo createInfo = {};
+    createInfo.sType = VK_STRUCTURE_TYPE_QUERY_POOL_CREATE_INFO;
+    createInfo.queryType = type;
+    createInfo.queryCount = m_MaxPassesPerFrame * (uint32_t)m_Slots.size();
+    createInfo.pipelineStatistics = statistics;
+    VkResult result = m_pfn.vkCreateQueryPool(m_Device, &createInfo, CREATE_ALLOCATOR(), pool.ptr());
+    if (result != VK_SUCCESS)
+    {
+        LOGE("vkCreateQueryPool failed (%d)", result);
+        return false;
+    }
+    return true;
+}
+
+bool QueryManager::Setup()
+{
+    if (!m_Occlusion && m_Statistics == 0)
+        return true;
+
+    if (m_Occlusion && !CreateQueryPool(VK_QUERY_TYPE_OCCLUSION, 0, m_OcclusionPool))
+        return false;
+
+    if (m_Statistics != 0 && !CreateQueryPool(VK_QUERY_TYPE_PIPELINE_STATISTICS, m_Statistics, m_StatisticsPool))
+        return false;
+
+    m_SlotSize = (VkDeviceSize)m_MaxPassesPerFrame * ((m_Occlusion ? 1 : 0) + m_StatisticCount) * sizeof(uint64_t);
+
+    VkBufferCreateInfo bufferCreateInfo = {};
+    bufferCreateInfo.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
+    bufferCreateInfo.size = m_SlotSize * m_Slots.size();
+    bufferCreateInfo.usage = VK_BUFFER_USAGE_TRANSFER_DST_BIT;
+    bufferCreateInfo.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+    VkResult result = m_pfn.vkCreateBuffer(m_Device, &bufferCreateInfo, CREATE_ALLOCATOR(), m_Buffer.ptr());
+    if (result != VK_SUCCESS)
+    {
+        LOGE("vkCreateBuffer failed (%d)", result);
+        return false;
+    }
+
+    // The host reads every result, so prefer cached memory
+    if (!m_Allocator.AllocateForBuffer(m_Buffer, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT,
+        VK_MEMORY_PROPERTY_HOST_CACHED_BIT, *m_Memory))
+    {
+        LOGE("Failed to allocate query results memory");
+        return false;
+    }
+
+    return true;
+}
+
+bool QueryManager::BeginFrame(VkCommandBuffer commandBuffer, uint64_t frameNumber)
+{
+    uint32_t slotIndex = (uint32_t)(frameNumber % m_Slots.size());
+    Slot &slot = m_Slots[slotIndex];
+    if (!Resolve(slot))
+        return false;
+
+    uint32_t firstQuery = slotIndex * m_MaxPassesPerFrame;
+    if (m_OcclusionPool)
+        m_pfn.vkCmdResetQueryPool(commandBuffer, m_OcclusionPool, firstQuery, m_MaxPassesPerFrame);
+    if (m_StatisticsPool)
+        m_pfn.vkCmdResetQueryPool(commandBuffer, m_StatisticsPool, firstQuery, m_MaxPassesPerFrame);
+
+    slot.frameNumber = frameNumber;
+    m_CurrentSlot = slotIndex;
+    return true;
+}
+
+uint32_t QueryManager::BeginPass(VkCommandBuffer commandBuffer, const char *name)
+{
+    if (m_CurrentSlot >= m_Slots.size() || m_SlotSize == 0)
+        return INVALID_PASS;
+
+    Slot &slot = m_Slots[m_CurrentSlot];
+    if (slot.copied || slot.passes.size() >= m_MaxPassesPerFrame)
+        return INVALID_PASS;
+
+    uint32_t query = m_CurrentSlot * m_MaxPassesPerFrame + (uint32_t)slot.passes.size();
+    slot.passes.push_back(name);
+
+    if (m_OcclusionPool)
+        m_pfn.vkCmdBeginQuery(commandBuffer, m_OcclusionPool, query, 0);
+    if (m_StatisticsPool)
+        m_pfn.vkCmdBeginQuery(commandBuffer, m_StatisticsPool, query, 0);
+
+    return query;
+}
+
+void QueryManager::EndPass(VkCommandBuffer commandBuffer, uint32_t pass)
+{
+    if (pass == INVALID_PASS)
+        return;
+
+    if (m_StatisticsPool)
+        m_pfn.vkCmdEndQuery(commandBuffer, m_StatisticsPool, pass);
+    if (m_OcclusionPool)
+        m_pfn.vkCmdEndQuery(commandBuffer, m_OcclusionPool, pass);
+}
+
+void QueryManager::EndFrame(VkCommandBuffer commandBuffer)
+{
+    if (m_CurrentSlot >= m_Slots.size())
+        return;
+
+    Slot &slot = m_Slots[m_CurrentSlot];
+    if (slot.copied || slot.passes.empty())
+        return;
+    slot.copied = true;
+
+    // Only copy the queries that were used: the rest are never written, so
+    // WAIT_BIT would wait forever for them
+    uint32_t firstQuery = m_CurrentSlot * m_MaxPassesPerFrame;
+    uint32_t queryCount = (uint32_t)slot.passes.size();
+    VkDeviceSize offset = m_SlotSize * m_CurrentSlot;
+    if (m_OcclusionPool)
+    {
+        m_pfn.vkCmdCopyQueryPoolResults(commandBuffer, m_OcclusionPool, firstQuery, queryCount,
+            m_Buffer, offset, sizeof(uint64_t), VK_QUERY_RESULT_64_BIT | VK_QUERY_RESULT_WAIT_BIT);
+        offset += m_MaxPassesPerFrame * sizeof(uint64_t);
+    }
+    if (m_StatisticsPool)
+    {
+        m_pfn.vkCmdCopyQueryPoolResults(commandBuffer, m_StatisticsPool, firstQuery, queryCount,
+            m_Buffer, offset, m_StatisticCount * sizeof(uint64_t), VK_QUERY_RESULT_64_BIT | VK_QUERY_RESULT_WAIT_BIT);
+    }
+
+    // Make the copies visible to the host once the frame's fence has signalled
+    VkBufferMemoryBarrier barrier = {};
+    barrier.sType = VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER;
+    barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+    barrier.dstAccessMask = VK_ACCESS_HOST_READ_BIT;
+    barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+    barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+    barrier.buffer = m_Buffer;
+    barrier.offset = m_SlotSize * m_CurrentSlot;
+    barrier.size = m_SlotSize;
+    m_pfn.vkCmdPipelineBarrier(commandBuffer, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_HOST_BIT,
+        0, 0, nullptr, 1, &barrier, 0, nullptr);
+}
+
+bool QueryManager::Resolve(Slot &slot)
+{
+    if (slot.passes.empty())
+        return true;
+
+    if (!slot.copied)
+    {
+        // EndFrame() was never recorded (e.g. on an error path)
+        LOGW("Dropping query results for frame %" PRIu64 ", which were never copied", slot.frameNumber);
+        slot.passes.clear();
+        return true;
+    }
+
+    uint32_t slotIndex = (uint32_t)(&slot - m_Slots.data());
+    VkDeviceSize offset = m_SlotSize * slotIndex;
+    if (!m_Allocator.InvalidateRange(*m_Memory, offset, m_SlotSize))
+        return false;
+
+    // The slot's frame has finished, so the copies have landed
+    const uint64_t *occlusionResults = (const uint64_t *)((const char *)m_Memory->mappedPtr + offset);
+    const uint64_t *statisticsResults = occlusionResults + (m_Occlusion ? m_MaxPassesPerFrame : 0);
+
+    for (size_t i = 0; i < slot.passes.size(); ++i)
+    {
+        QueryPassResult result;
+        result.name = slot.passes[i];
+        result.frame = slot.frameNumber;
+        result.samplesPassed = (m_Occlusion ? occlusionResults[i] : 0);
+        result.statistics.assign(statisticsResults + i * m_StatisticCount,
+            statisticsResults + (i + 1) * m_StatisticCount);
+        m_Results.push_back(std::move(result));
+    }
+
+    slot.passes.clear();
+    slot.copied = false;
+    return true;
+}
+
+bool QueryManager::ResolveAll()
+{
+    // Oldest first, so the results stay in frame order
+    std::vector<Slot *> slots;
+    for (auto &slot : m_Slots)
+        slots.push_back(&slot);
+    std::sort(slots.begin(), slots.end(), [](const Slot *a, const Slot *b) {
+        return a->frameNumber < b->frameNumber;
+    });
+
+    for (Slot *slot : slots)
+    {
+        if (!Resolve(*slot))
+            return false;
+    }
+    m_CurrentSlot = ~(uint32_t)0;
+    return true;
+}
+
+std::vector<QueryPassResult> QueryManager::TakeResults()
+{
+    std::vector<QueryPassResult> results;
+    results.swap(m_Results);
+    return results;
+}
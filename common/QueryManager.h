@@ -0,0 +1,177 @@
+/*
+ * Copyright (c) 2016 Philip Taylor
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#ifndef INCLUDED_VKSXS_QUERY_MANAGER
+#define INCLUDED_VKSXS_QUERY_MANAGER
+
+#include "common/Common.h"
+
+#include "common/AutoWrappers.h"
+#include "common/DeviceFunctions.h"
+#include "common/MemoryAllocator.h"
+
+#include <string>
+#include <vector>
+
+// e.g. "compute shader invocations", or nullptr for an unknown bit
+const char *PipelineStatisticName(VkQueryPipelineStatisticFlagBits statistic);
+
+struct QueryPassResult
+{
+    std::string name;
+    uint64_t frame;                   // FrameManager frame number
+    uint64_t samplesPassed;           // only meaningful as zero/non-zero, since queries aren't precise
+    std::vector<uint64_t> statistics; // one per bit in the statistics mask, lowest bit first
+};
+
+/*
+ * Counts occlusion samples and pipeline statistics per pass, for keeping
+ * an eye on the GPU's workload without any CPU-GPU sync points.
+ *
+ * There is one large query pool per query type, split into a range of
+ * queries per frame slot, and each pass (a BeginPass/EndPass pair) gets
+ * the next query in the current slot's range. EndFrame() records a
+ * vkCmdCopyQueryPoolResults of the whole range into a persistently mapped
+ * results buffer; VK_QUERY_RESULT_WAIT_BIT makes the device (not the host)
+ * wait for the queries. The host reads the buffer in BeginFrame() when the
+ * slot comes round again, after FrameManager has waited for the slot's
+ * fence, so vkGetQueryPoolResults is never needed.
+ *
+ * Occlusion queries need a graphics queue, and pipeline statistics need
+ * the pipelineStatisticsQuery feature (see DeviceLoader) and a graphics or
+ * compute queue. Only one query of each type can be active at once, so
+ * passes can't overlap, and each pass must begin and end in the same
+ * command buffer.
+ *
+ * This is not thread-safe.
+ */
+class QueryManager
+{
+public:
+    static const uint32_t INVALID_PASS = ~(uint32_t)0;
+    static const uint32_t DEFAULT_MAX_PASSES_PER_FRAME = 64;
+
+    /*
+     * 'statistics' is the set of pipeline statistics to count per pass (0
+     * for none). With neither occlusion nor statistics, every pass is
+     * INVALID_PASS.
+     */
+    QueryManager(const DeviceFunctions &pfn, VkDevice device, MemoryAllocator &allocator,
+        uint32_t framesInFlight, bool occlusion, VkQueryPipelineStatisticFlags statistics,
+        uint32_t maxPassesPerFrame = DEFAULT_MAX_PASSES_PER_FRAME);
+
+    QueryManager(const QueryManager &) = delete;
+    QueryManager &operator=(const QueryManager &) = delete;
+
+    bool Setup();
+
+    VkQueryPipelineStatisticFlags GetStatistics() const { return m_Statistics; }
+
+    /*
+     * Read the results of the frame that last used frameNumber's slot, then
+     * reset the slot's queries in commandBuffer. As with
+     * Profiler::BeginFrame(), that command buffer must execute before any of
+     * the frame's passes, and the previous use of the slot must have
+     * finished.
+     */
+    bool BeginFrame(VkCommandBuffer commandBuffer, uint64_t frameNumber);
+
+    // Returns INVALID_PASS if the frame is out of passes, which EndPass() ignores
+    uint32_t BeginPass(VkCommandBuffer commandBuffer, const char *name);
+    void EndPass(VkCommandBuffer commandBuffer, uint32_t pass);
+
+    /*
+     * Copy the current frame's results into the results buffer. This must
+     * be recorded outside a render pass and execute after all of the
+     * frame's passes, on a graphics or compute queue.
+     */
+    void EndFrame(VkCommandBuffer commandBuffer);
+
+    // Read every slot; the device must have finished all the frames
+    bool ResolveAll();
+
+    // The results read so far, oldest first; they're removed from the manager
+    std::vector<QueryPassResult> TakeResults();
+
+private:
+    struct Slot
+    {
+        uint64_t frameNumber;
+        bool copied; // whether EndFrame() recorded the copy
+        std::vector<std::string> passes; // pass i uses query i of the slot's range
+
+        Slot()
+            : frameNumber(0), copied(false)
+        {
+        }
+    };
+
+    bool CreateQueryPool(VkQueryType type, VkQueryPipelineStatisticFlags statistics, AutoVkQueryPool &pool);
+    bool Resolve(Slot &slot);
+
+    const DeviceFunctions &m_pfn;
+    VkDevice m_Device;
+    MemoryAllocator &m_Allocator;
+    bool m_Occlusion;
+    VkQueryPipelineStatisticFlags m_Statistics;
+    uint32_t m_StatisticCount;
+    uint32_t m_MaxPassesPerFrame;
+
+    AutoVkQueryPool m_OcclusionPool;
+    AutoVkQueryPool m_StatisticsPool;
+
+    // Each slot's results: the occlusion results for every pass, then the
+    // statistics for every pass
+    AutoVkBuffer m_Buffer;
+    AutoMemoryAllocation m_Memory;
+    VkDeviceSize m_SlotSize;
+
+    std::vector<Slot> m_Slots;
+    uint32_t m_CurrentSlot; // index into m_Slots, or ~0 before BeginFrame
+    std::vector<QueryPassResult> m_Results;
+};
+
+// Counts the commands recorded into commandBuffer during its lifetime as one pass
+class QueryPassScope
+{
+public:
+    QueryPassScope(QueryManager &queries, VkCommandBuffer commandBuffer, const char *name)
+        : m_Queries(queries), m_CommandBuffer(commandBuffer),
+        m_Pass(queries.BeginPass(commandBuffer, name))
+    {
+    }
+
+    ~QueryPassScope()
+    {
+        m_Queries.EndPass(m_CommandBuffer, m_Pass);
+    }
+
+    QueryPassScope(const QueryPassScope &) = delete;
+    QueryPassScope &operator=(const QueryPassScope &) = delete;
+
+private:
+    QueryManager &m_Queries;
+    VkCommandBuffer m_CommandBuffer;
+    uint32_t m_Pass;
+};
+
+#endif // INCLUDED_VKSXS_QUERY_MANAGER
@@ -0,0 +1,556 @@
+/*
+ * Copyright (c) 2016 Philip Taylor
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include "common/Common.h"
+
+#include "common/Log.h"
+#include "common/ResourceStateTracker.h"
+
+#include <algorithm>
+#include <iterator>
+
+const ResourceUsageInfo &GetResourceUsageInfo(ResourceUsage usage)
+{
+    static const ResourceUsageInfo infos[] = {
+        // RESOURCE_USAGE_UNDEFINED
+        { VK_IMAGE_LAYOUT_UNDEFINED, 0, 0, false },
+        // RESOURCE_USAGE_TRANSFER_SRC
+        { VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL, VK_PIPELINE_STAGE_TRANSFER_BIT,
+            VK_ACCESS_TRANSFER_READ_BIT, false },
+        // RESOURCE_USAGE_TRANSFER_DST
+        { VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, VK_PIPELINE_STAGE_TRANSFER_BIT,
+            VK_ACCESS_TRANSFER_WRITE_BIT, true },
+        // RESOURCE_USAGE_COLOR_ATTACHMENT
+        { VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL, VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT,
+            VK_ACCESS_COLOR_ATTACHMENT_READ_BIT | VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT, true },
+        // RESOURCE_USAGE_COMPUTE_READ
+        { VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+            VK_ACCESS_SHADER_READ_BIT, false },
+        // RESOURCE_USAGE_COMPUTE_WRITE
+        { VK_IMAGE_LAYOUT_GENERAL, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+            VK_ACCESS_SHADER_WRITE_BIT, true },
+        // RESOURCE_USAGE_HOST_READ
+        { VK_IMAGE_LAYOUT_GENERAL, VK_PIPELINE_STAGE_HOST_BIT,
+            VK_ACCESS_HOST_READ_BIT, false },
+        // RESOURCE_USAGE_HOST_WRITE
+        { VK_IMAGE_LAYOUT_GENERAL, VK_PIPELINE_STAGE_HOST_BIT,
+            VK_ACCESS_HOST_WRITE_BIT, true },
+    };
+
+    ASSERT((size_t)usage < sizeof(infos) / sizeof(infos[0]));
+    return infos[usage];
+}
+
+ResourceStateTracker::ResourceStateTracker(const DeviceFunctions &pfn)
+    : m_pfn(pfn)
+{
+}
+
+void ResourceStateTracker::AddImage(VkImage image, VkImageAspectFlags aspectMask,
+    uint32_t mipLevels, uint32_t arrayLayers)
+{
+    ASSERT(m_Images.find(image) == m_Images.end());
+
+    ImageState &state = m_Images[image];
+    state.aspectMask = aspectMask;
+    state.mipLevels = mipLevels;
+    state.arrayLayers = arrayLayers;
+    state.subresources.resize(mipLevels * arrayLayers);
+    SetImageState(image, RESOURCE_USAGE_UNDEFINED);
+}
+
+void ResourceStateTracker::RemoveImage(VkImage image)
+{
+    m_Images.erase(image);
+}
+
+void ResourceStateTracker::SetImageState(VkImage image, ResourceUsage usage, uint32_t queueFamily)
+{
+    auto it = m_Images.find(image);
+    ASSERT(it != m_Images.end());
+
+    const ResourceUsageInfo &info = GetResourceUsageInfo(usage);
+
+    SubresourceState sub = {};
+    sub.layout = info.layout;
+    sub.owner = queueFamily;
+    if (info.writes)
+    {
+        sub.written = true;
+        sub.writeStages = info.stages;
+        sub.writeAccess = info.access;
+    }
+    else
+    {
+        sub.readStages = info.stages;
+        sub.readAccess = info.access;
+    }
+
+    for (SubresourceState &s : it->second.subresources)
+        s = sub;
+}
+
+VkImageLayout ResourceStateTracker::GetImageLayout(VkImage image, uint32_t mipLevel, uint32_t arrayLayer) const
+{
+    auto it = m_Images.find(image);
+    ASSERT(it != m_Images.end());
+    ASSERT(mipLevel < it->second.mipLevels && arrayLayer < it->second.arrayLayers);
+    return it->second.subresources[mipLevel * it->second.arrayLayers + arrayLayer].layout;
+}
+
+void ResourceStateTracker::UseImage(VkImage image, ResourceUsage usage, uint32_t queueFamily,
+    const VkImageSubresourceRange *range)
+{
+    auto it = m_Images.find(image);
+    ASSERT(it != m_Images.end());
+    ImageState &state = it->second;
+
+    VkImageSubresourceRange fullRange = {};
+    fullRange.aspectMask = state.aspectMask;
+    fullRange.levelCount = state.mipLevels;
+    fullRange.layerCount = state.arrayLayers;
+    if (!range)
+        range = &fullRange;
+
+    uint32_t levelCount = (range->levelCount == VK_REMAINING_MIP_LEVELS ?
+        state.mipLevels - range->baseMipLevel : range->levelCount);
+    uint32_t layerCount = (range->layerCount == VK_REMAINING_ARRAY_LAYERS ?
+        state.arrayLayers - range->baseArrayLayer : range->layerCount);
+    ASSERT(range->baseMipLevel + levelCount <= state.mipLevels);
+    ASSERT(range->baseArrayLayer + layerCount <= state.arrayLayers);
+
+    // Use SetImageState to discard the contents instead
+    ASSERT(usage != RESOURCE_USAGE_UNDEFINED);
+    const ResourceUsageInfo &info = GetResourceUsageInfo(usage);
+
+    for (uint32_t level = range->baseMipLevel; level < range->baseMipLevel + levelCount; ++level)
+    {
+        for (uint32_t layer = range->baseArrayLayer; layer < range->baseArrayLayer + layerCount; ++layer)
+        {
+            SubresourceState &sub = state.subresources[level * state.arrayLayers + layer];
+
+            bool transition = (info.layout != sub.layout);
+
+            // Undefined contents don't need to be handed over
+            bool transfer = (sub.owner != VK_QUEUE_FAMILY_IGNORED &&
+                queueFamily != VK_QUEUE_FAMILY_IGNORED &&
+                sub.owner != queueFamily &&
+                sub.layout != VK_IMAGE_LAYOUT_UNDEFINED);
+
+            VkPipelineStageFlags srcStages = 0;
+            VkAccessFlags srcAccess = 0;
+            bool needBarrier = transition || transfer;
+            if (info.writes || transition)
+            {
+                // WAW needs the previous write made available, WAR only needs
+                // an execution dependency on the readers
+                if (sub.written)
+                {
+                    srcStages |= sub.writeStages | sub.readStages;
+                    srcAccess |= sub.writeAccess;
+                }
+                else
+                {
+                    srcStages |= sub.readStages;
+                }
+                needBarrier = needBarrier || srcStages != 0;
+            }
+            else if (sub.written &&
+                ((info.stages & ~sub.readStages) || (info.access & ~sub.readAccess)))
+            {
+                // RAW where this reader hasn't already waited for the write
+                srcStages = sub.writeStages;
+                srcAccess = sub.writeAccess;
+                needBarrier = needBarrier || srcStages != 0;
+            }
+
+            if (needBarrier)
+            {
+                VkImageMemoryBarrier barrier = {};
+                barrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
+                barrier.oldLayout = sub.layout;
+                barrier.newLayout = info.layout;
+                barrier.image = image;
+                barrier.subresourceRange.aspectMask = range->aspectMask;
+                barrier.subresourceRange.baseMipLevel = level;
+                barrier.subresourceRange.levelCount = 1;
+                barrier.subresourceRange.baseArrayLayer = layer;
+                barrier.subresourceRange.layerCount = 1;
+
+                // A barrier queued by an earlier UseImage() would be in the
+                // same vkCmdPipelineBarrier as this one, where this one's
+                // oldLayout doesn't hold yet, so fold it into this one. It
+                // goes straight from the earlier state to the new usage,
+                // since nothing can have used the intermediate state
+                PendingImageBarrier queued;
+                if (TakeQueuedImageBarrier(image, level, layer, transfer ? sub.owner : queueFamily, queued))
+                {
+                    barrier.oldLayout = queued.barrier.oldLayout;
+                    srcStages = queued.srcStages;
+                    srcAccess = queued.barrier.srcAccessMask;
+                }
+
+                // Nothing to wait for (e.g. the first use of the image), so
+                // the barrier only needs to order the layout transition
+                if (srcStages == 0)
+                    srcStages = VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT;
+                VkPipelineStageFlags dstStages = info.stages;
+
+                if (transfer)
+                {
+                    barrier.srcQueueFamilyIndex = sub.owner;
+                    barrier.dstQueueFamilyIndex = queueFamily;
+
+                    // Release on the old queue: the dst half is ignored
+                    VkImageMemoryBarrier release = barrier;
+                    release.srcAccessMask = srcAccess;
+                    release.dstAccessMask = 0;
+                    QueueImageBarrier(sub.owner, srcStages, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, release);
+
+                    // Acquire on the new queue: the src half is ignored, and
+                    // the semaphore wait provides the dependency
+                    VkImageMemoryBarrier acquire = barrier;
+                    acquire.srcAccessMask = 0;
+                    acquire.dstAccessMask = info.access;
+                    QueueImageBarrier(queueFamily, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, dstStages, acquire);
+                }
+                else
+                {
+                    barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+                    barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+                    barrier.srcAccessMask = srcAccess;
+                    barrier.dstAccessMask = info.access;
+                    QueueImageBarrier(queueFamily, srcStages, dstStages, barrier);
+                }
+            }
+
+            sub.layout = info.layout;
+            if (queueFamily != VK_QUEUE_FAMILY_IGNORED)
+                sub.owner = queueFamily;
+
+            if (info.writes || transition)
+            {
+                // A layout transition counts as a write: later readers in
+                // other stages still need to wait for it
+                sub.written = true;
+                sub.writeStages = info.stages;
+                sub.writeAccess = info.writes ? info.access : 0;
+                sub.readStages = info.writes ? 0 : info.stages;
+                sub.readAccess = info.writes ? 0 : info.access;
+            }
+            else
+            {
+                sub.readStages |= info.stages;
+                sub.readAccess |= info.access;
+            }
+        }
+    }
+}
+
+void ResourceStateTracker::QueueImageBarrier(uint32_t queueFamily, VkPipelineStageFlags srcStages,
+    VkPipelineStageFlags dstStages, const VkImageMemoryBarrier &barrier)
+{
+    // Try to merge with a queued barrier for an adjacent subresource that is
+    // otherwise identical: first the next array layer, then the next mip
+    // level with the same span of layers
+    for (auto it = m_ImageBarriers.rbegin(); it != m_ImageBarriers.rend(); ++it)
+    {
+        VkImageMemoryBarrier &b = it->barrier;
+        if (it->queueFamily != queueFamily ||
+            b.image != barrier.image ||
+            b.oldLayout != barrier.oldLayout ||
+            b.newLayout != barrier.newLayout ||
+            b.srcAccessMask != barrier.srcAccessMask ||
+            b.dstAccessMask != barrier.dstAccessMask ||
+            b.srcQueueFamilyIndex != barrier.srcQueueFamilyIndex ||
+            b.dstQueueFamilyIndex != barrier.dstQueueFamilyIndex ||
+            b.subresourceRange.aspectMask != barrier.subresourceRange.aspectMask)
+        {
+            continue;
+        }
+
+        VkImageSubresourceRange &r = b.subresourceRange;
+        const VkImageSubresourceRange &n = barrier.subresourceRange;
+        bool merged = false;
+        if (r.levelCount == 1 && r.baseMipLevel == n.baseMipLevel &&
+            r.baseArrayLayer + r.layerCount == n.baseArrayLayer && n.levelCount == 1)
+        {
+            r.layerCount += n.layerCount;
+            merged = true;
+        }
+        else if (r.baseArrayLayer == n.baseArrayLayer && r.layerCount == n.layerCount &&
+            r.baseMipLevel + r.levelCount == n.baseMipLevel)
+        {
+            r.levelCount += n.levelCount;
+            merged = true;
+        }
+
+        if (merged)
+        {
+            it->srcStages |= srcStages;
+            it->dstStages |= dstStages;
+
+            // Merging layers onto the end of a level might let it merge
+            // with the level before
+            if (it + 1 != m_ImageBarriers.rend())
+            {
+                PendingImageBarrier pending = *it;
+                m_ImageBarriers.erase(std::next(it).base());
+                QueueImageBarrier(pending.queueFamily, pending.srcStages, pending.dstStages, pending.barrier);
+            }
+            return;
+        }
+    }
+
+    PendingImageBarrier pending;
+    pending.queueFamily = queueFamily;
+    pending.srcStages = srcStages;
+    pending.dstStages = dstStages;
+    pending.barrier = barrier;
+    m_ImageBarriers.push_back(pending);
+}
+
+bool ResourceStateTracker::TakeQueuedImageBarrier(VkImage image, uint32_t level, uint32_t layer,
+    uint32_t queueFamily, PendingImageBarrier &taken)
+{
+    for (auto it = m_ImageBarriers.begin(); it != m_ImageBarriers.end(); ++it)
+    {
+        const VkImageMemoryBarrier &b = it->barrier;
+        const VkImageSubresourceRange &r = b.subresourceRange;
+        if (b.image != image ||
+            b.srcQueueFamilyIndex != b.dstQueueFamilyIndex ||
+            (it->queueFamily != queueFamily && it->queueFamily != VK_QUEUE_FAMILY_IGNORED &&
+                queueFamily != VK_QUEUE_FAMILY_IGNORED) ||
+            level < r.baseMipLevel || level >= r.baseMipLevel + r.levelCount ||
+            layer < r.baseArrayLayer || layer >= r.baseArrayLayer + r.layerCount)
+        {
+            continue;
+        }
+
+        taken = *it;
+        m_ImageBarriers.erase(it);
+
+        // Put back the rest of its range: the levels before and after this
+        // one, and the layers either side of this one in its level
+        auto putBack = [&](uint32_t baseLevel, uint32_t levelCount, uint32_t baseLayer, uint32_t layerCount) {
+            if (levelCount == 0 || layerCount == 0)
+                return;
+            PendingImageBarrier rest = taken;
+            rest.barrier.subresourceRange.baseMipLevel = baseLevel;
+            rest.barrier.subresourceRange.levelCount = levelCount;
+            rest.barrier.subresourceRange.baseArrayLayer = baseLayer;
+            rest.barrier.subresourceRange.layerCount = layerCount;
+            m_ImageBarriers.push_back(rest);
+        };
+        const VkImageSubresourceRange range = taken.barrier.subresourceRange;
+        putBack(range.baseMipLevel, level - range.baseMipLevel, range.baseArrayLayer, range.layerCount);
+        putBack(level + 1, range.baseMipLevel + range.levelCount - (level + 1), range.baseArrayLayer, range.layerCount);
+        putBack(level, 1, range.baseArrayLayer, layer - range.baseArrayLayer);
+        putBack(level, 1, layer + 1, range.baseArrayLayer + range.layerCount - (layer + 1));
+
+        taken.barrier.subresourceRange.baseMipLevel = level;
+        taken.barrier.subresourceRange.levelCount = 1;
+        taken.barrier.subresourceRange.baseArrayLayer = layer;
+        taken.barrier.subresourceRange.layerCount = 1;
+        return true;
+    }
+    return false;
+}
+
+void ResourceStateTracker::BufferBarrier(VkBuffer buffer, VkDeviceSize offset, VkDeviceSize size,
+    ResourceUsage from, ResourceUsage to, uint32_t queueFamily)
+{
+    const ResourceUsageInfo &fromInfo = GetResourceUsageInfo(from);
+    const ResourceUsageInfo &toInfo = GetResourceUsageInfo(to);
+
+    PendingBufferBarrier pending;
+    pending.queueFamily = queueFamily;
+    pending.srcStages = (fromInfo.stages ? fromInfo.stages : (VkPipelineStageFlags)VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT);
+    pending.dstStages = (toInfo.stages ? toInfo.stages : (VkPipelineStageFlags)VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT);
+
+    VkBufferMemoryBarrier &barrier = pending.barrier;
+    barrier = {};
+    barrier.sType = VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER;
+    barrier.srcAccessMask = fromInfo.writes ? fromInfo.access : 0;
+    barrier.dstAccessMask = toInfo.access;
+    barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+    barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+    barrier.buffer = buffer;
+    barrier.offset = offset;
+    barrier.size = size;
+
+    m_BufferBarriers.push_back(pending);
+}
+
+void ResourceStateTracker::TakeBarriers(uint32_t queueFamily,
+    std::vector<PendingImageBarrier> &imageBarriers, std::vector<PendingBufferBarrier> &bufferBarriers)
+{
+    auto matches = [queueFamily](uint32_t family) {
+        return family == queueFamily || family == VK_QUEUE_FAMILY_IGNORED;
+    };
+
+    auto imageEnd = std::remove_if(m_ImageBarriers.begin(), m_ImageBarriers.end(),
+        [&](const PendingImageBarrier &pending) {
+            if (!matches(pending.queueFamily))
+                return false;
+            imageBarriers.push_back(pending);
+            return true;
+        });
+    m_ImageBarriers.erase(imageEnd, m_ImageBarriers.end());
+
+    auto bufferEnd = std::remove_if(m_BufferBarriers.begin(), m_BufferBarriers.end(),
+        [&](const PendingBufferBarrier &pending) {
+            if (!matches(pending.queueFamily))
+                return false;
+            bufferBarriers.push_back(pending);
+            return true;
+        });
+    m_BufferBarriers.erase(bufferEnd, m_BufferBarriers.end());
+}
+
+// Merge the barriers' stages, for a single barrier command
+static void CombineBarrierStages(VkPipelineStageFlags &srcStages, VkPipelineStageFlags &dstStages)
+{
+    // TOP_OF_PIPE (as a source) and BOTTOM_OF_PIPE (as a destination) mean
+    // "nothing", so they're redundant when merged with any real stages
+    if (srcStages & ~VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT)
+        srcStages &= ~VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT;
+    if (dstStages & ~VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT)
+        dstStages &= ~VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT;
+}
+
+void ResourceStateTracker::Flush(VkCommandBuffer commandBuffer, uint32_t queueFamily)
+{
+    std::vector<PendingImageBarrier> pendingImageBarriers;
+    std::vector<PendingBufferBarrier> pendingBufferBarriers;
+    TakeBarriers(queueFamily, pendingImageBarriers, pendingBufferBarriers);
+
+    if (pendingImageBarriers.empty() && pendingBufferBarriers.empty())
+        return;
+
+    VkPipelineStageFlags srcStages = 0;
+    VkPipelineStageFlags dstStages = 0;
+    std::vector<VkImageMemoryBarrier> imageBarriers;
+    std::vector<VkBufferMemoryBarrier> bufferBarriers;
+    for (const PendingImageBarrier &pending : pendingImageBarriers)
+    {
+        srcStages |= pending.srcStages;
+        dstStages |= pending.dstStages;
+        imageBarriers.push_back(pending.barrier);
+    }
+    for (const PendingBufferBarrier &pending : pendingBufferBarriers)
+    {
+        srcStages |= pending.srcStages;
+        dstStages |= pending.dstStages;
+        bufferBarriers.push_back(pending.barrier);
+    }
+    CombineBarrierStages(srcStages, dstStages);
+
+    m_pfn.vkCmdPipelineBarrier(commandBuffer, srcStages, dstStages, 0,
+        0, nullptr,
+        (uint32_t)bufferBarriers.size(), bufferBarriers.data(),
+        (uint32_t)imageBarriers.size(), imageBarriers.data());
+}
+
+void ResourceStateTracker::FlushSplit(VkCommandBuffer commandBuffer, VkEvent event, uint32_t queueFamily,
+    SplitBarrier &split)
+{
+    ASSERT(split.event == VK_NULL_HANDLE);
+
+    std::vector<PendingImageBarrier> pendingImageBarriers;
+    std::vector<PendingBufferBarrier> pendingBufferBarriers;
+    TakeBarriers(queueFamily, pendingImageBarriers, pendingBufferBarriers);
+
+    // vkCmdWaitEvents can't transfer queue family ownership, and
+    // vkCmdSetEvent's stages can't include HOST, so those barriers are
+    // recorded straight away
+    VkPipelineStageFlags immediateSrcStages = 0;
+    VkPipelineStageFlags immediateDstStages = 0;
+    std::vector<VkImageMemoryBarrier> immediateImageBarriers;
+    std::vector<VkBufferMemoryBarrier> immediateBufferBarriers;
+
+    split.srcStages = 0;
+    split.dstStages = 0;
+    split.imageBarriers.clear();
+    split.bufferBarriers.clear();
+
+    for (const PendingImageBarrier &pending : pendingImageBarriers)
+    {
+        if (pending.barrier.srcQueueFamilyIndex != pending.barrier.dstQueueFamilyIndex ||
+            (pending.srcStages & VK_PIPELINE_STAGE_HOST_BIT))
+        {
+            immediateSrcStages |= pending.srcStages;
+            immediateDstStages |= pending.dstStages;
+            immediateImageBarriers.push_back(pending.barrier);
+        }
+        else
+        {
+            split.srcStages |= pending.srcStages;
+            split.dstStages |= pending.dstStages;
+            split.imageBarriers.push_back(pending.barrier);
+        }
+    }
+    for (const PendingBufferBarrier &pending : pendingBufferBarriers)
+    {
+        if (pending.srcStages & VK_PIPELINE_STAGE_HOST_BIT)
+        {
+            immediateSrcStages |= pending.srcStages;
+            immediateDstStages |= pending.dstStages;
+            immediateBufferBarriers.push_back(pending.barrier);
+        }
+        else
+        {
+            split.srcStages |= pending.srcStages;
+            split.dstStages |= pending.dstStages;
+            split.bufferBarriers.push_back(pending.barrier);
+        }
+    }
+
+    if (!immediateImageBarriers.empty() || !immediateBufferBarriers.empty())
+    {
+        CombineBarrierStages(immediateSrcStages, immediateDstStages);
+        m_pfn.vkCmdPipelineBarrier(commandBuffer, immediateSrcStages, immediateDstStages, 0,
+            0, nullptr,
+            (uint32_t)immediateBufferBarriers.size(), immediateBufferBarriers.data(),
+            (uint32_t)immediateImageBarriers.size(), immediateImageBarriers.data());
+    }
+
+    if (split.imageBarriers.empty() && split.bufferBarriers.empty())
+        return;
+
+    CombineBarrierStages(split.srcStages, split.dstStages);
+    split.event = event;
+    m_pfn.vkCmdSetEvent(commandBuffer, event, split.srcStages);
+}
+
+void ResourceStateTracker::WaitSplit(VkCommandBuffer commandBuffer, SplitBarrier &split)
+{
+    if (split.event == VK_NULL_HANDLE)
+        return;
+
+    m_pfn.vkCmdWaitEvents(commandBuffer, 1, &split.event, split.srcStages, split.dstStages,
+        0, nullptr,
+        (uint32_t)split.bufferBarriers.size(), split.bufferBarriers.data(),
+        (uint32_t)split.imageBarriers.size(), split.imageBarriers.data());
+
+    split.event = VK_NULL_HANDLE;
+}
@@ -0,0 +1,217 @@
+/*
+ * Copyright (c) 2016 Philip Taylor
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#ifndef INCLUDED_VKSXS_RESOURCE_STATE_TRACKER
+#define INCLUDED_VKSXS_RESOURCE_STATE_TRACKER
+
+#include "common/Common.h"
+
+#include "common/DeviceFunctions.h"
+
+#include <map>
+#include <vector>
+
+/*
+ * The ways a resource can be used by a command. Each implies an image layout,
+ * and the pipeline stages and access types that need to be synchronised.
+ */
+enum ResourceUsage
+{
+    RESOURCE_USAGE_UNDEFINED, // contents can be discarded
+    RESOURCE_USAGE_TRANSFER_SRC,
+    RESOURCE_USAGE_TRANSFER_DST,
+    RESOURCE_USAGE_COLOR_ATTACHMENT,
+    RESOURCE_USAGE_COMPUTE_READ,   // sampled or storage reads
+    RESOURCE_USAGE_COMPUTE_WRITE,  // storage writes, in GENERAL layout
+    RESOURCE_USAGE_HOST_READ,
+    RESOURCE_USAGE_HOST_WRITE,
+};
+
+struct ResourceUsageInfo
+{
+    VkImageLayout layout;
+    VkPipelineStageFlags stages;
+    VkAccessFlags access;
+    bool writes;
+};
+
+const ResourceUsageInfo &GetResourceUsageInfo(ResourceUsage usage);
+
+/*
+ * The second half of a split barrier: the barriers that
+ * ResourceStateTracker::FlushSplit() took, for WaitSplit() to record.
+ */
+struct SplitBarrier
+{
+    VkEvent event; // VK_NULL_HANDLE if there's nothing to wait for
+    VkPipelineStageFlags srcStages;
+    VkPipelineStageFlags dstStages;
+    std::vector<VkImageMemoryBarrier> imageBarriers;
+    std::vector<VkBufferMemoryBarrier> bufferBarriers;
+
+    SplitBarrier()
+        : event(VK_NULL_HANDLE), srcStages(0), dstStages(0)
+    {
+    }
+};
+
+/*
+ * Tracks the current layout, pending accesses and owning queue family of each
+ * subresource of each registered image, and works out the barriers needed to
+ * move them to a new usage. The barriers are queued up and emitted by Flush()
+ * in a single vkCmdPipelineBarrier, using only the stages that were actually
+ * involved.
+ *
+ * No barrier is emitted for read-after-read in the same layout, unless the
+ * new reader hasn't yet been made to wait for the last write.
+ *
+ * Moving an image between queue families (with VK_SHARING_MODE_EXCLUSIVE)
+ * queues a release barrier for the old family and an acquire barrier for the
+ * new one; flush the old family's command buffer before submitting it, and
+ * order the submits with a semaphore. If the old contents are undefined, the
+ * ownership transfer is skipped.
+ *
+ * The state follows recording order, not submission order, so if command
+ * buffers are recorded once and submitted repeatedly use SetImageState() to
+ * describe the state at the start of each one.
+ *
+ * This is not thread-safe; each recording thread should have its own
+ * tracker, covering the images that it uses.
+ */
+class ResourceStateTracker
+{
+public:
+    explicit ResourceStateTracker(const DeviceFunctions &pfn);
+
+    ResourceStateTracker(const ResourceStateTracker &) = delete;
+    ResourceStateTracker &operator=(const ResourceStateTracker &) = delete;
+
+    // Register an image, initially in RESOURCE_USAGE_UNDEFINED and not owned
+    // by any queue family
+    void AddImage(VkImage image, VkImageAspectFlags aspectMask, uint32_t mipLevels, uint32_t arrayLayers);
+    void RemoveImage(VkImage image);
+
+    /*
+     * Set every subresource's state without emitting any barriers, e.g. to
+     * describe what a previously recorded command buffer leaves it in.
+     */
+    void SetImageState(VkImage image, ResourceUsage usage, uint32_t queueFamily = VK_QUEUE_FAMILY_IGNORED);
+
+    /*
+     * Queue barriers so that commands recorded after the next Flush() can use
+     * the image (or 'range' of it) as 'usage', on 'queueFamily'. Pass
+     * VK_QUEUE_FAMILY_IGNORED to not track ownership. Calling this again
+     * before the Flush() replaces the queued barriers with ones straight to
+     * the new usage. That doesn't work for an ownership transfer's barriers,
+     * so Flush() before changing the layout of an image that's being
+     * transferred.
+     */
+    void UseImage(VkImage image, ResourceUsage usage, uint32_t queueFamily = VK_QUEUE_FAMILY_IGNORED,
+        const VkImageSubresourceRange *range = nullptr);
+
+    VkImageLayout GetImageLayout(VkImage image, uint32_t mipLevel = 0, uint32_t arrayLayer = 0) const;
+
+    // Queue a barrier for a buffer range, which isn't tracked
+    void BufferBarrier(VkBuffer buffer, VkDeviceSize offset, VkDeviceSize size,
+        ResourceUsage from, ResourceUsage to, uint32_t queueFamily = VK_QUEUE_FAMILY_IGNORED);
+
+    /*
+     * Emit every queued barrier that belongs in a command buffer for
+     * queueFamily (plus any that weren't given a family) as one
+     * vkCmdPipelineBarrier.
+     */
+    void Flush(VkCommandBuffer commandBuffer, uint32_t queueFamily = VK_QUEUE_FAMILY_IGNORED);
+
+    /*
+     * Like Flush(), but as a split barrier: this signals 'event' once the
+     * earlier commands have got through the barriers' source stages, and
+     * WaitSplit() waits for it and does the transitions. Commands recorded
+     * in between don't wait, so independent work can fill the gap (but it
+     * mustn't touch the resources involved). Both halves must be on the
+     * same queue, and the event must be unsignalled (e.g. one from
+     * Frame::GetEvent()). Queue family ownership transfers, and barriers
+     * from a host usage (HOST_WRITE or HOST_READ), are never split: they're
+     * recorded immediately as a vkCmdPipelineBarrier, since vkCmdWaitEvents
+     * can't transfer ownership and vkCmdSetEvent can't use the HOST stage.
+     */
+    void FlushSplit(VkCommandBuffer commandBuffer, VkEvent event, uint32_t queueFamily, SplitBarrier &split);
+    void WaitSplit(VkCommandBuffer commandBuffer, SplitBarrier &split);
+
+private:
+    struct SubresourceState
+    {
+        VkImageLayout layout;
+        uint32_t owner;
+
+        // The last write (or layout transition), and which stages/accesses
+        // have waited for it since
+        bool written;
+        VkPipelineStageFlags writeStages;
+        VkAccessFlags writeAccess;
+        VkPipelineStageFlags readStages;
+        VkAccessFlags readAccess;
+    };
+
+    struct ImageState
+    {
+        VkImageAspectFlags aspectMask;
+        uint32_t mipLevels;
+        uint32_t arrayLayers;
+        std::vector<SubresourceState> subresources; // [level * arrayLayers + layer]
+    };
+
+    struct PendingImageBarrier
+    {
+        uint32_t queueFamily;
+        VkPipelineStageFlags srcStages;
+        VkPipelineStageFlags dstStages;
+        VkImageMemoryBarrier barrier;
+    };
+
+    struct PendingBufferBarrier
+    {
+        uint32_t queueFamily;
+        VkPipelineStageFlags srcStages;
+        VkPipelineStageFlags dstStages;
+        VkBufferMemoryBarrier barrier;
+    };
+
+    void TakeBarriers(uint32_t queueFamily,
+        std::vector<PendingImageBarrier> &imageBarriers, std::vector<PendingBufferBarrier> &bufferBarriers);
+
+    void QueueImageBarrier(uint32_t queueFamily, VkPipelineStageFlags srcStages, VkPipelineStageFlags dstStages,
+        const VkImageMemoryBarrier &barrier);
+
+    // Remove the subresource from a queued barrier, that isn't an ownership
+    // transfer, which would be flushed along with one for queueFamily
+    bool TakeQueuedImageBarrier(VkImage image, uint32_t level, uint32_t layer, uint32_t queueFamily,
+        PendingImageBarrier &taken);
+
+    const DeviceFunctions &m_pfn;
+
+    std::map<VkImage, ImageState> m_Images;
+
+    std::vector<PendingImageBarrier> m_ImageBarriers;
+    std::vector<PendingBufferBarrier> m_BufferBarriers;
+};
+
+#endif // INCLUDED_VKSXS_RESOURCE_STATE_TRACKER
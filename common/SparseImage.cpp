@@ -0,0 +1,341 @@
+/*
+ * Copyright (c) 2016 Philip Taylor
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include "common/Common.h"
+
+#include "common/AllocationCallbacks.h"
+#include "common/Log.h"
+#include "common/SparseImage.h"
+
+#include <algorithm>
+
+SparseImage::SparseImage(const DeviceFunctions &pfn, VkDevice device, MemoryAllocator &allocator)
+    : m_pfn(pfn), m_Device(device), m_Allocator(allocator),
+    m_Image(pfn, device), m_Fence(pfn, device), m_Submitted(false),
+    m_Width(0), m_Height(0), m_Aspect(VK_IMAGE_ASPECT_COLOR_BIT), m_MemoryRequirements(),
+    m_TileExtent(), m_TileSize(0), m_TilesX(0), m_TilesY(0), m_ResidentTileCount(0)
+{
+}
+
+SparseImage::~SparseImage()
+{
+    Wait();
+
+    for (MemoryAllocation &allocation : m_Tiles)
+        m_Allocator.Free(allocation);
+    for (MemoryAllocation &allocation : m_OpaqueAllocations)
+        m_Allocator.Free(allocation);
+    for (MemoryAllocation &allocation : m_Evicted)
+        m_Allocator.Free(allocation);
+}
+
+bool SparseImage::Setup(VkFormat format, uint32_t width, uint32_t height, VkImageUsageFlags usage)
+{
+    VkResult result;
+
+    if (!m_pfn.vkQueueBindSparse || !m_pfn.vkGetImageSparseMemoryRequirements)
+    {
+        LOGE("Sparse images need a device with sparse residency (see DeviceLoader::SetEnableSparseResidency)");
+        return false;
+    }
+
+    VkFenceCreateInfo fenceCreateInfo = {};
+    fenceCreateInfo.sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO;
+    result = m_pfn.vkCreateFence(m_Device, &fenceCreateInfo, CREATE_ALLOCATOR(), m_Fence.ptr());
+    if (result != VK_SUCCESS)
+    {
+        LOGE("vkCreateFence failed (%d)", result);
+        return false;
+    }
+
+    VkImageCreateInfo imageCreateInfo = {};
+    imageCreateInfo.sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO;
+    imageCreateInfo.flags = VK_IMAGE_CREATE_SPARSE_BINDING_BIT | VK_IMAGE_CREATE_SPARSE_RESIDENCY_BIT;
+    imageCreateInfo.imageType = VK_IMAGE_TYPE_2D;
+    imageCreateInfo.format = format;
+    imageCreateInfo.extent = { width, height, 1 };
+    imageCreateInfo.mipLevels = 1;
+    imageCreateInfo.arrayLayers = 1;
+    imageCreateInfo.samples = VK_SAMPLE_COUNT_1_BIT;
+    imageCreateInfo.tiling = VK_IMAGE_TILING_OPTIMAL;
+    imageCreateInfo.usage = usage;
+    imageCreateInfo.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+    imageCreateInfo.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+    result = m_pfn.vkCreateImage(m_Device, &imageCreateInfo, CREATE_ALLOCATOR(), m_Image.ptr());
+    if (result != VK_SUCCESS)
+    {
+        LOGE("vkCreateImage failed (%d)", result);
+        return false;
+    }
+
+    // For sparse resources, the alignment is also the size of a sparse block
+    m_pfn.vkGetImageMemoryRequirements(m_Device, m_Image, &m_MemoryRequirements);
+    m_TileSize = m_MemoryRequirements.alignment;
+
+    uint32_t requirementCount = 0;
+    m_pfn.vkGetImageSparseMemoryRequirements(m_Device, m_Image, &requirementCount, nullptr);
+    std::vector<VkSparseImageMemoryRequirements> requirements(requirementCount);
+    m_pfn.vkGetImageSparseMemoryRequirements(m_Device, m_Image, &requirementCount, requirements.data());
+    requirements.resize(requirementCount);
+
+    bool foundColor = false;
+    for (const VkSparseImageMemoryRequirements &requirement : requirements)
+    {
+        const VkSparseImageFormatProperties &formatProperties = requirement.formatProperties;
+
+        if (formatProperties.aspectMask & VK_IMAGE_ASPECT_COLOR_BIT)
+        {
+            foundColor = true;
+            m_TileExtent = formatProperties.imageGranularity;
+        }
+
+        // The metadata (if the implementation has any) has to be bound for
+        // the image to be used at all. So does the mip tail, if there is
+        // one; it can't be bound tile by tile anyway. With one mip level,
+        // that only happens if the image is smaller than a tile
+        bool metadata = (formatProperties.aspectMask & VK_IMAGE_ASPECT_METADATA_BIT) != 0;
+        if ((metadata || requirement.imageMipTailFirstLod < imageCreateInfo.mipLevels) &&
+            requirement.imageMipTailSize > 0)
+        {
+            VkMemoryRequirements tailRequirements = m_MemoryRequirements;
+            tailRequirements.size = requirement.imageMipTailSize;
+
+            MemoryAllocation allocation;
+            if (!m_Allocator.Allocate(tailRequirements, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, 0,
+                MEMORY_RESOURCE_OPTIMAL, MEMORY_POOL_FREE_LIST, allocation))
+            {
+                LOGE("Failed to allocate the sparse image's mip tail");
+                return false;
+            }
+            m_OpaqueAllocations.push_back(allocation);
+
+            VkSparseMemoryBind bind = {};
+            bind.resourceOffset = requirement.imageMipTailOffset;
+            bind.size = requirement.imageMipTailSize;
+            bind.memory = allocation.memory;
+            bind.memoryOffset = allocation.offset;
+            bind.flags = metadata ? VK_SPARSE_MEMORY_BIND_METADATA_BIT : 0;
+            m_PendingOpaqueBinds.push_back(bind);
+        }
+    }
+
+    if (!foundColor || m_TileExtent.width == 0 || m_TileExtent.height == 0)
+    {
+        LOGE("Format %d doesn't support sparse residency", format);
+        return false;
+    }
+
+    m_Width = width;
+    m_Height = height;
+    m_TilesX = (width + m_TileExtent.width - 1) / m_TileExtent.width;
+    m_TilesY = (height + m_TileExtent.height - 1) / m_TileExtent.height;
+    m_Tiles.resize(m_TilesX * m_TilesY);
+    m_PendingBindIndex.resize(m_Tiles.size(), UINT32_MAX);
+
+    LOGI("Sparse image %ux%u: %ux%u tiles of %ux%u texels, %u bytes each",
+        width, height, m_TilesX, m_TilesY, m_TileExtent.width, m_TileExtent.height, (uint32_t)m_TileSize);
+
+    return true;
+}
+
+bool SparseImage::GetTileRange(VkOffset2D offset, VkExtent2D extent,
+    uint32_t &x0, uint32_t &y0, uint32_t &x1, uint32_t &y1) const
+{
+    uint32_t left = (uint32_t)std::max(offset.x, 0);
+    uint32_t top = (uint32_t)std::max(offset.y, 0);
+    uint32_t right = std::min((uint32_t)std::max(offset.x + (int32_t)extent.width, 0), m_Width);
+    uint32_t bottom = std::min((uint32_t)std::max(offset.y + (int32_t)extent.height, 0), m_Height);
+    if (left >= right || top >= bottom)
+        return false;
+
+    x0 = left / m_TileExtent.width;
+    y0 = top / m_TileExtent.height;
+    x1 = (right + m_TileExtent.width - 1) / m_TileExtent.width;
+    y1 = (bottom + m_TileExtent.height - 1) / m_TileExtent.height;
+    return true;
+}
+
+void SparseImage::QueueBind(uint32_t x, uint32_t y, const MemoryAllocation &allocation)
+{
+    uint32_t tile = y * m_TilesX + x;
+
+    VkSparseImageMemoryBind bind = {};
+    bind.subresource.aspectMask = m_Aspect;
+    bind.subresource.mipLevel = 0;
+    bind.subresource.arrayLayer = 0;
+    bind.offset = { (int32_t)(x * m_TileExtent.width), (int32_t)(y * m_TileExtent.height), 0 };
+
+    // Tiles on the right and bottom edges may be partial
+    bind.extent.width = std::min(m_TileExtent.width, m_Width - x * m_TileExtent.width);
+    bind.extent.height = std::min(m_TileExtent.height, m_Height - y * m_TileExtent.height);
+    bind.extent.depth = 1;
+    bind.memory = allocation.memory;
+    bind.memoryOffset = allocation.offset;
+
+    // Later binds of a tile replace earlier ones in the same Submit(), since
+    // the order they're executed in within a batch isn't defined
+    if (m_PendingBindIndex[tile] != UINT32_MAX)
+    {
+        m_PendingBinds[m_PendingBindIndex[tile]] = bind;
+    }
+    else
+    {
+        m_PendingBindIndex[tile] = (uint32_t)m_PendingBinds.size();
+        m_PendingBinds.push_back(bind);
+    }
+}
+
+bool SparseImage::MakeResident(VkOffset2D offset, VkExtent2D extent)
+{
+    uint32_t x0, y0, x1, y1;
+    if (!GetTileRange(offset, extent, x0, y0, x1, y1))
+        return true;
+
+    VkMemoryRequirements tileRequirements = m_MemoryRequirements;
+    tileRequirements.size = m_TileSize;
+
+    for (uint32_t y = y0; y < y1; ++y)
+    {
+        for (uint32_t x = x0; x < x1; ++x)
+        {
+            MemoryAllocation &allocation = m_Tiles[y * m_TilesX + x];
+            if (allocation.memory != VK_NULL_HANDLE)
+                continue;
+
+            if (!m_Allocator.Allocate(tileRequirements, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, 0,
+                MEMORY_RESOURCE_OPTIMAL, MEMORY_POOL_FREE_LIST, allocation))
+            {
+                LOGE("Failed to allocate memory for sparse tile (%u,%u)", x, y);
+                return false;
+            }
+
+            QueueBind(x, y, allocation);
+            ++m_ResidentTileCount;
+        }
+    }
+
+    return true;
+}
+
+void SparseImage::Evict(VkOffset2D offset, VkExtent2D extent)
+{
+    uint32_t x0, y0, x1, y1;
+    if (!GetTileRange(offset, extent, x0, y0, x1, y1))
+        return;
+
+    for (uint32_t y = y0; y < y1; ++y)
+    {
+        for (uint32_t x = x0; x < x1; ++x)
+        {
+            MemoryAllocation &allocation = m_Tiles[y * m_TilesX + x];
+            if (allocation.memory == VK_NULL_HANDLE)
+                continue;
+
+            m_Evicted.push_back(allocation);
+            allocation = MemoryAllocation();
+            QueueBind(x, y, allocation);
+            --m_ResidentTileCount;
+        }
+    }
+}
+
+bool SparseImage::Submit(SubmitScheduler &scheduler, VkSemaphore waitSemaphore, VkSemaphore signalSemaphore)
+{
+    if (!Wait())
+        return false;
+
+    VkSparseImageMemoryBindInfo imageBindInfo = {};
+    imageBindInfo.image = m_Image;
+    imageBindInfo.bindCount = (uint32_t)m_PendingBinds.size();
+    imageBindInfo.pBinds = m_PendingBinds.data();
+
+    VkSparseImageOpaqueMemoryBindInfo opaqueBindInfo = {};
+    opaqueBindInfo.image = m_Image;
+    opaqueBindInfo.bindCount = (uint32_t)m_PendingOpaqueBinds.size();
+    opaqueBindInfo.pBinds = m_PendingOpaqueBinds.data();
+
+    // This may have no binds at all, just to pass the semaphores along
+    VkBindSparseInfo bindSparseInfo = {};
+    bindSparseInfo.sType = VK_STRUCTURE_TYPE_BIND_SPARSE_INFO;
+    if (waitSemaphore != VK_NULL_HANDLE)
+    {
+        bindSparseInfo.waitSemaphoreCount = 1;
+        bindSparseInfo.pWaitSemaphores = &waitSemaphore;
+    }
+    if (!m_PendingOpaqueBinds.empty())
+    {
+        bindSparseInfo.imageOpaqueBindCount = 1;
+        bindSparseInfo.pImageOpaqueBinds = &opaqueBindInfo;
+    }
+    if (!m_PendingBinds.empty())
+    {
+        bindSparseInfo.imageBindCount = 1;
+        bindSparseInfo.pImageBinds = &imageBindInfo;
+    }
+    if (signalSemaphore != VK_NULL_HANDLE)
+    {
+        bindSparseInfo.signalSemaphoreCount = 1;
+        bindSparseInfo.pSignalSemaphores = &signalSemaphore;
+    }
+
+    if (!scheduler.BindSparse(1, &bindSparseInfo, m_Fence))
+        return false;
+    m_Submitted = true;
+
+    for (const VkSparseImageMemoryBind &bind : m_PendingBinds)
+    {
+        uint32_t x = (uint32_t)bind.offset.x / m_TileExtent.width;
+        uint32_t y = (uint32_t)bind.offset.y / m_TileExtent.height;
+        m_PendingBindIndex[y * m_TilesX + x] = UINT32_MAX;
+    }
+    m_PendingBinds.clear();
+    m_PendingOpaqueBinds.clear();
+
+    m_Retiring.swap(m_Evicted);
+    return true;
+}
+
+bool SparseImage::Wait()
+{
+    if (!m_Submitted)
+        return true;
+
+    VkResult result = m_pfn.vkWaitForFences(m_Device, 1, m_Fence.ptr(), VK_TRUE, UINT64_MAX);
+    if (result != VK_SUCCESS)
+    {
+        LOGE("vkWaitForFences failed (%d)", result);
+        return false;
+    }
+
+    result = m_pfn.vkResetFences(m_Device, 1, m_Fence.ptr());
+    if (result != VK_SUCCESS)
+    {
+        LOGE("vkResetFences failed (%d)", result);
+        return false;
+    }
+    m_Submitted = false;
+
+    for (MemoryAllocation &allocation : m_Retiring)
+        m_Allocator.Free(allocation);
+    m_Retiring.clear();
+    return true;
+}
@@ -0,0 +1,142 @@
+/*
+ * Copyright (c) 2016 Philip Taylor
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#ifndef INCLUDED_VKSXS_SPARSE_IMAGE
+#define INCLUDED_VKSXS_SPARSE_IMAGE
+
+#include "common/Common.h"
+
+#include "common/AutoWrappers.h"
+#include "common/DeviceFunctions.h"
+#include "common/MemoryAllocator.h"
+#include "common/SubmitScheduler.h"
+
+#include <vector>
+
+/*
+ * A 2D image with sparse residency, whose memory is bound one tile at a time
+ * so that only the parts being worked on take up device memory. This lets
+ * images that are far larger than the memory budget be processed in pieces
+ * (e.g. rendered and read back in bands).
+ *
+ * Tiles are the format's sparse block shape (typically 64KB, e.g. 128x128
+ * texels of RGBA8), and their memory comes from the MemoryAllocator's
+ * DEVICE_LOCAL pools, so binding a tile doesn't normally need a
+ * vkAllocateMemory.
+ *
+ * MakeResident() and Evict() only update the CPU's view; the binds are
+ * collected and executed by the next Submit(), on a queue with sparse
+ * binding support (see DeviceLoader::SetEnableSparseResidency). Like any
+ * other queue operation, work that uses the newly bound tiles has to wait
+ * for Submit()'s semaphore. Accesses to tiles that aren't resident are safe,
+ * but writes are discarded and reads are undefined.
+ *
+ * The device must have finished with a tile before it's evicted: the
+ * Submit() that unbinds it has to wait (through waitSemaphore) for every
+ * piece of work that may still access it, including ones that touch the
+ * whole image and not just the evicted region. Its memory isn't reused until
+ * that Submit() has completed.
+ */
+class SparseImage
+{
+public:
+    SparseImage(const DeviceFunctions &pfn, VkDevice device, MemoryAllocator &allocator);
+
+    // Frees all the image's memory, so the device must have finished with it
+    ~SparseImage();
+
+    SparseImage(const SparseImage &) = delete;
+    SparseImage &operator=(const SparseImage &) = delete;
+
+    // An OPTIMAL image with one mip level and layer, and no tiles resident
+    bool Setup(VkFormat format, uint32_t width, uint32_t height, VkImageUsageFlags usage);
+
+    VkImage GetImage() { return m_Image; }
+
+    VkExtent3D GetTileExtent() const { return m_TileExtent; }
+    VkDeviceSize GetTileSize() const { return m_TileSize; }
+
+    // Tiles currently bound (or about to be), and their memory
+    uint32_t GetResidentTileCount() const { return m_ResidentTileCount; }
+    VkDeviceSize GetResidentBytes() const { return m_ResidentTileCount * m_TileSize; }
+
+    // Bind memory to every tile that overlaps the region, if it hasn't got any
+    bool MakeResident(VkOffset2D offset, VkExtent2D extent);
+
+    // Unbind every tile that overlaps the region
+    void Evict(VkOffset2D offset, VkExtent2D extent);
+
+    /*
+     * Execute the binds from MakeResident() and Evict() with
+     * vkQueueBindSparse on the scheduler's queue, after waitSemaphore and
+     * signalling signalSemaphore (either can be VK_NULL_HANDLE). This waits
+     * for the previous Submit() first, so there's at most one in flight.
+     */
+    bool Submit(SubmitScheduler &scheduler, VkSemaphore waitSemaphore, VkSemaphore signalSemaphore);
+
+    // Wait for the last Submit(), and free the memory of the tiles it evicted
+    bool Wait();
+
+private:
+    // The tiles [x0,x1) x [y0,y1) overlapping the region; false if there aren't any
+    bool GetTileRange(VkOffset2D offset, VkExtent2D extent,
+        uint32_t &x0, uint32_t &y0, uint32_t &x1, uint32_t &y1) const;
+
+    void QueueBind(uint32_t x, uint32_t y, const MemoryAllocation &allocation);
+
+    const DeviceFunctions &m_pfn;
+    VkDevice m_Device;
+    MemoryAllocator &m_Allocator;
+
+    AutoVkImage m_Image;
+    AutoVkFence m_Fence;
+    bool m_Submitted;
+
+    uint32_t m_Width;
+    uint32_t m_Height;
+    VkImageAspectFlags m_Aspect;
+    VkMemoryRequirements m_MemoryRequirements;
+    VkExtent3D m_TileExtent;
+    VkDeviceSize m_TileSize;
+    uint32_t m_TilesX;
+    uint32_t m_TilesY;
+
+    // Indexed by y * m_TilesX + x; memory is VK_NULL_HANDLE if not resident
+    std::vector<MemoryAllocation> m_Tiles;
+    uint32_t m_ResidentTileCount;
+
+    // The mip tail and metadata, which are bound for the image's lifetime
+    std::vector<MemoryAllocation> m_OpaqueAllocations;
+
+    // Binds for the next Submit(), with at most one per tile (indexed by
+    // tile, or UINT32_MAX if none)
+    std::vector<VkSparseImageMemoryBind> m_PendingBinds;
+    std::vector<uint32_t> m_PendingBindIndex;
+    std::vector<VkSparseMemoryBind> m_PendingOpaqueBinds;
+
+    // Memory of evicted tiles, which can't be reused until the unbind has
+    // been executed
+    std::vector<MemoryAllocation> m_Evicted;  // by the next Submit()
+    std::vector<MemoryAllocation> m_Retiring; // by the last Submit()
+};
+
+#endif // INCLUDED_VKSXS_SPARSE_IMAGE
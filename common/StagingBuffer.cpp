@@ -0,0 +1,216 @@
+/*
+ * Copyright (c) 2016 Philip Taylor
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include "common/Common.h"
+
+#include "common/AllocationCallbacks.h"
+#include "common/Log.h"
+#include "common/StagingBuffer.h"
+
+#include <algorithm>
+
+const VkDeviceSize StagingBuffer::DEFAULT_SIZE;
+
+static VkDeviceSize AlignUp(VkDeviceSize value, VkDeviceSize alignment)
+{
+    return (value + alignment - 1) / alignment * alignment;
+}
+
+StagingBuffer::StagingBuffer(const DeviceFunctions &pfn, VkDevice device, MemoryAllocator &allocator,
+    VkDeviceSize size, VkMemoryPropertyFlags preferred)
+    : m_pfn(pfn), m_Device(device), m_Allocator(allocator), m_Size(size), m_Preferred(preferred),
+    m_Memory(allocator), m_Buffer(pfn, device), m_Coherent(false), m_Cached(false), m_AtomSize(1),
+    m_Head(0), m_Used(0), m_OpenBytes(0)
+{
+}
+
+StagingBuffer::~StagingBuffer()
+{
+    // The device may still be reading from or writing to the buffer
+    WaitIdle();
+}
+
+bool StagingBuffer::Setup()
+{
+    VkResult result;
+
+    VkBufferCreateInfo bufferCreateInfo = {};
+    bufferCreateInfo.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
+    bufferCreateInfo.size = m_Size;
+    bufferCreateInfo.usage = VK_BUFFER_USAGE_TRANSFER_SRC_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT;
+    bufferCreateInfo.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+    result = m_pfn.vkCreateBuffer(m_Device, &bufferCreateInfo, CREATE_ALLOCATOR(), m_Buffer.ptr());
+    if (result != VK_SUCCESS)
+    {
+        LOGE("vkCreateBuffer failed (%d)", result);
+        return false;
+    }
+
+    VkMemoryRequirements requirements;
+    m_pfn.vkGetBufferMemoryRequirements(m_Device, m_Buffer, &requirements);
+
+    // Align the whole buffer to nonCoherentAtomSize too, so that aligning
+    // regions relative to the buffer also aligns them within the memory
+    m_AtomSize = std::max<VkDeviceSize>(m_Allocator.GetLimits().nonCoherentAtomSize, 1);
+    requirements.alignment = std::max(requirements.alignment, m_AtomSize);
+
+    if (!m_Allocator.Allocate(requirements, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT, m_Preferred,
+        MEMORY_RESOURCE_LINEAR, MEMORY_POOL_FREE_LIST, *m_Memory))
+    {
+        LOGE("Failed to allocate staging buffer memory");
+        return false;
+    }
+
+    result = m_pfn.vkBindBufferMemory(m_Device, m_Buffer, m_Memory->memory, m_Memory->offset);
+    if (result != VK_SUCCESS)
+    {
+        LOGE("vkBindBufferMemory failed (%d)", result);
+        return false;
+    }
+
+    VkMemoryPropertyFlags flags = m_Allocator.GetMemoryProperties().memoryTypes[m_Memory->memoryTypeIndex].propertyFlags;
+    m_Coherent = (flags & VK_MEMORY_PROPERTY_HOST_COHERENT_BIT) != 0;
+    m_Cached = (flags & VK_MEMORY_PROPERTY_HOST_CACHED_BIT) != 0;
+
+    LOGI("Staging buffer: %" PRIu64 " KB, memory type %u%s%s", m_Size / 1024,
+        m_Memory->memoryTypeIndex, m_Coherent ? " (coherent)" : "", m_Cached ? " (cached)" : "");
+
+    // The allocator falls back to any HOST_VISIBLE type, which still works
+    // but is typically write-combined, so the host's reads will be slow
+    if ((m_Preferred & VK_MEMORY_PROPERTY_HOST_CACHED_BIT) && !m_Cached)
+        LOGW("No HOST_CACHED memory for the staging buffer; readbacks will be slow");
+
+    return true;
+}
+
+bool StagingBuffer::Allocate(VkDeviceSize size, VkDeviceSize alignment, StagingRegion &region)
+{
+    ASSERT(m_Memory->mappedPtr);
+
+    // Keep non-coherent regions in separate atoms, so flushing or invalidating
+    // one can never clobber host writes to its neighbours
+    alignment = std::max<VkDeviceSize>(alignment, 1);
+    if (!m_Coherent)
+        alignment = std::max(alignment, m_AtomSize);
+
+    if (AlignUp(size, m_Coherent ? 1 : m_AtomSize) > m_Size)
+    {
+        LOGE("Staging request for %" PRIu64 " bytes is larger than the ring (%" PRIu64 ")", size, m_Size);
+        return false;
+    }
+
+    // Restart from the beginning when the ring is empty, to avoid wrapping
+    if (m_Used == 0)
+        m_Head = 0;
+
+    VkDeviceSize offset = AlignUp(m_Head, alignment);
+    if (offset + size > m_Size)
+        offset = 0; // skip the rest of the ring, and wrap around
+
+    VkDeviceSize needed = (offset >= m_Head ? offset - m_Head : m_Size - m_Head) + size;
+
+    while (m_Used + needed > m_Size)
+    {
+        if (m_Batches.empty())
+        {
+            LOGE("Staging ring is full of regions that haven't been passed to EndBatch()");
+            return false;
+        }
+
+        if (!RetireOldest())
+            return false;
+
+        if (m_Used == 0 && m_OpenBytes == 0)
+        {
+            // Everything's free again, so don't bother wrapping
+            m_Head = 0;
+            offset = 0;
+            needed = size;
+        }
+    }
+
+    m_Head = offset + size;
+    m_Used += needed;
+    m_OpenBytes += needed;
+
+    region.buffer = m_Buffer;
+    region.offset = offset;
+    region.size = size;
+    region.ptr = (char *)m_Memory->mappedPtr + offset;
+    return true;
+}
+
+void StagingBuffer::EndBatch(Frame &frame)
+{
+    // An unsubmitted frame would count as finished straight away
+    ASSERT(frame.IsSubmitted());
+
+    Batch batch;
+    batch.frame = &frame;
+    batch.number = frame.GetNumber();
+    batch.bytes = m_OpenBytes;
+    m_Batches.push_back(batch);
+
+    m_OpenBytes = 0;
+}
+
+bool StagingBuffer::RetireOldest()
+{
+    ASSERT(!m_Batches.empty());
+    Batch &batch = m_Batches.front();
+
+    // If the slot has been reused, the FrameManager has already waited
+    if (batch.frame->GetNumber() == batch.number)
+    {
+        if (!batch.frame->Wait())
+            return false;
+    }
+
+    ASSERT(m_Used >= batch.bytes);
+    m_Used -= batch.bytes;
+    m_Batches.pop_front();
+    return true;
+}
+
+bool StagingBuffer::WaitIdle()
+{
+    while (!m_Batches.empty())
+    {
+        if (!RetireOldest())
+            return false;
+    }
+    return true;
+}
+
+bool StagingBuffer::Flush(const StagingRegion &region)
+{
+    if (m_Coherent)
+        return true;
+    return m_Allocator.FlushRange(*m_Memory, region.offset, region.size);
+}
+
+bool StagingBuffer::Invalidate(const StagingRegion &region)
+{
+    if (m_Coherent)
+        return true;
+    return m_Allocator.InvalidateRange(*m_Memory, region.offset, region.size);
+}
@@ -0,0 +1,148 @@
+/*
+ * Copyright (c) 2016 Philip Taylor
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#ifndef INCLUDED_VKSXS_STAGING_BUFFER
+#define INCLUDED_VKSXS_STAGING_BUFFER
+
+#include "common/Common.h"
+
+#include "common/AutoWrappers.h"
+#include "common/DeviceFunctions.h"
+#include "common/FrameManager.h"
+#include "common/MemoryAllocator.h"
+
+#include <deque>
+
+/*
+ * A piece of the staging ring, for the host to write upload data into or read
+ * back data the device copied into it.
+ */
+struct StagingRegion
+{
+    VkBuffer buffer;
+    VkDeviceSize offset; // from the start of buffer
+    VkDeviceSize size;
+    void *ptr;
+
+    StagingRegion()
+        : buffer(VK_NULL_HANDLE), offset(0), size(0), ptr(nullptr)
+    {
+    }
+};
+
+/*
+ * Ring buffer of persistently mapped HOST_VISIBLE memory, for streaming
+ * uploads and readbacks without stalling the device.
+ *
+ * Regions are allocated from the head of the ring. EndBatch() closes the
+ * batch of regions allocated since the previous EndBatch(), and ties it to
+ * the Frame whose SubmitLast() included all the work that uses them, so it
+ * needs no fence (or vkQueueSubmit) of its own. A batch's space is reclaimed
+ * once its frame has finished, so work from several frames can be in flight
+ * at once; Allocate() only blocks when the ring is full of unfinished batches.
+ *
+ * Space is reclaimed lazily, oldest first, when Allocate() runs out, so data
+ * read back into a region stays valid until the ring wraps back around to it.
+ * Wait for the batch's frame before reading. The frames must outlive their
+ * batches, so call WaitIdle() before destroying their FrameManager.
+ *
+ * Unless the memory is HOST_COHERENT, call Flush() after writing a region and
+ * Invalidate() before reading one. These only touch the region's own range:
+ * regions are aligned to nonCoherentAtomSize so they never share an atom.
+ *
+ * This is not thread-safe; use a separate StagingBuffer per thread.
+ */
+class StagingBuffer
+{
+public:
+    static const VkDeviceSize DEFAULT_SIZE = 32 * 1024 * 1024;
+
+    /*
+     * 'preferred' defaults to HOST_CACHED, since readbacks from uncached
+     * memory are very slow and uploads are fine either way.
+     */
+    StagingBuffer(const DeviceFunctions &pfn, VkDevice device, MemoryAllocator &allocator,
+        VkDeviceSize size = DEFAULT_SIZE,
+        VkMemoryPropertyFlags preferred = VK_MEMORY_PROPERTY_HOST_CACHED_BIT);
+
+    // Waits for all outstanding batches
+    ~StagingBuffer();
+
+    StagingBuffer(const StagingBuffer &) = delete;
+    StagingBuffer &operator=(const StagingBuffer &) = delete;
+
+    bool Setup();
+
+    MemoryAllocator &GetAllocator() { return m_Allocator; }
+    VkBuffer GetBuffer() { return m_Buffer; }
+    VkDeviceSize GetSize() const { return m_Size; }
+    bool IsCoherent() const { return m_Coherent; }
+
+    // Whether the memory is HOST_CACHED, which makes the host's reads fast
+    bool IsCached() const { return m_Cached; }
+
+    /*
+     * Reserve 'size' bytes in the current batch. alignment is relative to the
+     * start of the buffer, for vkCmdCopyBufferToImage etc.
+     */
+    bool Allocate(VkDeviceSize size, VkDeviceSize alignment, StagingRegion &region);
+
+    // Close the current batch. frame.SubmitLast() must already have been
+    // called, with all the work that uses it
+    void EndBatch(Frame &frame);
+
+    // Wait for every batch to finish, and reclaim the whole ring
+    bool WaitIdle();
+
+    bool Flush(const StagingRegion &region);
+    bool Invalidate(const StagingRegion &region);
+
+private:
+    struct Batch
+    {
+        Frame *frame;
+        uint64_t number;    // the frame's number when it was submitted
+        VkDeviceSize bytes; // including alignment padding and wrapping
+    };
+
+    bool RetireOldest();
+
+    const DeviceFunctions &m_pfn;
+    VkDevice m_Device;
+    MemoryAllocator &m_Allocator;
+    VkDeviceSize m_Size;
+    VkMemoryPropertyFlags m_Preferred;
+
+    AutoMemoryAllocation m_Memory;
+    AutoVkBuffer m_Buffer;
+    bool m_Coherent;
+    bool m_Cached;
+    VkDeviceSize m_AtomSize;
+
+    VkDeviceSize m_Head;
+    VkDeviceSize m_Used;      // bytes between the oldest live batch and m_Head
+    VkDeviceSize m_OpenBytes; // bytes in the current batch
+
+    std::deque<Batch> m_Batches;
+};
+
+#endif // INCLUDED_VKSXS_STAGING_BUFFER
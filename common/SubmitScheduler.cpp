@@ -0,0 +1,129 @@
+/*
+ * Copyright (c) 2016 Philip Taylor
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include "common/Common.h"
+
+#include "common/Log.h"
+#include "common/SubmitScheduler.h"
+
+const uint32_t SubmitScheduler::DEFAULT_FLUSH_THRESHOLD;
+
+SubmitScheduler::SubmitScheduler(const DeviceFunctions &pfn, VkQueue queue, uint32_t flushThreshold)
+    : m_pfn(pfn), m_Queue(queue), m_FlushThreshold(flushThreshold), m_PendingCount(0),
+    m_SubmitCallCount(0), m_SubmitInfoCount(0)
+{
+}
+
+bool SubmitScheduler::Post(uint32_t submitCount, const VkSubmitInfo *pSubmits)
+{
+    std::lock_guard<std::mutex> lock(m_Mutex);
+
+    for (uint32_t i = 0; i < submitCount; ++i)
+    {
+        const VkSubmitInfo &submit = pSubmits[i];
+        ASSERT(submit.pNext == nullptr);
+
+        if (m_PendingCount == m_Pending.size())
+            m_Pending.emplace_back();
+        PendingSubmit &pending = m_Pending[m_PendingCount++];
+
+        pending.waitSemaphores.assign(submit.pWaitSemaphores, submit.pWaitSemaphores + submit.waitSemaphoreCount);
+        pending.waitDstStageMasks.assign(submit.pWaitDstStageMask, submit.pWaitDstStageMask + submit.waitSemaphoreCount);
+        pending.commandBuffers.assign(submit.pCommandBuffers, submit.pCommandBuffers + submit.commandBufferCount);
+        pending.signalSemaphores.assign(submit.pSignalSemaphores, submit.pSignalSemaphores + submit.signalSemaphoreCount);
+    }
+
+    if (m_PendingCount >= m_FlushThreshold)
+        return FlushLocked(VK_NULL_HANDLE);
+
+    return true;
+}
+
+bool SubmitScheduler::Flush(VkFence fence)
+{
+    std::lock_guard<std::mutex> lock(m_Mutex);
+    return FlushLocked(fence);
+}
+
+bool SubmitScheduler::FlushLocked(VkFence fence)
+{
+    if (m_PendingCount == 0 && fence == VK_NULL_HANDLE)
+        return true;
+
+    // Build the infos now rather than in Post(), since the vectors they
+    // point into may have moved since
+    m_SubmitInfos.clear();
+    for (uint32_t i = 0; i < m_PendingCount; ++i)
+    {
+        const PendingSubmit &pending = m_Pending[i];
+        VkSubmitInfo submitInfo = {};
+        submitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+        submitInfo.waitSemaphoreCount = (uint32_t)pending.waitSemaphores.size();
+        submitInfo.pWaitSemaphores = pending.waitSemaphores.data();
+        submitInfo.pWaitDstStageMask = pending.waitDstStageMasks.data();
+        submitInfo.commandBufferCount = (uint32_t)pending.commandBuffers.size();
+        submitInfo.pCommandBuffers = pending.commandBuffers.data();
+        submitInfo.signalSemaphoreCount = (uint32_t)pending.signalSemaphores.size();
+        submitInfo.pSignalSemaphores = pending.signalSemaphores.data();
+        m_SubmitInfos.push_back(submitInfo);
+    }
+
+    VkResult result = m_pfn.vkQueueSubmit(m_Queue, (uint32_t)m_SubmitInfos.size(), m_SubmitInfos.data(), fence);
+    m_PendingCount = 0;
+    if (result != VK_SUCCESS)
+    {
+        LOGE("vkQueueSubmit failed (%d)", result);
+        return false;
+    }
+
+    ++m_SubmitCallCount;
+    m_SubmitInfoCount += m_SubmitInfos.size();
+    return true;
+}
+
+bool SubmitScheduler::BindSparse(uint32_t bindInfoCount, const VkBindSparseInfo *pBindInfo, VkFence fence)
+{
+    std::lock_guard<std::mutex> lock(m_Mutex);
+
+    if (!FlushLocked(VK_NULL_HANDLE))
+        return false;
+
+    VkResult result = m_pfn.vkQueueBindSparse(m_Queue, bindInfoCount, pBindInfo, fence);
+    if (result != VK_SUCCESS)
+    {
+        LOGE("vkQueueBindSparse failed (%d)", result);
+        return false;
+    }
+    return true;
+}
+
+uint64_t SubmitScheduler::GetSubmitCallCount() const
+{
+    std::lock_guard<std::mutex> lock(m_Mutex);
+    return m_SubmitCallCount;
+}
+
+uint64_t SubmitScheduler::GetSubmitInfoCount() const
+{
+    std::lock_guard<std::mutex> lock(m_Mutex);
+    return m_SubmitInfoCount;
+}
@@ -0,0 +1,147 @@
+/*
+ * Copyright (c) 2016 Philip Taylor
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#ifndef INCLUDED_VKSXS_SUBMIT_SCHEDULER
+#define INCLUDED_VKSXS_SUBMIT_SCHEDULER
+
+#include "common/Common.h"
+
+#include "common/DeviceFunctions.h"
+
+#include <memory>
+#include <mutex>
+#include <vector>
+
+/*
+ * Serialises access to one VkQueue, and batches the work posted to it.
+ *
+ * Post() copies the submit infos and returns without submitting anything,
+ * so threads can post their command buffers as they finish recording them.
+ * Flush() submits everything posted so far, in the order it was posted, as
+ * one vkQueueSubmit with a VkSubmitInfo per post (each submit costs a trip
+ * into the kernel on most drivers, while the infos in one submit are
+ * cheap). That's typically once per frame, via Frame::SubmitLast(), but
+ * Post() also flushes when flushThreshold infos are pending, so the device
+ * isn't left idle for too long.
+ *
+ * Everything that uses the queue (including vkQueueBindSparse, see
+ * BindSparse()) should go through the same scheduler, since Vulkan
+ * requires external synchronisation of the queue. DeviceLoader may return
+ * the same queue for several roles, which must then share a scheduler.
+ *
+ * A semaphore must be signalled by a submit before anything waits on it,
+ * so when a post waits on a semaphore signalled by work on another queue,
+ * flush that queue's scheduler first.
+ *
+ * Post/Flush/BindSparse are thread-safe.
+ */
+class SubmitScheduler
+{
+public:
+    static const uint32_t DEFAULT_FLUSH_THRESHOLD = 32;
+
+    SubmitScheduler(const DeviceFunctions &pfn, VkQueue queue,
+        uint32_t flushThreshold = DEFAULT_FLUSH_THRESHOLD);
+
+    SubmitScheduler(const SubmitScheduler &) = delete;
+    SubmitScheduler &operator=(const SubmitScheduler &) = delete;
+
+    VkQueue GetQueue() const { return m_Queue; }
+
+    // Queue the submit infos (whose pNext must be null) for the next Flush()
+    bool Post(uint32_t submitCount, const VkSubmitInfo *pSubmits);
+
+    /*
+     * Submit everything that's pending, signalling fence (if not
+     * VK_NULL_HANDLE) when it and all earlier work on the queue is done. With
+     * nothing pending, this only submits if there's a fence.
+     */
+    bool Flush(VkFence fence = VK_NULL_HANDLE);
+
+    // Flush, then vkQueueBindSparse, so the binds stay in order with the submits
+    bool BindSparse(uint32_t bindInfoCount, const VkBindSparseInfo *pBindInfo, VkFence fence);
+
+    // vkQueueSubmit calls, and the submit infos in them, so far
+    uint64_t GetSubmitCallCount() const;
+    uint64_t GetSubmitInfoCount() const;
+
+private:
+    struct PendingSubmit
+    {
+        std::vector<VkSemaphore> waitSemaphores;
+        std::vector<VkPipelineStageFlags> waitDstStageMasks;
+        std::vector<VkCommandBuffer> commandBuffers;
+        std::vector<VkSemaphore> signalSemaphores;
+    };
+
+    bool FlushLocked(VkFence fence);
+
+    const DeviceFunctions &m_pfn;
+    VkQueue m_Queue;
+    uint32_t m_FlushThreshold;
+
+    mutable std::mutex m_Mutex;
+
+    // The first m_PendingCount entries are pending; the rest are kept so
+    // their vectors' storage can be reused
+    std::vector<PendingSubmit> m_Pending;
+    uint32_t m_PendingCount;
+    std::vector<VkSubmitInfo> m_SubmitInfos;
+
+    uint64_t m_SubmitCallCount;
+    uint64_t m_SubmitInfoCount;
+};
+
+/*
+ * A scheduler per distinct VkQueue, created on first use, for when several
+ * roles (e.g. DeviceLoader's graphics and transfer queues) may turn out to
+ * be the same queue. Get() is not thread-safe: get all the schedulers before
+ * sharing them between threads.
+ */
+class SubmitSchedulerSet
+{
+public:
+    explicit SubmitSchedulerSet(const DeviceFunctions &pfn)
+        : m_pfn(pfn)
+    {
+    }
+
+    SubmitSchedulerSet(const SubmitSchedulerSet &) = delete;
+    SubmitSchedulerSet &operator=(const SubmitSchedulerSet &) = delete;
+
+    SubmitScheduler &Get(VkQueue queue)
+    {
+        for (auto &scheduler : m_Schedulers)
+        {
+            if (scheduler->GetQueue() == queue)
+                return *scheduler;
+        }
+        m_Schedulers.emplace_back(new SubmitScheduler(m_pfn, queue));
+        return *m_Schedulers.back();
+    }
+
+private:
+    const DeviceFunctions &m_pfn;
+    std::vector<std::unique_ptr<SubmitScheduler>> m_Schedulers;
+};
+
+#endif // INCLUDED_VKSXS_SUBMIT_SCHEDULER
@@ -0,0 +1,336 @@
+/*
+ * Copyright (c) 2016 Philip Taylor
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include "common/Common.h"
+
+#include "common/Log.h"
+#include "common/TransferEngine.h"
+
+#include <algorithm>
+
+const uint32_t TransferEngine::DEFAULT_BATCHES_IN_FLIGHT;
+const uint64_t TransferEngine::NO_BATCH;
+
+static VkDeviceSize Gcd(VkDeviceSize a, VkDeviceSize b)
+{
+    while (b)
+    {
+        VkDeviceSize t = a % b;
+        a = b;
+        b = t;
+    }
+    return a;
+}
+
+static bool IsGranular(uint32_t granularity, int32_t offset, uint32_t extent, uint32_t levelExtent)
+{
+    if (granularity == 0)
+        return offset == 0 && extent == levelExtent;
+    return (uint32_t)offset % granularity == 0 &&
+        (extent % granularity == 0 || (uint32_t)offset + extent == levelExtent);
+}
+
+bool IsTransferGranular(const VkExtent3D &granularity, const VkOffset3D &offset, const VkExtent3D &extent,
+    const VkExtent3D &levelExtent)
+{
+    return IsGranular(granularity.width, offset.x, extent.width, levelExtent.width) &&
+        IsGranular(granularity.height, offset.y, extent.height, levelExtent.height) &&
+        IsGranular(granularity.depth, offset.z, extent.depth, levelExtent.depth);
+}
+
+TransferEngine::TransferEngine(const DeviceFunctions &pfn, VkDevice device, StagingBuffer &stagingBuffer,
+    SubmitScheduler &scheduler, uint32_t queueFamily, uint32_t batchesInFlight)
+    : m_pfn(pfn), m_Device(device), m_StagingBuffer(stagingBuffer),
+    m_Scheduler(scheduler), m_QueueFamily(queueFamily),
+    m_Batches(pfn, device, batchesInFlight),
+    m_Batch(nullptr), m_CommandBuffer(VK_NULL_HANDLE)
+{
+}
+
+TransferEngine::~TransferEngine()
+{
+    WaitIdle();
+}
+
+bool TransferEngine::Setup()
+{
+    return m_Batches.Setup(std::vector<uint32_t>(1, m_QueueFamily), 1);
+}
+
+VkDeviceSize TransferEngine::GetCopyAlignment(VkDeviceSize alignment) const
+{
+    // Buffer offsets for image copies must be multiples of 4 and of the
+    // texel size, so use the lowest common multiple
+    if (alignment == 0)
+        alignment = 4;
+    alignment = alignment / Gcd(alignment, 4) * 4;
+
+    VkDeviceSize optimal = m_StagingBuffer.GetAllocator().GetLimits().optimalBufferCopyOffsetAlignment;
+    if (optimal > 1)
+        alignment = alignment / Gcd(alignment, optimal) * optimal;
+    return alignment;
+}
+
+// The buffer space used by a copy of 'extent' with the given bufferRowLength
+static VkDeviceSize GetImageCopySize(const VkImageSubresourceLayers &subresource, VkExtent3D extent,
+    uint32_t texelSize, uint32_t rowLength)
+{
+    if (rowLength == 0)
+        rowLength = extent.width;
+    ASSERT(rowLength >= extent.width);
+
+    VkDeviceSize rowPitch = (VkDeviceSize)rowLength * texelSize;
+    VkDeviceSize rows = (VkDeviceSize)extent.height * extent.depth * subresource.layerCount;
+    return rowPitch * rows;
+}
+
+bool TransferEngine::AllocateReadback(VkDeviceSize size, VkDeviceSize alignment, StagingRegion &region)
+{
+    if (!m_StagingBuffer.Allocate(size, GetCopyAlignment(alignment), region))
+        return false;
+
+    m_Readbacks.push_back(region);
+    return true;
+}
+
+bool TransferEngine::AllocateUpload(VkDeviceSize size, VkDeviceSize alignment, StagingRegion &region)
+{
+    if (!m_StagingBuffer.Allocate(size, GetCopyAlignment(alignment), region))
+        return false;
+
+    m_Uploads.push_back(region);
+    return true;
+}
+
+bool TransferEngine::BeginBatch()
+{
+    if (m_Batch)
+        return true;
+
+    Frame *batch;
+    if (!m_Batches.BeginFrame(batch))
+        return false;
+
+    VkCommandBuffer commandBuffer;
+    if (!batch->AllocateCommandBuffer(m_QueueFamily, commandBuffer))
+        return false;
+
+    VkCommandBufferBeginInfo beginInfo = {};
+    beginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+    beginInfo.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+    VkResult result = m_pfn.vkBeginCommandBuffer(commandBuffer, &beginInfo);
+    if (result != VK_SUCCESS)
+    {
+        LOGE("vkBeginCommandBuffer failed (%d)", result);
+        return false;
+    }
+
+    m_Batch = batch;
+    m_CommandBuffer = commandBuffer;
+    return true;
+}
+
+bool TransferEngine::GetCommandBuffer(ResourceStateTracker &tracker, VkCommandBuffer &commandBuffer, Frame *&batch)
+{
+    if (!BeginBatch())
+        return false;
+
+    tracker.Flush(m_CommandBuffer, m_QueueFamily);
+
+    commandBuffer = m_CommandBuffer;
+    batch = m_Batch;
+    return true;
+}
+
+bool TransferEngine::ReadbackImage(ResourceStateTracker &tracker, VkImage image,
+    const VkImageSubresourceLayers &subresource, VkOffset3D offset, VkExtent3D extent,
+    uint32_t texelSize, StagingRegion &region, uint32_t rowLength)
+{
+    VkDeviceSize size = GetImageCopySize(subresource, extent, texelSize, rowLength);
+    if (!AllocateReadback(size, texelSize, region))
+        return false;
+
+    VkImageSubresourceRange range = {};
+    range.aspectMask = subresource.aspectMask;
+    range.baseMipLevel = subresource.mipLevel;
+    range.levelCount = 1;
+    range.baseArrayLayer = subresource.baseArrayLayer;
+    range.layerCount = subresource.layerCount;
+    tracker.UseImage(image, RESOURCE_USAGE_TRANSFER_SRC, m_QueueFamily, &range);
+
+    VkCommandBuffer commandBuffer;
+    Frame *batch;
+    if (!GetCommandBuffer(tracker, commandBuffer, batch))
+        return false;
+
+    VkBufferImageCopy copyRegion = {};
+    copyRegion.bufferOffset = region.offset;
+    copyRegion.bufferRowLength = rowLength; // 0 means tightly packed
+    copyRegion.bufferImageHeight = 0;
+    copyRegion.imageSubresource = subresource;
+    copyRegion.imageOffset = offset;
+    copyRegion.imageExtent = extent;
+    m_pfn.vkCmdCopyImageToBuffer(commandBuffer, image, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL,
+        region.buffer, 1, &copyRegion);
+    return true;
+}
+
+bool TransferEngine::UploadImage(ResourceStateTracker &tracker, VkImage image,
+    const VkImageSubresourceLayers &subresource, VkOffset3D offset, VkExtent3D extent,
+    uint32_t texelSize, const void *data, uint32_t rowLength)
+{
+    VkDeviceSize size = GetImageCopySize(subresource, extent, texelSize, rowLength);
+    StagingRegion region;
+    if (!AllocateUpload(size, texelSize, region))
+        return false;
+
+    memcpy(region.ptr, data, (size_t)size);
+
+    VkImageSubresourceRange range = {};
+    range.aspectMask = subresource.aspectMask;
+    range.baseMipLevel = subresource.mipLevel;
+    range.levelCount = 1;
+    range.baseArrayLayer = subresource.baseArrayLayer;
+    range.layerCount = subresource.layerCount;
+    tracker.UseImage(image, RESOURCE_USAGE_TRANSFER_DST, m_QueueFamily, &range);
+
+    VkCommandBuffer commandBuffer;
+    Frame *batch;
+    if (!GetCommandBuffer(tracker, commandBuffer, batch))
+        return false;
+
+    VkBufferImageCopy copyRegion = {};
+    copyRegion.bufferOffset = region.offset;
+    copyRegion.bufferRowLength = rowLength; // 0 means tightly packed
+    copyRegion.bufferImageHeight = 0;
+    copyRegion.imageSubresource = subresource;
+    copyRegion.imageOffset = offset;
+    copyRegion.imageExtent = extent;
+    m_pfn.vkCmdCopyBufferToImage(commandBuffer, region.buffer,
+        image, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, 1, &copyRegion);
+    return true;
+}
+
+bool TransferEngine::Submit(ResourceStateTracker &tracker, VkSemaphore waitSemaphore,
+    VkSemaphore *signalSemaphore, uint64_t &batchNumber)
+{
+    batchNumber = NO_BATCH;
+    if (!m_Batch)
+        return true;
+
+    // Release anything that's moving to another family, and make the
+    // readbacks visible to the host
+    for (const StagingRegion &region : m_Readbacks)
+    {
+        tracker.BufferBarrier(region.buffer, region.offset, region.size,
+            RESOURCE_USAGE_TRANSFER_DST, RESOURCE_USAGE_HOST_READ, m_QueueFamily);
+    }
+    tracker.Flush(m_CommandBuffer, m_QueueFamily);
+
+    VkResult result = m_pfn.vkEndCommandBuffer(m_CommandBuffer);
+    if (result != VK_SUCCESS)
+    {
+        LOGE("vkEndCommandBuffer failed (%d)", result);
+        return false;
+    }
+
+    for (const StagingRegion &region : m_Uploads)
+    {
+        if (!m_StagingBuffer.Flush(region))
+            return false;
+    }
+
+    VkSemaphore semaphore = m_Batch->GetSemaphore(0);
+    VkPipelineStageFlags waitStages = VK_PIPELINE_STAGE_TRANSFER_BIT;
+
+    VkSubmitInfo submitInfo = {};
+    submitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+    if (waitSemaphore != VK_NULL_HANDLE)
+    {
+        submitInfo.waitSemaphoreCount = 1;
+        submitInfo.pWaitSemaphores = &waitSemaphore;
+        submitInfo.pWaitDstStageMask = &waitStages;
+    }
+    submitInfo.commandBufferCount = 1;
+    submitInfo.pCommandBuffers = &m_CommandBuffer;
+    if (signalSemaphore)
+    {
+        submitInfo.signalSemaphoreCount = 1;
+        submitInfo.pSignalSemaphores = &semaphore;
+    }
+
+    if (!m_Batch->SubmitLast(m_Scheduler, 1, &submitInfo))
+        return false;
+
+    // The staging space is reclaimed when the batch finishes, so it doesn't
+    // need a fence (and another vkQueueSubmit) of its own
+    m_StagingBuffer.EndBatch(*m_Batch);
+
+    SubmittedBatch submitted;
+    submitted.frame = m_Batch;
+    submitted.number = m_Batch->GetNumber();
+    submitted.readbacks.swap(m_Readbacks);
+    m_Submitted.push_back(std::move(submitted));
+    m_Uploads.clear();
+
+    if (signalSemaphore)
+        *signalSemaphore = semaphore;
+    batchNumber = m_Batch->GetNumber();
+
+    m_Batch = nullptr;
+    m_CommandBuffer = VK_NULL_HANDLE;
+    return true;
+}
+
+bool TransferEngine::Wait(uint64_t batchNumber)
+{
+    while (!m_Submitted.empty() && m_Submitted.front().number <= batchNumber)
+    {
+        SubmittedBatch &submitted = m_Submitted.front();
+
+        // If the slot has been reused, the FrameManager has already waited
+        if (submitted.frame->GetNumber() == submitted.number)
+        {
+            if (!submitted.frame->Wait())
+                return false;
+        }
+
+        for (const StagingRegion &region : submitted.readbacks)
+        {
+            if (!m_StagingBuffer.Invalidate(region))
+                return false;
+        }
+
+        m_Submitted.pop_front();
+    }
+    return true;
+}
+
+bool TransferEngine::WaitIdle()
+{
+    if (!m_Submitted.empty() && !Wait(m_Submitted.back().number))
+        return false;
+
+    // The staging buffer's batches point at our frames, so retire them all
+    // while the frames still exist
+    return m_StagingBuffer.WaitIdle() && m_Batches.WaitIdle();
+}
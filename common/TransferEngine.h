@@ -0,0 +1,168 @@
+/*
+ * Copyright (c) 2016 Philip Taylor
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#ifndef INCLUDED_VKSXS_TRANSFER_ENGINE
+#define INCLUDED_VKSXS_TRANSFER_ENGINE
+
+#include "common/Common.h"
+
+#include "common/DeviceFunctions.h"
+#include "common/FrameManager.h"
+#include "common/ResourceStateTracker.h"
+#include "common/StagingBuffer.h"
+#include "common/SubmitScheduler.h"
+
+#include <deque>
+#include <vector>
+
+/*
+ * Whether copying 'extent' texels at 'offset' in a mip level of
+ * 'levelExtent' meets a queue family's minImageTransferGranularity: each
+ * dimension must be a multiple of the granularity, or reach the edge of the
+ * level. A granularity of (0,0,0) only allows whole mip levels.
+ */
+bool IsTransferGranular(const VkExtent3D &granularity, const VkOffset3D &offset, const VkExtent3D &extent,
+    const VkExtent3D &levelExtent);
+
+/*
+ * Batches uploads and readbacks through a StagingBuffer onto a transfer queue
+ * (ideally a dedicated DMA family, see DeviceLoader), so they run alongside
+ * graphics work. Each Submit() is one batch, with its own command buffer and
+ * fence; up to batchesInFlight can be executing at once.
+ *
+ * Ownership of EXCLUSIVE images is handled through a ResourceStateTracker
+ * shared with the graphics side (on the same thread):
+ *
+ *  - For a readback, the image's acquire barrier is recorded into the batch,
+ *    and the release is left queued for the graphics family. Flush the
+ *    tracker into the graphics command buffer, submit it signalling a
+ *    semaphore, and pass that semaphore to Submit().
+ *
+ *  - For an upload, the image ends up owned by the transfer family. Call
+ *    tracker.UseImage() for the graphics family before Submit(), so the
+ *    release is recorded into the batch, and have the graphics submit wait
+ *    for the semaphore that Submit() signals.
+ *
+ * The engine ends the staging buffer's batch on every Submit(), so it should
+ * have the StagingBuffer to itself. Submit() flushes the queue's
+ * SubmitScheduler, so it also carries anything else posted to the queue.
+ */
+class TransferEngine
+{
+public:
+    static const uint32_t DEFAULT_BATCHES_IN_FLIGHT = 2;
+    static const uint64_t NO_BATCH = ~(uint64_t)0;
+
+    TransferEngine(const DeviceFunctions &pfn, VkDevice device, StagingBuffer &stagingBuffer,
+        SubmitScheduler &scheduler, uint32_t queueFamily,
+        uint32_t batchesInFlight = DEFAULT_BATCHES_IN_FLIGHT);
+
+    // Waits for all submitted batches
+    ~TransferEngine();
+
+    TransferEngine(const TransferEngine &) = delete;
+    TransferEngine &operator=(const TransferEngine &) = delete;
+
+    bool Setup();
+
+    uint32_t GetQueueFamily() const { return m_QueueFamily; }
+
+    /*
+     * Staging space that the device will write into. It gets a barrier to
+     * HOST_READ at the end of the batch, and is invalidated by Wait().
+     * alignment 0 means a suitable alignment for copies of 4-byte texels.
+     */
+    bool AllocateReadback(VkDeviceSize size, VkDeviceSize alignment, StagingRegion &region);
+
+    // Staging space for the host to fill before Submit(), which flushes it
+    bool AllocateUpload(VkDeviceSize size, VkDeviceSize alignment, StagingRegion &region);
+
+    /*
+     * The current batch's command buffer, for recording custom copies, with
+     * the tracker's pending barriers for the transfer family flushed into it.
+     * 'batch' can be used to allocate secondary command buffers for the
+     * transfer family.
+     */
+    bool GetCommandBuffer(ResourceStateTracker &tracker, VkCommandBuffer &commandBuffer, Frame *&batch);
+
+    /*
+     * Copy part of an image (which the tracker must know about) into a new
+     * readback region, with rows rowLength texels apart (the
+     * VkBufferImageCopy::bufferRowLength). rowLength 0 means tightly packed,
+     * i.e. extent.width.
+     */
+    bool ReadbackImage(ResourceStateTracker &tracker, VkImage image,
+        const VkImageSubresourceLayers &subresource, VkOffset3D offset, VkExtent3D extent,
+        uint32_t texelSize, StagingRegion &region, uint32_t rowLength = 0);
+
+    // Copy texels from 'data', with rows rowLength texels apart (0 for
+    // tightly packed), into part of an image
+    bool UploadImage(ResourceStateTracker &tracker, VkImage image,
+        const VkImageSubresourceLayers &subresource, VkOffset3D offset, VkExtent3D extent,
+        uint32_t texelSize, const void *data, uint32_t rowLength = 0);
+
+    /*
+     * Submit the current batch (if anything was recorded). It waits for
+     * waitSemaphore (if not VK_NULL_HANDLE) before its transfers, and signals
+     * *signalSemaphore (if not null) when it's done; the semaphore belongs
+     * to the batch, so it must be waited on exactly once.
+     *
+     * batchNumber is set to the number to pass to Wait(), or to
+     * NO_BATCH if nothing was submitted.
+     */
+    bool Submit(ResourceStateTracker &tracker, VkSemaphore waitSemaphore,
+        VkSemaphore *signalSemaphore, uint64_t &batchNumber);
+
+    // Wait for a submitted batch (and all before it), then invalidate their readbacks
+    bool Wait(uint64_t batchNumber);
+
+    bool WaitIdle();
+
+private:
+    struct SubmittedBatch
+    {
+        Frame *frame;
+        uint64_t number;
+        std::vector<StagingRegion> readbacks;
+    };
+
+    bool BeginBatch();
+    VkDeviceSize GetCopyAlignment(VkDeviceSize alignment) const;
+
+    const DeviceFunctions &m_pfn;
+    VkDevice m_Device;
+    StagingBuffer &m_StagingBuffer;
+    SubmitScheduler &m_Scheduler;
+    uint32_t m_QueueFamily;
+
+    FrameManager m_Batches;
+
+    // The batch being recorded, or nullptr
+    Frame *m_Batch;
+    VkCommandBuffer m_CommandBuffer;
+    std::vector<StagingRegion> m_Readbacks;
+    std::vector<StagingRegion> m_Uploads;
+
+    std::deque<SubmittedBatch> m_Submitted;
+};
+
+#endif // INCLUDED_VKSXS_TRANSFER_ENGINE